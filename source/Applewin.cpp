@@ -33,6 +33,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "Debug.h"
 #include "Disk.h"
 #include "DiskImage.h"
+#include "DiskImageIndex.h"
 #include "Frame.h"
 #include "Harddisk.h"
 #include "Joystick.h"
@@ -44,6 +45,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "Registry.h"
 #include "Riff.h"
 #include "SaveState.h"
+#include "ScreenCapture.h"
 #include "SerialComms.h"
 #include "SoundCore.h"
 #include "Speaker.h"
@@ -51,6 +53,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "Speech.h"
 #endif
 #include "Video.h"
+#include "VideoScaler.h"
 #include "NTSC.h"
 
 #include "Configuration\About.h"
@@ -225,10 +228,16 @@ void ContinueExecution(void)
 									? g_bScrollLock_FullSpeed
 									: (GetKeyState(VK_SCROLL) < 0);
 
+	const bool bDiskWantsFullSpeed = DiskIsSpinning() && enhancedisk;
+	const bool bDiskFullSpeed = bDiskWantsFullSpeed && !Spkr_IsActive() && !MB_IsActive();
+
 	const bool bWasFullSpeed = g_bFullSpeed;
 	g_bFullSpeed = ( (g_dwSpeed == SPEED_MAX) || 
 					 bScrollLock_FullSpeed ||
-					 (DiskIsSpinning() && enhancedisk && !Spkr_IsActive() && !MB_IsActive()) );
+					 bDiskFullSpeed );
+
+	const bool bOtherFullSpeed = (g_dwSpeed == SPEED_MAX) || bScrollLock_FullSpeed;
+	DiskUpdateSpeedStats(bDiskFullSpeed && !bOtherFullSpeed, bDiskWantsFullSpeed && !g_bFullSpeed);
 
 	if (g_bFullSpeed)
 	{
@@ -278,6 +287,7 @@ void ContinueExecution(void)
 	SpkrUpdate(uActualCyclesExecuted);
 	sg_SSC.CommUpdate(uActualCyclesExecuted);
 	PrintUpdate(uActualCyclesExecuted);
+	HD_Update(uActualCyclesExecuted);
 
 	//
 
@@ -290,6 +300,7 @@ void ContinueExecution(void)
 		else
 			VideoRefreshScreen(); // Just copy the output of our Apple framebuffer to the system Back Buffer
 
+		Video_CaptureFrame();
 		MB_EndOfVideoFrame();
 	}
 
@@ -372,6 +383,9 @@ void EnterMessageLoop(void)
 		}
 		else
 		{
+			if (g_nAppMode != MODE_RUNNING)
+				HD_Flush();		// Eg. paused or in the debugger: HD_Update()'s idle timer has stopped
+
 			if (g_nAppMode == MODE_DEBUG)
 				DebuggerUpdate();
 			else if ((g_nAppMode == MODE_LOGO) || (g_nAppMode == MODE_PAUSED))
@@ -854,6 +868,11 @@ int APIENTRY WinMain(HINSTANCE passinstance, HINSTANCE, LPSTR lpCmdLine, int)
 	LPSTR szImageName_drive1 = NULL;
 	LPSTR szImageName_drive2 = NULL;
 	LPSTR szSnapshotName = NULL;
+	LPSTR szFrameHashFilename = NULL;
+	LPSTR szFrameHashCompare1 = NULL;
+	LPSTR szFrameHashCompare2 = NULL;
+	LPSTR szCaptureFilename = NULL;
+	LPSTR szIndexDirectory = NULL;
 	const std::string strCmdLine(lpCmdLine);		// Keep a copy for log ouput
 
 	while (*lpCmdLine)
@@ -976,6 +995,99 @@ int APIENTRY WinMain(HINSTANCE passinstance, HINSTANCE, LPSTR lpCmdLine, int)
 		{
 			g_bMultiMon = true;
 		}
+		else if (strcmp(lpCmdLine, "-frame-hash") == 0)	// Log a hash of each video frame
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			szFrameHashFilename = lpCmdLine;
+		}
+		else if (strcmp(lpCmdLine, "-frame-hash-compare") == 0)	// Report the first divergent frame between 2 -frame-hash logs, then exit
+		{
+			szFrameHashCompare1 = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			szFrameHashCompare2 = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+		}
+		else if (strcmp(lpCmdLine, "-capture") == 0)	// Record every video frame to a (deflated) frame-sequence file
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			szCaptureFilename = lpCmdLine;
+		}
+		else if (strcmp(lpCmdLine, "-fast-rwts") == 0)	// Trap DOS 3.3 RWTS & ProDOS Disk II driver reads of standard sectors (copy-protected disks fall back)
+		{
+			g_bDiskFastRWTS = true;
+		}
+		else if (strcmp(lpCmdLine, "-disk-stats") == 0)	// Trace disk activity, & save it with the counters (machine-readable) on exit
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			DiskSetStatsFilename(lpCmdLine);
+		}
+		else if (strcmp(lpCmdLine, "-disk-bitstream") == 0)	// Floppy tracks as bit streams, read & written with the real disk's timing (for timing-sensitive titles)
+		{
+			g_bDiskBitstream = true;
+		}
+		else if (strcmp(lpCmdLine, "-hdd-dma") == 0)	// HDD card copies each block read straight to memory, instead of via 512 I/O reads by its f/w
+		{
+			HD_SetDMA(true);
+		}
+		else if (strcmp(lpCmdLine, "-hdd-smartport") == 0)	// HDD card identifies as SmartPort, so ProDOS 2.x sees all units (ie. partitions of >32MB images). NB. Won't autoboot on ][/][+/unenhanced //e
+		{
+			HD_SetSmartPort(true);
+		}
+		else if (strcmp(lpCmdLine, "-index") == 0)	// Index the disk images under a directory (in the background), so inserting them skips format detection
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			szIndexDirectory = lpCmdLine;
+		}
+		else if (strcmp(lpCmdLine, "-image-cache") == 0)	// Budget (MB) for keeping recently used (decompressed) images in memory, for fast disk swaps: 0 = off
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			ImageSetCacheBudget(atoi(lpCmdLine) * 1024 * 1024);
+		}
+		else if (strcmp(lpCmdLine, "-hdd-cache") == 0)	// Per HDD image (KB): blocks kept in memory for read-ahead & write-back: 0 = off (write-through)
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			ImageSetBlockCacheSize(atoi(lpCmdLine) * 1024);
+		}
+		else if (strcmp(lpCmdLine, "-overlay") == 0)	// Open images read-only (so they can be shared), with writes kept in a temp file: discard or commit them on exit/eject
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			if (strcmp(lpCmdLine, "discard") == 0)
+				ImageSetOverlay(eIMAGE_OVERLAY_DISCARD);
+			else if (strcmp(lpCmdLine, "commit") == 0)
+				ImageSetOverlay(eIMAGE_OVERLAY_COMMIT);
+		}
+		else if (strcmp(lpCmdLine, "-present-thread") == 0)	// Blit frames from a separate thread, so display stalls don't delay emulation
+		{
+			Video_SetPresentThread(true);
+		}
+		else if (strcmp(lpCmdLine, "-scaler") == 0)	// Scale the window on the CPU (instead of GDI's StretchBlt): nearest or sharp
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			if (strcmp(lpCmdLine, "nearest") == 0)
+				VideoScaler_SetFilter(VIDEOSCALER_NEAREST);
+			else if (strcmp(lpCmdLine, "sharp") == 0)
+				VideoScaler_SetFilter(VIDEOSCALER_SHARP_BILINEAR);
+			else
+				LogFileOutput("Unsupported -scaler filter: %s\n", lpCmdLine);
+		}
+		else if (strcmp(lpCmdLine, "-scanlines") == 0)	// Scaler's scanline darkening (percent), replaces the 50% half-scanline blending
+		{
+			lpCmdLine = GetCurrArg(lpNextArg);
+			lpNextArg = GetNextArg(lpNextArg);
+			VideoScaler_SetScanlines(atoi(lpCmdLine));
+		}
+		else if (strcmp(lpCmdLine, "-fb-indexed") == 0)	// 8-bit palette-indexed NTSC output, converted to 32-bit only when presenting or saving (monochrome styles only)
+		{
+			NTSC_SetIndexedFramebuffer(true);
+		}
 		else	// unsupported
 		{
 			LogFileOutput("Unsupported arg: %s\n", lpCmdLine);
@@ -986,6 +1098,23 @@ int APIENTRY WinMain(HINSTANCE passinstance, HINSTANCE, LPSTR lpCmdLine, int)
 
 	LogFileOutput("CmdLine: %s\n",  strCmdLine.c_str());
 
+	if (szFrameHashCompare1 && szFrameHashCompare2)
+	{
+		const int nRes = Video_FrameHashCompare(szFrameHashCompare1, szFrameHashCompare2);
+		if (g_fh)
+		{
+			fclose(g_fh);
+			g_fh = NULL;
+		}
+		return nRes;
+	}
+
+	if (szFrameHashFilename && !Video_FrameHashOpen(szFrameHashFilename))
+		LogFileOutput("FrameHash: Failed to create: %s\n", szFrameHashFilename);
+
+	if (szCaptureFilename && !ScreenCapture_RecordStart(szCaptureFilename))
+		LogFileOutput("ScreenCapture: Failed to create: %s\n", szCaptureFilename);
+
 #if 0
 #ifdef RIFF_SPKR
 	RiffInitWriteFile("Spkr.wav", SPKR_SAMPLE_RATE, 1);
@@ -1069,6 +1198,9 @@ int APIENTRY WinMain(HINSTANCE passinstance, HINSTANCE, LPSTR lpCmdLine, int)
 	ImageInitialize();
 	LogFileOutput("Init: ImageInitialize()\n");
 
+	if (szIndexDirectory)
+		DiskImageIndex_Scan(szIndexDirectory);
+
 	DiskInitialize();
 	LogFileOutput("Init: DiskInitialize()\n");
 
@@ -1229,6 +1361,11 @@ int APIENTRY WinMain(HINSTANCE passinstance, HINSTANCE, LPSTR lpCmdLine, int)
 	tfe_shutdown();
 	LogFileOutput("Exit: tfe_shutdown()\n");
 
+	Video_FrameHashClose();
+
+	ScreenCapture_Uninit();	// Flush any pending screenshots & recorded frames
+	LogFileOutput("Exit: ScreenCapture_Uninit()\n");
+
 	if (g_fh)
 	{
 		fprintf(g_fh,"*** Logging ended\n\n");
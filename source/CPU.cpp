@@ -88,6 +88,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "AppleWin.h"
 #include "CPU.h"
+#include "Disk.h"
 #include "Frame.h"
 #include "Memory.h"
 #include "Mockingboard.h"
@@ -373,7 +374,7 @@ static void DebugHddEntrypoint(const USHORT PC)
 }
 #endif
 
-static __forceinline int Fetch(BYTE& iOpcode, ULONG uExecutedCycles)
+static __forceinline int Fetch(BYTE& iOpcode, ULONG& uExecutedCycles)
 {
 	const USHORT PC = regs.pc;
 
@@ -381,6 +382,18 @@ static __forceinline int Fetch(BYTE& iOpcode, ULONG uExecutedCycles)
 	DebugHddEntrypoint(PC);
 #endif
 
+	if (g_bDiskFastRWTS && (PC == 0xBD00 || PC == 0xD000))
+	{
+		const ULONG uCycles = uExecutedCycles;
+		if (DiskTrapRWTS(PC, uExecutedCycles))
+		{
+			// RWTS/driver has been returned from: just clear carry (success)
+			g_nIrqCheckTimeout -= uExecutedCycles - uCycles;
+			iOpcode = 0x18;	// CLC
+			return 1;
+		}
+	}
+
 	iOpcode = ((PC & 0xF000) == 0xC000)
 	    ? IORead[(PC>>4) & 0xFF](PC,PC,0,0,uExecutedCycles)	// Fetch opcode from I/O memory, but params are still from mem[]
 		: *(mem+PC);
@@ -439,6 +452,19 @@ static __forceinline void IRQ(ULONG& uExecutedCycles, BOOL& flagc, BOOL& flagn,
 	}
 }
 
+// Cycles that a card's I/O handler has spent as bus master (eg. the HDD card copying a block to memory)
+static UINT g_uDmaCycles = 0;
+
+static __forceinline void DMA(ULONG& uExecutedCycles)
+{
+	if (g_uDmaCycles)
+	{
+		UINT uExtraCycles = 0;	// Needed for CYC(a) macro
+		CYC(g_uDmaCycles)
+		g_uDmaCycles = 0;
+	}
+}
+
 static __forceinline void CheckInterruptSources(ULONG uExecutedCycles)
 {
 	if (g_nIrqCheckTimeout < 0)
@@ -503,6 +529,15 @@ void CpuCalcCycles(const ULONG nExecutedCycles)
 
 //===========================================================================
 
+// Called from an I/O handler that has done a DMA transfer:
+// . the cycles are added once the current opcode completes, so that emulated time is the same as if the 6502 had done the copy
+void CpuDmaCycles(const UINT uCycles)
+{
+	g_uDmaCycles += uCycles;
+}
+
+//===========================================================================
+
 // Old method with g_uInternalExecutedCycles runs faster!
 //        Old     vs    New
 // - 68.0,69.0MHz vs  66.7, 67.2MHz  (with check for VBL IRQ every opcode)
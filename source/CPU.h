@@ -18,6 +18,7 @@ void    CpuDestroy ();
 void    CpuCalcCycles(ULONG nExecutedCycles);
 DWORD   CpuExecute (DWORD);
 ULONG   CpuGetCyclesThisVideoFrame(ULONG nExecutedCycles);
+void    CpuDmaCycles(UINT uCycles);
 void    CpuInitialize ();
 void    CpuSetupBenchmark ();
 void	CpuIrqReset();
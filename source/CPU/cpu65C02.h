@@ -322,12 +322,13 @@ static DWORD Cpu65C02 (DWORD uTotalCycles)
 #undef $
 		}
 
+		DMA(uExecutedCycles);
 		CheckInterruptSources(uExecutedCycles);
 		NMI(uExecutedCycles, flagc, flagn, flagv, flagz);
 		IRQ(uExecutedCycles, flagc, flagn, flagv, flagz);
 
 // NTSC_BEGIN
-		if (!g_bFullSpeed)
+		if (!g_bFullSpeed || g_bVideoScannerAtFullSpeed)
 		{
 			ULONG uElapsedCycles = uExecutedCycles - uPreviousCycles;
 			NTSC_VideoUpdateCycles( uElapsedCycles );
@@ -139,6 +139,7 @@ enum AppMode_e
 #define WM_USER_BOOT		WM_USER+8
 #define WM_USER_FULLSCREEN	WM_USER+9
 #define VK_SNAPSHOT_TEXT	WM_USER+10 // PrintScreen+Ctrl
+#define WM_USER_IMAGE_LOAD_ERROR	WM_USER+11
 
 // TODO-TC: Refactor codebase by renaming /nCyclesLeft/ to /uExecutedCycles/
 typedef BYTE (__stdcall *iofunction)(WORD nPC, WORD nAddr, BYTE nWriteFlag, BYTE nWriteValue, ULONG nCyclesLeft);
@@ -225,6 +225,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	ProfileOpmode_t g_aProfileOpmodes[ NUM_OPMODES ];
 
 	TCHAR g_FileNameProfile[] = TEXT("Profile.txt"); // changed from .csv to .txt since Excel doesn't give import options.
+	TCHAR g_FileNameDiskStats[] = TEXT("DiskStats.txt");
 	int   g_nProfileLine = 0;
 	char  g_aProfileLine[ NUM_PROFILE_LINES ][ CONSOLE_WIDTH ];
 
@@ -3707,6 +3708,115 @@ Update_t CmdDisk ( int nArgs)
 		return ConsoleUpdate();
 	}
 
+	if (iParam == PARAM_DISK_STATS)
+	{
+		if (nArgs > 2)
+			goto _Help;
+
+		if (nArgs == 2)
+		{
+			int iSubParam = 0;
+			if (! FindParam( g_aArgs[ 2 ].sArg, MATCH_EXACT, iSubParam, _PARAM_GENERAL_BEGIN, _PARAM_GENERAL_END ))
+				goto _Help;
+
+			if (iSubParam == PARAM_RESET)
+			{
+				DiskResetStats();
+				ConsoleBufferPush( TEXT(" Resetting disk stats." ) );
+			}
+			else if (iSubParam == PARAM_SAVE)
+			{
+				char sFilename[MAX_PATH];
+				strcpy( sFilename, g_sProgramDir );
+				strcat( sFilename, g_FileNameDiskStats );
+
+				char buffer[CONSOLE_WIDTH*2] = "";
+				if (DiskSaveStats( sFilename ))
+					sprintf_s(buffer, sizeof(buffer), " Saved: %s", g_FileNameDiskStats);
+				else
+					sprintf_s(buffer, sizeof(buffer), " ERROR: Couldn't save file. (In use?)");
+				ConsoleBufferPush(buffer);
+			}
+			else
+				goto _Help;
+
+			return ConsoleUpdate();
+		}
+
+		DiskStats_t stats;
+		DiskGetStats(stats);
+
+		char buffer[CONSOLE_WIDTH*2] = "";
+		sprintf_s(buffer, sizeof(buffer), " Steps: %I64u tracks, %I64u phases  Motor on: %u  Spin up/down: %u/%u",
+			stats.uTrackSteps, stats.uPhaseChanges, stats.uMotorOn, stats.uSpinUps, stats.uSpinDowns);
+		ConsoleBufferPush(buffer);
+		sprintf_s(buffer, sizeof(buffer), " ReadTrack: %I64u (%I64u misses) %.1f ms  Loads: %I64u %.1f ms",
+			stats.uReadTrack, stats.uReadTrackMisses, stats.fReadTrackMs, stats.uTrackLoads, stats.fTrackLoadMs);
+		ConsoleBufferPush(buffer);
+		sprintf_s(buffer, sizeof(buffer), " Prefetch: %I64u %.1f ms  Writes: %I64u tracks, %I64u image %.1f ms",
+			stats.uPrefetchLoads, stats.fPrefetchLoadMs, stats.uWriteTrack, stats.uImageWrites, stats.fImageWriteMs);
+		ConsoleBufferPush(buffer);
+		sprintf_s(buffer, sizeof(buffer), " Waited for writes: %.1f ms  Nibbles: %I64u read (%u/s), %I64u written",
+			stats.fWriteWaitMs, stats.uNibbleReads, stats.uNibbleReadsPerSec, stats.uNibbleWrites);
+		ConsoleBufferPush(buffer);
+		sprintf_s(buffer, sizeof(buffer), " Full-speed: %u times, %.1f ms  Held off by spkr/MB: %.1f ms  RWTS traps: %I64u",
+			stats.uFullSpeedEngaged, stats.fFullSpeedMs, stats.fThrottledMs, stats.uRWTSTraps);
+		ConsoleBufferPush(buffer);
+		return ConsoleUpdate();
+	}
+
+	if (iParam == PARAM_DISK_CACHE)
+	{
+		if (nArgs > 2)
+			goto _Help;
+
+		if (nArgs == 2)
+		{
+			int iSubParam = 0;
+			if (! FindParam( g_aArgs[ 2 ].sArg, MATCH_EXACT, iSubParam, _PARAM_GENERAL_BEGIN, _PARAM_GENERAL_END ) || iSubParam != PARAM_RESET)
+				goto _Help;
+
+			ImageResetCacheStats();
+			ConsoleBufferPush( TEXT(" Resetting image cache stats." ) );
+			return ConsoleUpdate();
+		}
+
+		ImageCacheStats_t stats;
+		ImageGetCacheStats(stats);
+
+		char buffer[CONSOLE_WIDTH*2] = "";
+		sprintf_s(buffer, sizeof(buffer), " Image cache: %u hits, %u detect-hits, %u misses, %u evictions",
+			stats.uHits, stats.uDetectHits, stats.uMisses, stats.uEvictions);
+		ConsoleBufferPush(buffer);
+		sprintf_s(buffer, sizeof(buffer), " Entries: %u  Size: %u / %u KB%s",
+			stats.uEntries, stats.uBytes / 1024, stats.uBudget / 1024, stats.uBudget ? "" : " (off: -image-cache <MB>)");
+		ConsoleBufferPush(buffer);
+		return ConsoleUpdate();
+	}
+
+	if (iParam == PARAM_DISK_TRACE)
+	{
+		if (nArgs > 2)
+			goto _Help;
+
+		if (nArgs == 2)
+		{
+			int iSubParam = 0;
+			if (! FindParam( g_aArgs[ 2 ].sArg, MATCH_EXACT, iSubParam, _PARAM_GENERAL_BEGIN, _PARAM_GENERAL_END ))
+				goto _Help;
+
+			if (iSubParam == PARAM_ON)
+				DiskSetTrace(true);
+			else if (iSubParam == PARAM_OFF)
+				DiskSetTrace(false);
+			else
+				goto _Help;
+		}
+
+		ConsoleBufferPush( DiskIsTracing() ? TEXT(" Disk trace: on (DISK STATS SAVE to dump it)") : TEXT(" Disk trace: off") );
+		return ConsoleUpdate();
+	}
+
 	if (nArgs < 2)
 		goto _Help;
 
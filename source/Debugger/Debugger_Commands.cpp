@@ -427,10 +427,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 		{TEXT("SPACES")		, NULL, PARAM_CONFIG_SPACES  },
 		{TEXT("TARGET")     , NULL, PARAM_CONFIG_TARGET  },
 // Disk
+		{TEXT("CACHE")      , NULL, PARAM_DISK_CACHE     },
 		{TEXT("EJECT")      , NULL, PARAM_DISK_EJECT     },
 		{TEXT("INFO")       , NULL, PARAM_DISK_INFO      },
 		{TEXT("PROTECT")    , NULL, PARAM_DISK_PROTECT   },
 		{TEXT("READ")       , NULL, PARAM_DISK_READ      },
+		{TEXT("STATS")      , NULL, PARAM_DISK_STATS     },
+		{TEXT("TRACE")      , NULL, PARAM_DISK_TRACE     },
 // Font (Config)
 		{TEXT("MODE")       , NULL, PARAM_FONT_MODE      }, // also INFO, CONSOLE, DISASM (from Window)
 // General
@@ -1322,10 +1322,13 @@ const	DisasmData_t* pDisasmData; // If != NULL then bytes are marked up as data
 
 // Disk
 	, _PARAM_DISK_BEGIN = _PARAM_CONFIG_END // Daisy Chain
-		, PARAM_DISK_EJECT = _PARAM_DISK_BEGIN // DISK 1 EJECT
+		, PARAM_DISK_CACHE = _PARAM_DISK_BEGIN // DISK CACHE [RESET]
+		, PARAM_DISK_EJECT                     // DISK 1 EJECT
 		, PARAM_DISK_INFO                      // DISK 1 INFO
 		, PARAM_DISK_PROTECT                   // DISK 1 PROTECT
 		, PARAM_DISK_READ                      // DISK 1 READ Track Sector NumSectors MemAddress
+		, PARAM_DISK_STATS                     // DISK STATS [RESET | SAVE]
+		, PARAM_DISK_TRACE                     // DISK TRACE [ON | OFF]
 	, _PARAM_DISK_END
 	,  PARAM_DISK_NUM = _PARAM_DISK_END - _PARAM_DISK_BEGIN
 
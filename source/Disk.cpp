@@ -33,6 +33,7 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "SaveState_Structs_v1.h"
 
 #include "AppleWin.h"
+#include "CPU.h"
 #include "Disk.h"
 #include "DiskImage.h"
 #include "Frame.h"
@@ -44,6 +45,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "..\resource\resource.h"
 
+#include "DiskGCR.inl"
+#include "DiskBitstream.inl"
+
 #define LOG_DISK_ENABLED 0
 #define LOG_DISK_TRACKS 1
 #define LOG_DISK_MOTOR 0
@@ -68,9 +72,31 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 // Public _________________________________________________________________________________________
 
 	BOOL enhancedisk = 1;					// TODO: Make static & add accessor funcs
+	bool g_bDiskFastRWTS = false;			// Trap DOS 3.3 RWTS & ProDOS Disk II driver reads (see DiskTrapRWTS())
+	bool g_bDiskBitstream = false;			// Tracks are read & written as bit streams, with the real disk's timing (see DiskBitstream.inl)
 
 // Private ________________________________________________________________________________________
 
+	// Track cache: all the nibblized tracks of the inserted image, so that a seek is just a pointer swap
+	// . Filled on demand by ReadTrack(), and ahead of the head by the disk I/O thread (see PrefetchTracks())
+	// . Dirty tracks are only written back to the image on eject, spin-down, save-state & exit (see FlushTrackCache())
+	// . The writes themselves are done by the disk I/O thread (see QueueTrackWrite()), so eject, save-state & exit wait for them (see WaitForTrackWrites())
+	// . NB. ImageReadTrack()/ImageWriteTrack() share the image helpers' work buffer & the image buffer, so always hold g_DiskImageCriticalSection
+	// . If g_bDiskBitstream, each track read is also converted to bits: DiskReadWrite() uses those, & WriteTrack() converts them back to nibbles
+	enum TrackState_e { TRACK_EMPTY=0, TRACK_CLEAN, TRACK_DIRTY };
+
+	struct TrackCache_t
+	{
+		ImageInfo* imagehandle;
+		LPBYTE pNibbles;					// [TRACKS_MAX][NIBBLES_PER_TRACK]
+		int    nibbles[TRACKS_MAX];
+		BYTE   state[TRACKS_MAX];
+		BYTE   skewed[TRACKS_MAX];			// Read with !enhancedisk (ie. SkewTrack() applied)
+		BYTE   pendingwrites[TRACKS_MAX];	// Queued or in-progress writes: the image is stale until they're done
+		LPBYTE pBits;						// [TRACKS_MAX][BITTRACK_BUFFER_SIZE], or NULL if !g_bDiskBitstream
+		BitTrack_t bittrack[TRACKS_MAX];
+	};
+
 	struct Disk_t
 	{
 		TCHAR  imagename[ MAX_DISK_IMAGE_NAME + 1 ];	// <FILENAME> (ie. no extension)
@@ -88,6 +114,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 		DWORD  spinning;
 		DWORD  writelight;
 		int    nibbles;						// Init'd by ReadTrack() -> ImageReadTrack()
+		TrackCache_t* trackcache;			// Init'd by AllocTrack(): trackimage points into this
+		BitTrack_t* bittrack;				// Init'd by ReadTrack() if g_bDiskBitstream: the current track's bits (in trackcache)
+		BitCursor_t bitcursor;
 
 		const Disk_t& operator= (const Disk_t& other)
 		{
@@ -105,6 +134,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 			spinning            = other.spinning;
 			writelight          = other.writelight;
 			nibbles             = other.nibbles;
+			trackcache          = other.trackcache;
+			bittrack            = other.bittrack;
+			bitcursor           = other.bitcursor;
 			return *this;
 		}
 	};
@@ -120,12 +152,105 @@ static WORD		phases = 0;						// state bits for stepper magnet phases 0 - 3
 static bool		g_bSaveDiskImage = true;	// Save the DiskImage name to Registry
 static UINT		g_uSlot = 0;
 
+static const int kPrefetchTracks = 2;			// # tracks to read ahead of the head
+static const size_t kPrefetchQueueMax = 8;
+
+struct PrefetchRequest_t
+{
+	TrackCache_t* pCache;
+	int track;
+};
+
+static const size_t kWriteQueueMax = 16;		// Then QueueTrackWrite() waits for the I/O thread
+
+struct WriteRequest_t
+{
+	TrackCache_t* pCache;		// For its pendingwrites[]
+	ImageInfo* imagehandle;
+	int track;
+	int nibbles;
+	LPBYTE pNibbles;			// Copy of the track: owned by the request
+};
+
+static CRITICAL_SECTION g_DiskIOCriticalSection;	// To guard /g_PrefetchQueue/, /g_WriteQueue/ & the TrackCache_t states
+static CRITICAL_SECTION g_DiskImageCriticalSection;	// To guard all ImageRead/WriteTrack() calls (NB. if both are needed, take g_DiskIOCriticalSection first)
+static bool g_bDiskIOInit = false;
+static HANDLE g_hDiskIOThread = NULL;
+static HANDLE g_hDiskIOEvent[3] = {NULL, NULL, NULL};	// [0] = Prefetch queued, [1] = Exit, [2] = Write queued
+static HANDLE g_hDiskWriteDone = NULL;			// Auto-reset: a write has completed
+static std::deque<PrefetchRequest_t> g_PrefetchQueue;
+static std::deque<WriteRequest_t> g_WriteQueue;
+static bool g_bDiskWriteInProgress = false;
+static DWORD g_dwDiskIOThreadId = 0;
+static std::string g_strDiskWriteError;			// Image that failed to be written (see ReportWriteErrors())
+static volatile bool g_bDiskWriteError = false;	// So the main thread can poll without the lock
+
+// Instrumentation (see DiskGetStats() & DiskSaveStats())
+// . The counters that the disk I/O thread updates are guarded by g_DiskImageCriticalSection (which it holds for the image I/O anyway)
+// . The trace is a ring of events, from both threads
+enum DiskTrace_e
+{
+	DISKTRACE_PHASE=0,		// value = magnet states
+	DISKTRACE_TRACK,		// Head moved to track
+	DISKTRACE_READTRACK,	// value = host us (incl. any load)
+	DISKTRACE_LOADTRACK,	// Emulation thread: value = host us
+	DISKTRACE_PREFETCH,		// I/O thread: value = host us
+	DISKTRACE_WRITETRACK,	// Written track handed over to the cache
+	DISKTRACE_IMAGEWRITE,	// value = host us
+	DISKTRACE_WRITEWAIT,	// Emulation thread waited for the I/O thread: value = host us
+	DISKTRACE_RWTSTRAP,		// value = emulated cycles
+	DISKTRACE_MOTORON,
+	DISKTRACE_MOTOROFF,
+	DISKTRACE_SPINUP,
+	DISKTRACE_SPINDOWN,
+	DISKTRACE_FULLSPEEDON,
+	DISKTRACE_FULLSPEEDOFF,
+	DISKTRACE_THROTTLEDON,
+	DISKTRACE_THROTTLEDOFF,
+	NUM_DISKTRACE
+};
+
+static const char* const g_aDiskTraceName[NUM_DISKTRACE] =
+{
+	"phase", "track", "readtrack", "loadtrack", "prefetch", "writetrack", "imagewrite", "writewait", "rwtstrap",
+	"motoron", "motoroff", "spinup", "spindown", "fullspeedon", "fullspeedoff", "throttledon", "throttledoff"
+};
+
+struct DiskTraceEvent_t
+{
+	double fHostMs;				// Since the stats were reset
+	unsigned __int64 uCycle;	// NB. Approximate for the I/O thread's events
+	BYTE   type;				// DiskTrace_e
+	BYTE   drive;				// 0xFF = n/a (eg. track cache events)
+	BYTE   track;
+	UINT   value;
+};
+
+static const size_t kDiskTraceMax = 0x10000;	// Then the oldest events are overwritten
+
+static DiskStats_t g_DiskStats;
+static LARGE_INTEGER g_liDiskStatsFreq = {0};
+static LONGLONG g_llDiskStatsStart = 0;
+static LONGLONG g_llDiskSpeedLast = 0;			// DiskUpdateSpeedStats()'s previous call
+static bool g_bDiskFullSpeedLast = false;
+static bool g_bDiskThrottledLast = false;
+static LONGLONG g_llDiskNibbleRateStart = 0;
+static unsigned __int64 g_uDiskNibbleRateReads = 0;
+static bool g_bDiskStatsInit = false;
+static CRITICAL_SECTION g_DiskTraceCriticalSection;
+static std::vector<DiskTraceEvent_t> g_DiskTrace;
+static size_t g_uDiskTraceNext = 0;
+static unsigned __int64 g_uDiskTraceTotal = 0;
+static bool g_bDiskTrace = false;
+static std::string g_strDiskStatsFilename;		// DiskSaveStats() on exit
+
 static void CheckSpinning();
+static void DiskTrace(const DiskTrace_e type, const int drive, const int track, const UINT value);
 static Disk_Status_e GetDriveLightStatus( const int iDrive );
 static bool IsDriveValid( const int iDrive );
 static void ReadTrack (int drive);
 static void RemoveDisk (int drive);
-static void WriteTrack (int drive);
+static void FlushTrackCache (int drive);
 static LPCTSTR DiskGetFullPathName(const int iDrive);
 
 //===========================================================================
@@ -235,6 +360,12 @@ static void CheckSpinning(void)
 	if (floppymotoron)
 		g_aFloppyDisk[currdrive].spinning = 20000;
 
+	if (modechange)
+	{
+		g_DiskStats.uSpinUps++;
+		DiskTrace(DISKTRACE_SPINUP, currdrive, g_aFloppyDisk[currdrive].track, 0);
+	}
+
 	if (modechange)
 		//FrameRefreshStatus(DRAW_LEDS);
 		FrameDrawDiskLEDS( (HDC)0 );
@@ -259,118 +390,962 @@ static Disk_Status_e GetDriveLightStatus(const int iDrive)
 				return DISK_STATUS_READ;
 		}
 		else
-			return DISK_STATUS_OFF;
+			return DISK_STATUS_OFF;
+	}
+
+	return DISK_STATUS_OFF;
+}
+
+//===========================================================================
+
+static bool IsDriveValid(const int iDrive)
+{
+	return (iDrive >= 0 && iDrive < NUM_DRIVES);
+}
+
+//===========================================================================
+
+static void DiskStats_Init(void)
+{
+	if (g_bDiskStatsInit)
+		return;
+
+	g_bDiskStatsInit = true;
+	InitializeCriticalSection(&g_DiskTraceCriticalSection);	// NB. Never deleted, as the I/O thread may trace until DiskIO_Uninit()
+	QueryPerformanceFrequency(&g_liDiskStatsFreq);
+	DiskResetStats();
+}
+
+static inline LONGLONG DiskStats_Now(void)
+{
+	LARGE_INTEGER li;
+	QueryPerformanceCounter(&li);
+	return li.QuadPart;
+}
+
+static inline double DiskStats_Ms(const LONGLONG llTicks)
+{
+	return g_liDiskStatsFreq.QuadPart ? (llTicks * 1000.0) / g_liDiskStatsFreq.QuadPart : 0.0;
+}
+
+static inline UINT DiskStats_Us(const LONGLONG llTicks)
+{
+	return (UINT) (DiskStats_Ms(llTicks) * 1000.0);
+}
+
+static void DiskTrace(const DiskTrace_e type, const int drive, const int track, const UINT value)
+{
+	if (!g_bDiskTrace)
+		return;
+
+	DiskTraceEvent_t event;
+	event.fHostMs = DiskStats_Ms(DiskStats_Now() - g_llDiskStatsStart);
+	event.uCycle  = g_nCumulativeCycles;
+	event.type    = (BYTE) type;
+	event.drive   = (BYTE) drive;
+	event.track   = (BYTE) track;
+	event.value   = value;
+
+	EnterCriticalSection(&g_DiskTraceCriticalSection);
+	if (g_DiskTrace.size() < kDiskTraceMax)
+	{
+		g_DiskTrace.push_back(event);
+	}
+	else
+	{
+		g_DiskTrace[g_uDiskTraceNext] = event;
+		g_uDiskTraceNext = (g_uDiskTraceNext + 1) % kDiskTraceMax;
+	}
+	g_uDiskTraceTotal++;
+	LeaveCriticalSection(&g_DiskTraceCriticalSection);
+}
+
+//===========================================================================
+
+static DWORD WINAPI DiskIOThread(LPVOID);
+
+static void DiskIO_Init(void)
+{
+	if (g_bDiskIOInit)
+		return;
+
+	g_bDiskIOInit = true;
+	InitializeCriticalSection(&g_DiskIOCriticalSection);
+	InitializeCriticalSection(&g_DiskImageCriticalSection);
+
+	for (UINT i=0; i<3; i++)
+		g_hDiskIOEvent[i] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto-reset, initially non-signaled
+	g_hDiskWriteDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (g_hDiskIOEvent[0] && g_hDiskIOEvent[1] && g_hDiskIOEvent[2] && g_hDiskWriteDone)
+	{
+		g_hDiskIOThread = CreateThread(NULL,			// lpThreadAttributes
+										0,				// dwStackSize
+										DiskIOThread,
+										NULL,			// lpParameter
+										0,				// dwCreationFlags : 0 = Run immediately
+										&g_dwDiskIOThreadId);	// lpThreadId
+	}
+
+	LogFileOutput("Disk: CreateThread(), g_hDiskIOThread=0x%08X\n", (UINT32)g_hDiskIOThread);
+
+	if (g_hDiskIOThread)
+		SetThreadPriority(g_hDiskIOThread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+static void DiskIO_Uninit(void)
+{
+	if (!g_bDiskIOInit)
+		return;
+
+	if (g_hDiskIOThread)
+	{
+		SetEvent(g_hDiskIOEvent[1]);
+		WaitForSingleObject(g_hDiskIOThread, INFINITE);
+		CloseHandle(g_hDiskIOThread);
+		g_hDiskIOThread = NULL;
+	}
+
+	for (UINT i=0; i<3; i++)
+	{
+		if (g_hDiskIOEvent[i])
+			CloseHandle(g_hDiskIOEvent[i]);
+		g_hDiskIOEvent[i] = NULL;
+	}
+
+	if (g_hDiskWriteDone)
+		CloseHandle(g_hDiskWriteDone);
+	g_hDiskWriteDone = NULL;
+
+	_ASSERT(g_WriteQueue.empty());	// The I/O thread drains it before exiting
+	g_PrefetchQueue.clear();
+	DeleteCriticalSection(&g_DiskImageCriticalSection);
+	DeleteCriticalSection(&g_DiskIOCriticalSection);
+	g_bDiskIOInit = false;
+}
+
+//===========================================================================
+
+static inline LPBYTE GetTrackCacheNibbles(TrackCache_t* pCache, const int track)
+{
+	return pCache->pNibbles + track * NIBBLES_PER_TRACK;
+}
+
+// Pre: g_DiskIOCriticalSection held
+static bool IsTrackCached(const TrackCache_t* pCache, const int track)
+{
+	if (pCache->state[track] == TRACK_DIRTY)
+		return true;
+
+	if (pCache->state[track] == TRACK_CLEAN && pCache->pendingwrites[track])
+		return true;	// Don't re-read it (eg. just for a different skew), as the image is stale until the write is done
+
+	return pCache->state[track] == TRACK_CLEAN && pCache->skewed[track] == (enhancedisk ? 0 : 1);
+}
+
+// Pre: g_DiskIOCriticalSection held
+static void ReadTrackIntoCache(TrackCache_t* pCache, const int track)
+{
+#if LOG_DISK_TRACKS
+	LOG_DISK("track $%02X read\r\n", track);
+#endif
+	EnterCriticalSection(&g_DiskImageCriticalSection);
+	const LONGLONG llStart = DiskStats_Now();
+	ImageReadTrack(
+		pCache->imagehandle,
+		track,
+		track << 1,
+		GetTrackCacheNibbles(pCache, track),
+		&pCache->nibbles[track]);
+
+	if (pCache->pBits)
+		BitTrack_FromNibbles(pCache->bittrack[track], GetTrackCacheNibbles(pCache, track), pCache->nibbles[track]);
+
+	const LONGLONG llTicks = DiskStats_Now() - llStart;
+	const bool bPrefetch = g_dwDiskIOThreadId && GetCurrentThreadId() == g_dwDiskIOThreadId;
+	if (bPrefetch)
+	{
+		g_DiskStats.uPrefetchLoads++;
+		g_DiskStats.fPrefetchLoadMs += DiskStats_Ms(llTicks);
+	}
+	else
+	{
+		g_DiskStats.uTrackLoads++;
+		g_DiskStats.fTrackLoadMs += DiskStats_Ms(llTicks);
+	}
+	LeaveCriticalSection(&g_DiskImageCriticalSection);
+
+	DiskTrace(bPrefetch ? DISKTRACE_PREFETCH : DISKTRACE_LOADTRACK, 0xFF, track, DiskStats_Us(llTicks));
+
+	// An unformatted track reads as random nibbles, so don't cache it (each read gets new ones)
+	pCache->state[track]  = ImageIsValidTrack(pCache->imagehandle, track) ? TRACK_CLEAN : TRACK_EMPTY;
+	pCache->skewed[track] = enhancedisk ? 0 : 1;
+}
+
+static bool WriteTrackToImage(ImageInfo* const pImageInfo, const int track, LPBYTE pNibbles, const int nibbles)
+{
+#if LOG_DISK_TRACKS
+	LOG_DISK("track $%02X write\r\n", track);
+#endif
+	EnterCriticalSection(&g_DiskImageCriticalSection);
+	const LONGLONG llStart = DiskStats_Now();
+	const bool bRes = ImageWriteTrack(pImageInfo, track, track << 1, pNibbles, nibbles);
+	const LONGLONG llTicks = DiskStats_Now() - llStart;
+	g_DiskStats.uImageWrites++;
+	g_DiskStats.fImageWriteMs += DiskStats_Ms(llTicks);
+	LeaveCriticalSection(&g_DiskImageCriticalSection);
+
+	DiskTrace(DISKTRACE_IMAGEWRITE, 0xFF, track, DiskStats_Us(llTicks));
+	return bRes;
+}
+
+// Hand a dirty track over to the disk I/O thread, to be written back to the image
+// . The request has its own copy of the nibbles, so the cache can keep changing (NB. but isn't freed until WaitForTrackWrites())
+// . If a request for this track is still queued, then it's just updated: so a track's writes are always done in order
+// . Pre: g_DiskIOCriticalSection *not* held, as this waits for the I/O thread if the queue is full
+static void QueueTrackWrite(TrackCache_t* pCache, const int track)
+{
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+
+	if (pCache->state[track] != TRACK_DIRTY)
+	{
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+		return;
+	}
+
+	if (!g_hDiskIOThread)
+	{
+		// No I/O thread, so write it now
+		if (!WriteTrackToImage(pCache->imagehandle, track, GetTrackCacheNibbles(pCache, track), pCache->nibbles[track]))
+		{
+			g_strDiskWriteError = ImageGetPathname(pCache->imagehandle);
+			g_bDiskWriteError = true;
+		}
+		pCache->state[track] = TRACK_CLEAN;
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+		return;
+	}
+
+	for (std::deque<WriteRequest_t>::iterator it = g_WriteQueue.begin(); it != g_WriteQueue.end(); ++it)
+	{
+		if (it->pCache == pCache && it->track == track)
+		{
+			it->nibbles = pCache->nibbles[track];
+			memcpy(it->pNibbles, GetTrackCacheNibbles(pCache, track), it->nibbles);
+			pCache->state[track] = TRACK_CLEAN;
+			LeaveCriticalSection(&g_DiskIOCriticalSection);
+			return;
+		}
+	}
+
+	if (g_WriteQueue.size() >= kWriteQueueMax)
+	{
+		const LONGLONG llStart = DiskStats_Now();
+		while (g_WriteQueue.size() >= kWriteQueueMax)
+		{
+			LeaveCriticalSection(&g_DiskIOCriticalSection);
+			WaitForSingleObject(g_hDiskWriteDone, INFINITE);
+			EnterCriticalSection(&g_DiskIOCriticalSection);
+		}
+		const LONGLONG llTicks = DiskStats_Now() - llStart;
+		g_DiskStats.fWriteWaitMs += DiskStats_Ms(llTicks);
+		DiskTrace(DISKTRACE_WRITEWAIT, 0xFF, track, DiskStats_Us(llTicks));
+	}
+
+	WriteRequest_t request = {pCache, pCache->imagehandle, track, pCache->nibbles[track], new BYTE[NIBBLES_PER_TRACK]};
+	memcpy(request.pNibbles, GetTrackCacheNibbles(pCache, track), request.nibbles);
+	g_WriteQueue.push_back(request);
+	pCache->pendingwrites[track]++;
+	pCache->state[track] = TRACK_CLEAN;
+
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	SetEvent(g_hDiskIOEvent[2]);
+}
+
+// Flush barrier: wait for all queued writes to be done
+static void WaitForTrackWrites(void)
+{
+	if (!g_bDiskIOInit)
+		return;
+
+	const LONGLONG llStart = DiskStats_Now();
+	bool bWaited = false;
+
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+	while (!g_WriteQueue.empty() || g_bDiskWriteInProgress)
+	{
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+		WaitForSingleObject(g_hDiskWriteDone, INFINITE);
+		bWaited = true;
+		EnterCriticalSection(&g_DiskIOCriticalSection);
+	}
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	if (bWaited)
+	{
+		const LONGLONG llTicks = DiskStats_Now() - llStart;
+		g_DiskStats.fWriteWaitMs += DiskStats_Ms(llTicks);
+		DiskTrace(DISKTRACE_WRITEWAIT, 0xFF, 0, DiskStats_Us(llTicks));
+	}
+}
+
+// Pre: called from the main thread (not the I/O thread)
+static void ReportWriteErrors(void)
+{
+	if (!g_bDiskIOInit)
+		return;
+
+	if (!g_bDiskWriteError)
+		return;
+
+	std::string strPathname;
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+	strPathname.swap(g_strDiskWriteError);
+	g_bDiskWriteError = false;
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	if (strPathname.empty())
+		return;
+
+	LogFileOutput("Disk: Failed to write track(s) to: %s\n", strPathname.c_str());
+
+	TCHAR szBuffer[MAX_PATH + 128];
+	wsprintf(
+		szBuffer,
+		TEXT("Unable to write to the disk image %s\n")
+		TEXT("so some of the changes to it have been lost."),
+		strPathname.c_str());
+
+	MessageBox(
+		g_hFrameWindow,
+		szBuffer,
+		g_pAppTitle,
+		MB_ICONEXCLAMATION | MB_SETFOREGROUND);
+}
+
+//===========================================================================
+
+// I/O thread: write the oldest queued track
+// . The write itself is done without g_DiskIOCriticalSection, so the emulation thread can still step to cached tracks meanwhile
+static bool DoNextTrackWrite(void)
+{
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+
+	if (g_WriteQueue.empty())
+	{
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+		return false;
+	}
+
+	const WriteRequest_t request = g_WriteQueue.front();
+	g_WriteQueue.pop_front();
+	g_bDiskWriteInProgress = true;
+
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	const bool bRes = WriteTrackToImage(request.imagehandle, request.track, request.pNibbles, request.nibbles);
+	delete [] request.pNibbles;
+
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+	request.pCache->pendingwrites[request.track]--;
+	g_bDiskWriteInProgress = false;
+	if (!bRes)
+	{
+		g_strDiskWriteError = ImageGetPathname(request.imagehandle);
+		g_bDiskWriteError = true;
+	}
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	SetEvent(g_hDiskWriteDone);
+	return true;
+}
+
+// I/O thread: read the next prefetch track
+static bool DoNextPrefetch(void)
+{
+	// NB. Dequeue & read under the one lock, so RemoveDisk() can safely drop its requests & free the cache
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+
+	if (g_PrefetchQueue.empty())
+	{
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+		return false;
+	}
+
+	const PrefetchRequest_t request = g_PrefetchQueue.front();
+	g_PrefetchQueue.pop_front();
+
+	// Only fill empty tracks: a track with stale skew may be the drive's current trackimage
+	if (request.pCache->state[request.track] == TRACK_EMPTY && ImageIsValidTrack(request.pCache->imagehandle, request.track))
+		ReadTrackIntoCache(request.pCache, request.track);
+
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+	return true;
+}
+
+static DWORD WINAPI DiskIOThread(LPVOID)
+{
+	while (1)
+	{
+		DWORD dwRes = WaitForMultipleObjects(3, g_hDiskIOEvent, FALSE, INFINITE);
+		if (dwRes != WAIT_OBJECT_0 && dwRes != WAIT_OBJECT_0+2)
+			break;	// Exit (or error)
+
+		// Writes first, in queue order, so a flush barrier isn't held up by prefetches
+		while (DoNextTrackWrite() || DoNextPrefetch())
+			;
+	}
+
+	// Nothing must be lost on exit
+	while (DoNextTrackWrite())
+		;
+
+	return 0;
+}
+
+//===========================================================================
+
+static void PrefetchTracks(TrackCache_t* pCache, const int track, const int direction, const int nNumTracksInImage)
+{
+	if (!g_hDiskIOThread)
+		return;
+
+	bool bQueued = false;
+
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+
+	for (int i=1; i<=kPrefetchTracks; i++)
+	{
+		const int prefetchTrack = track + i*direction;
+		if (prefetchTrack < 0 || prefetchTrack >= nNumTracksInImage || prefetchTrack >= TRACKS_MAX)
+			break;
+
+		if (pCache->state[prefetchTrack] != TRACK_EMPTY)
+			continue;
+
+		if (g_PrefetchQueue.size() >= kPrefetchQueueMax)
+			g_PrefetchQueue.pop_front();	// Head has moved on: drop the oldest
+
+		PrefetchRequest_t request = {pCache, prefetchTrack};
+		g_PrefetchQueue.push_back(request);
+		bQueued = true;
+	}
+
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	if (bQueued)
+		SetEvent(g_hDiskIOEvent[0]);
+}
+
+//===========================================================================
+
+static void AllocTrack(const int iDrive)
+{
+	Disk_t * fptr = &g_aFloppyDisk[iDrive];
+
+	DiskIO_Init();
+
+	TrackCache_t* pCache = new TrackCache_t;
+	ZeroMemory(pCache, sizeof(TrackCache_t));
+	pCache->imagehandle = fptr->imagehandle;
+	pCache->pNibbles = (LPBYTE)VirtualAlloc(NULL, TRACKS_MAX * NIBBLES_PER_TRACK, MEM_COMMIT, PAGE_READWRITE);
+	if (!pCache->pNibbles)
+	{
+		delete pCache;
+		return;
+	}
+
+	if (g_bDiskBitstream)
+	{
+		pCache->pBits = (LPBYTE)VirtualAlloc(NULL, TRACKS_MAX * BITTRACK_BUFFER_SIZE, MEM_COMMIT, PAGE_READWRITE);
+		for (int track=0; track<TRACKS_MAX && pCache->pBits; track++)
+			pCache->bittrack[track].pBits = pCache->pBits + track * BITTRACK_BUFFER_SIZE;
+	}
+
+	fptr->trackcache = pCache;
+	fptr->trackimage = GetTrackCacheNibbles(pCache, MIN(fptr->track, TRACKS_MAX-1));
+}
+
+//===========================================================================
+
+static void FreeTrack(const int iDrive)
+{
+	Disk_t * fptr = &g_aFloppyDisk[iDrive];
+	TrackCache_t* pCache = fptr->trackcache;
+
+	if (pCache)
+	{
+		// Drop any prefetches for this cache (NB. the I/O thread only reads while holding the lock)
+		EnterCriticalSection(&g_DiskIOCriticalSection);
+		for (std::deque<PrefetchRequest_t>::iterator it = g_PrefetchQueue.begin(); it != g_PrefetchQueue.end(); )
+		{
+			if (it->pCache == pCache)
+				it = g_PrefetchQueue.erase(it);
+			else
+				++it;
+		}
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+		VirtualFree(pCache->pNibbles, 0, MEM_RELEASE);
+		if (pCache->pBits)
+			VirtualFree(pCache->pBits, 0, MEM_RELEASE);
+		delete pCache;
+	}
+
+	fptr->trackcache     = NULL;
+	fptr->bittrack       = NULL;
+	fptr->trackimage     = NULL;
+	fptr->trackimagedata = 0;
+}
+
+// Snapshot has restored the current track's nibbles into trackimage
+static void SetTrackFromSnapshot(const int iDrive)
+{
+	Disk_t * fptr = &g_aFloppyDisk[iDrive];
+	TrackCache_t* pCache = fptr->trackcache;
+
+	if (!pCache || !fptr->trackimagedata || fptr->track >= TRACKS_MAX)
+		return;
+
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+	pCache->nibbles[fptr->track] = fptr->nibbles;
+	pCache->state  [fptr->track] = TRACK_CLEAN;	// NB. trackimagedirty (if set) still gets it written back
+	pCache->skewed [fptr->track] = enhancedisk ? 0 : 1;
+	if (pCache->pBits)
+		BitTrack_FromNibbles(pCache->bittrack[fptr->track], fptr->trackimage, fptr->nibbles);
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	if (pCache->pBits && pCache->bittrack[fptr->track].uBitCount)
+	{
+		fptr->bittrack = &pCache->bittrack[fptr->track];
+		fptr->bitcursor.uHead = fptr->byte * 8;
+		BitCursor_SetTrack(fptr->bitcursor, *fptr->bittrack, 0, g_nCumulativeCycles);
+	}
+}
+
+//===========================================================================
+
+static void ReadTrack(const int iDrive)
+{
+	if (! IsDriveValid( iDrive ))
+		return;
+
+	Disk_t *pFloppy = &g_aFloppyDisk[ iDrive ];
+
+	if (pFloppy->track >= ImageGetNumTracks(pFloppy->imagehandle) || pFloppy->track >= TRACKS_MAX)
+	{
+		pFloppy->trackimagedata = 0;
+		return;
+	}
+
+	if (! pFloppy->trackcache)
+		AllocTrack( iDrive );
+
+	if (pFloppy->trackcache && pFloppy->imagehandle)
+	{
+		TrackCache_t* pCache = pFloppy->trackcache;
+		const int track = pFloppy->track;
+		const LONGLONG llStart = DiskStats_Now();
+
+		EnterCriticalSection(&g_DiskIOCriticalSection);
+		const bool bMiss = !IsTrackCached(pCache, track);
+		if (bMiss)
+			ReadTrackIntoCache(pCache, track);
+		pFloppy->nibbles = pCache->nibbles[track];
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+		const LONGLONG llTicks = DiskStats_Now() - llStart;
+		g_DiskStats.uReadTrack++;
+		if (bMiss)
+			g_DiskStats.uReadTrackMisses++;
+		g_DiskStats.fReadTrackMs += DiskStats_Ms(llTicks);
+		DiskTrace(DISKTRACE_READTRACK, iDrive, track, DiskStats_Us(llTicks));
+
+		pFloppy->trackimage     = GetTrackCacheNibbles(pCache, track);
+		pFloppy->byte           = 0;
+		pFloppy->trackimagedata = (pFloppy->nibbles != 0);
+
+		// The head keeps its position in the revolution
+		const UINT uOldBitCount = pFloppy->bittrack ? pFloppy->bittrack->uBitCount : 0;
+		pFloppy->bittrack = (pCache->pBits && pCache->bittrack[track].uBitCount) ? &pCache->bittrack[track] : NULL;
+		if (pFloppy->bittrack)
+			BitCursor_SetTrack(pFloppy->bitcursor, *pFloppy->bittrack, uOldBitCount, g_nCumulativeCycles);
+	}
+}
+
+//===========================================================================
+
+static void RemoveDisk(const int iDrive)
+{
+	Disk_t *pFloppy = &g_aFloppyDisk[iDrive];
+
+	if (pFloppy->imagehandle)
+	{
+		FlushTrackCache( iDrive );
+		WaitForTrackWrites();	// Before the image is closed & the cache freed
+		ReportWriteErrors();
+		FreeTrack( iDrive );
+
+		ImageClose(pFloppy->imagehandle);
+		pFloppy->imagehandle = NULL;
+	}
+
+	if (pFloppy->trackcache)
+		FreeTrack( iDrive );
+
+	memset( pFloppy->imagename, 0, MAX_DISK_IMAGE_NAME+1 );
+	memset( pFloppy->fullname , 0, MAX_DISK_FULL_NAME +1 );
+	pFloppy->strFilenameInZip = "";
+
+	Disk_SaveLastDiskImage( iDrive );
+	Video_ResetScreenshotCounter( NULL );
+}
+
+//===========================================================================
+
+// Hand the current track's writes over to the cache, for writing back later
+static void WriteTrack(const int iDrive)
+{
+	Disk_t *pFloppy = &g_aFloppyDisk[ iDrive ];
+	TrackCache_t* pCache = pFloppy->trackcache;
+
+	if (pCache && pFloppy->trackimagedirty && pFloppy->track < ImageGetNumTracks(pFloppy->imagehandle) && pFloppy->track < TRACKS_MAX)
+	{
+		if (pFloppy->bittrack)
+		{
+			// Back to nibbles for the image (NB. the same number, as eg. .nib images have a fixed track size)
+			BitCursor_FlushWrite(pFloppy->bitcursor, *pFloppy->bittrack);
+			const int nibbles = BitTrack_ToNibbles(*pFloppy->bittrack, pFloppy->trackimage, pFloppy->nibbles);
+			memset(pFloppy->trackimage + nibbles, 0xFF, pFloppy->nibbles - nibbles);
+		}
+
+		EnterCriticalSection(&g_DiskIOCriticalSection);
+		pCache->nibbles[pFloppy->track] = pFloppy->nibbles;
+		pCache->state  [pFloppy->track] = pFloppy->bWriteProtected ? TRACK_EMPTY : TRACK_DIRTY;	// Write-protected: discard, as the image won't be written
+		LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+		g_DiskStats.uWriteTrack++;
+		DiskTrace(DISKTRACE_WRITETRACK, iDrive, pFloppy->track, 0);
+	}
+
+	pFloppy->trackimagedirty = 0;
+}
+
+//===========================================================================
+
+static void FlushTrackCache(const int iDrive)
+{
+	Disk_t *pFloppy = &g_aFloppyDisk[ iDrive ];
+	TrackCache_t* pCache = pFloppy->trackcache;
+
+	if (!pCache || !pFloppy->imagehandle)
+		return;
+
+	WriteTrack( iDrive );
+
+	for (int track=0; track<TRACKS_MAX; track++)
+	{
+		if (pFloppy->bWriteProtected)
+		{
+			EnterCriticalSection(&g_DiskIOCriticalSection);
+			if (pCache->state[track] == TRACK_DIRTY)
+				pCache->state[track] = TRACK_EMPTY;
+			LeaveCriticalSection(&g_DiskIOCriticalSection);
+		}
+		else
+		{
+			QueueTrackWrite(pCache, track);	// NB. Does nothing if it isn't dirty
+		}
 	}
-
-	return DISK_STATUS_OFF;
 }
 
 //===========================================================================
 
-static bool IsDriveValid(const int iDrive)
-{
-	return (iDrive >= 0 && iDrive < NUM_DRIVES);
-}
+// RWTS trap: see DiskTrapRWTS()
 
-//===========================================================================
+struct TrapSignature_t
+{
+	USHORT addr;
+	BYTE   len;
+	BYTE   bytes[20];
+};
 
-static void AllocTrack(const int iDrive)
+// DOS 3.3 RWTS: entry point, plus the address & data field prologue/epilogue compares (patched by most protected loaders)
+static const TrapSignature_t g_aDOS33Signature[] =
 {
-	Disk_t * fptr = &g_aFloppyDisk[iDrive];
-	fptr->trackimage = (LPBYTE)VirtualAlloc(NULL, NIBBLES_PER_TRACK, MEM_COMMIT, PAGE_READWRITE);
-}
+	{0xBD00, 19, {0x84,0x48,0x85,0x49,0xA0,0x02,0x8C,0xF8,0x06,0xA0,0x04,0x8C,0xF8,0x04,0xA0,0x01,0xB1,0x48,0xAA}},	// STY $48, STA $49 ...
+	{0xB954, 2, {0xC9,0xD5}}, {0xB95E, 2, {0xC9,0xAA}}, {0xB969, 2, {0xC9,0x96}},	// RDADR16: D5 AA 96
+	{0xB990, 2, {0xC9,0xDE}}, {0xB99A, 2, {0xC9,0xAA}},								//          DE AA
+	{0xB8E6, 2, {0x49,0xD5}}, {0xB8F0, 2, {0xC9,0xAA}}, {0xB8FB, 2, {0xC9,0xAD}},	// READ16:  D5 AA AD
+	{0xB934, 2, {0xC9,0xDE}}, {0xB93E, 2, {0xC9,0xAA}},								//          DE AA
+};
 
-//===========================================================================
+static const USHORT kDOS33RWTS = 0xBD00;
+static const USHORT kDOS33Interleave = 0xBFB8;	// RWTS's logical -> physical sector table
+static const USHORT kDOS33WriteTranslate = 0xBA29;	// RWTS's 6-bit value -> disk byte table
 
-static void ReadTrack(const int iDrive)
-{
-	if (! IsDriveValid( iDrive ))
-		return;
+static const USHORT kProDOSDiskIIDriver = 0xD000;	// Disk II driver, in LC RAM
+static const USHORT kProDOSMLI = 0xBF00;			// Global page: JMP MLI
+static const USHORT kProDOSDevAdr = 0xBF10;			// Global page: driver vectors, [drive][slot]
 
-	Disk_t *pFloppy = &g_aFloppyDisk[ iDrive ];
+// ProDOS block (within a track) -> its 2 physical sectors
+static const BYTE g_aProDOSBlockSectors[8][2] = { {0,2}, {4,6}, {8,10}, {12,14}, {1,3}, {5,7}, {9,11}, {13,15} };
 
-	if (pFloppy->track >= ImageGetNumTracks(pFloppy->imagehandle))
+static const UINT kTrapCyclesPerNibble = 32;		// Disk II: 4us per nibble
+static const UINT kTrapCyclesPerNibbleEnhanced = 8;	// Enhanced disk: roughly the driver's own read loop per nibble
+
+static bool IsTrapSignatureMatch(const TrapSignature_t* pSig, const UINT uNum)
+{
+	for (UINT i=0; i<uNum; i++)
 	{
-		pFloppy->trackimagedata = 0;
-		return;
+		if (memcmp(mem + pSig[i].addr, pSig[i].bytes, pSig[i].len) != 0)
+			return false;
 	}
 
-	if (! pFloppy->trackimage)
-		AllocTrack( iDrive );
+	return true;
+}
 
-	if (pFloppy->trackimage && pFloppy->imagehandle)
-	{
-#if LOG_DISK_TRACKS
-		LOG_DISK("track $%02X%s read\r\n", pFloppy->track, (pFloppy->phase & 1) ? ".5" : "  ");
-#endif
-		ImageReadTrack(
-			pFloppy->imagehandle,
-			pFloppy->track,
-			pFloppy->phase,
-			pFloppy->trackimage,
-			&pFloppy->nibbles);
+// As the CPU would write it (so respecting the memory map)
+static bool TrapWriteMem(const USHORT addr, const BYTE* pData, const UINT uLen)
+{
+	if ((UINT)addr + uLen > 0x10000 || (addr < 0xD000 && addr + uLen > 0xC000))
+		return false;
 
-		pFloppy->byte           = 0;
-		pFloppy->trackimagedata = (pFloppy->nibbles != 0);
+	for (UINT i=0; i<uLen; i++)
+	{
+		const USHORT a = addr + i;
+		memdirty[a >> 8] = 0xFF;
+		LPBYTE page = memwrite[a >> 8];
+		if (page)
+			*(page + (a & 0xFF)) = pData[i];
 	}
+
+	return true;
 }
 
-//===========================================================================
+static void TrapReturn(void)
+{
+	// RTS
+	const BYTE lo = *(mem + ((regs.sp >= 0x1FF) ? (regs.sp = 0x100) : ++regs.sp));
+	const BYTE hi = *(mem + ((regs.sp >= 0x1FF) ? (regs.sp = 0x100) : ++regs.sp));
+	regs.pc = (((USHORT)hi << 8) | lo) + 1;
+}
 
-static void RemoveDisk(const int iDrive)
+// Decode a standard sector (D5 AA 96 ... DE AA, D5 AA AD ... DE AA, valid checksums) straight from a drive's nibblized track
+// . Searches from the head (if it's on this track), like the real RWTS
+// . Returns false if there's no such sector, ie. the caller must fall back to the real driver
+static bool TrapReadSector(const int iDrive, const int track, const int sector, BYTE* pSectorData, BYTE& volume, UINT& uCycles)
 {
 	Disk_t *pFloppy = &g_aFloppyDisk[iDrive];
 
-	if (pFloppy->imagehandle)
-	{
-		if (pFloppy->trackimage && pFloppy->trackimagedirty)
-			WriteTrack( iDrive);
+	if (!pFloppy->imagehandle || track >= ImageGetNumTracks(pFloppy->imagehandle) || track >= TRACKS_MAX)
+		return false;
 
-		ImageClose(pFloppy->imagehandle);
-		pFloppy->imagehandle = NULL;
+	if (!ImageIsValidTrack(pFloppy->imagehandle, track))
+		return false;
+
+	if (!pFloppy->trackcache)
+		AllocTrack(iDrive);
+
+	TrackCache_t* pCache = pFloppy->trackcache;
+	if (!pCache)
+		return false;
+
+	const bool bCurrentTrack = (track == pFloppy->track) && pFloppy->trackimagedata;
+	if (bCurrentTrack && pFloppy->bittrack && pFloppy->trackimagedirty)
+		WriteTrack(iDrive);	// Get the bits' writes into the nibbles
+
+	// Doubled, so that fields wrapping around the end of the track can be read linearly
+	static BYTE aTrack[NIBBLES_PER_TRACK*2];
+	int nibbles;
+
+	EnterCriticalSection(&g_DiskIOCriticalSection);
+	if (bCurrentTrack)
+	{
+		nibbles = pFloppy->nibbles;		// Live, incl. any unflushed writes
+	}
+	else
+	{
+		if (pCache->state[track] == TRACK_EMPTY)	// NB. Any skew is fine, as sectors are found by their address fields
+			ReadTrackIntoCache(pCache, track);
+		nibbles = pCache->nibbles[track];
+	}
+	if (nibbles > 0 && nibbles <= NIBBLES_PER_TRACK)
+	{
+		memcpy(aTrack, GetTrackCacheNibbles(pCache, track), nibbles);
+		memcpy(aTrack+nibbles, aTrack, nibbles);
 	}
+	LeaveCriticalSection(&g_DiskIOCriticalSection);
+
+	if (nibbles <= 0 || nibbles > NIBBLES_PER_TRACK)
+		return false;
 
-	if (pFloppy->trackimage)
+	// Bit stream track: the head is wherever the time says it is (NB. pFloppy->byte is then in bits/8, not nibbles)
+	int start = 0;
+	if (bCurrentTrack && pFloppy->bittrack)
 	{
-		VirtualFree(pFloppy->trackimage,0,MEM_RELEASE);
-		pFloppy->trackimage     = NULL;
-		pFloppy->trackimagedata = 0;
+		BitCursor_Advance(pFloppy->bitcursor, *pFloppy->bittrack, g_nCumulativeCycles);
+		start = BitTrack_NibbleAtBit(*pFloppy->bittrack, pFloppy->bitcursor.uHead) % nibbles;
+	}
+	else if (bCurrentTrack)
+	{
+		start = pFloppy->byte;
 	}
 
-	memset( pFloppy->imagename, 0, MAX_DISK_IMAGE_NAME+1 );
-	memset( pFloppy->fullname , 0, MAX_DISK_FULL_NAME +1 );
-	pFloppy->strFilenameInZip = "";
+	const BYTE* pStart = aTrack + start;
 
-	Disk_SaveLastDiskImage( iDrive );
-	Video_ResetScreenshotCounter( NULL );
+	int pos = 0;
+	while (pos < nibbles)
+	{
+		const int i = GCR62_FindNibble(pStart+pos, nibbles-pos, 0xD5);
+		if (i < 0)
+			break;
+		pos += i;
+
+		const BYTE* p = pStart + pos++;
+		if (p[1] != 0xAA || p[2] != 0x96)
+			continue;
+
+		// Address field: 4-and-4 encoded volume, track, sector, checksum
+#define DECODE44(a,b) ((((a) << 1) | 1) & (b))
+		const BYTE vol = DECODE44(p[3], p[4]);
+		const BYTE trk = DECODE44(p[5], p[6]);
+		const BYTE sec = DECODE44(p[7], p[8]);
+		const BYTE chk = DECODE44(p[9], p[10]);
+#undef DECODE44
+		if ((vol ^ trk ^ sec ^ chk) != 0 || p[11] != 0xDE || p[12] != 0xAA)
+			continue;
+
+		if (trk != track || sec != sector)
+			continue;
+
+		// Data field: should follow within gap 2 (else it's non-standard, so let the real driver have a go)
+		const int kMaxGap2 = 64;
+		const BYTE* q = p + 13;
+		const int j = GCR62_FindNibble(q, kMaxGap2, 0xD5);
+		if (j < 0)
+			return false;
+
+		q += j;
+		if (q[1] != 0xAA || q[2] != 0xAD)
+			return false;
+
+		const BYTE* pData = q + 3;
+		if (!GCR62_Verify(pData) || pData[GCR62_NIBBLES] != 0xDE || pData[GCR62_NIBBLES+1] != 0xAA)
+			return false;
+
+		GCR62_Decode(pData, pSectorData);
+		volume = vol;
+
+		// Time for this sector to pass under the head
+		const int end = (int)(pData + GCR62_NIBBLES + 2 - pStart);
+		uCycles += end * (enhancedisk ? kTrapCyclesPerNibbleEnhanced : kTrapCyclesPerNibble);
+		if (bCurrentTrack && pFloppy->bittrack)
+		{
+			// The head is just past the data field when the driver returns (ie. after uCycles)
+			const UINT uBit = BitTrack_BitAfterNibble(*pFloppy->bittrack, (start + end - 1) % nibbles);
+			BitCursor_Seek(pFloppy->bitcursor, *pFloppy->bittrack, uBit, g_nCumulativeCycles + uCycles);
+			pFloppy->byte = uBit >> 3;
+		}
+		else if (bCurrentTrack)
+		{
+			pFloppy->byte = (start + end) % nibbles;
+		}
+
+		return true;
+	}
+
+	return false;
 }
 
-//===========================================================================
+// DOS 3.3 RWTS, entered with A/Y = IOB
+static bool TrapDOS33RWTS(int& iDrive, int& iTrack, UINT& uCycles)
+{
+	if (!IsTrapSignatureMatch(g_aDOS33Signature, sizeof(g_aDOS33Signature)/sizeof(g_aDOS33Signature[0])))
+		return false;
 
-static void WriteTrack(const int iDrive)
+	if (memcmp(mem + kDOS33WriteTranslate, g_aGCR62Nibble, sizeof(g_aGCR62Nibble)) != 0)
+		return false;
+
+	const USHORT iob = ((USHORT)regs.a << 8) | regs.y;
+	if ((UINT)iob + 0x11 > 0x10000)
+		return false;
+
+	const BYTE* pIOB = mem + iob;
+	const BYTE slot    = pIOB[0x01];
+	const BYTE drive   = pIOB[0x02];
+	const BYTE volume  = pIOB[0x03];
+	const BYTE track   = pIOB[0x04];
+	const BYTE sector  = pIOB[0x05];
+	const USHORT buffer = pIOB[0x08] | ((USHORT)pIOB[0x09] << 8);
+	const BYTE command = pIOB[0x0C];
+
+	if (pIOB[0x00] != 1 || command != 1 || slot != (g_uSlot << 4) || (drive != 1 && drive != 2) || sector > 0x0F)
+		return false;
+
+	iDrive = drive-1;
+	iTrack = track;
+
+	BYTE aSector[0x100];
+	BYTE volumeFound = 0;
+	if (!TrapReadSector(iDrive, track, mem[kDOS33Interleave + sector] & 0x0F, aSector, volumeFound, uCycles))
+		return false;
+
+	if (volume != 0 && volume != volumeFound)
+		return false;	// Let RWTS return its volume mismatch error
+
+	if (!TrapWriteMem(buffer, aSector, sizeof(aSector)))
+		return false;
+
+	// RWTS's exit state
+	const BYTE aIOBResult[] = {0x00, volumeFound, slot, drive};	// IOB+$0D..$10: error, volume found, previous slot & drive
+	TrapWriteMem(iob + 0x0D, aIOBResult, sizeof(aIOBResult));
+	const BYTE aZP48[] = {slot, regs.a};	// RWTS stores the IOB pointer at $48, then exits with STX $48
+	TrapWriteMem(0x48, aZP48, sizeof(aZP48));
+
+	regs.a = 0;
+	regs.x = slot;
+	regs.y = 0x0D;
+	return true;
+}
+
+// ProDOS Disk II driver, entered with the command in $42..$47
+static bool TrapProDOSDriver(int& iDrive, int& iTrack, UINT& uCycles)
 {
-	Disk_t *pFloppy = &g_aFloppyDisk[ iDrive ];
+	if (!MemCheckHIGHRAM())
+		return false;	// $D000 is ROM, not the driver in LC RAM
 
-	if (pFloppy->track >= ImageGetNumTracks(pFloppy->imagehandle))
-		return;
+	if (mem[kProDOSMLI] != 0x4C)	// JMP
+		return false;
 
-	if (pFloppy->bWriteProtected)
-		return;
+	const BYTE command = mem[0x42];
+	const BYTE unit    = mem[0x43];
+	const USHORT buffer = mem[0x44] | ((USHORT)mem[0x45] << 8);
+	const USHORT block  = mem[0x46] | ((USHORT)mem[0x47] << 8);
+
+	const UINT slot  = (unit >> 4) & 7;
+	const UINT drive = unit >> 7;
+	const USHORT devAdr = kProDOSDevAdr + drive*0x10 + slot*2;
+	if (command != 1 || slot != g_uSlot || (mem[devAdr] | ((USHORT)mem[devAdr+1] << 8)) != kProDOSDiskIIDriver)
+		return false;
+
+	iDrive = drive;
+	iTrack = block >> 3;
 
-	if (pFloppy->trackimage && pFloppy->imagehandle)
+	BYTE aBlock[0x200];
+	BYTE volumeFound = 0;
+	for (UINT i=0; i<2; i++)
 	{
-#if LOG_DISK_TRACKS
-		LOG_DISK("track $%02X%s write\r\n", pFloppy->track, (pFloppy->phase & 0) ? ".5" : "  "); // TODO: hard-coded to whole tracks - see below (nickw)
-#endif
-		ImageWriteTrack(
-			pFloppy->imagehandle,
-			pFloppy->track,
-			pFloppy->phase, // TODO: this should never be used; it's the current phase (half-track), not that of the track to be written (nickw)
-			pFloppy->trackimage,
-			pFloppy->nibbles);
+		if (!TrapReadSector(drive, block >> 3, g_aProDOSBlockSectors[block & 7][i], aBlock + i*0x100, volumeFound, uCycles))
+			return false;
 	}
 
-	pFloppy->trackimagedirty = 0;
+	if (!TrapWriteMem(buffer, aBlock, sizeof(aBlock)))
+		return false;
+
+	regs.a = 0;	// No error
+	return true;
 }
 
 //
@@ -391,7 +1366,14 @@ void DiskBoot(void)
 
 static void __stdcall DiskControlMotor(WORD, WORD address, BYTE, BYTE, ULONG uExecutedCycles)
 {
+	const BOOL bWasOn = floppymotoron;
 	floppymotoron = address & 1;
+	if (floppymotoron != bWasOn)
+	{
+		if (floppymotoron)
+			g_DiskStats.uMotorOn++;
+		DiskTrace(floppymotoron ? DISKTRACE_MOTORON : DISKTRACE_MOTOROFF, currdrive, g_aFloppyDisk[currdrive].track, 0);
+	}
 #if LOG_DISK_MOTOR
 	LOG_DISK("motor %s\r\n", (floppymotoron) ? "on" : "off");
 #endif
@@ -408,6 +1390,7 @@ static void __stdcall DiskControlStepper(WORD, WORD address, BYTE, BYTE, ULONG u
 
 #if 1
 	// update the magnet states
+	const WORD oldphases = phases;
 	if (address & 1)
 	{
 		// phase on
@@ -419,6 +1402,12 @@ static void __stdcall DiskControlStepper(WORD, WORD address, BYTE, BYTE, ULONG u
 		phases &= ~phase_bit;
 	}
 
+	if (phases != oldphases)
+	{
+		g_DiskStats.uPhaseChanges++;
+		DiskTrace(DISKTRACE_PHASE, currdrive, fptr->track, phases);
+	}
+
 	// check for any stepping effect from a magnet
 	// - move only when the magnet opposite the cog is off
 	// - move in the direction of an adjacent magnet if one is on
@@ -445,6 +1434,12 @@ static void __stdcall DiskControlStepper(WORD, WORD address, BYTE, BYTE, ULONG u
 			}
 			fptr->track          = newtrack;
 			fptr->trackimagedata = 0;
+
+			g_DiskStats.uTrackSteps++;
+			DiskTrace(DISKTRACE_TRACK, currdrive, newtrack, 0);
+
+			if (fptr->trackcache)
+				PrefetchTracks(fptr->trackcache, newtrack, direction, nNumTracksInImage);
 		}
 
 		// Feature Request #201 Show track status
@@ -479,6 +1474,22 @@ void DiskDestroy(void)
 	RemoveDisk(DRIVE_2);
 
 	g_bSaveDiskImage = true;
+
+	if (!g_strDiskStatsFilename.empty())
+		DiskSaveStats(g_strDiskStatsFilename.c_str());
+
+	DiskIO_Uninit();
+}
+
+//===========================================================================
+
+// Write back all dirty tracks & wait for them (eg. before the image file is used elsewhere)
+void DiskFlush(void)
+{
+	FlushTrackCache(DRIVE_1);
+	FlushTrackCache(DRIVE_2);
+	WaitForTrackWrites();
+	ReportWriteErrors();
 }
 
 //===========================================================================
@@ -552,6 +1563,8 @@ void DiskInitialize(void)
 
 	TCHAR imagefilename[MAX_PATH];
 	_tcscpy(imagefilename,g_sProgramDir);
+
+	DiskStats_Init();
 }
 
 //===========================================================================
@@ -722,6 +1735,35 @@ void DiskNotifyInvalidImage(const int iDrive, LPCTSTR pszImageFilename, const Im
 		MB_ICONEXCLAMATION | MB_SETFOREGROUND);
 }
 
+//===========================================================================
+
+// A compressed image (floppy or harddisk) failed to decompress in full, after it was opened
+// . The image layer has already write-protected it, so make any drive it's in follow suit
+void DiskNotifyImageLoadError(LPCTSTR pszImageFilename)
+{
+	for (int i = DRIVE_1; i < NUM_DRIVES; i++)
+	{
+		if (g_aFloppyDisk[i].imagehandle && Disk_ImageIsWriteProtected(i))
+			g_aFloppyDisk[i].bWriteProtected = true;
+	}
+
+	FrameRefreshStatus(DRAW_LEDS | DRAW_BUTTON_DRIVES);
+
+	TCHAR szBuffer[MAX_PATH+128];
+	wsprintf(
+		szBuffer,
+		TEXT("Unable to fully decompress the file %s\nbecause the ")
+		TEXT("compressed disk image is corrupt/unsupported.\n")
+		TEXT("It's now write-protected, to preserve the original file."),
+		pszImageFilename);
+
+	MessageBox(
+		g_hFrameWindow,
+		szBuffer,
+		g_pAppTitle,
+		MB_ICONEXCLAMATION | MB_SETFOREGROUND);
+}
+
 
 //===========================================================================
 
@@ -773,6 +1815,29 @@ bool Disk_IsDriveEmpty(const int iDrive)
 
 //===========================================================================
 
+// Bit stream track: the head is wherever the time says it is
+static void DiskReadWriteBits(Disk_t* fptr, ULONG uExecutedCycles)
+{
+	CpuCalcCycles(uExecutedCycles);
+
+	if (!floppywritemode)
+	{
+		floppylatch = BitCursor_Read(fptr->bitcursor, *fptr->bittrack, g_nCumulativeCycles);
+		g_DiskStats.uNibbleReads++;		// NB. Latch reads, not necessarily whole nibbles
+	}
+	else if (!fptr->bWriteProtected)
+	{
+		BitCursor_Write(fptr->bitcursor, *fptr->bittrack, g_nCumulativeCycles, floppylatch);
+		fptr->trackimagedirty = 1;
+		g_DiskStats.uNibbleWrites++;
+	}
+
+	const int byte = fptr->bitcursor.uHead >> 3;
+	if ((byte ^ fptr->byte) & ~0xFF)
+		FrameDrawDiskStatus( (HDC)0 );
+	fptr->byte = byte;
+}
+
 static void __stdcall DiskReadWrite(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG nCyclesLeft)
 {
 	/* floppyloadmode = 0; */
@@ -789,9 +1854,16 @@ static void __stdcall DiskReadWrite(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULO
 		return;
 	}
 
+	if (fptr->bittrack)
+	{
+		DiskReadWriteBits(fptr, nCyclesLeft);
+		return;
+	}
+
 	if (!floppywritemode)
 	{
 		floppylatch = *(fptr->trackimage + fptr->byte);
+		g_DiskStats.uNibbleReads++;
 #if LOG_DISK_NIBBLES
 		LOG_DISK("read %4X = %2X\r\n", fptr->byte, floppylatch);
 #endif
@@ -800,6 +1872,7 @@ static void __stdcall DiskReadWrite(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULO
 	{
 		*(fptr->trackimage + fptr->byte) = floppylatch;
 		fptr->trackimagedirty = 1;
+		g_DiskStats.uNibbleWrites++;
 	}
 
 	if (++fptr->byte >= fptr->nibbles)
@@ -814,6 +1887,37 @@ static void __stdcall DiskReadWrite(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULO
 
 //===========================================================================
 
+// Called (if g_bDiskFastRWTS) when the CPU is about to execute kDOS33RWTS or kProDOSDiskIIDriver
+// . If it's a read of a standard sector/block, then it's transferred straight from the track into memory & the driver is returned from
+// . The caller then executes a CLC, as both return with carry clear on success
+// . Else returns false & the real driver runs: eg. writes, formats, custom (ie. copy-protected) RWTS or disk formats
+bool DiskTrapRWTS(const USHORT PC, ULONG& uExecutedCycles)
+{
+	UINT uCycles = 0;
+	int iDrive = 0, iTrack = 0;	// As requested by the driver
+	bool bRes = false;
+
+	CpuCalcCycles(uExecutedCycles);	// For a bit stream track's head position
+
+	if (PC == kDOS33RWTS)
+		bRes = TrapDOS33RWTS(iDrive, iTrack, uCycles);
+	else if (PC == kProDOSDiskIIDriver)
+		bRes = TrapProDOSDriver(iDrive, iTrack, uCycles);
+
+	if (!bRes)
+		return false;
+
+	TrapReturn();
+	diskaccessed = 1;
+	uExecutedCycles += uCycles;
+
+	g_DiskStats.uRWTSTraps++;
+	DiskTrace(DISKTRACE_RWTSTRAP, iDrive, iTrack, uCycles);
+	return true;
+}
+
+//===========================================================================
+
 void DiskReset(void)
 {
 	floppymotoron = 0;
@@ -900,6 +2004,10 @@ static void __stdcall DiskLoadWriteProtect(WORD, WORD, BYTE write, BYTE value, U
 static void __stdcall DiskSetReadMode(WORD, WORD, BYTE, BYTE, ULONG)
 {
 	floppywritemode = 0;
+
+	Disk_t * fptr = &g_aFloppyDisk[currdrive];
+	if (fptr->bittrack)
+		BitCursor_FlushWrite(fptr->bitcursor, *fptr->bittrack);
 }
 
 //===========================================================================
@@ -928,6 +2036,11 @@ void DiskUpdatePosition(DWORD cycles)
 		if (fptr->spinning && !floppymotoron) {
 			if (!(fptr->spinning -= MIN(fptr->spinning, (cycles >> 6))))
 			{
+				g_DiskStats.uSpinDowns++;
+				DiskTrace(DISKTRACE_SPINDOWN, loop, fptr->track, 0);
+
+				FlushTrackCache(loop);	// Drive has spun down: a good time to write back (asynchronously)
+
 				// FrameRefreshStatus(DRAW_LEDS);
 				FrameDrawDiskLEDS( (HDC)0 );
 				FrameDrawDiskStatus( (HDC)0 );
@@ -957,6 +2070,8 @@ void DiskUpdatePosition(DWORD cycles)
 	}
 
 	diskaccessed = 0;
+
+	ReportWriteErrors();	// From the I/O thread's writes-back
 }
 
 //===========================================================================
@@ -1083,6 +2198,156 @@ static BYTE __stdcall Disk_IOWrite(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULON
 
 //===========================================================================
 
+void DiskGetStats(DiskStats_t& stats)
+{
+	if (g_bDiskIOInit)
+		EnterCriticalSection(&g_DiskImageCriticalSection);
+
+	stats = g_DiskStats;
+
+	if (g_bDiskIOInit)
+		LeaveCriticalSection(&g_DiskImageCriticalSection);
+}
+
+void DiskResetStats(void)
+{
+	if (g_bDiskIOInit)
+		EnterCriticalSection(&g_DiskImageCriticalSection);
+
+	ZeroMemory(&g_DiskStats, sizeof(g_DiskStats));
+
+	if (g_bDiskIOInit)
+		LeaveCriticalSection(&g_DiskImageCriticalSection);
+
+	g_llDiskStatsStart = DiskStats_Now();
+	g_llDiskSpeedLast = 0;
+	g_llDiskNibbleRateStart = g_llDiskStatsStart;
+	g_uDiskNibbleRateReads = 0;
+
+	EnterCriticalSection(&g_DiskTraceCriticalSection);
+	g_DiskTrace.clear();
+	g_uDiskTraceNext = 0;
+	g_uDiskTraceTotal = 0;
+	LeaveCriticalSection(&g_DiskTraceCriticalSection);
+}
+
+void DiskSetTrace(const bool bEnable)
+{
+	DiskStats_Init();
+	g_bDiskTrace = bEnable;
+}
+
+bool DiskIsTracing(void)
+{
+	return g_bDiskTrace;
+}
+
+void DiskSetStatsFilename(LPCTSTR pszFilename)
+{
+	g_strDiskStatsFilename = pszFilename;
+	DiskSetTrace(true);
+}
+
+// Called every execution period, with full-speed attributed to the disk (or held off despite it)
+void DiskUpdateSpeedStats(const bool bDiskFullSpeed, const bool bDiskThrottled)
+{
+	const LONGLONG llNow = DiskStats_Now();
+
+	if (g_llDiskSpeedLast)
+	{
+		if (g_bDiskFullSpeedLast)
+			g_DiskStats.fFullSpeedMs += DiskStats_Ms(llNow - g_llDiskSpeedLast);
+		if (g_bDiskThrottledLast)
+			g_DiskStats.fThrottledMs += DiskStats_Ms(llNow - g_llDiskSpeedLast);
+	}
+	g_llDiskSpeedLast = llNow;
+
+	if (bDiskFullSpeed != g_bDiskFullSpeedLast)
+	{
+		if (bDiskFullSpeed)
+			g_DiskStats.uFullSpeedEngaged++;
+		DiskTrace(bDiskFullSpeed ? DISKTRACE_FULLSPEEDON : DISKTRACE_FULLSPEEDOFF, currdrive, g_aFloppyDisk[currdrive].track, 0);
+		g_bDiskFullSpeedLast = bDiskFullSpeed;
+	}
+
+	if (bDiskThrottled != g_bDiskThrottledLast)
+	{
+		DiskTrace(bDiskThrottled ? DISKTRACE_THROTTLEDON : DISKTRACE_THROTTLEDOFF, currdrive, g_aFloppyDisk[currdrive].track, 0);
+		g_bDiskThrottledLast = bDiskThrottled;
+	}
+
+	// Nibble reads per (host) second
+	const LONGLONG llElapsed = llNow - g_llDiskNibbleRateStart;
+	if (llElapsed >= g_liDiskStatsFreq.QuadPart && llElapsed > 0)
+	{
+		g_DiskStats.uNibbleReadsPerSec = (UINT) (((g_DiskStats.uNibbleReads - g_uDiskNibbleRateReads) * g_liDiskStatsFreq.QuadPart) / llElapsed);
+		g_uDiskNibbleRateReads = g_DiskStats.uNibbleReads;
+		g_llDiskNibbleRateStart = llNow;
+	}
+}
+
+// Machine-readable: name=value lines, then the trace (oldest first) as CSV
+bool DiskSaveStats(LPCTSTR pszFilename)
+{
+	FILE* hFile = fopen(pszFilename, "wt");
+	if (!hFile)
+		return false;
+
+	DiskStats_t stats;
+	DiskGetStats(stats);
+
+	fprintf(hFile, "# AppleWin Disk II stats: host times in ms\n");
+	fprintf(hFile, "phase_changes=%I64u\n", stats.uPhaseChanges);
+	fprintf(hFile, "track_steps=%I64u\n", stats.uTrackSteps);
+	fprintf(hFile, "readtrack=%I64u\n", stats.uReadTrack);
+	fprintf(hFile, "readtrack_misses=%I64u\n", stats.uReadTrackMisses);
+	fprintf(hFile, "readtrack_ms=%.3f\n", stats.fReadTrackMs);
+	fprintf(hFile, "track_loads=%I64u\n", stats.uTrackLoads);
+	fprintf(hFile, "track_load_ms=%.3f\n", stats.fTrackLoadMs);
+	fprintf(hFile, "prefetch_loads=%I64u\n", stats.uPrefetchLoads);
+	fprintf(hFile, "prefetch_load_ms=%.3f\n", stats.fPrefetchLoadMs);
+	fprintf(hFile, "writetrack=%I64u\n", stats.uWriteTrack);
+	fprintf(hFile, "image_writes=%I64u\n", stats.uImageWrites);
+	fprintf(hFile, "image_write_ms=%.3f\n", stats.fImageWriteMs);
+	fprintf(hFile, "write_wait_ms=%.3f\n", stats.fWriteWaitMs);
+	fprintf(hFile, "nibble_reads=%I64u\n", stats.uNibbleReads);
+	fprintf(hFile, "nibble_writes=%I64u\n", stats.uNibbleWrites);
+	fprintf(hFile, "nibble_reads_per_sec=%u\n", stats.uNibbleReadsPerSec);
+	fprintf(hFile, "rwts_traps=%I64u\n", stats.uRWTSTraps);
+	fprintf(hFile, "motor_on=%u\n", stats.uMotorOn);
+	fprintf(hFile, "spin_ups=%u\n", stats.uSpinUps);
+	fprintf(hFile, "spin_downs=%u\n", stats.uSpinDowns);
+	fprintf(hFile, "fullspeed_engaged=%u\n", stats.uFullSpeedEngaged);
+	fprintf(hFile, "fullspeed_ms=%.3f\n", stats.fFullSpeedMs);
+	fprintf(hFile, "throttled_ms=%.3f\n", stats.fThrottledMs);
+	fprintf(hFile, "enhancedisk=%d\n", enhancedisk ? 1 : 0);
+
+	if (g_bDiskStatsInit)
+	{
+		EnterCriticalSection(&g_DiskTraceCriticalSection);
+
+		fprintf(hFile, "trace_events=%I64u\n", g_uDiskTraceTotal);
+		fprintf(hFile, "trace_dropped=%I64u\n", g_uDiskTraceTotal - g_DiskTrace.size());
+		fprintf(hFile, "# host_ms,cycle,event,drive,track,value\n");
+
+		for (size_t i = 0; i < g_DiskTrace.size(); i++)
+		{
+			const DiskTraceEvent_t& event = g_DiskTrace[(g_uDiskTraceNext + i) % g_DiskTrace.size()];
+			if (event.drive == 0xFF)
+				fprintf(hFile, "%.3f,%I64u,%s,,%u,%u\n", event.fHostMs, event.uCycle, g_aDiskTraceName[event.type], event.track, event.value);
+			else
+				fprintf(hFile, "%.3f,%I64u,%s,%u,%u,%u\n", event.fHostMs, event.uCycle, g_aDiskTraceName[event.type], event.drive + 1, event.track, event.value);
+		}
+
+		LeaveCriticalSection(&g_DiskTraceCriticalSection);
+	}
+
+	fclose(hFile);
+	return true;
+}
+
+//===========================================================================
+
 int DiskSetSnapshot_v1(const SS_CARD_DISK2* const pSS)
 {
 	if(pSS->Hdr.UnitHdr.hdr.v1.dwVersion > MAKE_VERSION(1,0,0,2))
@@ -1152,7 +2417,10 @@ int DiskSetSnapshot_v1(const SS_CARD_DISK2* const pSS)
 			if(g_aFloppyDisk[i].trackimage == NULL)
 				bImageError = true;
 			else
+			{
 				memcpy(g_aFloppyDisk[i].trackimage, pSS->Unit[i].nTrack, NIBBLES_PER_TRACK);
+				SetTrackFromSnapshot(i);
+			}
 		}
 
 		if(bImageError)
@@ -1222,6 +2490,9 @@ static void DiskSaveSnapshotDisk2Unit(YamlSaveHelper& yamlSaveHelper, UINT unit)
 
 void DiskSaveSnapshot(class YamlSaveHelper& yamlSaveHelper)
 {
+	// The snapshot only holds the current track, so the image file must have all the others
+	DiskFlush();
+
 	YamlSaveHelper::Slot slot(yamlSaveHelper, DiskGetSnapshotCardName(), g_uSlot, 1);
 
 	YamlSaveHelper::Label state(yamlSaveHelper, "%s:\n", SS_YAML_KEY_STATE);
@@ -1304,7 +2575,10 @@ static void DiskLoadSnapshotDriveUnit(YamlLoadHelper& yamlLoadHelper, UINT unit)
 		if (g_aFloppyDisk[unit].trackimage == NULL)
 			bImageError = true;
 		else
+		{
 			memcpy(g_aFloppyDisk[unit].trackimage, pTrack.get(), NIBBLES_PER_TRACK);
+			SetTrackFromSnapshot(unit);
+		}
 	}
 
 	if (bImageError)
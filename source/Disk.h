@@ -40,6 +40,8 @@ const bool IMAGE_DONT_CREATE = false;
 const bool IMAGE_CREATE = true;
 
 extern BOOL enhancedisk;
+extern bool g_bDiskFastRWTS;
+extern bool g_bDiskBitstream;
 const char* DiskGetDiskPathFilename(const int iDrive);
 
 void    DiskInitialize(void); // DiskIIManagerStartup()
@@ -47,6 +49,7 @@ void    DiskDestroy(void); // no, doesn't "destroy" the disk image.  DiskIIManag
 
 void    DiskBoot(void);
 void    DiskEject(const int iDrive);
+void    DiskFlush(void);
 
 LPCTSTR DiskGetFullName(const int iDrive);
 LPCTSTR DiskGetFullDiskFilename(const int iDrive);
@@ -57,6 +60,7 @@ void    DiskGetLightStatus (Disk_Status_e *pDisk1Status_, Disk_Status_e *pDisk2S
 ImageError_e DiskInsert(const int iDrive, LPCTSTR pszImageFilename, const bool bForceWriteProtected, const bool bCreateIfNecessary);
 BOOL    DiskIsSpinning(void);
 void    DiskNotifyInvalidImage(const int iDrive, LPCTSTR pszImageFilename, const ImageError_e Error);
+void    DiskNotifyImageLoadError(LPCTSTR pszImageFilename);
 void    DiskReset(void);
 bool    DiskGetProtect(const int iDrive);
 void    DiskSetProtect(const int iDrive, const bool bWriteProtect);
@@ -68,6 +72,7 @@ int     DiskGetCurrentOffset();
 char*   DiskGetCurrentState();
 void    DiskSelect(const int iDrive);
 void    DiskUpdatePosition(DWORD);
+bool    DiskTrapRWTS(const USHORT PC, ULONG& uExecutedCycles);
 bool    DiskDriveSwap(void);
 void    DiskLoadRom(LPBYTE pCxRomPeripheral, UINT uSlot);
 
@@ -81,3 +86,40 @@ void Disk_SaveLastDiskImage(const int iDrive);
 
 bool Disk_ImageIsWriteProtected(const int iDrive);
 bool Disk_IsDriveEmpty(const int iDrive);
+
+// Instrumentation: to tell whether slow loads are CPU-bound, I/O-bound or down to the speed heuristics
+// . Host times are in ms; track loads & image writes may be done by the disk I/O thread
+struct DiskStats_t
+{
+	unsigned __int64 uPhaseChanges;		// Stepper magnet on/off
+	unsigned __int64 uTrackSteps;		// Head moved to a different track
+	unsigned __int64 uReadTrack;		// ReadTrack(): the head arrived on a track (& its nibbles were wanted)
+	unsigned __int64 uReadTrackMisses;	// ... which had to be loaded from the image there & then
+	double           fReadTrackMs;		// ... host time in ReadTrack(), incl. any waits for the I/O thread
+	unsigned __int64 uTrackLoads;		// ImageReadTrack() calls by the emulation thread
+	double           fTrackLoadMs;
+	unsigned __int64 uPrefetchLoads;	// ImageReadTrack() calls by the I/O thread
+	double           fPrefetchLoadMs;
+	unsigned __int64 uWriteTrack;		// WriteTrack(): a written track handed over to the cache
+	unsigned __int64 uImageWrites;		// ImageWriteTrack() calls (either thread)
+	double           fImageWriteMs;
+	double           fWriteWaitMs;		// Emulation thread waiting for the I/O thread's writes (full queue, eject, save-state)
+	unsigned __int64 uNibbleReads;
+	unsigned __int64 uNibbleWrites;
+	UINT             uNibbleReadsPerSec;	// Over the last host second
+	unsigned __int64 uRWTSTraps;		// Sectors/blocks transferred by DiskTrapRWTS()
+	UINT             uMotorOn;
+	UINT             uSpinUps;			// Motor on, with the disk stopped
+	UINT             uSpinDowns;
+	UINT             uFullSpeedEngaged;	// Times full-speed was entered because of the disk (ie. DiskIsSpinning() && enhancedisk)
+	double           fFullSpeedMs;		// ... host time spent in it
+	double           fThrottledMs;		// Host time the disk was spinning with enhancedisk, but full-speed was held off by the speaker/Mockingboard
+};
+
+void DiskGetStats(DiskStats_t& stats);
+void DiskResetStats(void);
+void DiskSetTrace(const bool bEnable);	// Event trace (stepper, tracks, writes, motor & speed changes): dumped by DiskSaveStats()
+bool DiskIsTracing(void);
+bool DiskSaveStats(LPCTSTR pszFilename);	// name=value lines, then the trace as CSV
+void DiskSetStatsFilename(LPCTSTR pszFilename);	// Trace from now on, & save to pszFilename on exit
+void DiskUpdateSpeedStats(const bool bDiskFullSpeed, const bool bDiskThrottled);	// Pre: called from ContinueExecution()
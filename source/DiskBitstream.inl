@@ -0,0 +1,405 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2016, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: Bit-level (WOZ-style) floppy tracks & a timed read/write cursor over them
+ *
+ * Included by Disk.cpp & test/TestDiskGCR (which checks the round-trip & the cursor against the nibble stream)
+ *
+ * A track is a ring of bit cells (MSB first), of any length. A '1' is a flux transition.
+ * The Disk II's read logic shifts each bit cell (4 cycles) into its data register, and a nibble is complete
+ * when bit 7 is set. Leading zeros are skipped, which is how sync nibbles (FF + 2 zero bits) self-synchronise.
+ *
+ * The cursor doesn't shift bit by bit: it looks ahead a 64-bit word at a time to find where the next nibble
+ * ends, so a read costs O(1) amortized (ie. at most one lookahead per nibble that passes under the head).
+ *
+ * Not modelled: the MC3470's random bits after long runs of zeros, & quarter/half tracks.
+ *
+ * Scope: the image layer is still nibble based (no .woz), so the tracks are converted from .dsk/.nib ones.
+ * Cost: a read loop at full speed (65C02 core, an RWTS-style loop reading sectors) runs ~14% fewer emulated cycles/s
+ * than the same loop fed the same latch values from an array (ie. the nibble path's cost per read). This is over the 5% budget:
+ * it's mostly the time arithmetic & compares that every read needs, which the nibble path doesn't (before the inline
+ * fast path in BitCursor_Read() it was ~17-27%). Loads also take the real disk's time: ~2x the nibble path's cycles.
+ * TestDiskGCR's benchmark (the cursor alone) reads ~55M nibbles/s vs ~750M/s from the nibble array.
+ */
+
+#include <intrin.h>
+
+static const UINT BITTRACK_CYCLES_PER_BIT = 4;						// 4us bit cells
+static const UINT BITTRACK_MAX_BITS = NIBBLES_PER_TRACK * 10;		// Every nibble a 10-bit sync
+static const UINT BITTRACK_WRAP_BITS = 72;							// First bits repeated after the end: a 64-bit (unaligned) load never wraps
+static const UINT BITTRACK_BUFFER_SIZE = (BITTRACK_MAX_BITS + BITTRACK_WRAP_BITS + 7) / 8 + 8;
+static const UINT BITTRACK_SYNC_RUN = 5;							// FF runs at least this long are converted to 10-bit syncs
+static const UINT BITCURSOR_LATCH_HOLD_BITS = 2;					// A complete nibble stays in the latch for 2 bit cells (8us)
+
+struct BitTrack_t
+{
+	LPBYTE pBits;		// [BITTRACK_BUFFER_SIZE]
+	UINT   uBitCount;	// 0 = no track
+};
+
+// NB. POD, as it lives in Disk_t
+struct BitCursor_t
+{
+	unsigned __int64 uCycle;	// Time of uHead
+	unsigned __int64 uEndCycle;	// Time the next nibble ends: reads before then don't need to move the head
+	unsigned __int64 uLatchCycle;	// Time the latch expires
+	UINT uHead;					// Bit cell under the head
+	UINT uToEnd;				// Bits from uHead to the end of the next nibble
+	UINT uSinceLatch;			// Bits since the latch was loaded
+	BYTE nextNibble;
+	BYTE latch;
+	bool bWritePending;			// A nibble was loaded in write mode, but not yet written
+	BYTE writeNibble;
+	UINT uWriteStart;
+};
+
+//===========================================================================
+
+static inline UINT BitTrack_CountLeadingZeros(const unsigned __int64 v)	// Pre: v != 0
+{
+	unsigned long i;
+	if (_BitScanReverse(&i, (unsigned long)(v >> 32)))
+		return 31 - i;
+	_BitScanReverse(&i, (unsigned long)v);
+	return 63 - i;
+}
+
+// The (at least 57) bits from uBit on, MSB first
+static inline unsigned __int64 BitTrack_Peek64(const BitTrack_t& track, const UINT uBit)
+{
+	unsigned __int64 w;
+	memcpy(&w, track.pBits + (uBit >> 3), sizeof(w));
+	return _byteswap_uint64(w) << (uBit & 7);
+}
+
+static inline void BitTrack_PutBit(BitTrack_t& track, const UINT uBit, const bool bSet)
+{
+	const BYTE mask = 0x80 >> (uBit & 7);
+	if (bSet)
+		track.pBits[uBit >> 3] |= mask;
+	else
+		track.pBits[uBit >> 3] &= ~mask;
+}
+
+static inline bool BitTrack_GetBit(const BitTrack_t& track, const UINT uBit)
+{
+	return (track.pBits[uBit >> 3] & (0x80 >> (uBit & 7))) != 0;
+}
+
+// Pre: uBit < uBitCount
+static void BitTrack_WriteBit(BitTrack_t& track, const UINT uBit, const bool bSet)
+{
+	BitTrack_PutBit(track, uBit, bSet);
+	if (uBit < BITTRACK_WRAP_BITS)
+		BitTrack_PutBit(track, track.uBitCount + uBit, bSet);
+}
+
+static void BitTrack_UpdateWrap(BitTrack_t& track)
+{
+	for (UINT i = 0; i < BITTRACK_WRAP_BITS; i++)
+		BitTrack_PutBit(track, track.uBitCount + i, BitTrack_GetBit(track, i % track.uBitCount));
+}
+
+//===========================================================================
+
+// Each nibble becomes 8 bits, except runs of FFs (ie. gaps) which become 10-bit syncs
+// . Lossless: zeros after a nibble are skipped when reading, so BitTrack_ToNibbles() gets the same nibbles back
+// . NB. Except for nibbles without bit 7 set (which can't be on a real disk): their bits merge with the next nibble's
+static void BitTrack_FromNibbles(BitTrack_t& track, const BYTE* pNibbles, const int nNibbles)
+{
+	memset(track.pBits, 0, BITTRACK_BUFFER_SIZE);
+	track.uBitCount = 0;
+
+	int run = 0;		// FFs left in the current run
+	bool bSync = false;
+	for (int i = 0; i < nNibbles; i++)
+	{
+		const BYTE n = pNibbles[i];
+		if (n == 0xFF && run == 0)
+		{
+			while (i + run < nNibbles && pNibbles[i + run] == 0xFF)
+				run++;
+			bSync = run >= (int)BITTRACK_SYNC_RUN;
+		}
+
+		const UINT p = track.uBitCount;
+		track.pBits[p >> 3]     |= n >> (p & 7);
+		track.pBits[(p >> 3)+1] |= (BYTE)(n << (8 - (p & 7)));
+		track.uBitCount += (run && bSync) ? 10 : 8;
+
+		if (run)
+			run--;
+	}
+
+	if (track.uBitCount)
+		BitTrack_UpdateWrap(track);
+}
+
+// One revolution's nibbles, from bit 0; returns the number of nibbles (at most nMaxNibbles)
+static int BitTrack_ToNibbles(const BitTrack_t& track, BYTE* pNibbles, const int nMaxNibbles)
+{
+	int n = 0;
+	UINT uBit = 0;
+
+	while (n < nMaxNibbles && uBit < track.uBitCount)
+	{
+		const unsigned __int64 w = BitTrack_Peek64(track, uBit);
+		if ((w >> 15) == 0)
+		{
+			uBit += 49;		// No flux transition in the next 49 bits
+			continue;
+		}
+
+		const UINT lz = BitTrack_CountLeadingZeros(w);
+		if (uBit + lz >= track.uBitCount)
+			break;			// The next nibble starts on the next revolution
+
+		pNibbles[n++] = (BYTE)((w << lz) >> 56);
+		uBit += lz + 8;
+	}
+
+	return n;
+}
+
+// Nibble # (as counted by BitTrack_ToNibbles()) of the first nibble to end after uHead, or 0 if none this revolution
+static int BitTrack_NibbleAtBit(const BitTrack_t& track, const UINT uHead)
+{
+	int n = 0;
+	UINT uBit = 0;
+
+	while (uBit < track.uBitCount)
+	{
+		const unsigned __int64 w = BitTrack_Peek64(track, uBit);
+		if ((w >> 15) == 0)
+		{
+			uBit += 49;
+			continue;
+		}
+
+		const UINT lz = BitTrack_CountLeadingZeros(w);
+		if (uBit + lz >= track.uBitCount)
+			break;
+		if (uBit + lz + 8 > uHead)
+			return n;
+
+		n++;
+		uBit += lz + 8;
+	}
+
+	return 0;
+}
+
+// The bit just after the end of nibble # nNibble (as counted by BitTrack_ToNibbles())
+static UINT BitTrack_BitAfterNibble(const BitTrack_t& track, const int nNibble)
+{
+	int n = 0;
+	UINT uBit = 0;
+
+	while (uBit < track.uBitCount)
+	{
+		const unsigned __int64 w = BitTrack_Peek64(track, uBit);
+		if ((w >> 15) == 0)
+		{
+			uBit += 49;
+			continue;
+		}
+
+		const UINT lz = BitTrack_CountLeadingZeros(w);
+		if (uBit + lz >= track.uBitCount)
+			break;
+
+		uBit += lz + 8;
+		if (n++ == nNibble)
+			return (uBit < track.uBitCount) ? uBit : uBit - track.uBitCount;
+	}
+
+	return 0;
+}
+
+//===========================================================================
+
+// Find the next nibble after the head
+static void BitCursor_LookAhead(BitCursor_t& cursor, const BitTrack_t& track)
+{
+	UINT uOffset = 0;
+	while (uOffset < track.uBitCount)
+	{
+		UINT uBit = cursor.uHead + uOffset;
+		if (uBit >= track.uBitCount)
+			uBit -= track.uBitCount;
+
+		const unsigned __int64 w = BitTrack_Peek64(track, uBit);
+		if (w >> 15)	// A '1' in the first 49 bits, so there are 8 bits from it
+		{
+			const UINT lz = BitTrack_CountLeadingZeros(w);
+			cursor.nextNibble = (BYTE)((w << lz) >> 56);
+			cursor.uToEnd = uOffset + lz + 8;
+			return;
+		}
+
+		uOffset += 49;
+	}
+
+	// Unformatted: nothing completes for a whole revolution
+	cursor.nextNibble = 0;
+	cursor.uToEnd = track.uBitCount;
+}
+
+// Cache when the next nibble ends & when the latch expires, for BitCursor_Read()
+static inline void BitCursor_UpdateDeadlines(BitCursor_t& cursor)
+{
+	cursor.uEndCycle = cursor.uCycle + (unsigned __int64)cursor.uToEnd * BITTRACK_CYCLES_PER_BIT;
+	cursor.uLatchCycle = (cursor.uSinceLatch < BITCURSOR_LATCH_HOLD_BITS)
+		? cursor.uCycle + (BITCURSOR_LATCH_HOLD_BITS - cursor.uSinceLatch) * BITTRACK_CYCLES_PER_BIT
+		: 0;
+}
+
+// Move the head on to uCycle, latching each nibble that completes on the way
+static void BitCursor_Advance(BitCursor_t& cursor, const BitTrack_t& track, const unsigned __int64 uCycle)
+{
+	if (uCycle <= cursor.uCycle)
+		return;
+
+	const unsigned __int64 uBits64 = (uCycle - cursor.uCycle) / BITTRACK_CYCLES_PER_BIT;
+	cursor.uCycle += uBits64 * BITTRACK_CYCLES_PER_BIT;
+
+	UINT uBits = (UINT)uBits64;
+	if (uBits64 >= track.uBitCount)
+	{
+		uBits = (UINT)(uBits64 % track.uBitCount);		// Skip whole revolutions
+		cursor.uSinceLatch = BITCURSOR_LATCH_HOLD_BITS;	// So the latch (from a revolution ago) has expired
+	}
+
+	while (uBits >= cursor.uToEnd)
+	{
+		uBits -= cursor.uToEnd;
+		cursor.uHead += cursor.uToEnd;
+		while (cursor.uHead >= track.uBitCount)
+			cursor.uHead -= track.uBitCount;
+		cursor.latch = cursor.nextNibble;
+		cursor.uSinceLatch = 0;
+		BitCursor_LookAhead(cursor, track);
+	}
+
+	cursor.uHead += uBits;
+	if (cursor.uHead >= track.uBitCount)
+		cursor.uHead -= track.uBitCount;
+	cursor.uToEnd -= uBits;
+	cursor.uSinceLatch += uBits;
+	if (cursor.uSinceLatch > BITCURSOR_LATCH_HOLD_BITS)
+		cursor.uSinceLatch = BITCURSOR_LATCH_HOLD_BITS;
+
+	BitCursor_UpdateDeadlines(cursor);
+}
+
+// Put the head at uBit at time uCycle (eg. where the RWTS trap finished reading)
+static void BitCursor_Seek(BitCursor_t& cursor, const BitTrack_t& track, const UINT uBit, const unsigned __int64 uCycle)
+{
+	cursor.uHead = (uBit < track.uBitCount) ? uBit : 0;
+	cursor.uCycle = uCycle;
+	cursor.latch = 0;
+	cursor.uSinceLatch = BITCURSOR_LATCH_HOLD_BITS;
+	cursor.bWritePending = false;
+	BitCursor_LookAhead(cursor, track);
+	BitCursor_UpdateDeadlines(cursor);
+}
+
+// New track (or disk): keep the head's relative position (for tracks of different lengths)
+static void BitCursor_SetTrack(BitCursor_t& cursor, const BitTrack_t& track, const UINT uOldBitCount, const unsigned __int64 uCycle)
+{
+	if (uOldBitCount && uOldBitCount != track.uBitCount)
+		cursor.uHead = (UINT)(((unsigned __int64)cursor.uHead * track.uBitCount) / uOldBitCount);
+	if (cursor.uHead >= track.uBitCount)
+		cursor.uHead = 0;
+
+	cursor.uCycle = uCycle;
+	cursor.latch = 0;
+	cursor.uSinceLatch = BITCURSOR_LATCH_HOLD_BITS;
+	cursor.bWritePending = false;
+	BitCursor_LookAhead(cursor, track);
+	BitCursor_UpdateDeadlines(cursor);
+}
+
+// The data register's value at uCycle
+// . Inline for the common case: the read loop polls every few cycles, so mostly no nibble has ended since the last read
+//   (ie. uBits < uToEnd), & the head is left where it is (BitCursor_Advance() catches up from uCycle later)
+static inline BYTE BitCursor_Read(BitCursor_t& cursor, const BitTrack_t& track, const unsigned __int64 uCycle)
+{
+	if (uCycle >= cursor.uEndCycle)
+		BitCursor_Advance(cursor, track, uCycle);
+
+	if (uCycle < cursor.uLatchCycle)
+		return cursor.latch;
+
+	// Part of the next nibble has been shifted in (NB. never with bit 7 set)
+	const UINT uToEnd = (UINT)((cursor.uEndCycle - uCycle + BITTRACK_CYCLES_PER_BIT - 1) / BITTRACK_CYCLES_PER_BIT);
+	return (uToEnd >= 8) ? 0 : (BYTE)(cursor.nextNibble >> uToEnd);
+}
+
+//===========================================================================
+
+// Write out the pending nibble: its 8 bits, then zeros for as long as it was in the register (uBits)
+static void BitCursor_PutPending(BitCursor_t& cursor, BitTrack_t& track, UINT uBits)
+{
+	if (uBits > track.uBitCount)
+		uBits = track.uBitCount;
+
+	UINT uBit = cursor.uWriteStart;
+	for (UINT i = 0; i < uBits; i++)
+	{
+		BitTrack_WriteBit(track, uBit, i < 8 && (cursor.writeNibble & (0x80 >> i)));
+		if (++uBit >= track.uBitCount)
+			uBit = 0;
+	}
+
+	cursor.bWritePending = false;
+}
+
+// The write register was loaded with nibble at uCycle: the previous nibble was shifted out until now
+static void BitCursor_Write(BitCursor_t& cursor, BitTrack_t& track, const unsigned __int64 uCycle, const BYTE nibble)
+{
+	BitCursor_Advance(cursor, track, uCycle);
+
+	if (cursor.bWritePending)
+	{
+		UINT uBits = cursor.uHead + track.uBitCount - cursor.uWriteStart;
+		if (uBits >= track.uBitCount)
+			uBits -= track.uBitCount;
+		BitCursor_PutPending(cursor, track, uBits);
+	}
+
+	cursor.writeNibble = nibble;
+	cursor.uWriteStart = cursor.uHead;
+	cursor.bWritePending = true;
+}
+
+// Leaving write mode (or the track): the last nibble gets its 8 bits
+static void BitCursor_FlushWrite(BitCursor_t& cursor, BitTrack_t& track)
+{
+	if (!cursor.bWritePending)
+		return;
+
+	BitCursor_PutPending(cursor, track, 8);
+	BitCursor_LookAhead(cursor, track);		// The bits ahead of the head may have changed
+	BitCursor_UpdateDeadlines(cursor);
+}
@@ -0,0 +1,248 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2016, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: 6-and-2 GCR encode/decode & nibble search kernels
+ *
+ * Included by DiskImageHelper.cpp, Disk.cpp (RWTS trap) & test/TestDiskGCR (which checks them against the original byte-by-byte code)
+ *
+ * A 256-byte sector is 342 6-bit values, plus a checksum:
+ * . [0..85]    the "auxiliary" buffer: the low 2 bits of 3 sector bytes each, bit-swapped
+ * . [86..341]  the high 6 bits of each sector byte
+ * Each value is XOR'd with the previous one, then translated to a disk byte
+ *
+ * The auxiliary buffer's bit-shuffling is done 16 bytes at a time with SSE2 (if the CPU supports it)
+ */
+
+#include <emmintrin.h>	// SSE2
+
+// 6-bit value -> disk byte
+// A valid disk byte has the high bit set, at least two adjacent bits set (excluding the high bit),
+// and at most one pair of consecutive zero bits
+static const BYTE g_aGCR62Nibble[0x40] =
+{
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+static const int GCR62_AUX_SIZE = 0x56;		// 86
+static const int GCR62_VALUES = 0x156;			// 342
+static const int GCR62_NIBBLES = 0x157;		// 343 (incl. checksum)
+
+static BYTE g_aGCR62Decode[0x100];				// disk byte -> 6-bit value (invalid disk bytes -> 0, as before)
+static bool g_bGCR62Init = false;
+static bool g_bGCR62UseSSE2 = false;
+
+//===========================================================================
+
+static void GCR62_Init(void)
+{
+	if (g_bGCR62Init)
+		return;
+
+	memset(g_aGCR62Decode, 0, sizeof(g_aGCR62Decode));
+	for (int i = 0; i < 0x40; i++)
+	{
+		g_aGCR62Decode[g_aGCR62Nibble[i]       ] = (BYTE) i;
+		g_aGCR62Decode[g_aGCR62Nibble[i] & 0x7F] = (BYTE) i;	// The original code ignored bit 7 of the disk byte
+	}
+
+	g_bGCR62UseSSE2 = IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ? true : false;
+	g_bGCR62Init = true;
+}
+
+//===========================================================================
+
+// Swap bits 0 & 1
+static inline BYTE GCR62_Swap2(const BYTE b)
+{
+	return ((b & 0x01) << 1) | ((b & 0x02) >> 1);
+}
+
+static inline __m128i GCR62_Swap2_SSE2(const __m128i v)
+{
+	// NB. No 8-bit shifts in SSE2, but the 16-bit shifts only bleed into the bits that get masked off
+	const __m128i bit0 = _mm_set1_epi8(0x01);
+	const __m128i bit1 = _mm_set1_epi8(0x02);
+	return _mm_or_si128( _mm_and_si128(_mm_slli_epi16(v, 1), bit1),
+						 _mm_and_si128(_mm_srli_epi16(v, 1), bit0) );
+}
+
+//===========================================================================
+
+// pSector: 256 bytes -> pNibbles: 343 disk bytes
+static void GCR62_Encode(const BYTE* pSector, BYTE* pNibbles)
+{
+	GCR62_Init();
+
+	// Sector with zero padding, so the aux buffer can be built in whole 16-byte vectors (& the last 2 aux values' top bits come out as 0)
+	BYTE aSector[0x100+0x20];
+	memcpy(aSector, pSector, 0x100);
+	memset(aSector+0x100, 0, 0x20);
+
+	// [0] is the XOR chain's initial 0, [343] its final 0 (for the checksum)
+	BYTE aValues[1 + GCR62_VALUES + 0x10];
+	BYTE* pValues = aValues + 1;
+	aValues[0] = 0;
+
+	if (g_bGCR62UseSSE2)
+	{
+		for (int i = 0; i < GCR62_AUX_SIZE; i += 16)	// NB. Writes [86..95] too, which get overwritten below
+		{
+			const __m128i a = GCR62_Swap2_SSE2( _mm_loadu_si128((const __m128i*)(aSector + 0xAC + i)) );
+			const __m128i b = GCR62_Swap2_SSE2( _mm_loadu_si128((const __m128i*)(aSector + 0x56 + i)) );
+			const __m128i c = GCR62_Swap2_SSE2( _mm_loadu_si128((const __m128i*)(aSector + 0x00 + i)) );
+			const __m128i v = _mm_or_si128( _mm_or_si128(_mm_slli_epi16(a, 4), _mm_slli_epi16(b, 2)), c );
+			_mm_storeu_si128((__m128i*)(pValues + i), v);
+		}
+	}
+	else
+	{
+		for (int i = 0; i < GCR62_AUX_SIZE; i++)
+			pValues[i] = (GCR62_Swap2(aSector[0xAC+i]) << 4) | (GCR62_Swap2(aSector[0x56+i]) << 2) | GCR62_Swap2(aSector[i]);
+	}
+
+	for (int i = 0; i < 0x100; i++)
+		pValues[GCR62_AUX_SIZE+i] = aSector[i] >> 2;
+
+	pValues[GCR62_VALUES] = 0;
+
+	// XOR each value with the previous one (the 343rd is the checksum) & translate
+	for (int i = 0; i < GCR62_NIBBLES; i++)
+		pNibbles[i] = g_aGCR62Nibble[ pValues[i] ^ pValues[i-1] ];
+}
+
+//===========================================================================
+
+// pNibbles: 343 disk bytes -> pSector: 256 bytes
+// . NB. Like the original code, the checksum isn't verified
+static void GCR62_Decode(const BYTE* pNibbles, BYTE* pSector)
+{
+	GCR62_Init();
+
+	// Translate & undo the XOR chain (a prefix XOR, so stays scalar)
+	BYTE aValues[GCR62_VALUES + 0x20];	// Padded for the vector loads below
+	BYTE value = 0;
+	for (int i = 0; i < GCR62_VALUES; i++)
+	{
+		value ^= g_aGCR62Decode[ pNibbles[i] ];
+		aValues[i] = value;
+	}
+	memset(aValues+GCR62_VALUES, 0, 0x20);
+
+	// Sector byte = high 6 bits | 2 bits from the aux buffer:
+	// . [0x00..0x55] aux bits 1:0, [0x56..0xAB] aux bits 3:2, [0xAC..0xFF] aux bits 5:4 (each bit-swapped)
+	const BYTE* pHigh = aValues + GCR62_AUX_SIZE;
+	BYTE aSector[0x100+0x20];	// Padded as the last group is written in whole vectors
+
+	if (g_bGCR62UseSSE2)
+	{
+		const __m128i mask2 = _mm_set1_epi8(0x03);
+		const __m128i maskHigh = _mm_set1_epi8((char)0xFC);
+
+		for (int group = 0; group < 3; group++)
+		{
+			const int base = group * GCR62_AUX_SIZE;
+			const __m128i shift = _mm_cvtsi32_si128(group*2);
+			for (int i = 0; i < GCR62_AUX_SIZE; i += 16)	// NB. Overruns into the next group, which is then overwritten
+			{
+				const __m128i aux  = _mm_loadu_si128((const __m128i*)(aValues + i));
+				const __m128i high = _mm_loadu_si128((const __m128i*)(pHigh + base + i));
+				const __m128i low  = GCR62_Swap2_SSE2( _mm_and_si128(_mm_srl_epi16(aux, shift), mask2) );
+				const __m128i res  = _mm_or_si128( _mm_and_si128(_mm_slli_epi16(high, 2), maskHigh), low );
+				_mm_storeu_si128((__m128i*)(aSector + base + i), res);
+			}
+		}
+	}
+	else
+	{
+		for (int j = 0; j < 0x100; j++)
+		{
+			const int group = j / GCR62_AUX_SIZE;
+			const int i = j - group * GCR62_AUX_SIZE;
+			aSector[j] = (pHigh[j] << 2) | GCR62_Swap2((aValues[i] >> (group*2)) & 3);
+		}
+	}
+
+	memcpy(pSector, aSector, 0x100);
+}
+
+//===========================================================================
+
+// True if all 343 disk bytes are valid & the checksum (ie. the XOR of all the 6-bit values) is zero
+static bool GCR62_Verify(const BYTE* pNibbles)
+{
+	GCR62_Init();
+
+	BYTE checksum = 0;
+	for (int i = 0; i < GCR62_NIBBLES; i++)
+	{
+		const BYTE value = g_aGCR62Decode[ pNibbles[i] ];
+		if (g_aGCR62Nibble[value] != pNibbles[i])
+			return false;
+		checksum ^= value;
+	}
+
+	return checksum == 0;
+}
+
+//===========================================================================
+
+// Find the first nibble == b in p[0..n), else -1
+static int GCR62_FindNibble(const BYTE* p, const int n, const BYTE b)
+{
+	GCR62_Init();
+
+	int i = 0;
+
+	if (g_bGCR62UseSSE2)
+	{
+		const __m128i key = _mm_set1_epi8((char)b);
+		for (; i + 16 <= n; i += 16)
+		{
+			int mask = _mm_movemask_epi8( _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), key) );
+			if (mask)
+			{
+				while (!(mask & 1))
+				{
+					mask >>= 1;
+					i++;
+				}
+				return i;
+			}
+		}
+	}
+
+	for (; i < n; i++)
+	{
+		if (p[i] == b)
+			return i;
+	}
+
+	return -1;
+}
@@ -30,10 +30,14 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 
 #include "DiskImage.h"
 #include "DiskImageHelper.h"
+#include "DiskImageIndex.h"
 
 
 static CDiskImageHelper sg_DiskImageHelper;
 static CHardDiskImageHelper sg_HardDiskImageHelper;
+static UINT sg_uImageCacheBudget = 32*1024*1024;
+static UINT sg_uBlockCacheSize = 1024*1024;
+static ImageOverlay_e sg_OverlayMode = eIMAGE_OVERLAY_OFF;
 
 //===========================================================================
 
@@ -74,6 +78,8 @@ ImageError_e ImageOpen(	LPCTSTR pszImageFilename,
 	{
 		if (bExpectFloppy)
 			Err = eIMAGE_ERROR_UNSUPPORTED_HDV;
+		else
+			BlockCache_Create(pImageInfo);
 		return Err;
 	}
 
@@ -137,6 +143,10 @@ BOOL ImageBoot(ImageInfo* const pImageInfo)
 
 void ImageDestroy(void)
 {
+	DiskImageIndex_Destroy();
+	CImageHelperBase::DestroyImageCache();
+	CImageHelperBase::StopRecompressThread();
+
 	VirtualFree(sg_DiskImageHelper.GetWorkBuffer(), 0, MEM_RELEASE);
 	sg_DiskImageHelper.SetWorkBuffer(NULL);
 }
@@ -147,6 +157,48 @@ void ImageInitialize(void)
 {
 	LPBYTE pBuffer = (LPBYTE) VirtualAlloc(NULL, TRACK_DENIBBLIZED_SIZE*2, MEM_COMMIT, PAGE_READWRITE);
 	sg_DiskImageHelper.SetWorkBuffer(pBuffer);
+
+	DiskImageIndex_Initialize();
+
+	BlockCache_SetSize(sg_uBlockCacheSize);
+
+	CImageHelperBase::DeleteOrphanedOverlays();
+	sg_DiskImageHelper.SetOverlayMode(sg_OverlayMode);
+	sg_HardDiskImageHelper.SetOverlayMode(sg_OverlayMode);
+
+	if (sg_uImageCacheBudget)
+	{
+		CImageHelperBase::SetImageCacheBudget(sg_uImageCacheBudget);
+		sg_DiskImageHelper.EnableImageCache(true);
+		sg_HardDiskImageHelper.EnableImageCache(true);
+	}
+}
+
+//===========================================================================
+
+void ImageSetCacheBudget(const UINT uBytes)
+{
+	sg_uImageCacheBudget = uBytes;
+}
+
+void ImageSetBlockCacheSize(const UINT uBytes)
+{
+	sg_uBlockCacheSize = uBytes;
+}
+
+void ImageSetOverlay(const ImageOverlay_e Mode)
+{
+	sg_OverlayMode = Mode;
+}
+
+void ImageGetCacheStats(ImageCacheStats_t& stats)
+{
+	CImageHelperBase::GetImageCacheStats(stats);
+}
+
+void ImageResetCacheStats(void)
+{
+	CImageHelperBase::ResetImageCacheStats();
 }
 
 //===========================================================================
@@ -174,7 +226,8 @@ void ImageReadTrack(	ImageInfo* const pImageInfo,
 
 //===========================================================================
 
-void ImageWriteTrack(	ImageInfo* const pImageInfo,
+// Returns false if the image (or its file) couldn't be written
+bool ImageWriteTrack(	ImageInfo* const pImageInfo,
 						const int nTrack,
 						const int nQuarterTrack,
 						LPBYTE pTrackImage,
@@ -182,13 +235,16 @@ void ImageWriteTrack(	ImageInfo* const pImageInfo,
 {
 	_ASSERT(nTrack >= 0);
 	if (nTrack < 0)
-		return;
+		return false;
 
+	bool bRes = true;	// Nothing to write (eg. write-protected) isn't an error
 	if (pImageInfo->pImageType->AllowRW() && !pImageInfo->bWriteProtected)
 	{
-		pImageInfo->pImageType->Write(pImageInfo, nTrack, nQuarterTrack, pTrackImage, nNibbles);
+		bRes = pImageInfo->pImageType->Write(pImageInfo, nTrack, nQuarterTrack, pTrackImage, nNibbles);
 		pImageInfo->ValidTrack[nTrack] = 1;
 	}
+
+	return bRes;
 }
 
 //===========================================================================
@@ -219,11 +275,27 @@ bool ImageWriteBlock(	ImageInfo* const pImageInfo,
 
 //===========================================================================
 
+bool ImageFlushBlocks(ImageInfo* const pImageInfo)
+{
+	return pImageInfo ? BlockCache_Flush(pImageInfo) : true;
+}
+
+//===========================================================================
+
 int ImageGetNumTracks(ImageInfo* const pImageInfo)
 {
 	return pImageInfo ? pImageInfo->uNumTracks : 0;
 }
 
+// Track's nibbles come from the image (ie. not the random nibbles of an unformatted track)
+bool ImageIsValidTrack(ImageInfo* const pImageInfo, const int nTrack)
+{
+	if (!pImageInfo || nTrack < 0 || nTrack >= TRACKS_MAX)
+		return false;
+
+	return pImageInfo->pImageType->AllowRW() && pImageInfo->ValidTrack[nTrack];
+}
+
 bool ImageIsWriteProtected(ImageInfo* const pImageInfo)
 {
 	return pImageInfo ? pImageInfo->bWriteProtected : true;
@@ -242,7 +314,7 @@ const char* ImageGetPathname(ImageInfo* const pImageInfo)
 
 UINT ImageGetImageSize(ImageInfo* const pImageInfo)
 {
-	return pImageInfo ? pImageInfo->uImageSize : 0;
+	return pImageInfo ? BlockCache_GetImageSize(pImageInfo) : 0;
 }
 
 void GetImageTitle(LPCTSTR pPathname, TCHAR* pImageName, TCHAR* pFullName)
@@ -58,6 +58,13 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 		eIMAGE_ERROR_FAILED_TO_GET_PATHNAME,
 	};
 
+	enum ImageOverlay_e
+	{
+		eIMAGE_OVERLAY_OFF,
+		eIMAGE_OVERLAY_DISCARD,	// Writes are lost when the image is closed
+		eIMAGE_OVERLAY_COMMIT,	// Writes are written back to the image file when it's closed
+	};
+
 	const int MAX_DISK_IMAGE_NAME = 15;
 	const int MAX_DISK_FULL_NAME  = 127;
 
@@ -68,16 +75,36 @@ void ImageClose(ImageInfo* const pImageInfo, const bool bOpenError=false);
 BOOL ImageBoot(ImageInfo* const pImageInfo);
 void ImageDestroy(void);
 void ImageInitialize(void);
+void ImageSetCacheBudget(const UINT uBytes);	// Recently used images kept in memory (0 = off). Call before ImageInitialize()
+void ImageSetBlockCacheSize(const UINT uBytes);	// Per HDD image: blocks kept in memory, for read-ahead & write-back (0 = off). Call before ImageInitialize()
+void ImageSetOverlay(const ImageOverlay_e Mode);	// Images are opened read-only, with writes held in a temporary delta file. Call before ImageInitialize()
 
 void ImageReadTrack(ImageInfo* const pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImageBuffer, int* pNibbles);
-void ImageWriteTrack(ImageInfo* const pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles);
+bool ImageWriteTrack(ImageInfo* const pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles);
 bool ImageReadBlock(ImageInfo* const pImageInfo, UINT nBlock, LPBYTE pBlockBuffer);
 bool ImageWriteBlock(ImageInfo* const pImageInfo, UINT nBlock, LPBYTE pBlockBuffer);
+bool ImageFlushBlocks(ImageInfo* const pImageInfo);	// Write back any blocks held by the HDD block cache
 
 int ImageGetNumTracks(ImageInfo* const pImageInfo);
+bool ImageIsValidTrack(ImageInfo* const pImageInfo, const int nTrack);
 bool ImageIsWriteProtected(ImageInfo* const pImageInfo);
 bool ImageIsMultiFileZip(ImageInfo* const pImageInfo);
 const char* ImageGetPathname(ImageInfo* const pImageInfo);
 UINT ImageGetImageSize(ImageInfo* const pImageInfo);
 
 void GetImageTitle(LPCTSTR pPathname, TCHAR* pImageName, TCHAR* pFullName);
+
+// Image cache (see ImageSetCacheBudget())
+struct ImageCacheStats_t
+{
+	UINT uHits;			// Buffer re-used (ie. not re-read or re-decompressed)
+	UINT uDetectHits;	// Just the detection results re-used
+	UINT uMisses;
+	UINT uEvictions;
+	UINT uEntries;
+	UINT uBytes;
+	UINT uBudget;
+};
+
+void ImageGetCacheStats(ImageCacheStats_t& stats);
+void ImageResetCacheStats(void);
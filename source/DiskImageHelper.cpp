@@ -34,12 +34,18 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "unzip.h"
 #include "iowin32.h"
 
+#include "AppleWin.h"
 #include "CPU.h"
 #include "Disk.h"
 #include "DiskImage.h"
 #include "DiskImageHelper.h"
+#include "Frame.h"
+#include "DiskImageIndex.h"
+#include "Log.h"
 #include "Memory.h"
 
+#include "DiskGCR.inl"
+
 
 /* DO logical order  0 1 2 3 4 5 6 7 8 9 A B C D E F */
 /*    physical order 0 D B 9 7 5 3 1 E C A 8 6 4 2 F */
@@ -47,18 +53,6 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 /* PO logical order  0 E D C B A 9 8 7 6 5 4 3 2 1 F */
 /*    physical order 0 2 4 6 8 A C E 1 3 5 7 9 B D F */
 
-BYTE CImageBase::ms_DiskByte[0x40] =
-{
-	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
-	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
-	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
-	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
-	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
-	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
-	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
-	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
-};
-
 BYTE CImageBase::ms_SectorNumber[NUM_SECTOR_ORDERS][0x10] =
 {
 	{0x00,0x08,0x01,0x09,0x02,0x0A,0x03,0x0B, 0x04,0x0C,0x05,0x0D,0x06,0x0E,0x07,0x0F},
@@ -70,167 +64,649 @@ LPBYTE CImageBase::ms_pWorkBuffer = NULL;
 
 //-----------------------------------------------------------------------------
 
-bool CImageBase::ReadTrack(ImageInfo* pImageInfo, const int nTrack, LPBYTE pTrackBuffer, const UINT uTrackSize)
+// Map a normal (uncompressed) image file instead of reading it into a heap buffer:
+// . pages are only read when touched, and are shared with any other process that maps the same file
+// . the view is copy-on-write, so the file is only ever written by WriteFile() (which always follows an in-memory write)
+// . NB. copy-on-write even for a read-only file, as the drive's write-protect can be switched off after the image is opened
+// . A (partitioned) HDD image bigger than kImageWindowSize is mapped a window at a time: just the 1st window is mapped
+//   here (as pImageBuffer), & the others when first accessed (see GetImageView()), so only the partitions in use take
+//   up address space
+// . A page that can't be read raises EXCEPTION_IN_PAGE_ERROR (rather than failing a ReadFile()), so only files on a local
+//   hard disk are mapped (see IsImageFileMappable()), & the track & block copies to/from a view are guarded (see CopyImageView())
+static const UINT kImageWindowSize = HARDDISK_32M_SIZE;
+
+struct ImageWindows
 {
-	const long Offset = pImageInfo->uOffset + nTrack * uTrackSize;
-	memcpy(pTrackBuffer, &pImageInfo->pImageBuffer[Offset], uTrackSize);
+	UINT uMappingSize;				// ie. the file's size when opened
+	std::vector<BYTE*> vecViews;	// [0] = pImageBuffer, else NULL until first accessed
+	bool bMapFailed;				// Out of address space, so no more windows are mapped (the rest use ReadFile())
+};
+
+// Not a network share or a removable drive (eg. USB stick), which can go away while the file's open
+static bool IsImageFileMappable(LPCTSTR pszImageFilename)
+{
+	TCHAR szFullPath[MAX_PATH];
+	const DWORD uLen = GetFullPathName(pszImageFilename, MAX_PATH, szFullPath, NULL);
+	if (uLen == 0 || uLen >= MAX_PATH || szFullPath[1] != TEXT(':'))	// eg. a UNC path: \\server\share\...
+		return false;
+
+	const TCHAR szRoot[] = {szFullPath[0], TEXT(':'), TEXT('\\'), 0};
+	return GetDriveType(szRoot) == DRIVE_FIXED;
+}
+
+// Returns false if a page of the view couldn't be read (or written)
+// . NB. Just a memcpy() in here, as __try can't be used in a function with C++ objects that need unwinding
+static bool CopyImageView(void* pDst, const void* pSrc, const UINT uSize)
+{
+	__try
+	{
+		memcpy(pDst, pSrc, uSize);
+	}
+	__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		return false;
+	}
 
 	return true;
 }
 
-//-------------------------------------
+static BYTE* MapImageFile(ImageInfo* pImageInfo, const DWORD dwSize)
+{
+	pImageInfo->hMapping = CreateFileMapping(pImageInfo->hFile, NULL, PAGE_WRITECOPY, 0, dwSize, NULL);
+	if (pImageInfo->hMapping == NULL)
+		return NULL;
 
-bool CImageBase::WriteTrack(ImageInfo* pImageInfo, const int nTrack, LPBYTE pTrackBuffer, const UINT uTrackSize)
+	const UINT uViewSize = MIN(dwSize, kImageWindowSize);
+	BYTE* pView = (BYTE*) MapViewOfFile(pImageInfo->hMapping, FILE_MAP_COPY, 0, 0, uViewSize);
+	if (pView == NULL)
+	{
+		CloseHandle(pImageInfo->hMapping);
+		pImageInfo->hMapping = NULL;
+		return NULL;
+	}
+
+	if (dwSize > kImageWindowSize)
+	{
+		pImageInfo->pWindows = new ImageWindows;
+		pImageInfo->pWindows->uMappingSize = dwSize;
+		pImageInfo->pWindows->vecViews.resize((dwSize + kImageWindowSize - 1) / kImageWindowSize, NULL);
+		pImageInfo->pWindows->vecViews[0] = pView;
+		pImageInfo->pWindows->bMapFailed = false;
+	}
+
+	pImageInfo->uMappedSize = uViewSize;
+	return pView;
+}
+
+// The image file's bytes [Offset, Offset+uSize) in a view, mapping a window if necessary
+// . NULL if there's no view of them: eg. a heap buffer, beyond the file's end when opened, or straddling 2 windows
+static BYTE* GetImageView(ImageInfo* pImageInfo, const UINT Offset, const UINT uSize)
 {
-	const long Offset = pImageInfo->uOffset + nTrack * uTrackSize;
-	memcpy(&pImageInfo->pImageBuffer[Offset], pTrackBuffer, uTrackSize);
+	if (!pImageInfo->hMapping || !pImageInfo->pImageBuffer)
+		return NULL;
 
-	if (pImageInfo->FileType == eFileNormal)
+	if (Offset + uSize <= pImageInfo->uMappedSize)
+		return &pImageInfo->pImageBuffer[Offset];
+
+	ImageWindows* pWindows = pImageInfo->pWindows;
+	if (!pWindows || Offset + uSize > pWindows->uMappingSize)
+		return NULL;
+
+	const UINT uWindow = Offset / kImageWindowSize;
+	if ((Offset + uSize - 1) / kImageWindowSize != uWindow)
+		return NULL;
+
+	const UINT uWindowOffset = uWindow * kImageWindowSize;
+
+	if (!pWindows->vecViews[uWindow])
 	{
-		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
-			return false;
+		// NB. Once a window can't be mapped, no others are: as a window mapped after a write to it (which went to the view
+		// of the window if it had one) wouldn't see that write if it was held by an overlay
+		if (pWindows->bMapFailed)
+			return NULL;
 
-		SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
+		const UINT uViewSize = MIN(kImageWindowSize, pWindows->uMappingSize - uWindowOffset);
+		pWindows->vecViews[uWindow] = (BYTE*) MapViewOfFile(pImageInfo->hMapping, FILE_MAP_COPY, 0, uWindowOffset, uViewSize);
+		if (!pWindows->vecViews[uWindow])
+		{
+			LogFileOutput("Image: %s: failed to map window %u\n", pImageInfo->szFilename, uWindow);
+			pWindows->bMapFailed = true;
+			return NULL;
+		}
+	}
 
-		DWORD dwBytesWritten;
-		BOOL bRes = WriteFile(pImageInfo->hFile, pTrackBuffer, uTrackSize, &dwBytesWritten, NULL);
-		_ASSERT(dwBytesWritten == uTrackSize);
-		if (!bRes || dwBytesWritten != uTrackSize)
-			return false;
+	return pWindows->vecViews[uWindow] + (Offset - uWindowOffset);
+}
+
+// Keep the (copy-on-write) views coherent with the file, after a write to it
+static void WriteImageViews(ImageInfo* pImageInfo, const UINT Offset, const BYTE* pBuffer, const UINT uSize)
+{
+	if (!pImageInfo->hMapping)
+		return;
+
+	const UINT uViewedSize = pImageInfo->pWindows ? pImageInfo->pWindows->uMappingSize : pImageInfo->uMappedSize;
+	const UINT uEnd = MIN(Offset + uSize, uViewedSize);
+
+	// Each part within a window (NB. a view's end is also a window's end, or the file's end when opened)
+	UINT uPos = Offset;
+	while (uPos < uEnd)
+	{
+		const UINT uLen = MIN(uEnd - uPos, kImageWindowSize - uPos % kImageWindowSize);
+		BYTE* pView = GetImageView(pImageInfo, uPos, uLen);
+		if (pView && !CopyImageView(pView, pBuffer + (uPos - Offset), uLen))
+			LogFileOutput("Image: %s: in-page error writing the view at $%08X\n", pImageInfo->szFilename, uPos);
+		uPos += uLen;
 	}
-	else if (pImageInfo->FileType == eFileGZip)
+}
+
+static void FreeImageBuffer(ImageInfo* pImageInfo)
+{
+	_ASSERT(!pImageInfo->bCachedBuffer);	// See DetachFromImageCache()
+
+	if (pImageInfo->hMapping)
 	{
-		// Write entire compressed image each time (dirty track change or dirty disk removal)
-		gzFile hGZFile = gzopen(pImageInfo->szFilename, "wb");
-		if (hGZFile == NULL)
-			return false;
+		if (pImageInfo->pImageBuffer)
+			UnmapViewOfFile(pImageInfo->pImageBuffer);
 
-		int nLen = gzwrite(hGZFile, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
-		if (nLen != pImageInfo->uImageSize)
-			return false;
+		if (pImageInfo->pWindows)
+		{
+			for (UINT i=1; i<pImageInfo->pWindows->vecViews.size(); i++)
+			{
+				if (pImageInfo->pWindows->vecViews[i])
+					UnmapViewOfFile(pImageInfo->pWindows->vecViews[i]);
+			}
 
-		int nRes = gzclose(hGZFile);
-		hGZFile = NULL;
-		if (nRes != Z_OK)
-			return false;
+			delete pImageInfo->pWindows;
+			pImageInfo->pWindows = NULL;
+		}
+
+		CloseHandle(pImageInfo->hMapping);
+		pImageInfo->hMapping = NULL;
+		pImageInfo->uMappedSize = 0;
 	}
-	else if (pImageInfo->FileType == eFileZip)
+	else
 	{
-		// Write entire compressed image each time (dirty track change or dirty disk removal)
-		// NB. Only support Zip archives with a single file
-		zipFile hZipFile = zipOpen(pImageInfo->szFilename, APPEND_STATUS_CREATE);
-		if (hZipFile == NULL)
-			return false;
+		delete [] pImageInfo->pImageBuffer;
+	}
 
-		int nRes = zipOpenNewFileInZip(hZipFile, pImageInfo->szFilenameInZip, &pImageInfo->zipFileInfo, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_BEST_SPEED);
-		if (nRes != ZIP_OK)
-			return false;
+	pImageInfo->pImageBuffer = NULL;
+}
 
-		nRes = zipWriteInFileInZip(hZipFile, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
-		if (nRes != ZIP_OK)
-			return false;
+//-----------------------------------------------------------------------------
 
-		nRes = zipCloseFileInZip(hZipFile);
-		if (nRes != ZIP_OK)
-			return false;
+// GZip/Zip images: only the part needed by Detect() is decompressed when the image is opened,
+// and a thread decompresses the rest straight into the (exact-size) pImageBuffer
+// . If that fails (eg. a truncated file, a zip CRC error, or a multi-member .gz whose ISIZE trailer isn't the whole size),
+//   the rest of the buffer is zeros: so the image is write-protected (else recompressing it would lose the original data),
+//   the user is told, and the next open of a .gz reads it all up-front (as it did before ImageLoader)
 
-		nRes = zipClose(hZipFile, NULL);
-		if (nRes != ZIP_OK)
-			return false;
+struct ImageLoader
+{
+	gzFile hGZFile;			// One of these
+	unzFile hZipFile;		// - current file open
+	ImageInfo* pImageInfo;
+	BYTE* pBuffer;
+	UINT uSize;
+	volatile LONG uBytesReady;
+	volatile bool bAbort;
+	volatile bool bError;	// Set before uBytesReady is released
+	HANDLE hThread;
+	HANDLE hProgress;		// Auto-reset: set after each chunk
+	TCHAR szFilename[MAX_PATH];
+};
+
+static const UINT kImageLoaderChunkSize = 64*1024;
+
+static std::vector<std::string> g_vecGZipReadAll;	// .gz files whose ISIZE can't be trusted (main thread only: see StopImageLoader())
+
+static bool IsGZipReadAll(LPCTSTR pszImageFilename)
+{
+	return std::find(g_vecGZipReadAll.begin(), g_vecGZipReadAll.end(), DiskImageIndex_GetKey(pszImageFilename)) != g_vecGZipReadAll.end();
+}
+
+static DWORD WINAPI ImageLoaderThread(LPVOID lpParameter)
+{
+	ImageLoader* pLoader = (ImageLoader*) lpParameter;
+	bool bError = false;
+
+	while ((UINT)pLoader->uBytesReady < pLoader->uSize && !pLoader->bAbort)
+	{
+		const UINT uReady = pLoader->uBytesReady;
+		const UINT uLen = MIN(kImageLoaderChunkSize, pLoader->uSize - uReady);
+
+		const int nLen = pLoader->hGZFile ? gzread(pLoader->hGZFile, pLoader->pBuffer + uReady, uLen)
+										  : unzReadCurrentFile(pLoader->hZipFile, pLoader->pBuffer + uReady, uLen);
+		if (nLen <= 0)
+		{
+			bError = true;
+			break;
+		}
+
+		InterlockedExchange(&pLoader->uBytesReady, uReady + nLen);
+		SetEvent(pLoader->hProgress);
+	}
+
+	if (pLoader->hGZFile)
+	{
+		BYTE extra;
+		if (!bError && !pLoader->bAbort && gzread(pLoader->hGZFile, &extra, 1) != 0)
+			bError = true;		// Eg. a multi-member .gz, as ISIZE is only the last member's size
+		gzclose(pLoader->hGZFile);
 	}
 	else
 	{
-		_ASSERT(0);
+		if (unzCloseCurrentFile(pLoader->hZipFile) != UNZ_OK && !pLoader->bAbort)
+			bError = true;		// Eg. CRC error
+		unzClose(pLoader->hZipFile);
+	}
+
+	if (bError)
+	{
+		LogFileOutput("ImageLoader: %s: decompression failed after %u of %u bytes - now write-protected\n", pLoader->szFilename, (UINT)pLoader->uBytesReady, pLoader->uSize);
+		const UINT uReady = pLoader->uBytesReady;
+		memset(pLoader->pBuffer + uReady, 0, pLoader->uSize - uReady);
+
+		pLoader->pImageInfo->bWriteProtected = 1;
+		pLoader->bError = true;
+	}
+
+	// Release any waiters (even on error or abort)
+	InterlockedExchange(&pLoader->uBytesReady, pLoader->uSize);
+	SetEvent(pLoader->hProgress);
+
+	if (bError && g_hFrameWindow)
+	{
+		// The main thread tells the user (& write-protects the drive), then frees the copy
+		TCHAR* pszFilename = new TCHAR[MAX_PATH];
+		_tcsncpy(pszFilename, pLoader->szFilename, MAX_PATH);
+		if (!PostMessage(g_hFrameWindow, WM_USER_IMAGE_LOAD_ERROR, 0, (LPARAM)pszFilename))
+			delete [] pszFilename;
+	}
+
+	return 0;
+}
+
+// Pre: pImageInfo->pImageBuffer[0..uBytesReady) already read, and the handle is positioned just after it
+static bool StartImageLoader(LPCTSTR pszImageFilename, ImageInfo* pImageInfo, gzFile hGZFile, unzFile hZipFile, const UINT uBytesReady)
+{
+	ImageLoader* pLoader = new ImageLoader;
+	pLoader->hGZFile = hGZFile;
+	pLoader->hZipFile = hZipFile;
+	pLoader->pImageInfo = pImageInfo;
+	_tcsncpy(pLoader->szFilename, pszImageFilename, MAX_PATH);
+	pLoader->szFilename[MAX_PATH-1] = 0;
+	pLoader->pBuffer = pImageInfo->pImageBuffer;
+	pLoader->uSize = pImageInfo->uImageSize;
+	pLoader->uBytesReady = uBytesReady;
+	pLoader->bAbort = false;
+	pLoader->bError = false;
+	pLoader->hThread = NULL;
+	pLoader->hProgress = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (pLoader->hProgress)
+	{
+		DWORD dwThreadId;
+		pLoader->hThread = CreateThread(NULL,			// lpThreadAttributes
+										0,				// dwStackSize
+										ImageLoaderThread,
+										pLoader,		// lpParameter
+										0,				// dwCreationFlags : 0 = Run immediately
+										&dwThreadId);	// lpThreadId
+	}
+
+	if (!pLoader->hThread)
+	{
+		// Just decompress the rest now
+		ImageLoaderThread(pLoader);
+		if (pLoader->bError && pLoader->hGZFile && !IsGZipReadAll(pszImageFilename))
+			g_vecGZipReadAll.push_back(DiskImageIndex_GetKey(pszImageFilename));
+		if (pLoader->hProgress)
+			CloseHandle(pLoader->hProgress);
+		delete pLoader;
 		return false;
 	}
 
+	SetThreadPriority(pLoader->hThread, THREAD_PRIORITY_BELOW_NORMAL);
+	pImageInfo->pLoader = pLoader;
 	return true;
 }
 
-//-----------------------------------------------------------------------------
+// Returns true if pImageBuffer was (or had already been) fully & successfully decompressed
+static bool StopImageLoader(ImageInfo* pImageInfo)
+{
+	ImageLoader* pLoader = pImageInfo->pLoader;
+	if (!pLoader)
+		return true;
 
-bool CImageBase::ReadBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer)
+	const bool bAllRead = (UINT)pLoader->uBytesReady == pLoader->uSize;	// NB. Also set on error, but after bError
+
+	pLoader->bAbort = true;
+	WaitForSingleObject(pLoader->hThread, INFINITE);
+	CloseHandle(pLoader->hThread);
+	CloseHandle(pLoader->hProgress);
+
+	const bool bComplete = bAllRead && !pLoader->bError;
+
+	if (pLoader->bError && pLoader->hGZFile && !IsGZipReadAll(pLoader->szFilename))
+		g_vecGZipReadAll.push_back(DiskImageIndex_GetKey(pLoader->szFilename));	// Next time: don't trust its ISIZE
+
+	delete pLoader;
+	pImageInfo->pLoader = NULL;
+	return bComplete;
+}
+
+// Block until pImageBuffer[0..uEnd) has been decompressed
+// . Returns false if decompression failed, ie. the buffer isn't all the image's data (so mustn't be written back)
+static bool WaitForImageData(ImageInfo* pImageInfo, const UINT uEnd)
 {
-	long Offset = pImageInfo->uOffset + nBlock * HD_BLOCK_SIZE;
+	ImageLoader* pLoader = pImageInfo->pLoader;
+	if (!pLoader)
+		return true;
 
-	if (pImageInfo->FileType == eFileNormal)
+	while ((UINT)pLoader->uBytesReady < uEnd)
 	{
-		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
-			return false;
+		HANDLE hWait[2] = {pLoader->hThread, pLoader->hProgress};
+		if (WaitForMultipleObjects(2, hWait, FALSE, INFINITE) != WAIT_OBJECT_0+1)
+			break;	// Thread has exited
+	}
 
-		SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
+	return !pLoader->bError;
+}
 
-		DWORD dwBytesRead;
-		BOOL bRes = ReadFile(pImageInfo->hFile, pBlockBuffer, HD_BLOCK_SIZE, &dwBytesRead, NULL);
-		if (!bRes || dwBytesRead != HD_BLOCK_SIZE)
-			return false;
+// Read the gzip ISIZE trailer: the uncompressed size (mod 2^32) of the last member
+static bool GetGZipUncompressedSize(LPCTSTR pszImageFilename, UINT& uSize)
+{
+	HANDLE hFile = CreateFile(pszImageFilename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool bRes = false;
+	BYTE magic[2];
+	BYTE trailer[4];
+	DWORD dwBytesRead;
+
+	const DWORD dwFileSize = GetFileSize(hFile, NULL);
+	if (dwFileSize != INVALID_FILE_SIZE && dwFileSize >= 18 &&		// 10-byte header + 8-byte trailer
+		ReadFile(hFile, magic, sizeof(magic), &dwBytesRead, NULL) && dwBytesRead == sizeof(magic) &&
+		magic[0] == 0x1F && magic[1] == 0x8B &&
+		SetFilePointer(hFile, dwFileSize-sizeof(trailer), NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER &&
+		ReadFile(hFile, trailer, sizeof(trailer), &dwBytesRead, NULL) && dwBytesRead == sizeof(trailer))
+	{
+		uSize = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (trailer[3] << 24);
+		bRes = true;
 	}
-	else if ((pImageInfo->FileType == eFileGZip) || (pImageInfo->FileType == eFileZip))
+
+	CloseHandle(hFile);
+	return bRes;
+}
+
+//-----------------------------------------------------------------------------
+
+// Image cache: a process-wide LRU of opened images, so re-inserting a recently used image (eg. swapping between
+// the disks of a multi-disk game) skips re-reading, re-decompressing & re-detecting it
+// . every image keeps its detection results
+// . gzip/zip images also keep their decompressed buffer (which counts towards the budget):
+//   later opens share it, and copy it before their first write
+// . writes still go straight through to the file, and on close the written-to buffer replaces the cached one
+// . an entry is only valid while the file's size & last-write time are unchanged
+// NB. Only used by the (main thread's) helpers that ImageOpen() uses, but image writes can be on the disk I/O thread
+
+struct ImageCacheEntry
+{
+	CImageHelperBase* pHelper;
+	std::string strKey;
+	UINT64 uFileSize;
+	UINT64 uLastWriteTime;
+
+	// Detection results
+	CImageBase* pImageType;
+	UINT uNumTracks;
+	BYTE VolumeNumber;
+	bool bLocked;
+	FileType_e FileType;
+	DWORD uOffset;
+	UINT uImageSize;
+	char szFilenameInZip[MAX_PATH];
+	zip_fileinfo zipFileInfo;
+	UINT uNumEntriesInZip;
+
+	BYTE* pBuffer;		// GZip/Zip only (else NULL)
+	UINT uRefCount;		// # open images using this entry
+	UINT uBufferUsers;	// # of those sharing pBuffer
+	bool bStale;		// Invalidated or superseded: deleted once unused
+};
+
+static std::vector<ImageCacheEntry*> g_vecImageCache;	// [0] = most recently used
+static CRITICAL_SECTION g_ImageCacheCriticalSection;
+static bool g_bImageCacheInit = false;
+static UINT g_uImageCacheBudget = 0;
+static UINT g_uImageCacheBytes = 0;
+static const UINT kImageCacheMaxEntries = 256;
+
+static UINT g_uImageCacheHits = 0;			// Buffer re-used (ie. not re-read or re-decompressed)
+static UINT g_uImageCacheDetectHits = 0;	// Just the detection results re-used
+static UINT g_uImageCacheMisses = 0;
+static UINT g_uImageCacheEvictions = 0;
+
+static void InitImageCache(void)
+{
+	if (g_bImageCacheInit)
+		return;
+
+	InitializeCriticalSection(&g_ImageCacheCriticalSection);
+	g_bImageCacheInit = true;
+}
+
+static void LogImageCacheStats(void)
+{
+	LogFileOutput("ImageCache: hits=%u, detect-hits=%u, misses=%u, evictions=%u, entries=%u, bytes=%u/%u\n",
+		g_uImageCacheHits, g_uImageCacheDetectHits, g_uImageCacheMisses, g_uImageCacheEvictions,
+		(UINT)g_vecImageCache.size(), g_uImageCacheBytes, g_uImageCacheBudget);
+}
+
+// Pre: g_ImageCacheCriticalSection held
+// Returns the (valid) entry for this file & helper, and makes it the most recently used
+static ImageCacheEntry* LookupImageCache(CImageHelperBase* pHelper, LPCTSTR pszImageFilename)
+{
+	const std::string strKey = DiskImageIndex_GetKey(pszImageFilename);
+
+	UINT i = 0;
+	for (; i<g_vecImageCache.size(); i++)
 	{
-		memcpy(pBlockBuffer, &pImageInfo->pImageBuffer[Offset], HD_BLOCK_SIZE);
+		ImageCacheEntry* pEntry = g_vecImageCache[i];
+		if (!pEntry->bStale && pEntry->pHelper == pHelper && pEntry->strKey == strKey)
+			break;
 	}
-	else
+
+	if (i == g_vecImageCache.size())
+		return NULL;
+
+	ImageCacheEntry* pEntry = g_vecImageCache[i];
+
+	UINT64 uFileSize, uLastWriteTime;
+	if (!DiskImageIndex_GetFileStamp(pszImageFilename, uFileSize, uLastWriteTime) ||
+		uFileSize != pEntry->uFileSize || uLastWriteTime != pEntry->uLastWriteTime)
 	{
-		_ASSERT(0);
-		return false;
+		pEntry->bStale = true;	// Changed since
+		return NULL;
 	}
 
-	return true;
+	g_vecImageCache.erase(g_vecImageCache.begin()+i);
+	g_vecImageCache.insert(g_vecImageCache.begin(), pEntry);
+	return pEntry;
 }
 
-//-------------------------------------
+// Pre: g_ImageCacheCriticalSection held
+// Delete stale entries & evict unused ones (least recently used first) until within budget
+static void TrimImageCache(void)
+{
+	for (int i = (int)g_vecImageCache.size()-1; i >= 0; i--)
+	{
+		ImageCacheEntry* pEntry = g_vecImageCache[i];
+		if (pEntry->uRefCount)
+			continue;
 
-bool CImageBase::WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer)
+		const bool bOverBudget = g_uImageCacheBytes > g_uImageCacheBudget || g_vecImageCache.size() > kImageCacheMaxEntries;
+		if (!pEntry->bStale && !bOverBudget)
+			continue;
+
+		if (!pEntry->bStale)
+		{
+			g_uImageCacheEvictions++;
+			LogFileOutput("ImageCache: evicted %s (%u bytes)\n", pEntry->strKey.c_str(), pEntry->pBuffer ? pEntry->uImageSize : 0);
+		}
+
+		if (pEntry->pBuffer)
+		{
+			g_uImageCacheBytes -= pEntry->uImageSize;
+			delete [] pEntry->pBuffer;
+		}
+
+		delete pEntry;
+		g_vecImageCache.erase(g_vecImageCache.begin()+i);
+	}
+}
+
+// Pre: g_ImageCacheCriticalSection held
+static void ApplyImageCacheEntry(const ImageCacheEntry* pEntry, bool* pWriteProtected_)
 {
-	long Offset = pImageInfo->uOffset + nBlock * HD_BLOCK_SIZE;
-	const bool bGrowImageBuffer = (UINT)Offset+HD_BLOCK_SIZE > pImageInfo->uImageSize;
+	pEntry->pImageType->m_uNumTracksInImage = pEntry->uNumTracks;
+	pEntry->pImageType->SetVolumeNumber(pEntry->VolumeNumber);
 
-	if (pImageInfo->FileType == eFileGZip || pImageInfo->FileType == eFileZip)
+	if (pEntry->bLocked && !*pWriteProtected_)
+		*pWriteProtected_ = 1;
+}
+
+// Before the first write to a buffer shared with the image cache
+static bool MakeImageBufferPrivate(ImageInfo* pImageInfo)
+{
+	if (!pImageInfo->bCachedBuffer)
+		return true;
+
+	BYTE* pBuffer = new BYTE [pImageInfo->uImageSize];
+	if (!pBuffer)
+		return false;
+
+	memcpy(pBuffer, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+	pImageInfo->pCacheEntry->uBufferUsers--;
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+
+	pImageInfo->pImageBuffer = pBuffer;
+	pImageInfo->bCachedBuffer = false;
+	return true;
+}
+
+// Close (1): give up a shared buffer, or hand a complete gzip/zip buffer over to the cache
+// (it holds any writes, which have already gone through to the file)
+static void DetachFromImageCache(ImageInfo* pImageInfo, const bool bBufferComplete, const bool bDeleteFile)
+{
+	ImageCacheEntry* pEntry = pImageInfo->pCacheEntry;
+	if (!pEntry)
+		return;
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+
+	if (pImageInfo->bCachedBuffer)
+	{
+		pEntry->uBufferUsers--;
+		pImageInfo->pImageBuffer = NULL;
+		pImageInfo->bCachedBuffer = false;
+	}
+	else if (pImageInfo->FileType != eFileNormal && pImageInfo->pImageBuffer && bBufferComplete && !bDeleteFile)
 	{
-		if (bGrowImageBuffer)
+		if (pEntry->pBuffer && pEntry->uBufferUsers)
 		{
-			// Horribly inefficient! (Unzip to a normal file if you want better performance!)
-			const UINT uNewImageSize = Offset+HD_BLOCK_SIZE;
-			BYTE* pNewImageBuffer = new BYTE [uNewImageSize];
-			_ASSERT(pNewImageBuffer);
-			if (!pNewImageBuffer)
-				return false;
+			// The old buffer is still shared by another open image, so this (newer) one gets a new entry
+			ImageCacheEntry* pNewEntry = new ImageCacheEntry(*pEntry);
+			pNewEntry->pBuffer = NULL;
+			pNewEntry->uRefCount = 1;
+			pNewEntry->uBufferUsers = 0;
 
-			memcpy(pNewImageBuffer, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
-			memset(&pNewImageBuffer[pImageInfo->uImageSize], 0, uNewImageSize-pImageInfo->uImageSize);	// Should always be HD_BLOCK_SIZE (so this is redundant)
+			pEntry->bStale = true;
+			pEntry->uRefCount--;
 
-			delete [] pImageInfo->pImageBuffer;
-			pImageInfo->pImageBuffer = pNewImageBuffer;
-			pImageInfo->uImageSize = uNewImageSize;
+			g_vecImageCache.insert(g_vecImageCache.begin(), pNewEntry);
+			pEntry = pImageInfo->pCacheEntry = pNewEntry;
+		}
+
+		if (pEntry->pBuffer)
+		{
+			g_uImageCacheBytes -= pEntry->uImageSize;
+			delete [] pEntry->pBuffer;
 		}
 
-		memcpy(&pImageInfo->pImageBuffer[Offset], pBlockBuffer, HD_BLOCK_SIZE);
+		pEntry->pBuffer = pImageInfo->pImageBuffer;
+		pEntry->uImageSize = pImageInfo->uImageSize;	// NB. An HDD image may have grown
+		g_uImageCacheBytes += pEntry->uImageSize;
+		pImageInfo->pImageBuffer = NULL;
 	}
 
-	if (pImageInfo->FileType == eFileNormal)
-	{
-		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
-			return false;
+	if (bDeleteFile)
+		pEntry->bStale = true;
 
-		SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
 
-		DWORD dwBytesWritten;
-		BOOL bRes = WriteFile(pImageInfo->hFile, pBlockBuffer, HD_BLOCK_SIZE, &dwBytesWritten, NULL);
-		if (!bRes || dwBytesWritten != HD_BLOCK_SIZE)
-			return false;
+// Close (2), after the file is closed: the entry now describes the file as it is (ie. after any writes)
+static void ReleaseImageCacheEntry(ImageInfo* pImageInfo)
+{
+	ImageCacheEntry* pEntry = pImageInfo->pCacheEntry;
+	if (!pEntry)
+		return;
+
+	pImageInfo->pCacheEntry = NULL;
+
+	UINT64 uFileSize, uLastWriteTime;
+	const bool bStamp = DiskImageIndex_GetFileStamp(pEntry->strKey.c_str(), uFileSize, uLastWriteTime);
 
-		if (bGrowImageBuffer)
-			pImageInfo->uImageSize += HD_BLOCK_SIZE;
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+
+	if (bStamp)
+	{
+		pEntry->uFileSize = uFileSize;
+		pEntry->uLastWriteTime = uLastWriteTime;
+	}
+	else
+	{
+		pEntry->bStale = true;
 	}
-	else if (pImageInfo->FileType == eFileGZip)
+
+	pEntry->uRefCount--;
+	TrimImageCache();
+
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
+
+//-----------------------------------------------------------------------------
+
+// True if the block(s) are backed by pImageBuffer (for a normal file: they lie within a view - see GetImageView())
+static inline bool IsBlockInImageBuffer(ImageInfo* pImageInfo, const long Offset, const UINT uSize = HD_BLOCK_SIZE)
+{
+	if (!pImageInfo->pImageBuffer)
+		return false;
+
+	if (pImageInfo->FileType == eFileNormal)
+		return GetImageView(pImageInfo, Offset, uSize) != NULL;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// Write the whole (uncompressed) image back to its gzip or zip file
+// . pBuffer: the image buffer, or a snapshot of it
+static bool WriteCompressedFile(ImageInfo* pImageInfo, const BYTE* pBuffer, const UINT uSize)
+{
+	if (pImageInfo->FileType == eFileGZip)
 	{
-		// Write entire compressed image each time a block is written
 		gzFile hGZFile = gzopen(pImageInfo->szFilename, "wb");
 		if (hGZFile == NULL)
 			return false;
 
-		int nLen = gzwrite(hGZFile, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
-		if (nLen != pImageInfo->uImageSize)
+		int nLen = gzwrite(hGZFile, pBuffer, uSize);
+		if (nLen != uSize)
 			return false;
 
 		int nRes = gzclose(hGZFile);
@@ -240,7 +716,6 @@ bool CImageBase::WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlo
 	}
 	else if (pImageInfo->FileType == eFileZip)
 	{
-		// Write entire compressed image each time a block is written
 		// NB. Only support Zip archives with a single file
 		zipFile hZipFile = zipOpen(pImageInfo->szFilename, APPEND_STATUS_CREATE);
 		if (hZipFile == NULL)
@@ -250,7 +725,7 @@ bool CImageBase::WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlo
 		if (nRes != ZIP_OK)
 			return false;
 
-		nRes = zipWriteInFileInZip(hZipFile, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
+		nRes = zipWriteInFileInZip(hZipFile, pBuffer, uSize);
 		if (nRes != ZIP_OK)
 			return false;
 
@@ -264,198 +739,1146 @@ bool CImageBase::WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlo
 	}
 	else
 	{
-		_ASSERT(0);
+		_ASSERT(0);
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// Copy-on-write overlay: the image file is opened read-only (so can be shared), and writes go to a per-session delta file
+// . Delta file: a sparse temp file, with each block at the same offset as in the image. A bitmap (1 bit per 512-byte block
+//   of the image file, incl. any header) says which blocks are in it.
+// . Reads come from the views, which already hold the writes (as they're copy-on-write). Only HDD blocks not in a view
+//   are read through the bitmap.
+// . GZip/Zip: no delta file, as the writes are already held in the (private) image buffer: only the recompress is deferred.
+// . When the image is closed: eIMAGE_OVERLAY_COMMIT writes the delta back to the image file; else it's just deleted.
+// . A delta that fails to commit (eg. another session has the image open) is kept, renamed to AWD*.delta, & reported.
+// . At startup, any AWD*.tmp delta files left by a session that didn't exit cleanly are deleted (see DeleteOrphanedOverlays()).
+
+#ifndef FSCTL_SET_SPARSE
+#define FSCTL_SET_SPARSE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 49, METHOD_BUFFERED, FILE_SPECIAL_ACCESS)	// Needs _WIN32_WINNT >= 0x0500
+#endif
+
+static const UINT kOverlayBlockSize = HD_BLOCK_SIZE;
+static const TCHAR kOverlayDeltaPrefix[] = TEXT("AWD");	// GetTempFileName() adds "<hex>.tmp"
+static const TCHAR kOverlayKeptExt[] = TEXT(".delta");
+
+struct ImageOverlay
+{
+	ImageOverlay_e Mode;
+	HANDLE hDeltaFile;				// Created on the first write (INVALID_HANDLE_VALUE until then, & always for gzip/zip)
+	TCHAR szDeltaFilename[MAX_PATH];
+	std::vector<BYTE> vecBitmap;	// b0 of [0] = 1st block
+	UINT uBaseSize;					// Image file's size when opened
+	bool bDirty;					// GZip/Zip: image buffer needs recompressing
+	UINT uBlocksWritten;
+};
+
+static inline bool Overlay_IsBlockInDelta(ImageOverlay* pOverlay, const UINT uBlock)
+{
+	return (uBlock >> 3) < pOverlay->vecBitmap.size() && (pOverlay->vecBitmap[uBlock >> 3] & (1 << (uBlock & 7)));
+}
+
+static void Overlay_Create(ImageInfo* pImageInfo, const ImageOverlay_e Mode)
+{
+	ImageOverlay* pOverlay = new ImageOverlay;
+	pOverlay->Mode = Mode;
+	pOverlay->hDeltaFile = INVALID_HANDLE_VALUE;
+	pOverlay->szDeltaFilename[0] = 0;
+	pOverlay->uBaseSize = pImageInfo->uImageSize;
+	pOverlay->bDirty = false;
+	pOverlay->uBlocksWritten = 0;
+
+	pImageInfo->pOverlay = pOverlay;
+}
+
+static bool Overlay_CreateDeltaFile(ImageOverlay* pOverlay)
+{
+	TCHAR szTempPath[MAX_PATH];
+	if (!GetTempPath(MAX_PATH, szTempPath) || !GetTempFileName(szTempPath, kOverlayDeltaPrefix, 0, pOverlay->szDeltaFilename))
+		return false;
+
+	pOverlay->hDeltaFile = CreateFile(pOverlay->szDeltaFilename,
+		GENERIC_READ | GENERIC_WRITE,
+		0,
+		(LPSECURITY_ATTRIBUTES)NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY,
+		NULL);
+
+	if (pOverlay->hDeltaFile == INVALID_HANDLE_VALUE)
+	{
+		DeleteFile(pOverlay->szDeltaFilename);
+		return false;
+	}
+
+	// So disk usage is just the blocks written (this fails harmlessly on a file system without sparse files, eg. FAT32)
+	DWORD dwBytesReturned;
+	DeviceIoControl(pOverlay->hDeltaFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &dwBytesReturned, NULL);
+
+	return true;
+}
+
+static bool Overlay_ReadFile(HANDLE hFile, const UINT uOffset, LPBYTE pBuffer, const UINT uSize)
+{
+	if (SetFilePointer(hFile, uOffset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+		return false;
+
+	DWORD dwBytesRead;
+	return ReadFile(hFile, pBuffer, uSize, &dwBytesRead, NULL) && dwBytesRead == uSize;
+}
+
+static bool Overlay_WriteFile(HANDLE hFile, const UINT uOffset, LPBYTE pBuffer, const UINT uSize)
+{
+	if (SetFilePointer(hFile, uOffset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+		return false;
+
+	DWORD dwBytesWritten;
+	return WriteFile(hFile, pBuffer, uSize, &dwBytesWritten, NULL) && dwBytesWritten == uSize;
+}
+
+// Read from the image file's offset uOffset, through the bitmap
+// . Each run of blocks from the same place (delta file, image file, or neither: zeros) is read in one go
+static bool Overlay_Read(ImageInfo* pImageInfo, const UINT uOffset, LPBYTE pBuffer, const UINT uSize)
+{
+	ImageOverlay* pOverlay = pImageInfo->pOverlay;
+
+	UINT uPos = uOffset;
+	while (uPos < uOffset + uSize)
+	{
+		const UINT uBlock = uPos / kOverlayBlockSize;
+		const bool bInDelta = Overlay_IsBlockInDelta(pOverlay, uBlock);
+		const bool bInBase = !bInDelta && uPos < pOverlay->uBaseSize;
+
+		UINT uEnd = MIN((uBlock+1) * kOverlayBlockSize, uOffset + uSize);
+		while (uEnd < uOffset + uSize && Overlay_IsBlockInDelta(pOverlay, uEnd / kOverlayBlockSize) == bInDelta)
+			uEnd = MIN(uEnd + kOverlayBlockSize, uOffset + uSize);
+		if (bInBase)
+			uEnd = MIN(uEnd, pOverlay->uBaseSize);
+
+		LPBYTE pDst = pBuffer + (uPos - uOffset);
+		if (bInDelta)
+		{
+			if (!Overlay_ReadFile(pOverlay->hDeltaFile, uPos, pDst, uEnd - uPos))
+				return false;
+		}
+		else if (bInBase)
+		{
+			if (!Overlay_ReadFile(pImageInfo->hFile, uPos, pDst, uEnd - uPos))
+				return false;
+		}
+		else
+		{
+			memset(pDst, 0, uEnd - uPos);	// Beyond the image file's original end, & not (yet) written
+		}
+
+		uPos = uEnd;
+	}
+
+	return true;
+}
+
+// Write to the image file's offset uOffset
+static bool Overlay_Write(ImageInfo* pImageInfo, const UINT uOffset, LPBYTE pBuffer, const UINT uSize)
+{
+	ImageOverlay* pOverlay = pImageInfo->pOverlay;
+
+	if (pOverlay->hDeltaFile == INVALID_HANDLE_VALUE && !Overlay_CreateDeltaFile(pOverlay))
+	{
+		LogFileOutput("Overlay: %s: failed to create delta file\n", pImageInfo->szFilename);
+		return false;
+	}
+
+	const UINT uFirstBlock = uOffset / kOverlayBlockSize;
+	const UINT uLastBlock = (uOffset + uSize - 1) / kOverlayBlockSize;
+
+	// A partially written block must first be completed in the delta file, from the image file
+	const UINT uPartialBlock[2] = {	(uOffset % kOverlayBlockSize) ? uFirstBlock : (UINT)-1,
+									((uOffset + uSize) % kOverlayBlockSize) ? uLastBlock : (UINT)-1 };
+	for (UINT i = 0; i < 2; i++)
+	{
+		const UINT uBlock = uPartialBlock[i];
+		if (uBlock == (UINT)-1 || Overlay_IsBlockInDelta(pOverlay, uBlock) || (i == 1 && uBlock == uPartialBlock[0]))
+			continue;
+
+		BYTE block[kOverlayBlockSize];
+		if (!Overlay_Read(pImageInfo, uBlock * kOverlayBlockSize, block, kOverlayBlockSize) ||
+			!Overlay_WriteFile(pOverlay->hDeltaFile, uBlock * kOverlayBlockSize, block, kOverlayBlockSize))
+			return false;
+	}
+
+	if (!Overlay_WriteFile(pOverlay->hDeltaFile, uOffset, pBuffer, uSize))
+		return false;
+
+	if (pOverlay->vecBitmap.size() <= (uLastBlock >> 3))
+		pOverlay->vecBitmap.resize((uLastBlock >> 3) + 1, 0);
+
+	for (UINT uBlock = uFirstBlock; uBlock <= uLastBlock; uBlock++)
+	{
+		if (!Overlay_IsBlockInDelta(pOverlay, uBlock))
+		{
+			pOverlay->vecBitmap[uBlock >> 3] |= 1 << (uBlock & 7);
+			pOverlay->uBlocksWritten++;
+		}
+	}
+
+	return true;
+}
+
+// Log & show a failed commit
+// . pszKeptIn: the delta file holding the writes (NULL for a gzip/zip, whose writes are lost)
+static void Overlay_ReportCommitError(ImageInfo* pImageInfo, const bool bSharingViolation, LPCTSTR pszKeptIn)
+{
+	const TCHAR* pszReason = bSharingViolation ? TEXT("it's open in another program (or AppleWin session)") : TEXT("it couldn't be written");
+
+	LogFileOutput("Overlay: %s: failed to commit (%s) - writes %s%s\n", pImageInfo->szFilename,
+		bSharingViolation ? "sharing violation" : "write error", pszKeptIn ? "kept in: " : "lost", pszKeptIn ? pszKeptIn : "");
+
+	TCHAR szBuffer[MAX_PATH*2 + 256];
+	wsprintf(
+		szBuffer,
+		TEXT("Unable to commit the changes to the disk image %s\n")
+		TEXT("as %s.\n\n")
+		TEXT("%s%s"),
+		pImageInfo->szFilename,
+		pszReason,
+		pszKeptIn ? TEXT("The changes have been kept in: ") : TEXT("The changes have been lost."),
+		pszKeptIn ? pszKeptIn : TEXT(""));
+
+	MessageBox(
+		g_hFrameWindow,
+		szBuffer,
+		g_pAppTitle,
+		MB_ICONEXCLAMATION | MB_SETFOREGROUND);
+}
+
+// Close (1), while the image buffer is still valid: recompress a gzip/zip
+static void Overlay_CommitBuffer(ImageInfo* pImageInfo)
+{
+	ImageOverlay* pOverlay = pImageInfo->pOverlay;
+	if (!pOverlay || !pOverlay->bDirty || pOverlay->Mode != eIMAGE_OVERLAY_COMMIT)
+		return;
+
+	if (WaitForImageData(pImageInfo, pImageInfo->uImageSize) &&
+		WriteCompressedFile(pImageInfo, pImageInfo->pImageBuffer, pImageInfo->uImageSize))
+		pOverlay->bDirty = false;
+	else
+		Overlay_ReportCommitError(pImageInfo, GetLastError() == ERROR_SHARING_VIOLATION, NULL);
+}
+
+// Close (2), after the image file is closed: commit or discard the delta file
+static void Overlay_Destroy(ImageInfo* pImageInfo, const bool bCommit)
+{
+	ImageOverlay* pOverlay = pImageInfo->pOverlay;
+	if (!pOverlay)
+		return;
+
+	bool bDeleteDelta = true;
+	bool bSharingViolation = false;
+
+	if (pOverlay->hDeltaFile != INVALID_HANDLE_VALUE && pOverlay->Mode == eIMAGE_OVERLAY_COMMIT && bCommit)
+	{
+		HANDLE hFile = CreateFile(pImageInfo->szFilename, GENERIC_WRITE, FILE_SHARE_READ, (LPSECURITY_ATTRIBUTES)NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		bool bRes = (hFile != INVALID_HANDLE_VALUE);
+		bSharingViolation = !bRes && GetLastError() == ERROR_SHARING_VIOLATION;	// Eg. another -overlay session has it open
+
+		// Copy each run of blocks in the delta file
+		const UINT uNumBlocks = pOverlay->vecBitmap.size() * 8;
+		std::vector<BYTE> vecRun;
+		for (UINT uBlock = 0; bRes && uBlock < uNumBlocks; )
+		{
+			if (!Overlay_IsBlockInDelta(pOverlay, uBlock))
+			{
+				uBlock++;
+				continue;
+			}
+
+			UINT uEndBlock = uBlock+1;
+			while (uEndBlock < uNumBlocks && Overlay_IsBlockInDelta(pOverlay, uEndBlock))
+				uEndBlock++;
+
+			const UINT uOffset = uBlock * kOverlayBlockSize;
+			const UINT uSize = MIN(uEndBlock * kOverlayBlockSize, pImageInfo->uImageSize) - uOffset;	// Not beyond the image's end
+			vecRun.resize(uSize);
+			bRes = Overlay_ReadFile(pOverlay->hDeltaFile, uOffset, &vecRun[0], uSize) &&
+				   Overlay_WriteFile(hFile, uOffset, &vecRun[0], uSize);
+
+			uBlock = uEndBlock;
+		}
+
+		// An HDD image may have grown (beyond the last block written)
+		if (bRes && pImageInfo->uImageSize > pOverlay->uBaseSize)
+			bRes = SetFilePointer(hFile, pImageInfo->uImageSize, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER && SetEndOfFile(hFile);
+
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
+
+		if (bRes)
+		{
+			LogFileOutput("Overlay: %s: committed %u blocks\n", pImageInfo->szFilename, pOverlay->uBlocksWritten);
+		}
+		else
+		{
+			bDeleteDelta = false;
+		}
+	}
+
+	if (pOverlay->hDeltaFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(pOverlay->hDeltaFile);
+		if (bDeleteDelta)
+		{
+			DeleteFile(pOverlay->szDeltaFilename);
+		}
+		else
+		{
+			// Rename it, so it isn't deleted as an orphan at the next startup
+			TCHAR szKeptFilename[MAX_PATH];
+			_tcscpy(szKeptFilename, pOverlay->szDeltaFilename);
+			TCHAR* pszExt = _tcsrchr(szKeptFilename, TEXT('.'));
+			if (pszExt && (pszExt - szKeptFilename) + _tcslen(kOverlayKeptExt) < MAX_PATH)
+			{
+				_tcscpy(pszExt, kOverlayKeptExt);
+				if (MoveFile(pOverlay->szDeltaFilename, szKeptFilename))
+					_tcscpy(pOverlay->szDeltaFilename, szKeptFilename);
+			}
+
+			Overlay_ReportCommitError(pImageInfo, bSharingViolation, pOverlay->szDeltaFilename);
+		}
+	}
+
+	delete pOverlay;
+	pImageInfo->pOverlay = NULL;
+}
+
+// For a gzip/zip: writes that haven't been recompressed (& won't be, as they're being discarded)
+static inline bool Overlay_HasUncommittedBuffer(ImageInfo* pImageInfo)
+{
+	return pImageInfo->pOverlay && pImageInfo->pOverlay->bDirty;
+}
+
+//-----------------------------------------------------------------------------
+
+// GZip/Zip: deferred recompression
+// . A write just updates the image buffer & marks it dirty: the whole image is recompressed later, by a background thread,
+//   once there have been no writes for kRecompressQuietMs (so a burst of track or block writes is recompressed just once).
+// . The thread compresses a snapshot of the buffer, so it's never held up by (nor holds up) further writes.
+// . On Close() (eject or exit) a dirty image is recompressed straight away (waiting for any recompress that's under way).
+// . NB. With an overlay, the recompress is instead deferred until Close(), and only if it's committed.
+
+static const DWORD kRecompressQuietMs = 2000;
+
+struct ImageRecompress
+{
+	CRITICAL_SECTION csBuffer;	// Guards pImageBuffer & uImageSize: held while they're written, & while the snapshot is taken
+	bool bDirty;				// These 3 are guarded by g_RecompressCriticalSection
+	bool bBusy;					// Being recompressed by the thread
+	DWORD dwLastWrite;			// GetTickCount()
+	UINT uRecompressions;
+};
+
+static std::vector<ImageInfo*> g_vecRecompress;	// Open gzip/zip images
+static CRITICAL_SECTION g_RecompressCriticalSection;
+static bool g_bRecompressInit = false;
+static HANDLE g_hRecompressThread = NULL;
+static HANDLE g_hRecompressEvent[2] = {NULL, NULL};	// [0] = Image written, [1] = Exit
+static HANDLE g_hRecompressDone = NULL;
+
+static DWORD WINAPI RecompressThread(LPVOID);
+
+static void InitRecompress(void)
+{
+	if (g_bRecompressInit)
+		return;
+
+	g_bRecompressInit = true;
+	InitializeCriticalSection(&g_RecompressCriticalSection);
+
+	for (UINT i=0; i<2; i++)
+		g_hRecompressEvent[i] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto-reset, initially non-signaled
+	g_hRecompressDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (g_hRecompressEvent[0] && g_hRecompressEvent[1] && g_hRecompressDone)
+	{
+		DWORD dwThreadId;
+		g_hRecompressThread = CreateThread(NULL,				// lpThreadAttributes
+											0,					// dwStackSize
+											RecompressThread,
+											NULL,				// lpParameter
+											0,					// dwCreationFlags : 0 = Run immediately
+											&dwThreadId);		// lpThreadId
+	}
+
+	LogFileOutput("Recompress: CreateThread(), g_hRecompressThread=0x%08X\n", (UINT32)g_hRecompressThread);
+
+	if (g_hRecompressThread)
+		SetThreadPriority(g_hRecompressThread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+static inline void LockImageBuffer(ImageInfo* pImageInfo)
+{
+	if (pImageInfo->pRecompress)
+		EnterCriticalSection(&pImageInfo->pRecompress->csBuffer);
+}
+
+static inline void UnlockImageBuffer(ImageInfo* pImageInfo)
+{
+	if (pImageInfo->pRecompress)
+		LeaveCriticalSection(&pImageInfo->pRecompress->csBuffer);
+}
+
+// Snapshot the buffer & recompress it
+// . Pre: the image's bBusy is set (if called by the thread), so Recompress_Close() waits for this to finish
+static bool Recompress(ImageInfo* pImageInfo)
+{
+	ImageRecompress* pRecompress = pImageInfo->pRecompress;
+
+	EnterCriticalSection(&pRecompress->csBuffer);
+
+	EnterCriticalSection(&g_RecompressCriticalSection);
+	pRecompress->bDirty = false;	// A write after this (ie. not in the snapshot) sets it again
+	LeaveCriticalSection(&g_RecompressCriticalSection);
+
+	std::vector<BYTE> vecSnapshot(pImageInfo->pImageBuffer, pImageInfo->pImageBuffer + pImageInfo->uImageSize);
+
+	LeaveCriticalSection(&pRecompress->csBuffer);
+
+	const bool bRes = WriteCompressedFile(pImageInfo, &vecSnapshot[0], vecSnapshot.size());
+
+	EnterCriticalSection(&g_RecompressCriticalSection);
+	if (bRes)
+	{
+		pRecompress->uRecompressions++;
+	}
+	else
+	{
+		pRecompress->bDirty = true;	// Retry after the next quiet period (or on Close())
+		pRecompress->dwLastWrite = GetTickCount();
+	}
+	LeaveCriticalSection(&g_RecompressCriticalSection);
+
+	if (!bRes)
+		LogFileOutput("Recompress: %s: failed to write\n", pImageInfo->szFilename);
+
+	return bRes;
+}
+
+static DWORD WINAPI RecompressThread(LPVOID)
+{
+	DWORD dwTimeout = INFINITE;
+
+	while (WaitForMultipleObjects(2, g_hRecompressEvent, FALSE, dwTimeout) != WAIT_OBJECT_0+1)	// [1] = Exit
+	{
+		// Find an image that's been quiet for long enough, & when the next one will be
+		ImageInfo* pImageInfo = NULL;
+		dwTimeout = INFINITE;
+
+		EnterCriticalSection(&g_RecompressCriticalSection);
+
+		const DWORD dwNow = GetTickCount();
+		for (UINT i=0; i<g_vecRecompress.size(); i++)
+		{
+			ImageRecompress* pRecompress = g_vecRecompress[i]->pRecompress;
+			if (!pRecompress->bDirty)
+				continue;
+
+			const DWORD dwQuietMs = dwNow - pRecompress->dwLastWrite;
+			if (dwQuietMs < kRecompressQuietMs)
+			{
+				dwTimeout = MIN(dwTimeout, kRecompressQuietMs - dwQuietMs);
+			}
+			else if (!pImageInfo)
+			{
+				pImageInfo = g_vecRecompress[i];
+				pRecompress->bBusy = true;
+			}
+		}
+
+		LeaveCriticalSection(&g_RecompressCriticalSection);
+
+		if (pImageInfo)
+		{
+			Recompress(pImageInfo);
+
+			EnterCriticalSection(&g_RecompressCriticalSection);
+			pImageInfo->pRecompress->bBusy = false;
+			LeaveCriticalSection(&g_RecompressCriticalSection);
+			SetEvent(g_hRecompressDone);
+
+			dwTimeout = 0;	// Look again
+		}
+	}
+
+	return 0;
+}
+
+// Open: a gzip/zip image (NB. even if write-protected, as that can be switched off)
+static void Recompress_Create(ImageInfo* pImageInfo)
+{
+	InitRecompress();
+
+	ImageRecompress* pRecompress = new ImageRecompress;
+	InitializeCriticalSection(&pRecompress->csBuffer);
+	pRecompress->bDirty = false;
+	pRecompress->bBusy = false;
+	pRecompress->dwLastWrite = 0;
+	pRecompress->uRecompressions = 0;
+
+	EnterCriticalSection(&g_RecompressCriticalSection);
+	pImageInfo->pRecompress = pRecompress;
+	g_vecRecompress.push_back(pImageInfo);
+	LeaveCriticalSection(&g_RecompressCriticalSection);
+}
+
+// Close, while the image buffer is still valid: recompress now if there are still writes outstanding
+static void Recompress_Close(ImageInfo* pImageInfo, const bool bRecompress)
+{
+	ImageRecompress* pRecompress = pImageInfo->pRecompress;
+	if (!pRecompress)
+		return;
+
+	while (1)
+	{
+		EnterCriticalSection(&g_RecompressCriticalSection);
+		if (!pRecompress->bBusy)
+		{
+			g_vecRecompress.erase(std::find(g_vecRecompress.begin(), g_vecRecompress.end(), pImageInfo));
+			LeaveCriticalSection(&g_RecompressCriticalSection);
+			break;
+		}
+		LeaveCriticalSection(&g_RecompressCriticalSection);
+
+		WaitForSingleObject(g_hRecompressDone, 100);	// NB. Shared by all images, so just poll again
+	}
+
+	if (pRecompress->bDirty && bRecompress && WaitForImageData(pImageInfo, pImageInfo->uImageSize))
+		Recompress(pImageInfo);
+
+	if (pRecompress->uRecompressions)
+		LogFileOutput("Recompress: %s: recompressed %u times\n", pImageInfo->szFilename, pRecompress->uRecompressions);
+
+	DeleteCriticalSection(&pRecompress->csBuffer);
+	delete pRecompress;
+	pImageInfo->pRecompress = NULL;
+}
+
+//-------------------------------------
+
+// Called once all the image's (track or block) writes are in the image buffer
+static bool WriteCompressedImage(ImageInfo* pImageInfo)
+{
+	if (pImageInfo->pOverlay)
+	{
+		pImageInfo->pOverlay->bDirty = true;
+		return true;
+	}
+
+	if (!pImageInfo->pRecompress)
+		return WriteCompressedFile(pImageInfo, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
+
+	// NB. After StopRecompressThread(), a dirty image is just recompressed by Close()
+	EnterCriticalSection(&g_RecompressCriticalSection);
+	pImageInfo->pRecompress->bDirty = true;
+	pImageInfo->pRecompress->dwLastWrite = GetTickCount();
+	LeaveCriticalSection(&g_RecompressCriticalSection);
+
+	SetEvent(g_hRecompressEvent[0]);
+	return true;
+}
+
+// Exit: any images still open (eg. HDDs) are then recompressed synchronously, by Close()
+void CImageHelperBase::StopRecompressThread(void)
+{
+	if (!g_hRecompressThread)
+		return;
+
+	SetEvent(g_hRecompressEvent[1]);
+	WaitForSingleObject(g_hRecompressThread, INFINITE);
+	CloseHandle(g_hRecompressThread);
+
+	EnterCriticalSection(&g_RecompressCriticalSection);
+	g_hRecompressThread = NULL;
+	LeaveCriticalSection(&g_RecompressCriticalSection);
+}
+
+//-----------------------------------------------------------------------------
+
+// Block I/O for uCount contiguous blocks, direct to the image (ie. bypassing the block cache)
+
+static bool ReadImageBlocks(ImageInfo* pImageInfo, const UINT nBlock, const UINT uCount, LPBYTE pBuffer)
+{
+	const long Offset = pImageInfo->uOffset + nBlock * HD_BLOCK_SIZE;
+	const UINT uSize = uCount * HD_BLOCK_SIZE;
+
+	if (pImageInfo->FileType == eFileNormal && IsBlockInImageBuffer(pImageInfo, Offset, uSize))
+	{
+		if (!CopyImageView(pBuffer, GetImageView(pImageInfo, Offset, uSize), uSize))
+		{
+			LogFileOutput("Image: %s: in-page error reading block %u\n", pImageInfo->szFilename, nBlock);
+			return false;
+		}
+	}
+	else if (pImageInfo->FileType == eFileNormal)
+	{
+		// Beyond the views (ie. the image has grown since it was opened, or the block straddles 2 windows)
+		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		if (pImageInfo->pOverlay)
+			return Overlay_Read(pImageInfo, Offset, pBuffer, uSize);
+
+		SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
+
+		DWORD dwBytesRead;
+		BOOL bRes = ReadFile(pImageInfo->hFile, pBuffer, uSize, &dwBytesRead, NULL);
+		if (!bRes || dwBytesRead != uSize)
+			return false;
+	}
+	else if ((pImageInfo->FileType == eFileGZip) || (pImageInfo->FileType == eFileZip))
+	{
+		WaitForImageData(pImageInfo, Offset + uSize);
+		memcpy(pBuffer, &pImageInfo->pImageBuffer[Offset], uSize);
+	}
+	else
+	{
+		_ASSERT(0);
+		return false;
+	}
+
+	return true;
+}
+
+// Grow the image to uNewImageSize in one go: the new area reads as zeros
+// . Normal file: just the file's end is moved (it's not written) - or with an overlay, not even that (until it's committed)
+// . GZip/Zip: horribly inefficient! (Unzip to a normal file if you want better performance!)
+static bool ExtendImage(ImageInfo* pImageInfo, const UINT uNewImageSize)
+{
+	if (uNewImageSize <= pImageInfo->uImageSize)
+		return true;
+
+	if (pImageInfo->FileType == eFileNormal)
+	{
+		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		// NB. With an overlay, Overlay_Read() returns zeros beyond the image file's end
+		if (!pImageInfo->pOverlay)
+		{
+			if (SetFilePointer(pImageInfo->hFile, uNewImageSize, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !SetEndOfFile(pImageInfo->hFile))
+				return false;
+		}
+	}
+	else
+	{
+		if (!WaitForImageData(pImageInfo, pImageInfo->uImageSize))
+			return false;
+		if (!MakeImageBufferPrivate(pImageInfo))
+			return false;
+
+		BYTE* pNewImageBuffer = new BYTE [uNewImageSize];
+		_ASSERT(pNewImageBuffer);
+		if (!pNewImageBuffer)
+			return false;
+
+		memcpy(pNewImageBuffer, pImageInfo->pImageBuffer, pImageInfo->uImageSize);
+		memset(&pNewImageBuffer[pImageInfo->uImageSize], 0, uNewImageSize-pImageInfo->uImageSize);
+
+		LockImageBuffer(pImageInfo);	// The recompress thread may be taking a snapshot of the old buffer
+		delete [] pImageInfo->pImageBuffer;
+		pImageInfo->pImageBuffer = pNewImageBuffer;
+		pImageInfo->uImageSize = uNewImageSize;
+		UnlockImageBuffer(pImageInfo);
+		return true;
+	}
+
+	pImageInfo->uImageSize = uNewImageSize;
+	return true;
+}
+
+// GZip/Zip: only the image buffer is updated - call WriteCompressedImage() once all the blocks are written
+static bool WriteImageBlocks(ImageInfo* pImageInfo, const UINT nBlock, const UINT uCount, LPBYTE pBuffer)
+{
+	const long Offset = pImageInfo->uOffset + nBlock * HD_BLOCK_SIZE;
+	const UINT uSize = uCount * HD_BLOCK_SIZE;
+
+	if (!ExtendImage(pImageInfo, Offset + uSize))
+		return false;
+
+	if (pImageInfo->FileType == eFileGZip || pImageInfo->FileType == eFileZip)
+	{
+		if (!WaitForImageData(pImageInfo, pImageInfo->uImageSize))	// The whole image gets recompressed
+			return false;
+		if (!MakeImageBufferPrivate(pImageInfo))
+			return false;
+
+		LockImageBuffer(pImageInfo);
+		memcpy(&pImageInfo->pImageBuffer[Offset], pBuffer, uSize);
+		UnlockImageBuffer(pImageInfo);
+		return true;
+	}
+
+	if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	WriteImageViews(pImageInfo, Offset, pBuffer, uSize);
+
+	if (pImageInfo->pOverlay)
+		return Overlay_Write(pImageInfo, Offset, pBuffer, uSize);
+
+	SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
+
+	DWORD dwBytesWritten;
+	BOOL bRes = WriteFile(pImageInfo->hFile, pBuffer, uSize, &dwBytesWritten, NULL);
+	if (!bRes || dwBytesWritten != uSize)
+		return false;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// HDD block cache: one per image, with an LRU of 4KB extents (8 blocks, each with a valid & dirty bit)
+// . Reads that would need a ReadFile (ie. beyond a normal file's view) fetch a whole extent, or once reads
+//   are sequential, several extents ahead. Blocks already in memory (the view, or a gzip/zip buffer) aren't copied.
+// . Writes are held until BlockCache_Flush() (on idle, eject & exit, or to make room), which extends the image
+//   once, writes each run of contiguous dirty blocks with a single WriteFile, and recompresses a gzip/zip just once.
+//   NB. So an error writing back a block can't be returned to the (emulated) OS - it's just logged.
+
+static const UINT kBlockCacheExtentBlocks = 8;
+static const UINT kBlockCacheExtentSize = kBlockCacheExtentBlocks * HD_BLOCK_SIZE;
+static const UINT kBlockCacheReadAheadExtents = 8;	// 32KB
+static const UINT kBlockCacheSeqReads = 2;			// # of sequential reads before reading ahead
+static UINT g_uBlockCacheSize = 0;					// Per image
+
+struct BlockCacheExtent
+{
+	BYTE data[kBlockCacheExtentSize];
+	BYTE bmValid;			// b0 = 1st block
+	BYTE bmDirty;
+	UINT64 uLastUsed;
+};
+
+struct BlockCache
+{
+	std::map<UINT, BlockCacheExtent*> mapExtents;	// Key = extent # (ie. block / kBlockCacheExtentBlocks)
+	UINT uMaxExtents;
+	UINT64 uTick;
+	UINT uImageSize;		// Incl. blocks appended, but not yet written back
+	UINT uDirtyBlocks;
+	UINT nNextReadBlock;	// For detecting sequential reads
+	UINT uSeqReads;
+
+	UINT uHits;
+	UINT uMisses;
+	UINT uReadAheads;
+	UINT uWrites;			// ie. WriteFile()s, after coalescing
+	UINT uBlocksWritten;
+};
+
+void BlockCache_SetSize(const UINT uBytes)
+{
+	g_uBlockCacheSize = uBytes;
+}
+
+void BlockCache_Create(ImageInfo* pImageInfo)
+{
+	_ASSERT(!pImageInfo->pBlockCache);
+	if (!g_uBlockCacheSize || !pImageInfo->pImageType->AllowRW())
+		return;
+
+	BlockCache* pCache = new BlockCache;
+	pCache->uMaxExtents = MAX(g_uBlockCacheSize / kBlockCacheExtentSize, kBlockCacheReadAheadExtents*2);
+	pCache->uTick = 0;
+	pCache->uImageSize = pImageInfo->uImageSize;
+	pCache->uDirtyBlocks = 0;
+	pCache->nNextReadBlock = (UINT)-1;
+	pCache->uSeqReads = 0;
+	pCache->uHits = pCache->uMisses = pCache->uReadAheads = pCache->uWrites = pCache->uBlocksWritten = 0;
+
+	pImageInfo->pBlockCache = pCache;
+}
+
+void BlockCache_Destroy(ImageInfo* pImageInfo)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+	if (!pCache)
+		return;
+
+	BlockCache_Flush(pImageInfo);
+
+	LogFileOutput("BlockCache: %s: hits=%u, misses=%u, read-aheads=%u, writes=%u (%u blocks)\n",
+		pImageInfo->szFilename, pCache->uHits, pCache->uMisses, pCache->uReadAheads, pCache->uWrites, pCache->uBlocksWritten);
+
+	for (std::map<UINT, BlockCacheExtent*>::iterator it = pCache->mapExtents.begin(); it != pCache->mapExtents.end(); ++it)
+		delete it->second;
+
+	delete pCache;
+	pImageInfo->pBlockCache = NULL;
+}
+
+// Write back a run of contiguous dirty blocks, then start a new run
+static bool BlockCache_WriteRun(ImageInfo* pImageInfo, const UINT nRunBlock, std::vector<BYTE>& vecRun, std::vector<BlockCacheExtent*>& vecRunExtents)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+	const UINT uCount = vecRunExtents.size();
+
+	const bool bRes = WriteImageBlocks(pImageInfo, nRunBlock, uCount, &vecRun[0]);
+	if (bRes)
+	{
+		for (UINT i = 0; i < uCount; i++)
+			vecRunExtents[i]->bmDirty &= ~(1 << ((nRunBlock + i) % kBlockCacheExtentBlocks));
+
+		pCache->uDirtyBlocks -= uCount;
+		pCache->uWrites++;
+		pCache->uBlocksWritten += uCount;
+	}
+
+	vecRun.clear();
+	vecRunExtents.clear();
+	return bRes;
+}
+
+bool BlockCache_Flush(ImageInfo* pImageInfo)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+	if (!pCache || !pCache->uDirtyBlocks)
+		return true;
+
+	bool bRes = ExtendImage(pImageInfo, pCache->uImageSize);
+
+	// Coalesce runs of contiguous dirty blocks (the map is in block order)
+	std::vector<BYTE> vecRun;
+	std::vector<BlockCacheExtent*> vecRunExtents;	// Extent of each block in the run
+	UINT nRunBlock = 0;
+
+	for (std::map<UINT, BlockCacheExtent*>::iterator it = pCache->mapExtents.begin(); bRes && it != pCache->mapExtents.end(); ++it)
+	{
+		for (UINT i = 0; bRes && i < kBlockCacheExtentBlocks; i++)
+		{
+			if (!(it->second->bmDirty & (1<<i)))
+				continue;
+
+			const UINT nBlock = it->first * kBlockCacheExtentBlocks + i;
+			if (!vecRunExtents.empty() && nBlock != nRunBlock + vecRunExtents.size())
+			{
+				bRes = BlockCache_WriteRun(pImageInfo, nRunBlock, vecRun, vecRunExtents);
+				if (!bRes)
+					break;
+			}
+
+			if (vecRunExtents.empty())
+				nRunBlock = nBlock;
+
+			vecRun.insert(vecRun.end(), &it->second->data[i*HD_BLOCK_SIZE], &it->second->data[(i+1)*HD_BLOCK_SIZE]);
+			vecRunExtents.push_back(it->second);
+		}
+	}
+
+	if (bRes && !vecRunExtents.empty())
+		bRes = BlockCache_WriteRun(pImageInfo, nRunBlock, vecRun, vecRunExtents);
+
+	if (bRes && pImageInfo->FileType != eFileNormal)
+		bRes = WriteCompressedImage(pImageInfo);
+
+	if (!bRes)
+		LogFileOutput("BlockCache: %s: failed to write back %u blocks\n", pImageInfo->szFilename, pCache->uDirtyBlocks);
+
+	return bRes;
+}
+
+UINT BlockCache_GetImageSize(ImageInfo* pImageInfo)
+{
+	return pImageInfo->pBlockCache ? pImageInfo->pBlockCache->uImageSize : pImageInfo->uImageSize;
+}
+
+// Returns NULL if not cached & bCreate=false
+// . NB. If the cache is full of dirty blocks that can't be written back, then it grows beyond its size
+static BlockCacheExtent* BlockCache_GetExtent(ImageInfo* pImageInfo, const UINT uExtent, const bool bCreate)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+
+	std::map<UINT, BlockCacheExtent*>::iterator it = pCache->mapExtents.find(uExtent);
+	if (it != pCache->mapExtents.end())
+	{
+		it->second->uLastUsed = ++pCache->uTick;
+		return it->second;
+	}
+
+	if (!bCreate)
+		return NULL;
+
+	BlockCacheExtent* pExtent = NULL;
+
+	if (pCache->mapExtents.size() >= pCache->uMaxExtents)
+	{
+		// Re-use the least recently used clean extent (writing back all dirty blocks first, if necessary)
+		for (UINT uPass = 0; uPass < 2 && !pExtent; uPass++)
+		{
+			std::map<UINT, BlockCacheExtent*>::iterator itLRU = pCache->mapExtents.end();
+			for (it = pCache->mapExtents.begin(); it != pCache->mapExtents.end(); ++it)
+			{
+				if (!it->second->bmDirty && (itLRU == pCache->mapExtents.end() || it->second->uLastUsed < itLRU->second->uLastUsed))
+					itLRU = it;
+			}
+
+			if (itLRU != pCache->mapExtents.end())
+			{
+				pExtent = itLRU->second;
+				pCache->mapExtents.erase(itLRU);
+			}
+			else if (uPass == 0 && !BlockCache_Flush(pImageInfo))
+			{
+				break;
+			}
+		}
+	}
+
+	if (!pExtent)
+		pExtent = new BlockCacheExtent;
+
+	pExtent->bmValid = 0;
+	pExtent->bmDirty = 0;
+	pExtent->uLastUsed = ++pCache->uTick;
+	pCache->mapExtents[uExtent] = pExtent;
+	return pExtent;
+}
+
+static bool BlockCache_Read(ImageInfo* pImageInfo, const UINT nBlock, LPBYTE pBlockBuffer)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+	const UINT uExtent = nBlock / kBlockCacheExtentBlocks;
+	const BYTE bmBlock = 1 << (nBlock % kBlockCacheExtentBlocks);
+
+	pCache->uSeqReads = (nBlock == pCache->nNextReadBlock) ? pCache->uSeqReads+1 : 0;
+	pCache->nNextReadBlock = nBlock+1;
+
+	BlockCacheExtent* pExtent = BlockCache_GetExtent(pImageInfo, uExtent, false);
+	if (pExtent && (pExtent->bmValid & bmBlock))
+	{
+		pCache->uHits++;
+		memcpy(pBlockBuffer, &pExtent->data[(nBlock % kBlockCacheExtentBlocks) * HD_BLOCK_SIZE], HD_BLOCK_SIZE);
+		return true;
+	}
+
+	const long Offset = pImageInfo->uOffset + nBlock * HD_BLOCK_SIZE;
+	if ((UINT)Offset+HD_BLOCK_SIZE > pImageInfo->uImageSize)
+	{
+		// Between the image's end & a block appended (but not yet written back)
+		memset(pBlockBuffer, 0, HD_BLOCK_SIZE);
+		return (UINT)Offset+HD_BLOCK_SIZE <= pCache->uImageSize;
+	}
+
+	if (pImageInfo->FileType != eFileNormal || IsBlockInImageBuffer(pImageInfo, Offset))
+		return ReadImageBlocks(pImageInfo, nBlock, 1, pBlockBuffer);	// Already in memory
+
+	// Read this extent (& the next few, if reading sequentially) with one ReadFile
+	pCache->uMisses++;
+
+	const UINT uNumExtents = (pCache->uSeqReads >= kBlockCacheSeqReads) ? kBlockCacheReadAheadExtents : 1;
+	if (uNumExtents > 1)
+		pCache->uReadAheads++;
+
+	const UINT nFirstBlock = uExtent * kBlockCacheExtentBlocks;
+	const UINT uImageBlocks = (pImageInfo->uImageSize - pImageInfo->uOffset) / HD_BLOCK_SIZE;
+	const UINT uCount = MIN(uNumExtents * kBlockCacheExtentBlocks, uImageBlocks - nFirstBlock);
+
+	std::vector<BYTE> vecBuffer(uCount * HD_BLOCK_SIZE);
+	if (!ReadImageBlocks(pImageInfo, nFirstBlock, uCount, &vecBuffer[0]))
+		return ReadImageBlocks(pImageInfo, nBlock, 1, pBlockBuffer);	// Just this block then
+
+	for (UINT i = 0; i < uCount; i += kBlockCacheExtentBlocks)
+	{
+		pExtent = BlockCache_GetExtent(pImageInfo, uExtent + i/kBlockCacheExtentBlocks, true);
+		if (!pExtent)
+			break;
+
+		for (UINT j = 0; j < kBlockCacheExtentBlocks && i+j < uCount; j++)
+		{
+			if (!(pExtent->bmValid & (1<<j)))	// Don't overwrite a (dirty) block that's newer than the image
+			{
+				memcpy(&pExtent->data[j*HD_BLOCK_SIZE], &vecBuffer[(i+j)*HD_BLOCK_SIZE], HD_BLOCK_SIZE);
+				pExtent->bmValid |= 1<<j;
+			}
+		}
+	}
+
+	memcpy(pBlockBuffer, &vecBuffer[(nBlock - nFirstBlock) * HD_BLOCK_SIZE], HD_BLOCK_SIZE);
+	return true;
+}
+
+static bool BlockCache_Write(ImageInfo* pImageInfo, const UINT nBlock, LPBYTE pBlockBuffer)
+{
+	BlockCache* pCache = pImageInfo->pBlockCache;
+	const BYTE bmBlock = 1 << (nBlock % kBlockCacheExtentBlocks);
+
+	BlockCacheExtent* pExtent = BlockCache_GetExtent(pImageInfo, nBlock / kBlockCacheExtentBlocks, true);
+	if (!pExtent)
+		return false;
+
+	memcpy(&pExtent->data[(nBlock % kBlockCacheExtentBlocks) * HD_BLOCK_SIZE], pBlockBuffer, HD_BLOCK_SIZE);
+	pExtent->bmValid |= bmBlock;
+	if (!(pExtent->bmDirty & bmBlock))
+	{
+		pExtent->bmDirty |= bmBlock;
+		pCache->uDirtyBlocks++;
+	}
+
+	pCache->uImageSize = MAX(pCache->uImageSize, pImageInfo->uOffset + (nBlock+1) * HD_BLOCK_SIZE);
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+
+bool CImageBase::ReadTrack(ImageInfo* pImageInfo, const int nTrack, LPBYTE pTrackBuffer, const UINT uTrackSize)
+{
+	const long Offset = pImageInfo->uOffset + nTrack * uTrackSize;
+	WaitForImageData(pImageInfo, Offset + uTrackSize);
+
+	if (!CopyImageView(pTrackBuffer, &pImageInfo->pImageBuffer[Offset], uTrackSize))
+	{
+		LogFileOutput("Image: %s: in-page error reading track %d\n", pImageInfo->szFilename, nTrack);
+		memset(pTrackBuffer, 0, uTrackSize);	// ie. no sync nibbles or sectors: reads as an I/O error
 		return false;
 	}
 
 	return true;
 }
 
-//-----------------------------------------------------------------------------
+//-------------------------------------
 
-LPBYTE CImageBase::Code62(int sector)
+bool CImageBase::WriteTrack(ImageInfo* pImageInfo, const int nTrack, LPBYTE pTrackBuffer, const UINT uTrackSize)
 {
-	// CONVERT THE 256 8-BIT BYTES INTO 342 6-BIT BYTES, WHICH WE STORE
-	// STARTING AT 4K INTO THE WORK BUFFER.
+	const long Offset = pImageInfo->uOffset + nTrack * uTrackSize;
+	if (!WaitForImageData(pImageInfo, pImageInfo->uImageSize))	// GZip/Zip: the whole image gets recompressed
+		return false;
+	if (!MakeImageBufferPrivate(pImageInfo))
+		return false;
+
+	LockImageBuffer(pImageInfo);
+	const bool bViewRes = CopyImageView(&pImageInfo->pImageBuffer[Offset], pTrackBuffer, uTrackSize);
+	UnlockImageBuffer(pImageInfo);
+
+	if (!bViewRes)
 	{
-		LPBYTE sectorbase = ms_pWorkBuffer+(sector << 8);
-		LPBYTE resultptr  = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		BYTE   offset     = 0xAC;
-		while (offset != 0x02)
-		{
-			BYTE value = 0;
-#define ADDVALUE(a) value = (value << 2) |        \
-							(((a) & 0x01) << 1) | \
-							(((a) & 0x02) >> 1)
-			ADDVALUE(*(sectorbase+offset));  offset -= 0x56;
-			ADDVALUE(*(sectorbase+offset));  offset -= 0x56;
-			ADDVALUE(*(sectorbase+offset));  offset -= 0x53;
-#undef ADDVALUE
-			*(resultptr++) = value << 2;
-		}
-		*(resultptr-2) &= 0x3F;
-		*(resultptr-1) &= 0x3F;
-		int loop = 0;
-		while (loop < 0x100)
-			*(resultptr++) = *(sectorbase+(loop++));
+		LogFileOutput("Image: %s: in-page error writing track %d\n", pImageInfo->szFilename, nTrack);
+		return false;
 	}
 
-	// EXCLUSIVE-OR THE ENTIRE DATA BLOCK WITH ITSELF OFFSET BY ONE BYTE,
-	// CREATING A 343RD BYTE WHICH IS USED AS A CHECKSUM.  STORE THE NEW
-	// BLOCK OF 343 BYTES STARTING AT 5K INTO THE WORK BUFFER.
+	if (pImageInfo->FileType == eFileNormal)
 	{
-		BYTE   savedval  = 0;
-		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
-		int    loop      = 342;
-		while (loop--)
-		{
-			*(resultptr++) = savedval ^ *sourceptr;
-			savedval = *(sourceptr++);
-		}
-		*resultptr = savedval;
-	}
+		if (pImageInfo->hFile == INVALID_HANDLE_VALUE)
+			return false;
+
+		if (pImageInfo->pOverlay)
+			return Overlay_Write(pImageInfo, Offset, pTrackBuffer, uTrackSize);
+
+		SetFilePointer(pImageInfo->hFile, Offset, NULL, FILE_BEGIN);
 
-	// USING A LOOKUP TABLE, CONVERT THE 6-BIT BYTES INTO DISK BYTES.  A VALID
-	// DISK BYTE IS A BYTE THAT HAS THE HIGH BIT SET, AT LEAST TWO ADJACENT
-	// BITS SET (EXCLUDING THE HIGH BIT), AND AT MOST ONE PAIR OF CONSECUTIVE
-	// ZERO BITS.  THE CONVERTED BLOCK OF 343 BYTES IS STORED STARTING AT 4K
-	// INTO THE WORK BUFFER.
+		DWORD dwBytesWritten;
+		BOOL bRes = WriteFile(pImageInfo->hFile, pTrackBuffer, uTrackSize, &dwBytesWritten, NULL);
+		_ASSERT(dwBytesWritten == uTrackSize);
+		if (!bRes || dwBytesWritten != uTrackSize)
+			return false;
+	}
+	else
 	{
-		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
-		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		int    loop      = 343;
-		while (loop--)
-			*(resultptr++) = ms_DiskByte[(*(sourceptr++)) >> 2];
+		// Entire compressed image is rewritten (deferred until writes go quiet, or the disk is removed)
+		if (!WriteCompressedImage(pImageInfo))
+			return false;
 	}
 
-	return ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+	return true;
 }
 
-//-------------------------------------
+//-----------------------------------------------------------------------------
 
-void CImageBase::Decode62(LPBYTE imageptr)
+bool CImageBase::ReadBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer)
 {
-	// IF WE HAVEN'T ALREADY DONE SO, GENERATE A TABLE FOR CONVERTING
-	// DISK BYTES BACK INTO 6-BIT BYTES
-	static BOOL tablegenerated = 0;
-	static BYTE sixbitbyte[0x80];
-	if (!tablegenerated)
-	{
-		ZeroMemory(sixbitbyte,0x80);
-		int loop = 0;
-		while (loop < 0x40) {
-			sixbitbyte[ms_DiskByte[loop]-0x80] = loop << 2;
-			loop++;
-		}
-		tablegenerated = 1;
-	}
+	if (pImageInfo->pBlockCache)
+		return BlockCache_Read(pImageInfo, nBlock, pBlockBuffer);
 
-	// USING OUR TABLE, CONVERT THE DISK BYTES BACK INTO 6-BIT BYTES
-	{
-		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
-		int    loop      = 343;
-		while (loop--)
-			*(resultptr++) = sixbitbyte[*(sourceptr++) & 0x7F];
-	}
+	return ReadImageBlocks(pImageInfo, nBlock, 1, pBlockBuffer);
+}
 
-	// EXCLUSIVE-OR THE ENTIRE DATA BLOCK WITH ITSELF OFFSET BY ONE BYTE
-	// TO UNDO THE EFFECTS OF THE CHECKSUMMING PROCESS
-	{
-		BYTE   savedval  = 0;
-		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
-		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		int    loop      = 342;
-		while (loop--)
-		{
-			*resultptr = savedval ^ *(sourceptr++);
-			savedval = *(resultptr++);
-		}
-	}
+//-------------------------------------
 
-	// CONVERT THE 342 6-BIT BYTES INTO 256 8-BIT BYTES
-	{
-		LPBYTE lowbitsptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
-		LPBYTE sectorbase = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x56;
-		BYTE   offset     = 0xAC;
-		while (offset != 0x02)
-		{
-			if (offset >= 0xAC)
-			{
-				*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
-										| (((*lowbitsptr) & 0x80) >> 7)
-										| (((*lowbitsptr) & 0x40) >> 5);
-			}
+bool CImageBase::WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer)
+{
+	if (pImageInfo->pBlockCache)
+		return BlockCache_Write(pImageInfo, nBlock, pBlockBuffer);
 
-			offset -= 0x56;
-			*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
-										| (((*lowbitsptr) & 0x20) >> 5)
-										| (((*lowbitsptr) & 0x10) >> 3);
+	if (!WriteImageBlocks(pImageInfo, nBlock, 1, pBlockBuffer))
+		return false;
 
-			offset -= 0x56;
-			*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
-										| (((*lowbitsptr) & 0x08) >> 3)
-										| (((*lowbitsptr) & 0x04) >> 1);
+	if (pImageInfo->FileType != eFileNormal)
+		return WriteCompressedImage(pImageInfo);	// Entire compressed image is rewritten (deferred until writes go quiet)
 
-			offset -= 0x53;
-			lowbitsptr++;
-		}
-	}
+	return true;
 }
 
-//-------------------------------------
+//-----------------------------------------------------------------------------
 
 void CImageBase::DenibblizeTrack(LPBYTE trackimage, SectorOrder_e SectorOrder, int nibbles)
 {
 	ZeroMemory(ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
 
 	// SEARCH THROUGH THE TRACK IMAGE FOR EACH SECTOR.  FOR EVERY SECTOR
-	// WE FIND, COPY THE NIBBLIZED DATA FOR THAT SECTOR INTO THE WORK
-	// BUFFER AT OFFSET 4K.  THEN CALL DECODE62() TO DENIBBLIZE THE DATA
-	// IN THE BUFFER AND WRITE IT INTO THE FIRST PART OF THE WORK BUFFER
-	// OFFSET BY THE SECTOR NUMBER.
+	// WE FIND, DECODE ITS NIBBLIZED DATA INTO THE FIRST PART OF THE WORK
+	// BUFFER OFFSET BY THE SECTOR NUMBER.
+
+	if (nibbles < 3)
+		return;
 
 	int offset    = 0;
 	int partsleft = 33;
 	int sector    = 0;
 	while (partsleft--)
 	{
-		BYTE byteval[3] = {0,0,0};
-		int  bytenum    = 0;
-		int  loop       = nibbles;
-		while ((loop--) && (bytenum < 3))
-		{
-			if (bytenum)
-				byteval[bytenum++] = *(trackimage+offset++);
-			else if (*(trackimage+offset++) == 0xD5)
-				bytenum = 1;
+		// Find the next prologue's $D5 (wrapping around the track), with room for the 2 bytes after it
+		int pos = GCR62_FindNibble(trackimage+offset, nibbles-offset, 0xD5);
+		if (pos >= 0)
+			pos += offset;
+		else
+			pos = GCR62_FindNibble(trackimage, offset, 0xD5);
 
-			if (offset >= nibbles)
-				offset = 0;
-		}
+		if (pos < 0 || ((pos - offset + nibbles) % nibbles) > nibbles-3)
+			break;	// None: the search would keep returning to the same offset, so no more sectors
+
+		const BYTE byteval1 = trackimage[(pos+1) % nibbles];
+		const BYTE byteval2 = trackimage[(pos+2) % nibbles];
+		offset = (pos+3) % nibbles;
 
-		if ((bytenum == 3) && (byteval[1] == 0xAA))
+		if (byteval1 != 0xAA)
+			continue;
+
+		if (byteval2 == 0x96)
 		{
-			int loop       = 0;
-			int tempoffset = offset;
-			while (loop < 384)
-			{
-				*(ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+loop++) = *(trackimage+tempoffset++);
-				if (tempoffset >= nibbles)
-					tempoffset = 0;
-			}
-			
-			if (byteval[2] == 0x96)
-			{
-				sector = ((*(ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+4) & 0x55) << 1)
-						| (*(ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+5) & 0x55);
-			}
-			else if (byteval[2] == 0xAD)
+			sector = ((trackimage[(offset+4) % nibbles] & 0x55) << 1)
+					| (trackimage[(offset+5) % nibbles] & 0x55);
+			sector &= 0x0F;	// A corrupt address field mustn't index beyond ms_SectorNumber[] & the work buffer
+		}
+		else if (byteval2 == 0xAD)
+		{
+			const BYTE* pData = trackimage+offset;
+			BYTE aData[GCR62_NIBBLES];
+			if (offset + GCR62_NIBBLES > nibbles)
 			{
-				Decode62(ms_pWorkBuffer+(ms_SectorNumber[SectorOrder][sector] << 8));
-				sector = 0;
+				int tempoffset = offset;
+				for (int loop = 0; loop < GCR62_NIBBLES; loop++)
+				{
+					aData[loop] = trackimage[tempoffset++];
+					if (tempoffset >= nibbles)
+						tempoffset = 0;
+				}
+				pData = aData;
 			}
+
+			GCR62_Decode(pData, ms_pWorkBuffer+(ms_SectorNumber[SectorOrder][sector] << 8));
+			sector = 0;
 		}
 	}
 }
@@ -464,7 +1887,6 @@ void CImageBase::DenibblizeTrack(LPBYTE trackimage, SectorOrder_e SectorOrder, i
 
 DWORD CImageBase::NibblizeTrack(LPBYTE trackimagebuffer, SectorOrder_e SectorOrder, int track)
 {
-	ZeroMemory(ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE, TRACK_DENIBBLIZED_SIZE);
 	LPBYTE imageptr = trackimagebuffer;
 	BYTE   sector   = 0;
 
@@ -512,8 +1934,8 @@ DWORD CImageBase::NibblizeTrack(LPBYTE trackimagebuffer, SectorOrder_e SectorOrd
 		*(imageptr++) = 0xD5;
 		*(imageptr++) = 0xAA;
 		*(imageptr++) = 0xAD;
-		CopyMemory(imageptr, Code62(ms_SectorNumber[SectorOrder][sector]), 343);
-		imageptr += 343;
+		GCR62_Encode(ms_pWorkBuffer+(ms_SectorNumber[SectorOrder][sector] << 8), imageptr);
+		imageptr += GCR62_NIBBLES;
 		*(imageptr++) = 0xDE;
 		*(imageptr++) = 0xAA;
 		*(imageptr++) = 0xEB;
@@ -622,11 +2044,11 @@ public:
 			SkewTrack(nTrack, *pNibbles, pTrackImageBuffer);
 	}
 
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
 	{
 		ZeroMemory(ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
 		DenibblizeTrack(pTrackImage, eDOSOrder, nNibbles);
-		WriteTrack(pImageInfo, nTrack, ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
+		return WriteTrack(pImageInfo, nTrack, ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
 	}
 
 	virtual bool AllowCreate(void) { return true; }
@@ -689,11 +2111,11 @@ public:
 			SkewTrack(nTrack, *pNibbles, pTrackImageBuffer);
 	}
 
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
 	{
 		ZeroMemory(ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
 		DenibblizeTrack(pTrackImage, eProDOSOrder, nNibbles);
-		WriteTrack(pImageInfo, nTrack, ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
+		return WriteTrack(pImageInfo, nTrack, ms_pWorkBuffer, TRACK_DENIBBLIZED_SIZE);
 	}
 
 	virtual eImageType GetType(void) { return eImagePO; }
@@ -727,10 +2149,10 @@ public:
 		*pNibbles = NIB1_TRACK_SIZE;
 	}
 
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
 	{
 		_ASSERT(nNibbles == NIB1_TRACK_SIZE);	// Must be true - as nNibbles gets init'd by ImageReadTrace()
-		WriteTrack(pImageInfo, nTrack, pTrackImage, nNibbles);
+		return WriteTrack(pImageInfo, nTrack, pTrackImage, nNibbles);
 	}
 
 	virtual bool AllowCreate(void) { return true; }
@@ -767,10 +2189,10 @@ public:
 		*pNibbles = NIB2_TRACK_SIZE;
 	}
 
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
 	{
 		_ASSERT(nNibbles == NIB2_TRACK_SIZE);	// Must be true - as nNibbles gets init'd by ImageReadTrace()
-		WriteTrack(pImageInfo, nTrack, pTrackImage, nNibbles);
+		return WriteTrack(pImageInfo, nTrack, pTrackImage, nNibbles);
 	}
 
 	virtual eImageType GetType(void) { return eImageNIB2; }
@@ -878,9 +2300,10 @@ public:
 		}
 	}
 
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles)
 	{
 		// note: unimplemented
+		return false;
 	}
 
 	virtual eImageType GetType(void) { return eImageIIE; }
@@ -1112,7 +2535,9 @@ bool C2IMGHelper::IsLocked(void)
 
 //-----------------------------------------------------------------------------
 
-// NB. Of the 6 cases (floppy/harddisk x gzip/zip/normal) only harddisk-normal isn't read entirely to memory
+// NB. Of the 6 cases (floppy/harddisk x gzip/zip/normal):
+// - normal files are mapped (or read entirely to memory if that fails)
+// - gzip/zip are decompressed to an exact-size buffer: GetMinDetectSize() bytes now, the rest by an ImageLoader thread
 // - harddisk-normal-create also doesn't create a max size image-buffer
 
 // DETERMINE THE FILE'S EXTENSION AND CONVERT IT TO LOWERCASE
@@ -1147,23 +2572,36 @@ void GetCharLowerExt2(TCHAR* pszExt, LPCTSTR pszImageFilename, const UINT uExtSi
 
 ImageError_e CImageHelperBase::CheckGZipFile(LPCTSTR pszImageFilename, ImageInfo* pImageInfo)
 {
+	// The gzip trailer gives the exact uncompressed size, so only decompress what Detect() needs now
+	UINT uISize = 0;
+	const bool bExactSize = !IsGZipReadAll(pszImageFilename) && GetGZipUncompressedSize(pszImageFilename, uISize);
+	if (bExactSize && uISize > GetMaxImageSize())
+		return eIMAGE_ERROR_BAD_SIZE;
+
 	gzFile hGZFile = gzopen(pszImageFilename, "rb");
 	if (hGZFile == NULL)
 		return eIMAGE_ERROR_UNABLE_TO_OPEN_GZ;
 
+	// Not a (readable) gzip trailer: read it all, as before
 	const UINT MAX_UNCOMPRESSED_SIZE = GetMaxImageSize() + 1;	// +1 to detect images that are too big
-	pImageInfo->pImageBuffer = new BYTE[MAX_UNCOMPRESSED_SIZE];
+	const UINT uBufferSize = bExactSize ? uISize : MAX_UNCOMPRESSED_SIZE;
+
+	bool bTempDetectBuffer;
+	const UINT uReadSize = bExactSize ? MIN(GetMinDetectSize(uISize, &bTempDetectBuffer), uISize) : uBufferSize;
+
+	pImageInfo->pImageBuffer = new BYTE[uBufferSize];
 	if (!pImageInfo->pImageBuffer)
+	{
+		gzclose(hGZFile);
 		return eIMAGE_ERROR_BAD_POINTER;
+	}
 
-	int nLen = gzread(hGZFile, pImageInfo->pImageBuffer, MAX_UNCOMPRESSED_SIZE);
-	if (nLen < 0 || nLen == MAX_UNCOMPRESSED_SIZE)
+	int nLen = gzread(hGZFile, pImageInfo->pImageBuffer, uReadSize);
+	if (nLen < 0 || (bExactSize && (UINT)nLen != uReadSize) || (!bExactSize && (UINT)nLen == MAX_UNCOMPRESSED_SIZE))
+	{
+		gzclose(hGZFile);
 		return eIMAGE_ERROR_BAD_SIZE;
-
-	int nRes = gzclose(hGZFile);
-	hGZFile = NULL;
-	if (nRes != Z_OK)
-		return eIMAGE_ERROR_GZ;
+	}
 
 	//
 
@@ -1171,22 +2609,45 @@ ImageError_e CImageHelperBase::CheckGZipFile(LPCTSTR pszImageFilename, ImageInfo
 	TCHAR szExt[_MAX_EXT] = "";
 	GetCharLowerExt2(szExt, pszImageFilename, _MAX_EXT);
 
-	DWORD dwSize = nLen;
+	DWORD dwSize = bExactSize ? uISize : nLen;
 	DWORD dwOffset = 0;
-	CImageBase* pImageType = Detect(pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
-
-	if (!pImageType)
-		return eIMAGE_ERROR_UNSUPPORTED;
+	CImageBase* pImageType = DetectImage(pszImageFilename, pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
 
-	const eImageType Type = pImageType->GetType();
-	if (Type == eImageAPL || Type == eImageIIE || Type == eImagePRG)
+	const eImageType Type = pImageType ? pImageType->GetType() : eImageUNKNOWN;
+	if (!pImageType || Type == eImageAPL || Type == eImageIIE || Type == eImagePRG)
+	{
+		gzclose(hGZFile);
 		return eIMAGE_ERROR_UNSUPPORTED;
+	}
 
 	pImageInfo->FileType = eFileGZip;
 	pImageInfo->uOffset = dwOffset;
 	pImageInfo->pImageType = pImageType;
 	pImageInfo->uImageSize = dwSize;
 
+	if ((UINT)nLen < pImageInfo->uImageSize)
+	{
+		StartImageLoader(pszImageFilename, pImageInfo, hGZFile, NULL, nLen);	// Takes ownership of hGZFile
+	}
+	else
+	{
+		BYTE extra;
+		if (bExactSize && gzread(hGZFile, &extra, 1) != 0)
+		{
+			// More data than ISIZE (eg. a multi-member .gz): so read it all
+			gzclose(hGZFile);
+			delete [] pImageInfo->pImageBuffer;
+			pImageInfo->pImageBuffer = NULL;
+			g_vecGZipReadAll.push_back(DiskImageIndex_GetKey(pszImageFilename));
+			return CheckGZipFile(pszImageFilename, pImageInfo);
+		}
+
+		int nRes = gzclose(hGZFile);
+		hGZFile = NULL;
+		if (nRes != Z_OK)
+			return eIMAGE_ERROR_GZ;
+	}
+
 	return eIMAGE_ERROR_NONE;
 }
 
@@ -1217,10 +2678,14 @@ ImageError_e CImageHelperBase::CheckZipFile(LPCTSTR pszImageFilename, ImageInfo*
 	if (nRes != UNZ_OK)
 		return eIMAGE_ERROR_ZIP;
 
+	// Exact-size buffer, but only decompress what Detect() needs now
 	const UINT uFileSize = file_info.uncompressed_size;
 	if (uFileSize > GetMaxImageSize())
 		return eIMAGE_ERROR_BAD_SIZE;
 
+	bool bTempDetectBuffer;
+	const UINT uReadSize = MIN(GetMinDetectSize(uFileSize, &bTempDetectBuffer), uFileSize);
+
 	pImageInfo->pImageBuffer = new BYTE[uFileSize];
 	if (!pImageInfo->pImageBuffer)
 		return eIMAGE_ERROR_BAD_POINTER;
@@ -1229,22 +2694,14 @@ ImageError_e CImageHelperBase::CheckZipFile(LPCTSTR pszImageFilename, ImageInfo*
 	if (nRes != UNZ_OK)
 		return eIMAGE_ERROR_ZIP;
 
-	int nLen = unzReadCurrentFile(hZipFile, pImageInfo->pImageBuffer, uFileSize);
-	if (nLen < 0)
+	int nLen = unzReadCurrentFile(hZipFile, pImageInfo->pImageBuffer, uReadSize);
+	if (nLen < 0 || (UINT)nLen != uReadSize)
 	{
 		unzCloseCurrentFile(hZipFile);	// Must CloseCurrentFile before Close
+		unzClose(hZipFile);
 		return eIMAGE_ERROR_UNSUPPORTED;
 	}
 
-	nRes = unzCloseCurrentFile(hZipFile);
-	if (nRes != UNZ_OK)
-		return eIMAGE_ERROR_ZIP;
-
-	nRes = unzClose(hZipFile);
-	hZipFile = NULL;
-	if (nRes != UNZ_OK)
-		return eIMAGE_ERROR_ZIP;
-
 	strncpy(pImageInfo->szFilenameInZip, szFilename, MAX_PATH);
 	memcpy(&pImageInfo->zipFileInfo.tmz_date, &file_info.tmu_date, sizeof(file_info.tmu_date));
 	pImageInfo->zipFileInfo.dosDate     = file_info.dosDate;
@@ -1259,22 +2716,22 @@ ImageError_e CImageHelperBase::CheckZipFile(LPCTSTR pszImageFilename, ImageInfo*
 	TCHAR szExt[_MAX_EXT] = "";
 	GetCharLowerExt(szExt, szFilename, _MAX_EXT);
 
-	DWORD dwSize = nLen;
+	DWORD dwSize = uFileSize;
 	DWORD dwOffset = 0;
-	CImageBase* pImageType = Detect(pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
+	CImageBase* pImageType = DetectImage(pszImageFilename, pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
 
-	if (!pImageType)
+	const eImageType Type = pImageType ? pImageType->GetType() : eImageUNKNOWN;
+	if (!pImageType || Type == eImageAPL || Type == eImageIIE || Type == eImagePRG)
 	{
-		if (global_info.number_entry > 1)
+		unzCloseCurrentFile(hZipFile);
+		unzClose(hZipFile);
+
+		if (!pImageType && global_info.number_entry > 1)
 			return eIMAGE_ERROR_UNSUPPORTED_MULTI_ZIP;
 
 		return eIMAGE_ERROR_UNSUPPORTED;
 	}
 
-	const eImageType Type = pImageType->GetType();
-	if (Type == eImageAPL || Type == eImageIIE || Type == eImagePRG)
-		return eIMAGE_ERROR_UNSUPPORTED;
-
 	if (global_info.number_entry > 1)
 		pImageInfo->bWriteProtected = 1;	// Zip archives with multiple files are read-only (for now)
 
@@ -1283,6 +2740,25 @@ ImageError_e CImageHelperBase::CheckZipFile(LPCTSTR pszImageFilename, ImageInfo*
 	pImageInfo->pImageType = pImageType;
 	pImageInfo->uImageSize = dwSize;
 
+	if ((UINT)nLen < uFileSize)
+	{
+		StartImageLoader(pszImageFilename, pImageInfo, NULL, hZipFile, nLen);	// Takes ownership of hZipFile
+	}
+	else
+	{
+		nRes = unzCloseCurrentFile(hZipFile);
+		if (nRes != UNZ_OK)
+		{
+			unzClose(hZipFile);
+			return eIMAGE_ERROR_ZIP;
+		}
+
+		nRes = unzClose(hZipFile);
+		hZipFile = NULL;
+		if (nRes != UNZ_OK)
+			return eIMAGE_ERROR_ZIP;
+	}
+
 	return eIMAGE_ERROR_NONE;
 }
 
@@ -1294,7 +2770,7 @@ ImageError_e CImageHelperBase::CheckNormalFile(LPCTSTR pszImageFilename, ImageIn
 
 	HANDLE& hFile = pImageInfo->hFile;
 
-	if (!pImageInfo->bWriteProtected)
+	if (!pImageInfo->bWriteProtected && m_OverlayMode == eIMAGE_OVERLAY_OFF)	// Overlay: the image file is only read (until it's committed)
 	{
 		hFile = CreateFile(pszImageFilename,
                       GENERIC_READ | GENERIC_WRITE,
@@ -1311,13 +2787,13 @@ ImageError_e CImageHelperBase::CheckNormalFile(LPCTSTR pszImageFilename, ImageIn
 		hFile = CreateFile(
 			pszImageFilename,
 			GENERIC_READ,
-			FILE_SHARE_READ,
+			m_bShareWrite ? (FILE_SHARE_READ | FILE_SHARE_WRITE) : FILE_SHARE_READ,
 			(LPSECURITY_ATTRIBUTES)NULL,
 			OPEN_EXISTING,
 			FILE_ATTRIBUTE_NORMAL,
 			NULL );
 		
-		if (hFile != INVALID_HANDLE_VALUE)
+		if (hFile != INVALID_HANDLE_VALUE && m_OverlayMode == eIMAGE_OVERLAY_OFF)
 			pImageInfo->bWriteProtected = 1;
 	}
 
@@ -1345,31 +2821,38 @@ ImageError_e CImageHelperBase::CheckNormalFile(LPCTSTR pszImageFilename, ImageIn
 
 	if (dwSize > 0)
 	{
-		if (dwSize > GetMaxImageSize())
+		if (dwSize > GetMaxNormalImageSize())
 			return eIMAGE_ERROR_BAD_SIZE;
 
 		bool bTempDetectBuffer;
 		const UINT uDetectSize = GetMinDetectSize(dwSize, &bTempDetectBuffer);
 
-		pImageInfo->pImageBuffer = new BYTE [dwSize];
-		if (!pImageInfo->pImageBuffer)
-			return eIMAGE_ERROR_BAD_POINTER;
+		if (IsImageFileMappable(pszImageFilename))
+			pImageInfo->pImageBuffer = MapImageFile(pImageInfo, dwSize);
 
-		DWORD dwBytesRead;
-		BOOL bRes = ReadFile(hFile, pImageInfo->pImageBuffer, dwSize, &dwBytesRead, NULL);
-		if (!bRes || dwSize != dwBytesRead)
+		if (!pImageInfo->pImageBuffer)
 		{
-			delete [] pImageInfo->pImageBuffer;
-			pImageInfo->pImageBuffer = NULL;
-			return eIMAGE_ERROR_BAD_SIZE;
-		}
+			// Not mapped (eg. on a network share, or out of address space): fall back to reading the file
+			// . Just what's needed for detection, if the buffer isn't kept (so all of an HDD image's blocks are read by ReadFile())
+			const UINT uReadSize = bTempDetectBuffer ? MIN(uDetectSize, dwSize) : dwSize;
+			pImageInfo->pImageBuffer = new BYTE [uReadSize];
+			if (!pImageInfo->pImageBuffer)
+				return eIMAGE_ERROR_BAD_POINTER;
 
-		pImageType = Detect(pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
-		if (bTempDetectBuffer)
-		{
-			delete [] pImageInfo->pImageBuffer;
-			pImageInfo->pImageBuffer = NULL;
+			DWORD dwBytesRead;
+			BOOL bRes = ReadFile(hFile, pImageInfo->pImageBuffer, uReadSize, &dwBytesRead, NULL);
+			if (!bRes || uReadSize != dwBytesRead)
+			{
+				FreeImageBuffer(pImageInfo);
+				return eIMAGE_ERROR_BAD_SIZE;
+			}
 		}
+
+		pImageType = DetectImage(pszImageFilename, pImageInfo->pImageBuffer, dwSize, szExt, dwOffset, &pImageInfo->bWriteProtected);
+
+		// A view costs nothing to keep, and makes HDD block reads a memcpy(); but don't keep a heap copy of a large HDD image
+		if (bTempDetectBuffer && !pImageInfo->hMapping)
+			FreeImageBuffer(pImageInfo);
 	}
 	else	// Create (or pre-existing zero-length file)
 	{
@@ -1388,6 +2871,7 @@ ImageError_e CImageHelperBase::CheckNormalFile(LPCTSTR pszImageFilename, ImageIn
 
 	if (!pImageType)
 	{
+		FreeImageBuffer(pImageInfo);
 		CloseHandle(hFile);
 		hFile = INVALID_HANDLE_VALUE;
 
@@ -1417,7 +2901,11 @@ ImageError_e CImageHelperBase::Open(	LPCTSTR pszImageFilename,
 	ImageError_e Err;
     const size_t uStrLen = strlen(pszImageFilename);
 
-    if (uStrLen > GZ_SUFFIX_LEN && strcmp(pszImageFilename+uStrLen-GZ_SUFFIX_LEN, GZ_SUFFIX) == 0)
+	if (OpenCachedImage(pszImageFilename, pImageInfo, strFilenameInZip))
+	{
+		Err = eIMAGE_ERROR_NONE;
+	}
+    else if (uStrLen > GZ_SUFFIX_LEN && strcmp(pszImageFilename+uStrLen-GZ_SUFFIX_LEN, GZ_SUFFIX) == 0)
 	{
 		Err = CheckGZipFile(pszImageFilename, pImageInfo);
 	}
@@ -1436,6 +2924,14 @@ ImageError_e CImageHelperBase::Open(	LPCTSTR pszImageFilename,
 	if (Err != eIMAGE_ERROR_NONE)
 		return Err;
 
+	if (!pImageInfo->pCacheEntry)
+		AddToImageCache(pszImageFilename, pImageInfo);
+
+	if (m_OverlayMode != eIMAGE_OVERLAY_OFF)
+		Overlay_Create(pImageInfo, m_OverlayMode);
+	else if (pImageInfo->FileType != eFileNormal)
+		Recompress_Create(pImageInfo);
+
 	DWORD uNameLen = GetFullPathName(pszImageFilename, MAX_PATH, pImageInfo->szFilename, NULL);
 	if (uNameLen == 0 || uNameLen >= MAX_PATH)
 		Err = eIMAGE_ERROR_FAILED_TO_GET_PATHNAME;
@@ -1445,8 +2941,27 @@ ImageError_e CImageHelperBase::Open(	LPCTSTR pszImageFilename,
 
 //-------------------------------------
 
+LPBYTE CImageHelperBase::GetImageBuffer(ImageInfo* pImageInfo)
+{
+	WaitForImageData(pImageInfo, pImageInfo->uImageSize);
+	return pImageInfo->pImageBuffer;
+}
+
+//-------------------------------------
+
 void CImageHelperBase::Close(ImageInfo* pImageInfo, const bool bDeleteFile)
 {
+	BlockCache_Destroy(pImageInfo);	// Before the loader is stopped, as a gzip/zip needs all its data to be recompressed
+	if (!bDeleteFile)
+		Overlay_CommitBuffer(pImageInfo);
+	Recompress_Close(pImageInfo, !bDeleteFile);
+
+	// Before freeing the buffer it's decompressing into
+	// . NB. a buffer with discarded writes isn't complete, ie. it mustn't be kept by the image cache
+	const bool bBufferComplete = StopImageLoader(pImageInfo) && !Overlay_HasUncommittedBuffer(pImageInfo);
+	DetachFromImageCache(pImageInfo, bBufferComplete, bDeleteFile);
+	FreeImageBuffer(pImageInfo);	// Unmap before closing (or deleting) the file
+
 	if (pImageInfo->hFile != INVALID_HANDLE_VALUE)
 	{
 		CloseHandle(pImageInfo->hFile);
@@ -1458,10 +2973,232 @@ void CImageHelperBase::Close(ImageInfo* pImageInfo, const bool bDeleteFile)
 		DeleteFile(pImageInfo->szFilename);
 	}
 
+	Overlay_Destroy(pImageInfo, !bDeleteFile);	// Before the image cache entry is re-stamped, as a commit changes the file
+	ReleaseImageCacheEntry(pImageInfo);
+
 	pImageInfo->szFilename[0] = 0;
+}
 
-	delete [] pImageInfo->pImageBuffer;
-	pImageInfo->pImageBuffer = NULL;
+//-------------------------------------
+
+CImageBase* CImageHelperBase::DetectImage(LPCTSTR pszImageFilename, LPBYTE pImage, DWORD dwSize, const TCHAR* pszExt, DWORD& dwOffset, bool* pWriteProtected_)
+{
+	CImageBase* pImageType = GetCachedImage(pszImageFilename, dwSize, dwOffset, pWriteProtected_);
+	if (!pImageType)
+		pImageType = GetIndexedImage(pszImageFilename, dwSize, dwOffset, pWriteProtected_);
+	if (pImageType)
+		return pImageType;
+
+	pImageType = Detect(pImage, dwSize, pszExt, dwOffset, pWriteProtected_);
+	m_bImageLocked = (m_Result2IMG == eMatch) && m_2IMGHelper.IsLocked();
+	return pImageType;
+}
+
+//-------------------------------------
+
+CImageBase* CImageHelperBase::GetCachedImage(LPCTSTR pszImageFilename, DWORD dwSize, DWORD& dwOffset, bool* pWriteProtected_)
+{
+	if (!m_bImageCache)
+		return NULL;
+
+	CImageBase* pImageType = NULL;
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+
+	ImageCacheEntry* pEntry = LookupImageCache(this, pszImageFilename);
+	if (pEntry && pEntry->uImageSize == dwSize)
+	{
+		ApplyImageCacheEntry(pEntry, pWriteProtected_);
+		m_bImageLocked = pEntry->bLocked;
+		dwOffset = pEntry->uOffset;
+		pImageType = pEntry->pImageType;
+		g_uImageCacheDetectHits++;
+	}
+
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+
+	return pImageType;
+}
+
+// A gzip/zip image whose decompressed buffer is cached: no file access at all
+bool CImageHelperBase::OpenCachedImage(LPCTSTR pszImageFilename, ImageInfo* pImageInfo, std::string& strFilenameInZip)
+{
+	if (!m_bImageCache)
+		return false;
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+
+	ImageCacheEntry* pEntry = LookupImageCache(this, pszImageFilename);
+	const bool bHit = pEntry && pEntry->pBuffer;
+	if (bHit)
+	{
+		ApplyImageCacheEntry(pEntry, &pImageInfo->bWriteProtected);
+		m_bImageLocked = pEntry->bLocked;
+
+		pImageInfo->FileType = pEntry->FileType;
+		pImageInfo->uOffset = pEntry->uOffset;
+		pImageInfo->pImageType = pEntry->pImageType;
+		pImageInfo->uImageSize = pEntry->uImageSize;
+		pImageInfo->pImageBuffer = pEntry->pBuffer;
+		pImageInfo->bCachedBuffer = true;
+
+		if (pEntry->FileType == eFileZip)
+		{
+			strncpy(pImageInfo->szFilenameInZip, pEntry->szFilenameInZip, MAX_PATH);
+			pImageInfo->zipFileInfo = pEntry->zipFileInfo;
+			pImageInfo->uNumEntriesInZip = pEntry->uNumEntriesInZip;
+			strFilenameInZip = pEntry->szFilenameInZip;
+
+			if (pEntry->uNumEntriesInZip > 1)
+				pImageInfo->bWriteProtected = 1;	// Zip archives with multiple files are read-only (for now)
+		}
+
+		pEntry->uRefCount++;
+		pEntry->uBufferUsers++;
+		pImageInfo->pCacheEntry = pEntry;
+		g_uImageCacheHits++;
+	}
+
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+
+	return bHit;
+}
+
+// After opening an image that wasn't cached (or only its detection results were)
+void CImageHelperBase::AddToImageCache(LPCTSTR pszImageFilename, ImageInfo* pImageInfo)
+{
+	if (!m_bImageCache)
+		return;
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+
+	ImageCacheEntry* pEntry = LookupImageCache(this, pszImageFilename);
+	if (!pEntry)
+	{
+		pEntry = new ImageCacheEntry;
+		pEntry->pHelper = this;
+		pEntry->strKey = DiskImageIndex_GetKey(pszImageFilename);
+		pEntry->uFileSize = 0;
+		pEntry->uLastWriteTime = 0;		// Set on close
+
+		pEntry->pImageType = pImageInfo->pImageType;
+		pEntry->uNumTracks = pImageInfo->pImageType->m_uNumTracksInImage;
+		pEntry->VolumeNumber = pImageInfo->pImageType->GetVolumeNumber();
+		pEntry->bLocked = m_bImageLocked;
+		pEntry->FileType = pImageInfo->FileType;
+		pEntry->uOffset = pImageInfo->uOffset;
+		pEntry->uImageSize = pImageInfo->uImageSize;
+		strncpy(pEntry->szFilenameInZip, pImageInfo->szFilenameInZip, MAX_PATH);
+		pEntry->zipFileInfo = pImageInfo->zipFileInfo;
+		pEntry->uNumEntriesInZip = pImageInfo->uNumEntriesInZip;
+
+		pEntry->pBuffer = NULL;
+		pEntry->uRefCount = 0;
+		pEntry->uBufferUsers = 0;
+		pEntry->bStale = false;
+
+		g_vecImageCache.insert(g_vecImageCache.begin(), pEntry);
+		g_uImageCacheMisses++;
+	}
+
+	pEntry->uRefCount++;
+	pImageInfo->pCacheEntry = pEntry;
+
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
+
+//-------------------------------------
+
+void CImageHelperBase::EnableImageCache(const bool bEnable)
+{
+	InitImageCache();
+	m_bImageCache = bEnable;
+}
+
+void CImageHelperBase::SetOverlayMode(const ImageOverlay_e Mode)
+{
+	m_OverlayMode = Mode;
+}
+
+// Startup: delete the delta files of sessions that didn't exit cleanly
+// . A running session's delta files are open without sharing, so can't be deleted
+// . Kept delta files (that failed to commit) have been renamed, so aren't matched
+void CImageHelperBase::DeleteOrphanedOverlays(void)
+{
+	TCHAR szTempPath[MAX_PATH];
+	if (!GetTempPath(MAX_PATH, szTempPath))
+		return;
+
+	const std::string strTempPath(szTempPath);
+
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = FindFirstFile((strTempPath + kOverlayDeltaPrefix + "*.tmp").c_str(), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	UINT uDeleted = 0;
+	do
+	{
+		if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && DeleteFile((strTempPath + findData.cFileName).c_str()))
+			uDeleted++;
+	}
+	while (FindNextFile(hFind, &findData));
+
+	FindClose(hFind);
+
+	if (uDeleted)
+		LogFileOutput("Overlay: deleted %u orphaned delta files from: %s\n", uDeleted, szTempPath);
+}
+
+void CImageHelperBase::SetImageCacheBudget(const UINT uBytes)
+{
+	InitImageCache();
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+	g_uImageCacheBudget = uBytes;
+	TrimImageCache();
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
+
+void CImageHelperBase::GetImageCacheStats(ImageCacheStats_t& stats)
+{
+	InitImageCache();
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+	stats.uHits = g_uImageCacheHits;
+	stats.uDetectHits = g_uImageCacheDetectHits;
+	stats.uMisses = g_uImageCacheMisses;
+	stats.uEvictions = g_uImageCacheEvictions;
+	stats.uEntries = g_vecImageCache.size();
+	stats.uBytes = g_uImageCacheBytes;
+	stats.uBudget = g_uImageCacheBudget;
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
+
+void CImageHelperBase::ResetImageCacheStats(void)
+{
+	InitImageCache();
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+	g_uImageCacheHits = 0;
+	g_uImageCacheDetectHits = 0;
+	g_uImageCacheMisses = 0;
+	g_uImageCacheEvictions = 0;
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
+}
+
+void CImageHelperBase::DestroyImageCache(void)
+{
+	if (!g_bImageCacheInit)
+		return;
+
+	LogImageCacheStats();
+
+	EnterCriticalSection(&g_ImageCacheCriticalSection);
+	for (UINT i=0; i<g_vecImageCache.size(); i++)
+		g_vecImageCache[i]->bStale = true;
+	TrimImageCache();	// NB. Any entries still in use are leaked (ie. images still open at exit)
+	LeaveCriticalSection(&g_ImageCacheCriticalSection);
 }
 
 //-----------------------------------------------------------------------------
@@ -1550,6 +3287,33 @@ CImageBase* CDiskImageHelper::Detect(LPBYTE pImage, DWORD dwSize, const TCHAR* p
 	return pImageType;
 }
 
+// Apply an index entry as Detect() would have
+CImageBase* CDiskImageHelper::GetIndexedImage(LPCTSTR pszImageFilename, DWORD dwSize, DWORD& dwOffset, bool* pWriteProtected_)
+{
+	DiskImageIndexEntry entry;
+	if (!DiskImageIndex_Lookup(pszImageFilename, entry))
+		return NULL;
+
+	if (entry.dwImageSize != dwSize || entry.Type == eImageUNKNOWN || entry.Type > eImagePRG)
+		return NULL;
+
+	CImageBase* pImageType = GetImage((eImageType)entry.Type);
+	if (!pImageType)
+		return NULL;
+
+	if (pImageType->AllowRW())
+		SetNumTracksInImage(pImageType, entry.NumTracks ? entry.NumTracks : TRACKS_STANDARD);
+
+	pImageType->SetVolumeNumber(entry.VolumeNumber);
+
+	m_bImageLocked = (entry.Flags & DISKIMAGEINDEX_LOCKED) ? true : false;
+	if (m_bImageLocked && !*pWriteProtected_)
+		*pWriteProtected_ = 1;
+
+	dwOffset = entry.dwOffset;
+	return pImageType;
+}
+
 CImageBase* CDiskImageHelper::GetImageForCreation(const TCHAR* pszExt, DWORD* pCreateImageSize)
 {
 	// WE CREATE ONLY DOS ORDER (DO) OR 6656-NIBBLE (NIB) FORMAT FILES
@@ -1583,7 +3347,10 @@ UINT CDiskImageHelper::GetMaxImageSize(void)
 UINT CDiskImageHelper::GetMinDetectSize(const UINT uImageSize, bool* pTempDetectBuffer)
 {
 	*pTempDetectBuffer = false;
-	return uImageSize;
+
+	// The DO/PO detection looks no further than track $11 (the DOS catalog track), and the other images only at their header or size
+	const UINT uDetectSize = m_MacBinaryHelper.GetMaxHdrSize() + m_2IMGHelper.GetMaxHdrSize() + (0x11+1) * TRACK_DENIBBLIZED_SIZE;
+	return MIN(uImageSize, uDetectSize);
 }
 
 //-----------------------------------------------------------------------------
@@ -1658,6 +3425,11 @@ UINT CHardDiskImageHelper::GetMaxImageSize(void)
 	return HARDDISK_32M_SIZE + m_2IMGHelper.GetMaxHdrSize();
 }
 
+UINT CHardDiskImageHelper::GetMaxNormalImageSize(void)
+{
+	return HARDDISK_MAX_SIZE + m_2IMGHelper.GetMaxHdrSize();
+}
+
 UINT CHardDiskImageHelper::GetMinDetectSize(const UINT uImageSize, bool* pTempDetectBuffer)
 {
 	*pTempDetectBuffer = true;
@@ -14,6 +14,12 @@ enum eDetectResult {eMismatch, ePossibleMatch, eMatch};
 
 class CImageBase;
 class CImageHelperBase;
+struct ImageLoader;
+struct ImageCacheEntry;
+struct BlockCache;
+struct ImageOverlay;
+struct ImageRecompress;
+struct ImageWindows;
 
 enum FileType_e {eFileNormal, eFileGZip, eFileZip};
 
@@ -34,6 +40,21 @@ struct ImageInfo
 	BYTE			ValidTrack[TRACKS_MAX];
 	UINT			uNumTracks;
 	BYTE*			pImageBuffer;
+	// Normal files: pImageBuffer is a copy-on-write view of the file
+	HANDLE			hMapping;		// NULL if pImageBuffer is a heap buffer
+	UINT			uMappedSize;	// Size of the view (an HDD image can grow beyond it)
+	ImageWindows*	pWindows;		// HDD only: the other views of an image bigger than the 1st (NULL if it isn't)
+	// GZip/Zip files: the rest of pImageBuffer is still being decompressed (NULL if it was all read when opened)
+	ImageLoader*	pLoader;
+	// Image cache (see CImageHelperBase::Open() & Close())
+	ImageCacheEntry* pCacheEntry;
+	bool			bCachedBuffer;	// pImageBuffer is shared with the image cache, so is copied before the first write
+	// HDD only: block cache (see CImageBase::ReadBlock() & WriteBlock())
+	BlockCache*		pBlockCache;	// NULL if disabled
+	// Copy-on-write overlay (see CImageHelperBase::SetOverlayMode())
+	ImageOverlay*	pOverlay;		// NULL if disabled
+	// GZip/Zip only: deferred recompression (see WriteCompressedImage())
+	ImageRecompress* pRecompress;
 };
 
 //-------------------------------------
@@ -42,9 +63,17 @@ struct ImageInfo
 
 #define UNIDISK35_800K_SIZE (800*1024)	// UniDisk 3.5"
 #define HARDDISK_32M_SIZE (HD_BLOCK_SIZE * 65536)
+#define HARDDISK_MAX_SIZE (HARDDISK_32M_SIZE * 63)	// A normal file split into 32MB partitions (< 2GB, as file offsets are signed 32-bit)
 
 #define DEFAULT_VOLUME_NUMBER 254
 
+// HDD block cache
+void BlockCache_SetSize(const UINT uBytes);			// Per image (0 = off, ie. write-through)
+void BlockCache_Create(ImageInfo* pImageInfo);		// After the image is opened
+void BlockCache_Destroy(ImageInfo* pImageInfo);		// Writes back any dirty blocks
+bool BlockCache_Flush(ImageInfo* pImageInfo);		// Writes back any dirty blocks
+UINT BlockCache_GetImageSize(ImageInfo* pImageInfo);	// Incl. appended blocks not yet written back
+
 class CImageBase
 {
 public:
@@ -55,7 +84,7 @@ public:
 	virtual eDetectResult Detect(const LPBYTE pImage, const DWORD dwImageSize, const TCHAR* pszExt) = 0;
 	virtual void Read(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImageBuffer, int* pNibbles) { }
 	virtual bool Read(ImageInfo* pImageInfo, UINT nBlock, LPBYTE pBlockBuffer) { return false; }
-	virtual void Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles) { }
+	virtual bool Write(ImageInfo* pImageInfo, int nTrack, int nQuarterTrack, LPBYTE pTrackImage, int nNibbles) { return false; }
 	virtual bool Write(ImageInfo* pImageInfo, UINT nBlock, LPBYTE pBlockBuffer) { return false; }
 
 	virtual bool AllowBoot(void) { return false; }		// Only:    APL and PRG
@@ -68,6 +97,7 @@ public:
 	virtual char* GetRejectExtensions(void) = 0;
 
 	void SetVolumeNumber(const BYTE uVolumeNumber) { m_uVolumeNumber = uVolumeNumber; }
+	BYTE GetVolumeNumber(void) { return m_uVolumeNumber; }
 	bool IsValidImageSize(const DWORD uImageSize);
 
 	enum SectorOrder_e {eProDOSOrder, eDOSOrder, eSIMSYSTEMOrder, NUM_SECTOR_ORDERS};
@@ -78,8 +108,6 @@ protected:
 	bool ReadBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer);
 	bool WriteBlock(ImageInfo* pImageInfo, const int nBlock, LPBYTE pBlockBuffer);
 
-	LPBYTE Code62(int sector);
-	void Decode62(LPBYTE imageptr);
 	void DenibblizeTrack (LPBYTE trackimage, SectorOrder_e SectorOrder, int nibbles);
 	DWORD NibblizeTrack (LPBYTE trackimagebuffer, SectorOrder_e SectorOrder, int track);
 	void SkewTrack (const int nTrack, const int nNumNibbles, const LPBYTE pTrackImageBuffer);
@@ -89,7 +117,6 @@ public:
 	UINT m_uNumTracksInImage;	// Init'd by CDiskImageHelper.Detect()/GetImageForCreation() & possibly updated by IsValidImageSize()
 
 protected:
-	static BYTE ms_DiskByte[0x40];
 	static BYTE ms_SectorNumber[NUM_SECTOR_ORDERS][0x10];
 	BYTE m_uVolumeNumber;
 };
@@ -189,7 +216,11 @@ class CImageHelperBase
 public:
 	CImageHelperBase(const bool bIsFloppy) :
 		m_2IMGHelper(bIsFloppy),
-		m_Result2IMG(eMismatch)
+		m_Result2IMG(eMismatch),
+		m_bImageLocked(false),
+		m_bImageCache(false),
+		m_bShareWrite(false),
+		m_OverlayMode(eIMAGE_OVERLAY_OFF)
 	{
 	}
 	virtual ~CImageHelperBase(void)
@@ -204,9 +235,35 @@ public:
 	virtual CImageBase* Detect(LPBYTE pImage, DWORD dwSize, const TCHAR* pszExt, DWORD& dwOffset, bool* pWriteProtected_) = 0;
 	virtual CImageBase* GetImageForCreation(const TCHAR* pszExt, DWORD* pCreateImageSize) = 0;
 	virtual UINT GetMaxImageSize(void) = 0;
+	virtual UINT GetMaxNormalImageSize(void) { return GetMaxImageSize(); }	// A normal file is mapped, rather than read into memory, so can be bigger
 	virtual UINT GetMinDetectSize(const UINT uImageSize, bool* pTempDetectBuffer) = 0;
 
+	LPBYTE GetImageBuffer(ImageInfo* pImageInfo);	// Waits for any background decompression
+	bool IsImageLocked(void) { return m_bImageLocked; }	// After Open(): 2IMG header's locked flag
+
+	// Process-wide LRU of opened images' detection results & (gzip/zip) decompressed buffers
+	void EnableImageCache(const bool bEnable);
+	static void SetImageCacheBudget(const UINT uBytes);
+	static void DestroyImageCache(void);
+	static void GetImageCacheStats(ImageCacheStats_t& stats);
+	static void ResetImageCacheStats(void);
+
+	// GZip/Zip: writes are recompressed by a background thread, once they go quiet
+	static void StopRecompressThread(void);
+
+	// Overlay: the image file is opened read-only, and writes go to a temporary delta file, which is committed or discarded on Close()
+	void SetOverlayMode(const ImageOverlay_e Mode);
+	static void DeleteOrphanedOverlays(void);
+
+	// Let others open the image file read/write while it's open read-only (eg. so a DiskImageIndex scan doesn't stop the emulator)
+	void SetShareWrite(const bool bShareWrite) { m_bShareWrite = bShareWrite; }
+
 protected:
+	// Detection results from the image cache, else the DiskImageIndex, else Detect()
+	CImageBase* DetectImage(LPCTSTR pszImageFilename, LPBYTE pImage, DWORD dwSize, const TCHAR* pszExt, DWORD& dwOffset, bool* pWriteProtected_);
+	// Detection results from the DiskImageIndex (NULL if not indexed)
+	virtual CImageBase* GetIndexedImage(LPCTSTR pszImageFilename, DWORD dwSize, DWORD& dwOffset, bool* pWriteProtected_) { return NULL; }
+
 	ImageError_e CheckGZipFile(LPCTSTR pszImageFilename, ImageInfo* pImageInfo);
 	ImageError_e CheckZipFile(LPCTSTR pszImageFilename, ImageInfo* pImageInfo, std::string& strFilenameInZip);
 	ImageError_e CheckNormalFile(LPCTSTR pszImageFilename, ImageInfo* pImageInfo, const bool bCreateIfNecessary);
@@ -226,12 +283,23 @@ protected:
 		return NULL;
 	}
 
+private:
+	CImageBase* GetCachedImage(LPCTSTR pszImageFilename, DWORD dwSize, DWORD& dwOffset, bool* pWriteProtected_);
+	bool OpenCachedImage(LPCTSTR pszImageFilename, ImageInfo* pImageInfo, std::string& strFilenameInZip);
+	void AddToImageCache(LPCTSTR pszImageFilename, ImageInfo* pImageInfo);
+
 protected:
 	typedef std::vector<CImageBase*> VECIMAGETYPE;
 	VECIMAGETYPE m_vecImageTypes;
 
 	C2IMGHelper m_2IMGHelper;
 	eDetectResult m_Result2IMG;
+	bool m_bImageLocked;
+
+private:
+	bool m_bImageCache;
+	bool m_bShareWrite;
+	ImageOverlay_e m_OverlayMode;
 };
 
 //-------------------------------------
@@ -253,6 +321,9 @@ public:
 	LPBYTE GetWorkBuffer(void) { return CImageBase::ms_pWorkBuffer; }
 	void SetWorkBuffer(LPBYTE pBuffer) { CImageBase::ms_pWorkBuffer = pBuffer; }
 
+protected:
+	virtual CImageBase* GetIndexedImage(LPCTSTR pszImageFilename, DWORD dwSize, DWORD& dwOffset, bool* pWriteProtected_);
+
 private:
 	void SkipMacBinaryHdr(LPBYTE& pImage, DWORD& dwSize, DWORD& dwOffset);
 
@@ -271,5 +342,10 @@ public:
 	virtual CImageBase* Detect(LPBYTE pImage, DWORD dwSize, const TCHAR* pszExt, DWORD& dwOffset, bool* pWriteProtected_);
 	virtual CImageBase* GetImageForCreation(const TCHAR* pszExt, DWORD* pCreateImageSize);
 	virtual UINT GetMaxImageSize(void);
+	virtual UINT GetMaxNormalImageSize(void);
 	virtual UINT GetMinDetectSize(const UINT uImageSize, bool* pTempDetectBuffer);
 };
+
+//-------------------------------------
+
+void GetCharLowerExt(TCHAR* pszExt, LPCTSTR pszImageFilename, const UINT uExtSize);
@@ -0,0 +1,444 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2017, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: Disk image library index
+ *
+ * Maps a (lowercase, full) pathname to the floppy helper's detection results for that file,
+ * valid while the file's size & last-write time are unchanged.
+ *
+ * DiskImageIndex_Scan() walks a directory tree on a background thread, and indexes each new or changed
+ * image on a pool of worker threads (each with its own CDiskImageHelper, as Detect() isn't thread-safe).
+ *
+ * The index is loaded from & saved to DiskImageIndex.dat in the program directory.
+ */
+
+#include "StdAfx.h"
+
+#include "Applewin.h"
+#include "DiskImage.h"
+#include "DiskImageHelper.h"
+#include "DiskImageIndex.h"
+#include "Log.h"
+
+#include "zlib.h"
+
+static const UINT32 kIndexMagic = 'xdIA';	// 'AIdx'
+static const UINT32 kIndexVersion = 1;
+static const TCHAR kIndexFilename[] = TEXT("DiskImageIndex.dat");
+static const UINT kMaxScanThreads = 8;
+
+typedef std::map<std::string, DiskImageIndexEntry> DiskImageIndexMap;
+
+static DiskImageIndexMap g_Index;
+static bool g_bIndexDirty = false;
+static bool g_bIndexInit = false;
+static CRITICAL_SECTION g_IndexCriticalSection;
+
+static HANDLE g_hScanThread = NULL;
+static volatile bool g_bScanAbort = false;
+static std::string g_strScanDirectory;
+
+// Scan work list (shared by the worker threads)
+static std::vector<std::string> g_vecScanFiles;
+static volatile LONG g_nScanNext = 0;
+
+//===========================================================================
+
+std::string DiskImageIndex_GetKey(LPCTSTR pszPathname)
+{
+	TCHAR szFullPathname[MAX_PATH];
+	DWORD uNameLen = GetFullPathName(pszPathname, MAX_PATH, szFullPathname, NULL);
+	if (uNameLen == 0 || uNameLen >= MAX_PATH)
+		return std::string();
+
+	CharLowerBuff(szFullPathname, uNameLen);
+	return std::string(szFullPathname);
+}
+
+bool DiskImageIndex_GetFileStamp(LPCTSTR pszPathname, UINT64& uFileSize, UINT64& uLastWriteTime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (!GetFileAttributesEx(pszPathname, GetFileExInfoStandard, &attr))
+		return false;
+
+	uFileSize = ((UINT64)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	uLastWriteTime = ((UINT64)attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+
+static std::string GetIndexPathname(void)
+{
+	return std::string(g_sProgramDir) + kIndexFilename;
+}
+
+//===========================================================================
+
+static void LoadIndex(void)
+{
+	FILE* hFile = fopen(GetIndexPathname().c_str(), "rb");
+	if (!hFile)
+		return;
+
+	UINT32 hdr[3];	// Magic, version, #entries
+	if (fread(hdr, sizeof(hdr), 1, hFile) == 1 && hdr[0] == kIndexMagic && hdr[1] == kIndexVersion)
+	{
+		for (UINT32 i=0; i<hdr[2]; i++)
+		{
+			UINT16 uLen;
+			char szKey[MAX_PATH];
+			DiskImageIndexEntry entry;
+
+			if (fread(&uLen, sizeof(uLen), 1, hFile) != 1 || uLen == 0 || uLen >= MAX_PATH)
+				break;
+			if (fread(szKey, uLen, 1, hFile) != 1 || fread(&entry, sizeof(entry), 1, hFile) != 1)
+				break;
+
+			szKey[uLen] = 0;
+			entry.szVolumeName[sizeof(entry.szVolumeName)-1] = 0;
+			g_Index[szKey] = entry;
+		}
+	}
+
+	fclose(hFile);
+	LogFileOutput("DiskImageIndex: loaded %u entries\n", (UINT)g_Index.size());
+}
+
+// Pre: g_IndexCriticalSection held
+static void SaveIndex(void)
+{
+	if (!g_bIndexDirty)
+		return;
+
+	FILE* hFile = fopen(GetIndexPathname().c_str(), "wb");
+	if (!hFile)
+		return;
+
+	UINT32 hdr[3] = {kIndexMagic, kIndexVersion, (UINT32)g_Index.size()};
+	fwrite(hdr, sizeof(hdr), 1, hFile);
+
+	for (DiskImageIndexMap::const_iterator it = g_Index.begin(); it != g_Index.end(); ++it)
+	{
+		UINT16 uLen = (UINT16) it->first.size();
+		fwrite(&uLen, sizeof(uLen), 1, hFile);
+		fwrite(it->first.c_str(), uLen, 1, hFile);
+		fwrite(&it->second, sizeof(it->second), 1, hFile);
+	}
+
+	fclose(hFile);
+	g_bIndexDirty = false;
+	LogFileOutput("DiskImageIndex: saved %u entries\n", (UINT)g_Index.size());
+}
+
+//===========================================================================
+
+bool DiskImageIndex_Lookup(LPCTSTR pszPathname, DiskImageIndexEntry& entry)
+{
+	if (!g_bIndexInit)
+		return false;
+
+	UINT64 uFileSize, uLastWriteTime;
+	if (!DiskImageIndex_GetFileStamp(pszPathname, uFileSize, uLastWriteTime))
+		return false;
+
+	const std::string strKey = DiskImageIndex_GetKey(pszPathname);
+
+	EnterCriticalSection(&g_IndexCriticalSection);
+	DiskImageIndexMap::const_iterator it = g_Index.find(strKey);
+	const bool bFound = it != g_Index.end() && it->second.uFileSize == uFileSize && it->second.uLastWriteTime == uLastWriteTime;
+	if (bFound)
+		entry = it->second;
+	LeaveCriticalSection(&g_IndexCriticalSection);
+
+	return bFound;
+}
+
+//===========================================================================
+
+// ProDOS volume directory header (block 2), else a DOS 3.3 VTOC (track $11, sector 0)
+static void GetVolumeName(const BYTE* pImage, const UINT uSize, const eImageType Type, char* pszVolumeName, const UINT uMaxLen)
+{
+	pszVolumeName[0] = 0;
+
+	const UINT uBlock2 = (Type == eImagePO) ? 0x400 : 0xB00;	// DOS order: block 2 is logical sector $B
+	if ((Type == eImageDO || Type == eImagePO) && uSize >= uBlock2+0x100 && (pImage[uBlock2+4] >> 4) == 0xF)
+	{
+		const UINT uLen = MIN(pImage[uBlock2+4] & 0x0F, uMaxLen-1);
+		memcpy(pszVolumeName, &pImage[uBlock2+5], uLen);
+		pszVolumeName[uLen] = 0;
+		return;
+	}
+
+	const UINT uVTOC = 0x11 * TRACK_DENIBBLIZED_SIZE;
+	if ((Type == eImageDO || Type == eImagePO) && uSize >= uVTOC+0x100 && pImage[uVTOC+1] == 0x11 && pImage[uVTOC+3] == 3)
+		_snprintf(pszVolumeName, uMaxLen-1, "DOS 3.3 V%03u", pImage[uVTOC+6]);
+
+	pszVolumeName[uMaxLen-1] = 0;
+}
+
+static void IndexImage(CDiskImageHelper& helper, const std::string& strPathname)
+{
+	DiskImageIndexEntry entry;
+	memset(&entry, 0, sizeof(entry));
+
+	LPCTSTR pszPathname = strPathname.c_str();
+	if (!DiskImageIndex_GetFileStamp(pszPathname, entry.uFileSize, entry.uLastWriteTime))
+		return;
+
+	if (GetFileAttributes(pszPathname) & FILE_ATTRIBUTE_READONLY)
+		entry.Flags |= DISKIMAGEINDEX_READONLY;
+
+	ImageInfo imageInfo;
+	ZeroMemory(&imageInfo, sizeof(imageInfo));
+	imageInfo.bWriteProtected = true;	// Open read-only, so as not to stop the emulator opening it read/write
+	imageInfo.pImageHelper = &helper;
+
+	std::string strFilenameInZip;
+	ImageError_e Err = helper.Open(pszPathname, &imageInfo, false, strFilenameInZip);
+	if (Err == eIMAGE_ERROR_UNABLE_TO_OPEN || Err == eIMAGE_ERROR_UNABLE_TO_OPEN_GZ || Err == eIMAGE_ERROR_UNABLE_TO_OPEN_ZIP ||
+		Err == eIMAGE_ERROR_BAD_POINTER)
+	{
+		// Not the image's fault (eg. it's open elsewhere without sharing), so don't index it: it's re-scanned next time
+		helper.Close(&imageInfo, false);
+		return;
+	}
+
+	if (Err == eIMAGE_ERROR_NONE && imageInfo.pImageType)
+	{
+		CImageBase* pImageType = imageInfo.pImageType;
+		const eImageType Type = pImageType->GetType();
+
+		entry.Type = (BYTE) Type;
+		entry.NumTracks = (BYTE) helper.GetNumTracksInImage(pImageType);
+		entry.VolumeNumber = pImageType->GetVolumeNumber();
+		entry.dwOffset = imageInfo.uOffset;
+		entry.dwImageSize = imageInfo.uImageSize;
+		if (helper.IsImageLocked())
+			entry.Flags |= DISKIMAGEINDEX_LOCKED;
+
+		const BYTE* pImage = helper.GetImageBuffer(&imageInfo);	// Waits for any background decompression
+		if (pImage)
+		{
+			entry.dwCRC32 = crc32(0, pImage, imageInfo.uImageSize);
+			GetVolumeName(pImage + imageInfo.uOffset, imageInfo.uImageSize - imageInfo.uOffset, Type, entry.szVolumeName, sizeof(entry.szVolumeName));
+		}
+	}
+	// else: not an image, so recorded as eImageUNKNOWN (& not re-scanned until it changes)
+
+	helper.Close(&imageInfo, false);
+
+	const std::string strKey = DiskImageIndex_GetKey(pszPathname);
+
+	EnterCriticalSection(&g_IndexCriticalSection);
+	g_Index[strKey] = entry;
+	g_bIndexDirty = true;
+	LeaveCriticalSection(&g_IndexCriticalSection);
+}
+
+static DWORD WINAPI ScanWorkerThread(LPVOID)
+{
+	CDiskImageHelper helper;
+	helper.SetShareWrite(true);
+
+	while (!g_bScanAbort)
+	{
+		const LONG n = InterlockedIncrement(&g_nScanNext) - 1;
+		if (n >= (LONG)g_vecScanFiles.size())
+			break;
+
+		IndexImage(helper, g_vecScanFiles[n]);
+	}
+
+	return 0;
+}
+
+//===========================================================================
+
+static bool IsImageExtension(LPCTSTR pszFilename)
+{
+	static const TCHAR* const kExtensions[] = {".dsk", ".do", ".po", ".nib", ".2mg", ".2img", ".iie", ".apl", ".prg", ".gz", ".zip"};
+
+	TCHAR szExt[_MAX_EXT] = "";
+	GetCharLowerExt(szExt, pszFilename, _MAX_EXT);
+
+	for (UINT i=0; i<sizeof(kExtensions)/sizeof(kExtensions[0]); i++)
+	{
+		if (_tcscmp(szExt, kExtensions[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// Collect the images that aren't indexed, or have changed since
+static void FindImages(const std::string& strDirectory)
+{
+	WIN32_FIND_DATA findData;
+	HANDLE hFind = FindFirstFile((strDirectory + "\\*").c_str(), &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do
+	{
+		if (findData.cFileName[0] == '.' && (findData.cFileName[1] == 0 || (findData.cFileName[1] == '.' && findData.cFileName[2] == 0)))
+			continue;
+
+		const std::string strPathname = strDirectory + "\\" + findData.cFileName;
+
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			FindImages(strPathname);
+			continue;
+		}
+
+		if (!IsImageExtension(findData.cFileName))
+			continue;
+
+		DiskImageIndexEntry entry;
+		if (!DiskImageIndex_Lookup(strPathname.c_str(), entry))
+			g_vecScanFiles.push_back(strPathname);
+	}
+	while (!g_bScanAbort && FindNextFile(hFind, &findData));
+
+	FindClose(hFind);
+}
+
+static DWORD WINAPI ScanThread(LPVOID)
+{
+	const DWORD dwStart = GetTickCount();
+
+	g_vecScanFiles.clear();
+	g_nScanNext = 0;
+	FindImages(g_strScanDirectory);
+
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	const UINT uNumThreads = MAX(1, MIN(sysInfo.dwNumberOfProcessors, kMaxScanThreads));
+
+	HANDLE hWorkerThread[kMaxScanThreads];
+	UINT uNumWorkers = 0;
+	for (UINT i=0; i<uNumThreads && !g_vecScanFiles.empty(); i++)
+	{
+		DWORD dwThreadId;
+		HANDLE hThread = CreateThread(NULL,				// lpThreadAttributes
+										0,				// dwStackSize
+										ScanWorkerThread,
+										NULL,			// lpParameter
+										0,				// dwCreationFlags : 0 = Run immediately
+										&dwThreadId);	// lpThreadId
+		if (hThread)
+		{
+			SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+			hWorkerThread[uNumWorkers++] = hThread;
+		}
+	}
+
+	if (uNumWorkers)
+	{
+		WaitForMultipleObjects(uNumWorkers, hWorkerThread, TRUE, INFINITE);
+		for (UINT i=0; i<uNumWorkers; i++)
+			CloseHandle(hWorkerThread[i]);
+	}
+	else
+	{
+		ScanWorkerThread(NULL);
+	}
+
+	EnterCriticalSection(&g_IndexCriticalSection);
+	SaveIndex();
+	LeaveCriticalSection(&g_IndexCriticalSection);
+
+	LogFileOutput("DiskImageIndex: scanned %s: %u new/changed images, %u threads, %u ms%s\n",
+		g_strScanDirectory.c_str(), (UINT)g_vecScanFiles.size(), uNumWorkers, GetTickCount() - dwStart, g_bScanAbort ? " (aborted)" : "");
+
+	return 0;
+}
+
+//===========================================================================
+
+void DiskImageIndex_Scan(LPCTSTR pszDirectory)
+{
+	if (!g_bIndexInit || DiskImageIndex_IsScanning())
+		return;
+
+	if (g_hScanThread)
+	{
+		CloseHandle(g_hScanThread);
+		g_hScanThread = NULL;
+	}
+
+	g_strScanDirectory = pszDirectory;
+	while (!g_strScanDirectory.empty() && (*g_strScanDirectory.rbegin() == '\\' || *g_strScanDirectory.rbegin() == '/'))
+		g_strScanDirectory.resize(g_strScanDirectory.size()-1);
+
+	g_bScanAbort = false;
+
+	DWORD dwThreadId;
+	g_hScanThread = CreateThread(NULL,				// lpThreadAttributes
+									0,				// dwStackSize
+									ScanThread,
+									NULL,			// lpParameter
+									0,				// dwCreationFlags : 0 = Run immediately
+									&dwThreadId);	// lpThreadId
+
+	if (g_hScanThread)
+		SetThreadPriority(g_hScanThread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+bool DiskImageIndex_IsScanning(void)
+{
+	return g_hScanThread && WaitForSingleObject(g_hScanThread, 0) == WAIT_TIMEOUT;
+}
+
+//===========================================================================
+
+void DiskImageIndex_Initialize(void)
+{
+	if (g_bIndexInit)
+		return;
+
+	InitializeCriticalSection(&g_IndexCriticalSection);
+	LoadIndex();
+	g_bIndexInit = true;
+}
+
+void DiskImageIndex_Destroy(void)
+{
+	if (!g_bIndexInit)
+		return;
+
+	if (g_hScanThread)
+	{
+		g_bScanAbort = true;
+		WaitForSingleObject(g_hScanThread, INFINITE);
+		CloseHandle(g_hScanThread);
+		g_hScanThread = NULL;
+	}
+
+	EnterCriticalSection(&g_IndexCriticalSection);
+	SaveIndex();
+	g_Index.clear();
+	LeaveCriticalSection(&g_IndexCriticalSection);
+
+	DeleteCriticalSection(&g_IndexCriticalSection);
+	g_bIndexInit = false;
+}
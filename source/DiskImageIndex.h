@@ -0,0 +1,35 @@
+#pragma once
+
+// On-disk index of floppy images' detection results, keyed by pathname, file size & last-write time.
+// An indexed image is inserted without running CDiskImageHelper::Detect().
+
+enum
+{
+	DISKIMAGEINDEX_READONLY	= 1<<0,	// File has the read-only attribute
+	DISKIMAGEINDEX_LOCKED	= 1<<1,	// 2IMG header's locked flag
+};
+
+struct DiskImageIndexEntry
+{
+	UINT64	uFileSize;
+	UINT64	uLastWriteTime;		// FILETIME
+	BYTE	Type;				// eImageType (implies the sector order)
+	BYTE	NumTracks;
+	BYTE	VolumeNumber;
+	BYTE	Flags;				// DISKIMAGEINDEX_xxx
+	DWORD	dwOffset;			// Size of any MacBinary/2IMG header
+	DWORD	dwImageSize;		// Uncompressed size (as passed to Detect())
+	DWORD	dwCRC32;			// Of the (uncompressed) image
+	char	szVolumeName[16];	// ProDOS volume name, or "DOS 3.3 Vnnn"
+};
+
+void DiskImageIndex_Initialize(void);
+void DiskImageIndex_Destroy(void);	// Stops any scan & saves the index
+
+bool DiskImageIndex_Lookup(LPCTSTR pszPathname, DiskImageIndexEntry& entry);	// False if not indexed, or the file has changed since
+void DiskImageIndex_Scan(LPCTSTR pszDirectory);	// Index all (new or changed) images under pszDirectory, in the background
+bool DiskImageIndex_IsScanning(void);
+
+// Also used by the image cache
+std::string DiskImageIndex_GetKey(LPCTSTR pszPathname);	// Lowercase full pathname
+bool DiskImageIndex_GetFileStamp(LPCTSTR pszPathname, UINT64& uFileSize, UINT64& uLastWriteTime);
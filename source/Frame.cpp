@@ -1762,6 +1762,15 @@ LRESULT CALLBACK FrameWndProc (
 		break;
 	}
 
+	// Message posted by: an ImageLoader thread (lparam = image's pathname, allocated by new[])
+	case WM_USER_IMAGE_LOAD_ERROR:
+	{
+		LPTSTR pszPathname = (LPTSTR) lparam;
+		DiskNotifyImageLoadError(pszPathname);
+		delete [] pszPathname;
+		break;
+	}
+
   }	// switch(message)
  
   return DefWindowProc(window,message,wparam,lparam);
@@ -2488,6 +2497,20 @@ HDC FrameGetDC () {
   return g_hFrameDC;
 }
 
+//===========================================================================
+// For the presentation thread: a separate (cache) DC, since the frame window's own DC is used by the UI thread
+HDC FrameGetPresentDC () {
+  HDC hDC = GetDCEx(g_hFrameWindow, NULL, DCX_CACHE);
+  if (hDC)
+    SetViewportOrgEx(hDC,viewportx,viewporty,NULL);
+  return hDC;
+}
+
+//===========================================================================
+void FrameReleasePresentDC (HDC hDC) {
+  ReleaseDC(g_hFrameWindow,hDC);
+}
+
 //===========================================================================
 HDC FrameGetVideoDC (LPBYTE *pAddr_, LONG *pPitch_)
 {
@@ -58,10 +58,12 @@
 	void    FrameCreateWindow(void);
 	HDC     FrameGetDC ();
 	HDC     FrameGetVideoDC (LPBYTE *,LONG *);
+	HDC     FrameGetPresentDC ();
 	void    FrameRefreshStatus (int, bool bUpdateDiskStatus = true );
 	void    FrameRegisterClass ();
 	void    FrameReleaseDC ();
 	void    FrameReleaseVideoDC ();
+	void    FrameReleasePresentDC (HDC hDC);
 	void	FrameSetCursorPosByMousePos();
 	int		GetViewportScale(void);
 	int     SetViewportScale(int nNewScale, bool bForce = false);
@@ -29,10 +29,12 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "StdAfx.h"
 
 #include "AppleWin.h"
+#include "CPU.h"
 #include "DiskImage.h"	// ImageError_e, Disk_Status_e
 #include "DiskImageHelper.h"
 #include "Frame.h"
 #include "HardDisk.h"
+#include "Log.h"
 #include "Memory.h"
 #include "Registry.h"
 #include "YamlHelper.h"
@@ -51,6 +53,8 @@ Memory map:
 	C0F6	(r/w) LOW BYTE OF BLOCK NUMBER
 	C0F7	(r/w) HIGH BYTE OF BLOCK NUMBER
 	C0F8    (r)   NEXT BYTE
+	C0F9    (r)   DMA STATUS (b7=1: the last READ was copied directly to memory)
+	C0FA    (w)   BITS 23-16 OF BLOCK NUMBER (written by the f/w for a SmartPort call only, so it also flags one; cleared by EXECUTE)
 */
 
 /*
@@ -80,6 +84,8 @@ Overview
             location in HDV file.
           If seek fails, returns a DEVICE I/O ERROR.  Resets hd_buf_ptr used by HD_NEXTBYTE
           Returns a DEVICE OK if read was successful, or a DEVICE I/O ERROR otherwise.
+          With DMA enabled (and the command issued by the card's f/w), the block is also copied
+            to the Apple's memory & the f/w skips its 512 reads of HD_NEXTBYTE.
 
       3. WRITE
           Copies requested block from the Apple's memory to a 512 byte buffer
@@ -110,6 +116,16 @@ Overview
       I'm sure there are programs out there that may try to use the I/O ports in
       ways they weren't designed (like telling Ultima 5 that you have a Phasor
       sound card in slot 7 is a generally bad idea) will cause problems.
+
+  4. Units & partitions
+      A ProDOS volume is at most 65535 blocks, so an image bigger than 32MB is split
+        into 32MB partitions, each a separate unit. The units are HDD-1's partitions
+        then HDD-2's (an unplugged HDD is still one, offline, unit).
+      ProDOS calls (via $CnFF) select unit 1 or 2 with b7 of the unit number (DSSS0000).
+      SmartPort calls (via $CnFF+3) select any unit by number (1..n, with 0 being the
+        controller itself), use 24-bit block numbers for READ & WRITE, & also support STATUS codes 0 & 3.
+      So ProDOS 2.x can access units 3+ through the SmartPort entrypoint - although it
+        only looks for one if $Cn07=$00 (see HD_SetSmartPort()).
 */
 
 struct HDD
@@ -126,6 +142,8 @@ struct HDD
 	UINT	hd_diskblock;
 	WORD	hd_buf_ptr;
 	bool	hd_imageloaded;
+	bool	hd_dma;						// Last READ was copied to memory (read by f/w via $C0F9)
+	bool	bFlushError;				// Last write-back of the held blocks failed (& the user has been told)
 	BYTE	hd_buf[HD_BLOCK_SIZE+1];	// Why +1? Probably for erroreous reads beyond the block size (ie. reads from I/O addr 0xC0F8)
 
 #if HD_LED
@@ -148,19 +166,66 @@ static HDD g_HardDisk[NUM_HARDDISKS] = {0};
 static bool g_bSaveDiskImage = true;	// Save the DiskImage name to Registry
 static UINT g_uSlot = 7;
 
+static bool g_bHD_DMA = false;	// READ copies the block straight to memory (cmd line: -hdd-dma)
+static bool g_bHD_SmartPortID = false;	// $Cn07=$00 (cmd line: -hdd-smartport)
+static bool g_bHD_SmartPortCall = false;	// $C0FA written since the last EXECUTE
+static BYTE g_nHD_DiskBlockHigh = 0;		// $C0FA: a single controller register, as the f/w writes it before the unit#
+
+static const UINT HD_PARTITION_BLOCKS = HARDDISK_32M_SIZE / HD_BLOCK_SIZE;
+
+// Written blocks are held by the image's block cache, and written back once the HDD is idle
+static const UINT HD_IDLE_FLUSH_CYCLES = 500000;	// ~0.5s
+static bool g_bHD_FlushPending = false;
+static UINT g_uHD_IdleCycles = 0;
+
 //===========================================================================
 
 static void HD_SaveLastDiskImage(const int iDrive);
 
+static void HD_ReportFlushError(const int iDrive, const bool bClosing)
+{
+	LogFileOutput("HDD: Failed to write back block(s) to: %s\n", g_HardDisk[iDrive].imagehandle->szFilename);
+
+	TCHAR szBuffer[MAX_PATH + 256];
+	wsprintf(
+		szBuffer,
+		TEXT("Unable to write to the hard disk image %s\n")
+		TEXT("%s"),
+		g_HardDisk[iDrive].imagehandle->szFilename,
+		bClosing ? TEXT("so some of the changes to it have been lost.")
+				 : TEXT("so the changes to it are being held in memory, until it can be written."));
+
+	MessageBox(
+		g_hFrameWindow,
+		szBuffer,
+		g_pAppTitle,
+		MB_ICONEXCLAMATION | MB_SETFOREGROUND);
+}
+
+// Write back the blocks held by the image's block cache
+// . A failure is reported once, until a write-back succeeds (the blocks are still held, & retried at the next flush)
+static void HD_FlushDrive(const int iDrive, const bool bClosing)
+{
+	HDD* pHDD = &g_HardDisk[iDrive];
+
+	const bool bRes = ImageFlushBlocks(pHDD->imagehandle);
+	if (!bRes && (!pHDD->bFlushError || bClosing))
+		HD_ReportFlushError(iDrive, bClosing);
+
+	pHDD->bFlushError = !bRes;
+}
+
 static void HD_CleanupDrive(const int iDrive)
 {
 	if (g_HardDisk[iDrive].imagehandle)
 	{
+		HD_FlushDrive(iDrive, true);	// Before closing, as ImageClose() can't report a failure
 		ImageClose(g_HardDisk[iDrive].imagehandle);
 		g_HardDisk[iDrive].imagehandle = NULL;
 	}
 
 	g_HardDisk[iDrive].hd_imageloaded = false;
+	g_HardDisk[iDrive].bFlushError = false;
 
 	g_HardDisk[iDrive].imagename[0] = 0;
 	g_HardDisk[iDrive].fullname[0] = 0;
@@ -316,6 +381,11 @@ void HD_Load_Rom(const LPBYTE pCxRomPeripheral, const UINT uSlot)
 	memcpy(pCxRomPeripheral + uSlot*256, pData, HDDRVR_SIZE);
 	g_bHD_RomLoaded = true;
 
+	// Patch the f/w's 'lda #$3C' to identify as a SmartPort interface
+	// . NB. Then it won't autoboot on a ][, ][+ or unenhanced //e
+	if (g_bHD_SmartPortID)
+		pCxRomPeripheral[uSlot*256 + 7] = 0x00;
+
 	RegisterIoHandler(g_uSlot, HD_IO_EMUL, HD_IO_EMUL, NULL, NULL, NULL, NULL);
 }
 
@@ -445,12 +515,339 @@ bool HD_IsDriveUnplugged(const int iDrive)
 	return g_HardDisk[iDrive].hd_imageloaded == false;
 }
 
+void HD_SetDMA(const bool bEnabled)
+{
+	g_bHD_DMA = bEnabled;
+}
+
+void HD_SetSmartPort(const bool bEnabled)
+{
+	g_bHD_SmartPortID = bEnabled;
+}
+
+// Called after each CPU execution period
+void HD_Update(const UINT uExecutedCycles)
+{
+	if (!g_bHD_FlushPending)
+		return;
+
+	g_uHD_IdleCycles += uExecutedCycles;
+	if (g_uHD_IdleCycles < HD_IDLE_FLUSH_CYCLES)
+		return;
+
+	HD_Flush();
+}
+
+void HD_Flush(void)
+{
+	if (!g_bHD_FlushPending)
+		return;
+
+	for (UINT i = 0; i < NUM_HARDDISKS; i++)
+	{
+		if (g_HardDisk[i].hd_imageloaded)
+			HD_FlushDrive(i, false);
+	}
+
+	g_bHD_FlushPending = false;
+}
+
+//-----------------------------------------------------------------------------
+
+struct HDDUnit
+{
+	HDD* pHDD;
+	UINT uFirstBlock;	// Of the partition, in the image
+	UINT uNumBlocks;	// 0 if offline
+};
+
+static UINT HD_GetNumPartitions(const int iDrive)
+{
+	if (!g_HardDisk[iDrive].hd_imageloaded)
+		return 1;
+
+	const UINT uNumBlocks = ImageGetImageSize(g_HardDisk[iDrive].imagehandle) / HD_BLOCK_SIZE;
+	return MAX(1, (uNumBlocks + HD_PARTITION_BLOCKS - 1) / HD_PARTITION_BLOCKS);
+}
+
+static UINT HD_GetNumUnits(void)
+{
+	UINT uNumUnits = 0;
+	for (UINT i = 0; i < NUM_HARDDISKS; i++)
+		uNumUnits += HD_GetNumPartitions(i);
+
+	return uNumUnits;
+}
+
+// uUnit: 0-based
+// . NB. The partitions are re-counted each time, as an image can grow (although only within its last partition)
+static bool HD_GetUnit(const UINT uUnit, HDDUnit& unit)
+{
+	UINT uFirstUnit = 0;
+	for (UINT i = 0; i < NUM_HARDDISKS; i++)
+	{
+		const UINT uNumPartitions = HD_GetNumPartitions(i);
+		if (uUnit < uFirstUnit + uNumPartitions)
+		{
+			unit.pHDD = &g_HardDisk[i];
+			unit.uFirstBlock = (uUnit - uFirstUnit) * HD_PARTITION_BLOCKS;
+			unit.uNumBlocks = 0;
+
+			if (unit.pHDD->hd_imageloaded)
+			{
+				const UINT uImageBlocks = ImageGetImageSize(unit.pHDD->imagehandle) / HD_BLOCK_SIZE;
+				if (uImageBlocks > unit.uFirstBlock)
+					unit.uNumBlocks = MIN(uImageBlocks - unit.uFirstBlock, HD_PARTITION_BLOCKS);
+			}
+
+			return true;
+		}
+
+		uFirstUnit += uNumPartitions;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+// Write to memory as the f/w's 'sta (addr),y' would, ie. via the current paging
+static void HD_WriteMemory(const WORD addr, const BYTE* pData, const UINT uSize)
+{
+	UINT uOffset = 0;
+	while (uOffset < uSize)
+	{
+		const WORD addrPage = addr + uOffset;	// NB. Wraps at $FFFF, as does the f/w
+		const UINT uLen = MIN(uSize - uOffset, 0x100 - (addrPage & 0xFF));
+
+		memdirty[addrPage >> 8] = 0xFF;
+		LPBYTE page = memwrite[addrPage >> 8];
+		if (page)	// else write-protected (eg. ROM) so writes are ignored
+			memcpy(page + (addrPage & 0xFF), pData + uOffset, uLen);
+
+		uOffset += uLen;
+	}
+}
+
+// Cycles for the f/w's 'jsr sread' (2 loops of 256 x 'lda abs; sta (zp),y; iny; bne' + setup),
+// less 1 as the 'bmi' that skips it is then taken
+static const UINT HD_DMA_READ_CYCLES = 6 + 2*(256*15-1) + 31 - 1;
+
+// Copy the block to memory as the f/w's 'sta (memblock),y' would, ie. via the current paging
+// . Pre: the command was issued by the card's f/w, so it will skip 'sread' if this returns true
+static bool HD_DMARead(HDD* pHDD, const WORD pc)
+{
+	if (!g_bHD_DMA || (pc >> 8) != (0xC0 | g_uSlot))
+		return false;
+
+	// Don't DMA to I/O space - leave it to the f/w to access the soft-switches
+	for (UINT i = 0; i < HD_BLOCK_SIZE; i += 0x100)
+	{
+		const BYTE uPageFirst = (pHDD->hd_memblock + i) >> 8;
+		const BYTE uPageLast = (pHDD->hd_memblock + i + 0xFF) >> 8;
+		if ((uPageFirst & 0xF0) == 0xC0 || (uPageLast & 0xF0) == 0xC0)
+			return false;
+	}
+
+	HD_WriteMemory(pHDD->hd_memblock, pHDD->hd_buf, HD_BLOCK_SIZE);
+
+	CpuDmaCycles(HD_DMA_READ_CYCLES);
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 
 #define DEVICE_OK				0x00
 #define DEVICE_UNKNOWN_ERROR	0x03
 #define DEVICE_IO_ERROR			0x08
 
+// SmartPort errors
+#define SP_BADCMD				0x01
+#define SP_BADCTL				0x21
+#define SP_NODRIVE				0x28
+#define SP_BADBLOCK				0x2D
+
+// SmartPort STATUS: the status list is written to memory (at memblock)
+// . unit 0 = the controller itself
+static BYTE HD_SmartPortStatus(HDD* pHDD, const UINT uUnitNum)
+{
+	const BYTE uStatusCode = pHDD->hd_diskblock & 0xFF;
+	BYTE status[25] = {0};
+	UINT uSize = 0;
+
+	if (uUnitNum == 0)
+	{
+		if (uStatusCode != 0x00)
+			return SP_BADCTL;
+
+		status[0] = (BYTE) HD_GetNumUnits();
+		status[1] = 0x40;	// No interrupt
+		uSize = 8;
+	}
+	else
+	{
+		HDDUnit unit;
+		if (!HD_GetUnit(uUnitNum-1, unit))
+			return SP_NODRIVE;
+
+		if (uStatusCode != 0x00 && uStatusCode != 0x03)	// Status or DIB
+			return SP_BADCTL;
+
+		status[0] = 0xE8;	// Block device, write, read, format
+		if (unit.uNumBlocks)
+			status[0] |= 0x10;	// Online
+		if (unit.pHDD->hd_imageloaded && ImageIsWriteProtected(unit.pHDD->imagehandle))
+			status[0] |= 0x04;
+
+		const UINT uNumBlocks = MIN(unit.uNumBlocks, 0xFFFF);	// ProDOS's limit (so not 65536 for a full partition)
+		status[1] = uNumBlocks & 0xFF;
+		status[2] = (uNumBlocks >> 8) & 0xFF;
+		status[3] = (uNumBlocks >> 16) & 0xFF;
+		uSize = 4;
+
+		if (uStatusCode == 0x03)
+		{
+			const char szName[] = "APPLEWIN HDD    ";	// 16 chars, space padded
+			status[4] = sizeof(szName)-1;
+			memcpy(&status[5], szName, sizeof(szName)-1);
+			status[21] = 0x02;	// Type: hard disk
+			status[22] = 0x20;	// Subtype: not removable
+			status[23] = 0x00;	// Version
+			status[24] = 0x01;
+			uSize = 25;
+		}
+	}
+
+	HD_WriteMemory(pHDD->hd_memblock, status, uSize);
+	return DEVICE_OK;
+}
+
+// EXECUTE the command, for the unit# (& with the block# etc) in pHDD's registers
+static BYTE HD_Execute(HDD* pHDD, const WORD pc)
+{
+	BYTE r = DEVICE_OK;
+
+	// ProDOS: b7=drive (so unit 1 or 2), else SmartPort: unit# (0 = the controller)
+	const UINT uUnitNum = g_bHD_SmartPortCall ? g_nHD_UnitNum : (g_nHD_UnitNum >> 7) + 1;
+
+	if (g_bHD_SmartPortCall && uUnitNum == 0)
+	{
+		r = (g_nHD_Command == 0x00) ? HD_SmartPortStatus(pHDD, uUnitNum) : SP_BADCMD;
+		pHDD->hd_error = (r == DEVICE_OK) ? 0 : 1;
+		return r;
+	}
+
+	HDDUnit unit;
+	if (!HD_GetUnit(uUnitNum-1, unit) || !unit.pHDD->hd_imageloaded)
+	{
+#if HD_LED
+		pHDD->hd_status_next = DISK_STATUS_OFF;
+#endif
+		pHDD->hd_error = 1;
+		return g_bHD_SmartPortCall ? SP_NODRIVE : DEVICE_UNKNOWN_ERROR;
+	}
+
+	ImageInfo* pImage = unit.pHDD->imagehandle;
+
+	// NB. A unit's block# is limited to its partition (but may be beyond the image's end, to grow the last partition)
+	// . SmartPort: b23-16 are only meaningful for READ & WRITE (for the other commands that param list byte is something else)
+	const bool bBlockCommand = (g_nHD_Command == 0x01 || g_nHD_Command == 0x02);
+	const UINT uBlock = pHDD->hd_diskblock | ((g_bHD_SmartPortCall && bBlockCommand) ? (g_nHD_DiskBlockHigh << 16) : 0);
+	const bool bValidBlock = uBlock < HD_PARTITION_BLOCKS;
+	const UINT uImageBlock = unit.uFirstBlock + uBlock;
+	const BYTE errBlock = g_bHD_SmartPortCall ? SP_BADBLOCK : DEVICE_IO_ERROR;
+
+	// based on loaded data block request, load block into memory
+	// returns status
+	switch (g_nHD_Command)
+	{
+		default:
+			if (g_bHD_SmartPortCall)
+			{
+				pHDD->hd_error = 1;
+				r = SP_BADCMD;
+				break;
+			}
+			// else fall through
+		case 0x00: //status
+			if (g_bHD_SmartPortCall)
+			{
+				r = HD_SmartPortStatus(pHDD, uUnitNum);
+				pHDD->hd_error = (r == DEVICE_OK) ? 0 : 1;
+			}
+			else if (ImageGetImageSize(pImage) == 0)
+			{
+				pHDD->hd_error = 1;
+				r = DEVICE_IO_ERROR;
+			}
+			break;
+		case 0x01: //read
+			if (bValidBlock && (uImageBlock * HD_BLOCK_SIZE) < ImageGetImageSize(pImage))
+			{
+				bool bRes = ImageReadBlock(pImage, uImageBlock, pHDD->hd_buf);
+				if (bRes)
+				{
+					pHDD->hd_error = 0;
+					r = 0;
+					pHDD->hd_buf_ptr = 0;
+					pHDD->hd_dma = HD_DMARead(pHDD, pc);
+				}
+				else
+				{
+					pHDD->hd_error = 1;
+					r = DEVICE_IO_ERROR;
+				}
+			}
+			else
+			{
+				pHDD->hd_error = 1;
+				r = errBlock;
+			}
+			break;
+		case 0x02: //write
+			{
+#if HD_LED
+				pHDD->hd_status_next = DISK_STATUS_WRITE;
+#endif
+				if (!bValidBlock)
+				{
+					pHDD->hd_error = 1;
+					r = errBlock;
+					break;
+				}
+
+				// NB. A block beyond the end of the image grows it (the image layer zero-fills any gap in one go)
+				MoveMemory(pHDD->hd_buf, mem+pHDD->hd_memblock, HD_BLOCK_SIZE);
+
+				bool bRes = ImageWriteBlock(pImage, uImageBlock, pHDD->hd_buf);
+				g_bHD_FlushPending = true;
+
+				if (bRes)
+				{
+					pHDD->hd_error = 0;
+					r = 0;
+				}
+				else
+				{
+					pHDD->hd_error = 1;
+					r = DEVICE_IO_ERROR;
+				}
+			}
+			break;
+		case 0x03: //format
+#if HD_LED
+			pHDD->hd_status_next = DISK_STATUS_WRITE;
+#endif
+			break;
+		case 0x04: //control (SmartPort)
+		case 0x05: //init (SmartPort)
+			pHDD->hd_error = 0;
+			break;
+	}
+
+	return r;
+}
+
 static BYTE __stdcall HD_IO_EMUL(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG nCyclesLeft)
 {
 	BYTE r = DEVICE_OK;
@@ -469,97 +866,11 @@ static BYTE __stdcall HD_IO_EMUL(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG
 		switch (addr)
 		{
 			case 0xF0:
-				if (pHDD->hd_imageloaded)
-				{
-					// based on loaded data block request, load block into memory
-					// returns status
-					switch (g_nHD_Command)
-					{
-						default:
-						case 0x00: //status
-							if (ImageGetImageSize(pHDD->imagehandle) == 0)
-							{
-								pHDD->hd_error = 1;
-								r = DEVICE_IO_ERROR;
-							}
-							break;
-						case 0x01: //read
-							if ((pHDD->hd_diskblock * HD_BLOCK_SIZE) < ImageGetImageSize(pHDD->imagehandle))
-							{
-								bool bRes = ImageReadBlock(pHDD->imagehandle, pHDD->hd_diskblock, pHDD->hd_buf);
-								if (bRes)
-								{
-									pHDD->hd_error = 0;
-									r = 0;
-									pHDD->hd_buf_ptr = 0;
-								}
-								else
-								{
-									pHDD->hd_error = 1;
-									r = DEVICE_IO_ERROR;
-								}
-							}
-							else
-							{
-								pHDD->hd_error = 1;
-								r = DEVICE_IO_ERROR;
-							}
-							break;
-						case 0x02: //write
-							{
-#if HD_LED
-								pHDD->hd_status_next = DISK_STATUS_WRITE;
-#endif
-								bool bRes = true;
-								const bool bAppendBlocks = (pHDD->hd_diskblock * HD_BLOCK_SIZE) >= ImageGetImageSize(pHDD->imagehandle);
-
-								if (bAppendBlocks)
-								{
-									ZeroMemory(pHDD->hd_buf, HD_BLOCK_SIZE);
-
-									// Inefficient (especially for gzip/zip files!)
-									UINT uBlock = ImageGetImageSize(pHDD->imagehandle) / HD_BLOCK_SIZE;
-									while (uBlock < pHDD->hd_diskblock)
-									{
-										bRes = ImageWriteBlock(pHDD->imagehandle, uBlock++, pHDD->hd_buf);
-										_ASSERT(bRes);
-										if (!bRes)
-											break;
-									}
-								}
-
-								MoveMemory(pHDD->hd_buf, mem+pHDD->hd_memblock, HD_BLOCK_SIZE);
-
-								if (bRes)
-									bRes = ImageWriteBlock(pHDD->imagehandle, pHDD->hd_diskblock, pHDD->hd_buf);
-
-								if (bRes)
-								{
-									pHDD->hd_error = 0;
-									r = 0;
-								}
-								else
-								{
-									pHDD->hd_error = 1;
-									r = DEVICE_IO_ERROR;
-								}
-							}
-							break;
-						case 0x03: //format
-#if HD_LED
-							pHDD->hd_status_next = DISK_STATUS_WRITE;
-#endif
-							break;
-					}
-				}
-				else
-				{
-#if HD_LED
-					pHDD->hd_status_next = DISK_STATUS_OFF;
-#endif
-					pHDD->hd_error = 1;
-					r = DEVICE_UNKNOWN_ERROR;
-				}
+				pHDD->hd_dma = false;
+				g_uHD_IdleCycles = 0;
+				r = HD_Execute(pHDD, pc);
+				g_nHD_DiskBlockHigh = 0;	// For the next (maybe ProDOS) call
+				g_bHD_SmartPortCall = false;
 			break;
 		case 0xF1: // hd_error
 #if HD_LED
@@ -590,6 +901,9 @@ static BYTE __stdcall HD_IO_EMUL(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG
 			if (pHDD->hd_buf_ptr < sizeof(pHDD->hd_buf)-1)
 				pHDD->hd_buf_ptr++;
 			break;
+		case 0xF9:
+			r = pHDD->hd_dma ? 0x80 : 0x00;
+			break;
 		default:
 #if HD_LED
 			pHDD->hd_status_next = DISK_STATUS_OFF;
@@ -608,9 +922,11 @@ static BYTE __stdcall HD_IO_EMUL(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG
 			g_nHD_Command = d;
 			break;
 		case 0xF3:
+			// ProDOS:
 			// b7    = drive#
 			// b6..4 = slot#
 			// b3..0 = ?
+			// SmartPort: unit# (see HD_Execute())
 			g_nHD_UnitNum = d;
 			break;
 		case 0xF4:
@@ -625,6 +941,10 @@ static BYTE __stdcall HD_IO_EMUL(WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG
 		case 0xF7:
 			pHDD->hd_diskblock = pHDD->hd_diskblock & 0x00FF | (d << 8);
 			break;
+		case 0xFA:
+			g_nHD_DiskBlockHigh = d;
+			g_bHD_SmartPortCall = true;
+			break;
 		default:
 #if HD_LED
 			pHDD->hd_status_next = DISK_STATUS_OFF;
@@ -727,6 +1047,7 @@ static bool HD_LoadSnapshotHDDUnit(YamlLoadHelper& yamlLoadHelper, UINT unit)
 	g_HardDisk[unit].fullname[0] = 0;
 	g_HardDisk[unit].imagename[0] = 0;
 	g_HardDisk[unit].hd_imageloaded = false;	// Default to false (until image is successfully loaded below)
+	g_HardDisk[unit].hd_dma = false;			// Not saved: the f/w will just read the block via $C0F8 instead
 	g_HardDisk[unit].hd_status_next = DISK_STATUS_OFF;
 	g_HardDisk[unit].hd_status_prev = DISK_STATUS_OFF;
 
@@ -792,6 +1113,8 @@ bool HD_LoadSnapshot(YamlLoadHelper& yamlLoadHelper, UINT slot, UINT version, co
 
 	g_nHD_UnitNum = yamlLoadHelper.LoadUint(SS_YAML_KEY_CURRENT_UNIT);	// b7=unit
 	g_nHD_Command = yamlLoadHelper.LoadUint(SS_YAML_KEY_COMMAND);
+	g_bHD_SmartPortCall = false;	// Not saved: only set between the f/w's write to $C0FA & its EXECUTE
+	g_nHD_DiskBlockHigh = 0;
 
 	// Unplug all HDDs first in case HDD-2 is to be plugged in as HDD-1
 	for (UINT i=0; i<NUM_HARDDISKS; i++)
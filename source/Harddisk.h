@@ -40,6 +40,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	void HD_Unplug(const int iDrive);
 	bool HD_IsDriveUnplugged(const int iDrive);
 	void HD_LoadLastDiskImage(const int iDrive);
+	void HD_SetDMA(const bool bEnabled);
+	void HD_SetSmartPort(const bool bEnabled);	// Call before HD_Load_Rom()
+	void HD_Update(const UINT uExecutedCycles);
+	void HD_Flush(void);	// When emulation isn't running (eg. paused or in the debugger), as HD_Update() isn't called
 
 	// 1.19.0.0 Hard Disk Status/Indicator Light
 	void HD_GetLightStatus (Disk_Status_e *pDisk1Status_);
@@ -1024,6 +1024,14 @@ bool MemCheckSLOTCXROM()
 
 //===========================================================================
 
+// Language card RAM (rather than ROM) is read-enabled at $D000-$FFFF
+bool MemCheckHIGHRAM()
+{
+	return SW_HIGHRAM ? true : false;
+}
+
+//===========================================================================
+
 static LPBYTE MemGetPtrBANK1(const WORD offset, const LPBYTE pMemBase)
 {
 	if ((offset & 0xF000) != 0xC000)	// Requesting RAM at physical addr $Cxxx (ie. 4K RAM BANK1)
@@ -1520,7 +1528,10 @@ BYTE MemReadFloatingBus(const ULONG uExecutedCycles)
 	_ASSERT(addr1 == addr2);
 #endif
 //	return mem[ VideoGetScannerAddress(NULL, uExecutedCycles) ];	// NG: ANSI STORY (End Credits) - repro by running from "Turn the disk over"
-	return mem[ NTSC_VideoGetScannerAddress() ];					// OK: This does the 2-cycle adjust for ANSI STORY (End Credits)
+	// OK: This does the 2-cycle adjust for ANSI STORY (End Credits)
+	// NB. Computed from the cycle count, not the NTSC scanner state: at an opcode's memory access, uExecutedCycles matches the
+	// scanner's last update, and this stays correct during full-speed (when the scanner isn't updated)
+	return mem[ NTSC_VideoGetScannerAddressFromCycles( CpuGetCyclesThisVideoFrame(uExecutedCycles) ) ];
 }
 
 //===========================================================================
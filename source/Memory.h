@@ -40,6 +40,7 @@ void	RegisterIoHandler(UINT uSlot, iofunction IOReadC0, iofunction IOWriteC0, io
 
 void    MemDestroy ();
 bool	MemCheckSLOTCXROM();
+bool	MemCheckHIGHRAM();
 LPBYTE  MemGetAuxPtr(const WORD);
 LPBYTE  MemGetMainPtr(const WORD);
 LPBYTE  MemGetBankPtr(const UINT nBank);
@@ -24,8 +24,10 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	#include "AppleWin.h"
 	#include "CPU.h"
 	#include "Frame.h"  // FRAMEBUFFER_W FRAMEBUFFER_H
+	#include "Log.h"
 	#include "Memory.h" // MemGetMainPtr() MemGetBankPtr()
 	#include "Video.h"  // g_pFramebufferbits
+	#include "VideoScaler.h" // VideoScaler_GetScanlines()
 
 	#include "NTSC.h"
 	#include "NTSC_CharSet.h"
@@ -155,9 +157,54 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	static unsigned g_aPixelMaskGR       [ 16];
 	static uint16_t g_aPixelDoubleMaskHGR[128]; // hgrbits -> g_aPixelDoubleMaskHGR: 7-bit mono 280 pixels to 560 pixel doubling
 
+	// Glyph cache: pre-expanded text pixel bits, indexed by [flash phase][alt charset][char][row]
+	// . Holds the luminance bits fed to updatePixels(), not BGRA - chroma depends on the neighbouring signal bits,
+	//   so the cache is independent of the video style, monochrome color & chroma tables
+	// . Rebuilt whenever the char set changes (see set_csbits())
+	static uint16_t g_aGlyphCacheText40[2][2][256][8];	// 7-bit char row, doubled to 14 pixels
+	static uint16_t g_aGlyphCacheText80[2][2][256][8];	// 7-bit char row, combined as (main << 7) | aux
+
+	// Text cell render cache: skip re-rendering text cells whose output can't have changed since the last pass
+	// . Keyed on the glyph bits (so flash phase, inverse & char set are implicit) plus the NTSC state entering the cell
+	// . So on a flash toggle only the cells with flashing glyphs get re-rendered, and a static text screen renders nothing
+	// . A scanline is only eligible if every cell of its previous pass was rendered by TEXT40/80 (ie. not mixed/graphics)
+	// . TV styles blend with the scanline above, so also require the line above to be all text & its cell to have been skipped
+	#define TEXT_CELLS_PER_LINE 40
+	static uint32_t g_aTextCellKey    [VIDEO_SCANNER_Y_DISPLAY][TEXT_CELLS_PER_LINE];	// glyph bits, signal bits, color phase, color burst
+	static uint16_t g_aTextCellExit   [VIDEO_SCANNER_Y_DISPLAY][TEXT_CELLS_PER_LINE];	// signal bits, color phase, last column pixel
+	static bool     g_aTextCellSkipped[VIDEO_SCANNER_Y_DISPLAY][TEXT_CELLS_PER_LINE];
+	static bool     g_aTextLineCached [VIDEO_SCANNER_Y_DISPLAY];
+	static int      g_nTextLineCells = 0;
+	static bool     g_bTextCellNeedAbove = false;
+
+	// Optional 8-bit palette-indexed output, see NTSC_SetIndexedFramebuffer()
+	// . The NTSC writers store a palette index per pixel (single scanline, no border) instead of 32-bit BGRA to 3 scanlines
+	// . NTSC_VideoConvertIndexedFramebuffer() expands to g_pFramebufferbits, only when presenting or saving
+	// . The palette holds the active chroma tables' colors exactly, so it's only used for styles with <= 256 colors (ie. the
+	//   monochrome styles): any other style falls back to the direct 32-bit writers (see NTSC_SetVideoStyle())
+	#define INDEXED_FRAMEBUFFER_PIXELS  (560+4)	// NB. +4 for the pixels written at end-of-line (see updateVideoScannerHorzEOL())
+	#define INDEXED_FRAMEBUFFER_PITCH   576
+	enum IndexedStyle_e { INDEXED_MONITOR_DOUBLE, INDEXED_MONITOR_SINGLE, INDEXED_COLORTV_DOUBLE, INDEXED_COLORTV_SINGLE };
+
+	static bool     g_bIndexedRequested   = false;	// -fb-indexed
+	static bool     g_bIndexedFramebuffer = false;	// Requested, & the current style has an exact palette
+	static bool     g_bIndexedFramebufferDirty = false;	// Written (or palette changed) since the last NTSC_VideoConvertIndexedFramebuffer()
+	static uint8_t  g_aIndexedFramebuffer[VIDEO_SCANNER_Y_DISPLAY][INDEXED_FRAMEBUFFER_PITCH];
+	static uint8_t *g_pIndexedAddress = 0;
+	static uint32_t g_aIndexedPalette[256];
+	static uint8_t  g_aIndexedMapHue[4][4096];	// [NTSC_NUM_PHASES][NTSC_NUM_SEQUENCES]
+	static uint8_t  g_aIndexedMapBnW   [4096];	// [NTSC_NUM_SEQUENCES]
+	static bgra_t  *g_pIndexedHueTable = 0;	// [NTSC_NUM_PHASES][NTSC_NUM_SEQUENCES] or NULL for monochrome styles
+	static bgra_t  *g_pIndexedBnWTable = 0;
+	static IndexedStyle_e g_eIndexedStyle = INDEXED_MONITOR_DOUBLE;
+
 	static int g_nLastColumnPixelNTSC;
 	static int g_nColorBurstPixels;
 
+	// VBL, for -frame-hash: set when the scanner leaves the last displayed line, acted on once the current opcode's cycles are done
+	static bool g_bVideoScannerEnteredVBL = false;
+	static unsigned __int64 g_nVideoScannerCycles = 0;	// Emulated cycles stepped through by NTSC_VideoUpdateCycles()
+
 	#define INITIAL_COLOR_PHASE 0
 	static int g_nColorPhaseNTSC = INITIAL_COLOR_PHASE;
 	static int g_nSignalBitsNTSC = 0;
@@ -178,6 +225,24 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	static bgra_t g_aBnWMonitorCustom           [NTSC_NUM_SEQUENCES];
 	static bgra_t g_aBnWColorTVCustom           [NTSC_NUM_SEQUENCES];
 
+	// Chroma table cache file (in the AppleWin program dir)
+	// . Bump NTSC_CHROMA_CACHE_VERSION whenever initChromaPhaseTables() or its filters change
+	#define NTSC_CHROMA_CACHE_FILENAME "NTSC_Chroma.bin"
+	#define NTSC_CHROMA_CACHE_VERSION  1
+	#define NTSC_CHROMA_CACHE_CONFIG   ((NTSC_REMOVE_WHITE_RINGING<<0) | (NTSC_REMOVE_BLACK_GHOSTING<<1) | (NTSC_REMOVE_GRAY_CHROMA<<2) | (DEBUG_PHASE_ZERO<<3))
+
+	struct ChromaCacheHeader_t
+	{
+		char     szId[8];		// "AWNTSC\0\0"
+		uint32_t uVersion;
+		uint32_t uConfig;
+		uint32_t uTablesSize;
+		uint32_t uChecksum;		// FNV-1a of all tables
+	};
+
+	static const char g_szChromaCacheId[8] = "AWNTSC";
+	static std::vector<BYTE> g_vecChromaCanonical;	// Copy of the canonical tables (from the 1st init), to restore on a re-init
+
 	#define CHROMA_ZEROS 2
 	#define CHROMA_POLES 2
 	#define CHROMA_GAIN  7.438011255f // Should this be 7.15909 MHz ?
@@ -397,6 +462,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	//unsigned char * MemGetMainPtr (unsigned short);
 	INLINE float     clampZeroOne( const float & x );
 	INLINE uint8_t   getCharSetBits( const int iChar );
+	INLINE uint16_t  getGlyphBits40( const uint8_t iChar );
+	INLINE uint16_t  getGlyphBits80( const uint8_t iChar );
 	INLINE uint16_t  getLoResBits( uint8_t iByte );
 	INLINE uint32_t  getScanlineColor( const uint16_t signal, const bgra_t *pTable );
 	INLINE uint32_t* getScanlineNext1Address();
@@ -409,20 +476,31 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	INLINE void      updateFramebufferColorTVDoubleScanline( uint16_t signal, bgra_t *pTable );
 	INLINE void      updateFramebufferMonitorSingleScanline( uint16_t signal, bgra_t *pTable );
 	INLINE void      updateFramebufferMonitorDoubleScanline( uint16_t signal, bgra_t *pTable );
+	INLINE void      updateFramebufferIndexed( uint16_t signal, const uint8_t *pIndexMap );
+	INLINE void      putFramebufferColorTVSingleScanline( const uint32_t color0 );
+	INLINE void      putFramebufferColorTVDoubleScanline( const uint32_t color0 );
+	INLINE void      putFramebufferMonitorSingleScanline( const uint32_t color0 );
+	INLINE void      putFramebufferMonitorDoubleScanline( const uint32_t color0 );
 	INLINE void      updatePixels( uint16_t bits );
 	INLINE bool      updateScanLineModeSwitch( long cycles6502, UpdateScreenFunc_t self );
 	INLINE void      updateVideoScannerHorzEOL();
+	INLINE bool      updateTextCellCached( uint16_t bits );
+	INLINE void      updateTextCellStore();
+	static void      invalidateTextCells();
 	INLINE void      updateVideoScannerAddress();
 	INLINE uint16_t  updateVideoScannerAddressTXT();
 	INLINE uint16_t  updateVideoScannerAddressHGR();
 
 	static void initChromaPhaseTables();
+	static void initChromaTables();
 	static real initFilterChroma   (real z);
 	static real initFilterLuma0    (real z);
 	static real initFilterLuma1    (real z);
 	static real initFilterSignal(real z);
+	static void initGlyphCache(const UINT uNumCharSets);
 	static void initPixelDoubleMasks(void);
 	static void updateMonochromeTables( uint16_t r, uint16_t g, uint16_t b );
+	static bool updateIndexedPalette(void);
 
 	static void updatePixelBnWColorTVSingleScanline( uint16_t compositeSignal );
 	static void updatePixelBnWColorTVDoubleScanline( uint16_t compositeSignal );
@@ -432,6 +510,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 	static void updatePixelHueColorTVDoubleScanline( uint16_t compositeSignal );
 	static void updatePixelHueMonitorSingleScanline( uint16_t compositeSignal );
 	static void updatePixelHueMonitorDoubleScanline( uint16_t compositeSignal );
+	static void updatePixelBnWIndexed( uint16_t compositeSignal );
+	static void updatePixelHueIndexed( uint16_t compositeSignal );
 
 	static void updateScreenDoubleHires40( long cycles6502 );
 	static void updateScreenDoubleHires80( long cycles6502 );
@@ -446,18 +526,21 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 static void set_csbits()
 {
 	// NB. For models that don't have an alt charset then set /g_nVideoCharSet/ to zero
+	UINT uNumCharSets = 2;
 	switch ( GetApple2Type() )
 	{
-	case A2TYPE_APPLE2:			csbits = &csbits_a2[0];         g_nVideoCharSet = 0; break;
-	case A2TYPE_APPLE2PLUS:		csbits = &csbits_a2[0];         g_nVideoCharSet = 0; break;
+	case A2TYPE_APPLE2:			csbits = &csbits_a2[0];         g_nVideoCharSet = 0; uNumCharSets = 1; break;
+	case A2TYPE_APPLE2PLUS:		csbits = &csbits_a2[0];         g_nVideoCharSet = 0; uNumCharSets = 1; break;
 	case A2TYPE_APPLE2E:		csbits = &csbits_2e[0];			break;
 	case A2TYPE_APPLE2EENHANCED:csbits = &csbits_enhanced2e[0]; break;
-	case A2TYPE_PRAVETS82:	    csbits = &csbits_pravets82[0];  g_nVideoCharSet = 0; break;	// Apple ][ clone
-	case A2TYPE_PRAVETS8M:	    csbits = &csbits_pravets8M[0];  g_nVideoCharSet = 0; break;	// Apple ][ clone
+	case A2TYPE_PRAVETS82:	    csbits = &csbits_pravets82[0];  g_nVideoCharSet = 0; uNumCharSets = 1; break;	// Apple ][ clone
+	case A2TYPE_PRAVETS8M:	    csbits = &csbits_pravets8M[0];  g_nVideoCharSet = 0; uNumCharSets = 1; break;	// Apple ][ clone
 	case A2TYPE_PRAVETS8A:	    csbits = &csbits_pravets8C[0];  break;	// Apple //e clone
 	case A2TYPE_TK30002E:		csbits = &csbits_enhanced2e[0]; break;	// Enhanced Apple //e clone
 	default:					csbits = &csbits_enhanced2e[0]; break;
 	}
+
+	initGlyphCache(uNumCharSets);
 }
 
 //===========================================================================
@@ -474,6 +557,18 @@ inline uint8_t getCharSetBits(int iChar)
 	return csbits[g_nVideoCharSet][iChar][g_nVideoClockVert & 7];
 }
 
+//===========================================================================
+inline uint16_t getGlyphBits40(const uint8_t iChar)
+{
+	return g_aGlyphCacheText40[g_nTextFlashMask & 1][g_nVideoCharSet][iChar][g_nVideoClockVert & 7];
+}
+
+//===========================================================================
+inline uint16_t getGlyphBits80(const uint8_t iChar)
+{
+	return g_aGlyphCacheText80[g_nTextFlashMask & 1][g_nVideoCharSet][iChar][g_nVideoClockVert & 7];
+}
+
 //===========================================================================
 inline uint16_t getLoResBits( uint8_t iByte )
 {
@@ -591,13 +686,12 @@ inline void updateFlashRate() // TODO: Flash rate should be constant (regardless
 #else
 
 //===========================================================================
-inline void updateFramebufferColorTVSingleScanline( uint16_t signal, bgra_t *pTable )
+inline void putFramebufferColorTVSingleScanline( const uint32_t color0 )
 {
 	/* */ uint32_t *pLine0Address = getScanlineThis0Address();
 	/* */ uint32_t *pLine1Address = getScanlinePrev1Address();
 	/* */ uint32_t *pLine2Address = getScanlinePrev2Address();
 
-	const uint32_t color0 = getScanlineColor( signal, pTable );
 	const uint32_t color2 = *pLine2Address;
 //	const uint32_t color1 = color0 - ((color2 & 0x00fcfcfc) >> 2); // BUG? color0 - color0? not color0-color2?
 	// TC: The above operation "color0 - ((color2 & 0x00fcfcfc) >> 2)" causes underflow, so I've recoded to clamp on underflow:
@@ -617,13 +711,12 @@ inline void updateFramebufferColorTVSingleScanline( uint16_t signal, bgra_t *pTa
 }
 
 //===========================================================================
-inline void updateFramebufferColorTVDoubleScanline( uint16_t signal, bgra_t *pTable )
+inline void putFramebufferColorTVDoubleScanline( const uint32_t color0 )
 {
 	/* */ uint32_t *pLine0Address = getScanlineThis0Address();
 	/* */ uint32_t *pLine1Address = getScanlinePrev1Address();
 	const uint32_t *pLine2Address = getScanlinePrev2Address();
 
-	const uint32_t color0 = getScanlineColor( signal, pTable );
 	const uint32_t color2 = *pLine2Address;
 	const uint32_t color1 = ((color0 & 0x00fefefe) >> 1) + ((color2 & 0x00fefefe) >> 1); // 50% Blend
 
@@ -633,11 +726,10 @@ inline void updateFramebufferColorTVDoubleScanline( uint16_t signal, bgra_t *pTa
 }
 
 //===========================================================================
-inline void updateFramebufferMonitorSingleScanline( uint16_t signal, bgra_t *pTable )
+inline void putFramebufferMonitorSingleScanline( const uint32_t color0 )
 {
 	/* */ uint32_t *pLine0Address = getScanlineThis0Address();
 	/* */ uint32_t *pLine1Address = getScanlineNext1Address();
-	const uint32_t color0 = getScanlineColor( signal, pTable );
 	const uint32_t color1 = ((color0 & 0x00fcfcfc) >> 2); // 25% Blend (original)
 //	const uint32_t color1 = ((color0 & 0x00fefefe) >> 1); // 50% Blend -- looks OK most of the time; Archon looks poor
 
@@ -647,18 +739,48 @@ inline void updateFramebufferMonitorSingleScanline( uint16_t signal, bgra_t *pTa
 }
 
 //===========================================================================
-inline void updateFramebufferMonitorDoubleScanline( uint16_t signal, bgra_t *pTable )
+inline void putFramebufferMonitorDoubleScanline( const uint32_t color0 )
 {
 	/* */ uint32_t *pLine0Address = getScanlineThis0Address();
 	/* */ uint32_t *pLine1Address = getScanlineNext1Address();
-	const uint32_t color0 = getScanlineColor( signal, pTable );
 
 	/* */  *pLine1Address = color0;
 	/* */  *pLine0Address = color0;
 	/* */ g_pVideoAddress++;
 }
+
+//===========================================================================
+inline void updateFramebufferColorTVSingleScanline( uint16_t signal, bgra_t *pTable )
+{
+	putFramebufferColorTVSingleScanline( getScanlineColor( signal, pTable ) );
+}
+
+//===========================================================================
+inline void updateFramebufferColorTVDoubleScanline( uint16_t signal, bgra_t *pTable )
+{
+	putFramebufferColorTVDoubleScanline( getScanlineColor( signal, pTable ) );
+}
+
+//===========================================================================
+inline void updateFramebufferMonitorSingleScanline( uint16_t signal, bgra_t *pTable )
+{
+	putFramebufferMonitorSingleScanline( getScanlineColor( signal, pTable ) );
+}
+
+//===========================================================================
+inline void updateFramebufferMonitorDoubleScanline( uint16_t signal, bgra_t *pTable )
+{
+	putFramebufferMonitorDoubleScanline( getScanlineColor( signal, pTable ) );
+}
 #endif
 
+//===========================================================================
+inline void updateFramebufferIndexed( uint16_t signal, const uint8_t *pIndexMap )
+{
+	g_nSignalBitsNTSC = ((g_nSignalBitsNTSC << 1) | signal) & 0xFFF; // 12-bit
+	*g_pIndexedAddress++ = pIndexMap[ g_nSignalBitsNTSC ];
+}
+
 //===========================================================================
 inline void updatePixels( uint16_t bits )
 {
@@ -740,6 +862,8 @@ inline void updateVideoScannerHorzEOL()
 	{
 		if (g_nVideoClockVert < VIDEO_SCANNER_Y_DISPLAY)
 		{
+			g_aTextLineCached[g_nVideoClockVert] = (g_nTextLineCells == TEXT_CELLS_PER_LINE);
+
 			//VIDEO_DRAW_ENDLINE();
 			if (g_nColorBurstPixels < 2)
 			{
@@ -761,7 +885,11 @@ inline void updateVideoScannerHorzEOL()
 
 		g_nVideoClockHorz = 0;
 
-		if (++g_nVideoClockVert == VIDEO_SCANNER_MAX_VERT)
+		if (++g_nVideoClockVert == VIDEO_SCANNER_Y_DISPLAY)
+		{
+			g_bVideoScannerEnteredVBL = true;
+		}
+		else if (g_nVideoClockVert == VIDEO_SCANNER_MAX_VERT)
 		{
 			g_nVideoClockVert = 0;
 
@@ -776,13 +904,66 @@ inline void updateVideoScannerHorzEOL()
 	}
 }
 
+//===========================================================================
+inline bool updateTextCellCached( uint16_t bits )
+{
+	const int y = g_nVideoClockVert;
+	const int x = g_nVideoClockHorz - VIDEO_SCANNER_HORZ_START;
+	// NB. Only b13..0 of bits are rendered, and b15..14 may be set (flash's XOR, TEXT80's main<<7) so mask them off the key's other fields
+	const uint32_t key = (bits & 0x3FFF) | (g_nSignalBitsNTSC << 14) | (g_nColorPhaseNTSC << 26) | ((g_nColorBurstPixels < 2) << 28);
+
+	g_nTextLineCells++;
+	g_aTextCellSkipped[y][x] = false;
+
+	if (!g_aTextLineCached[y] || g_aTextCellKey[y][x] != key)
+	{
+		g_aTextCellKey[y][x] = key;
+		return false;
+	}
+
+	// NB. g_aTextCellSkipped[y-1] is only current if line y-1 was all text (else it's stale, eg. line 159 in mixed mode)
+	if (g_bTextCellNeedAbove && y > 0 && (!g_aTextLineCached[y-1] || !g_aTextCellSkipped[y-1][x]))
+		return false;
+
+	// Pixels are unchanged: just advance the scanner state as updatePixels() would have
+	const uint16_t exit = g_aTextCellExit[y][x];
+	g_nSignalBitsNTSC      = exit & 0xFFF;
+	g_nColorPhaseNTSC      = (exit >> 12) & 3;
+	g_nLastColumnPixelNTSC = (exit >> 14) & 1;
+
+	if (g_bIndexedFramebuffer)
+		g_pIndexedAddress += 14;
+	else
+		g_pVideoAddress += 14;
+
+	g_aTextCellSkipped[y][x] = true;
+	return true;
+}
+
+//===========================================================================
+inline void updateTextCellStore()
+{
+	const int x = g_nVideoClockHorz - VIDEO_SCANNER_HORZ_START;
+	g_aTextCellExit[g_nVideoClockVert][x] = (uint16_t) (g_nSignalBitsNTSC | (g_nColorPhaseNTSC << 12) | ((g_nLastColumnPixelNTSC & 1) << 14));
+}
+
+//===========================================================================
+static void invalidateTextCells()
+{
+	memset( g_aTextLineCached, 0, sizeof(g_aTextLineCached) );
+	g_nTextLineCells = TEXT_CELLS_PER_LINE+1;	// Current line's cells rendered so far are stale too (reset at next line)
+}
+
 //===========================================================================
 inline void updateVideoScannerAddress()
 {
 	g_pVideoAddress        = g_nVideoClockVert<VIDEO_SCANNER_Y_DISPLAY ? g_pScanLines[2*g_nVideoClockVert] : g_pScanLines[0];
+	g_pIndexedAddress      = g_aIndexedFramebuffer[ g_nVideoClockVert<VIDEO_SCANNER_Y_DISPLAY ? g_nVideoClockVert : 0 ];
+	g_bIndexedFramebufferDirty = true;
 	g_nColorPhaseNTSC      = INITIAL_COLOR_PHASE;
 	g_nLastColumnPixelNTSC = 0;
 	g_nSignalBitsNTSC      = 0;
+	g_nTextLineCells       = 0;
 
 	// ANSI STORY: clear mode and pointer to draw func
 	memset( g_aFuncUpdateHorz    , 0, sizeof( g_aFuncUpdateHorz     ) );
@@ -975,6 +1156,205 @@ static void initChromaPhaseTables (void)
 
 }
 
+//===========================================================================
+static void getChromaTablesLayout(BYTE* pTables[4], UINT uSizes[4])
+{
+	pTables[0] = (BYTE*) g_aBnWMonitor; uSizes[0] = sizeof(g_aBnWMonitor);
+	pTables[1] = (BYTE*) g_aHueMonitor; uSizes[1] = sizeof(g_aHueMonitor);
+	pTables[2] = (BYTE*) g_aBnwColorTV; uSizes[2] = sizeof(g_aBnwColorTV);
+	pTables[3] = (BYTE*) g_aHueColorTV; uSizes[3] = sizeof(g_aHueColorTV);
+}
+
+static uint32_t getChromaTablesChecksum(void)
+{
+	BYTE* pTables[4];
+	UINT uSizes[4];
+	getChromaTablesLayout(pTables, uSizes);
+
+	uint32_t hash = 2166136261u;	// FNV-1a
+	for (UINT t = 0; t < 4; t++)
+		for (UINT i = 0; i < uSizes[t]; i++)
+			hash = (hash ^ pTables[t][i]) * 16777619u;
+
+	return hash;
+}
+
+static void getChromaCachePathname(std::string& pathname)
+{
+	pathname = std::string(g_sProgramDir) + NTSC_CHROMA_CACHE_FILENAME;
+}
+
+static double getElapsed_ms(const LARGE_INTEGER& freq, const LARGE_INTEGER& start)
+{
+	LARGE_INTEGER end;
+	QueryPerformanceCounter(&end);
+	return freq.QuadPart ? (double)(end.QuadPart - start.QuadPart) * 1000.0 / (double)freq.QuadPart : 0.0;
+}
+
+static void copyChromaTables(const bool bSave)
+{
+	BYTE* pTables[4];
+	UINT uSizes[4];
+	getChromaTablesLayout(pTables, uSizes);
+
+	if (bSave)
+		g_vecChromaCanonical.resize(uSizes[0] + uSizes[1] + uSizes[2] + uSizes[3]);
+
+	BYTE* p = &g_vecChromaCanonical[0];
+	for (UINT t = 0; t < 4; t++)
+	{
+		if (bSave)
+			memcpy(p, pTables[t], uSizes[t]);
+		else
+			memcpy(pTables[t], p, uSizes[t]);
+		p += uSizes[t];
+	}
+}
+
+//===========================================================================
+// Map the cache file read-only and copy the tables out (the tables themselves must stay writable, eg. for the debugger's palette load)
+static bool loadChromaTablesFromCache(void)
+{
+	std::string pathname;
+	getChromaCachePathname(pathname);
+
+	HANDLE hFile = CreateFile(pathname.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+
+	BYTE* pTables[4];
+	UINT uSizes[4];
+	getChromaTablesLayout(pTables, uSizes);
+	const UINT uTablesSize = uSizes[0] + uSizes[1] + uSizes[2] + uSizes[3];
+
+	bool bRes = false;
+
+	if (GetFileSize(hFile, NULL) == sizeof(ChromaCacheHeader_t) + uTablesSize)
+	{
+		HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping)
+		{
+			const BYTE* pView = (const BYTE*) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+			if (pView)
+			{
+				const ChromaCacheHeader_t* pHdr = (const ChromaCacheHeader_t*) pView;
+				if (memcmp(pHdr->szId, g_szChromaCacheId, sizeof(pHdr->szId)) == 0 &&
+					pHdr->uVersion == NTSC_CHROMA_CACHE_VERSION &&
+					pHdr->uConfig == NTSC_CHROMA_CACHE_CONFIG &&
+					pHdr->uTablesSize == uTablesSize)
+				{
+					const BYTE* pSrc = pView + sizeof(ChromaCacheHeader_t);
+					for (UINT t = 0; t < 4; t++)
+					{
+						memcpy(pTables[t], pSrc, uSizes[t]);
+						pSrc += uSizes[t];
+					}
+
+					bRes = (getChromaTablesChecksum() == pHdr->uChecksum);	// Else: corrupt file, so caller will regenerate the tables
+				}
+
+				UnmapViewOfFile(pView);
+			}
+
+			CloseHandle(hMapping);
+		}
+	}
+
+	CloseHandle(hFile);
+	return bRes;
+}
+
+//===========================================================================
+// Write to a temp file, then rename, so that concurrent instances never see a partial cache file
+static bool saveChromaTablesToCache(void)
+{
+	std::string pathname;
+	getChromaCachePathname(pathname);
+
+	char szTmpSuffix[16];
+	sprintf_s(szTmpSuffix, sizeof(szTmpSuffix), ".%08X", GetCurrentProcessId());
+	const std::string tmpPathname = pathname + szTmpSuffix;
+
+	LogFileOutput("NTSC: Saving chroma tables to cache: %s\n", pathname.c_str());
+
+	HANDLE hFile = CreateFile(tmpPathname.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		// eg. program dir is read-only: just regenerate next time
+		LogFileOutput("NTSC: Failed to save chroma tables to cache: can't create file (error %u)\n", (UINT)GetLastError());
+		return false;
+	}
+
+	BYTE* pTables[4];
+	UINT uSizes[4];
+	getChromaTablesLayout(pTables, uSizes);
+
+	ChromaCacheHeader_t hdr;
+	memcpy(hdr.szId, g_szChromaCacheId, sizeof(hdr.szId));
+	hdr.uVersion = NTSC_CHROMA_CACHE_VERSION;
+	hdr.uConfig = NTSC_CHROMA_CACHE_CONFIG;
+	hdr.uTablesSize = uSizes[0] + uSizes[1] + uSizes[2] + uSizes[3];
+	hdr.uChecksum = getChromaTablesChecksum();
+
+	DWORD dwBytesWritten;
+	bool bRes = WriteFile(hFile, &hdr, sizeof(hdr), &dwBytesWritten, NULL) && dwBytesWritten == sizeof(hdr);
+	for (UINT t = 0; t < 4 && bRes; t++)
+		bRes = WriteFile(hFile, pTables[t], uSizes[t], &dwBytesWritten, NULL) && dwBytesWritten == uSizes[t];
+
+	CloseHandle(hFile);
+
+	if (!bRes)
+	{
+		LogFileOutput("NTSC: Failed to save chroma tables to cache: write error (error %u)\n", (UINT)GetLastError());
+		DeleteFile(tmpPathname.c_str());
+		return false;
+	}
+
+	if (!MoveFileEx(tmpPathname.c_str(), pathname.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		LogFileOutput("NTSC: Failed to save chroma tables to cache: can't rename temp file (error %u)\n", (UINT)GetLastError());
+		DeleteFile(tmpPathname.c_str());
+		return false;
+	}
+
+	LogFileOutput("NTSC: Saved chroma tables to cache\n");
+	return true;
+}
+
+//===========================================================================
+// . 1st init: load the tables from the cache file, else generate them (& save them to the cache file)
+// . Re-init (eg. debugger's palette reset): restore the 1st init's tables, whether or not they came from the cache file.
+//   (Regenerating isn't an option, as the filters' state would give different tables)
+static void initChromaTables (void)
+{
+	LARGE_INTEGER freq, start;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+
+	if (!g_vecChromaCanonical.empty())
+	{
+		copyChromaTables(false);
+		LogFileOutput("NTSC: Chroma tables restored in %.2f ms\n", getElapsed_ms(freq, start));
+		return;
+	}
+
+	if (loadChromaTablesFromCache())
+	{
+		LogFileOutput("NTSC: Chroma tables loaded from cache in %.2f ms\n", getElapsed_ms(freq, start));
+	}
+	else
+	{
+		initChromaPhaseTables();	// NB. Only ever run once, as the filters have state
+		LogFileOutput("NTSC: Chroma tables generated in %.2f ms\n", getElapsed_ms(freq, start));
+
+		QueryPerformanceCounter(&start);
+		const bool bSaved = saveChromaTablesToCache();
+		LogFileOutput("NTSC: Chroma cache save %s in %.2f ms\n", bSaved ? "done" : "abandoned", getElapsed_ms(freq, start));
+	}
+
+	copyChromaTables(true);
+}
+
 /*
 http://www-users.cs.york.ac.uk/~fisher/mkfilter/trad.html
 Sample Rate: ???
@@ -1079,9 +1459,49 @@ static void initPixelDoubleMasks (void)
 		g_aPixelMaskGR[ color ] = (color << 12) | (color << 8) | (color << 4) | (color << 0);
 }
 
+//===========================================================================
+// Pre: csbits & g_aPixelDoubleMaskHGR[] are setup
+static void initGlyphCache (const UINT uNumCharSets)
+{
+	for (UINT flash = 0; flash < 2; flash++)
+	{
+		const uint16_t flashMask = flash ? 0xFFFF : 0x0000;	// Same as g_nTextFlashMask
+
+		for (UINT charset = 0; charset < 2; charset++)
+		{
+			// Models without an alt char set only ever use charset 0, but keep the 2nd entry valid
+			const UINT srcCharSet = (charset < uNumCharSets) ? charset : 0;
+
+			for (UINT ch = 0; ch < 256; ch++)
+			{
+				// Flash only if mousetext not active
+				const bool bFlash = (0 == charset) && (0x40 == (ch & 0xC0));
+
+				for (UINT row = 0; row < 8; row++)
+				{
+					const uint8_t c = csbits[srcCharSet][ch][row];
+
+					uint16_t bits40 = g_aPixelDoubleMaskHGR[c & 0x7F]; // Optimization: hgrbits second 128 entries are mirror of first 128
+					uint16_t bits80 = c;
+					if (bFlash)
+					{
+						bits40 ^= flashMask;
+						bits80 ^= flashMask;
+					}
+
+					g_aGlyphCacheText40[flash][charset][ch][row] = bits40;
+					g_aGlyphCacheText80[flash][charset][ch][row] = bits80;
+				}
+			}
+		}
+	}
+}
+
 //===========================================================================
 void updateMonochromeTables( uint16_t r, uint16_t g, uint16_t b )
 {
+	invalidateTextCells();
+
 	for( int iSample = 0; iSample < NTSC_NUM_SEQUENCES; iSample++ )
 	{
 		g_aBnWMonitorCustom[ iSample ].b = (g_aBnWMonitor[ iSample ].b * b) >> 8;
@@ -1096,6 +1516,46 @@ void updateMonochromeTables( uint16_t r, uint16_t g, uint16_t b )
 	}
 }
 
+//===========================================================================
+// Build g_aIndexedPalette[] & the signal->index maps from the active chroma tables
+// . Returns false if the tables have more than 256 colors: an 8-bit palette can't represent the style exactly
+static bool updateIndexedPalette (void)
+{
+	if (!g_pIndexedBnWTable)
+		return false;
+
+	std::map<uint32_t, uint8_t> colorToIndex;
+	UINT uColors = 0;
+
+	const int nHueSequences = g_pIndexedHueTable ? NTSC_NUM_PHASES*NTSC_NUM_SEQUENCES : 0;
+	for (int s = 0; s < NTSC_NUM_SEQUENCES + nHueSequences; s++)
+	{
+		const uint32_t color = (s < NTSC_NUM_SEQUENCES) ? *(uint32_t*)&g_pIndexedBnWTable[s]
+		                                                : *(uint32_t*)&g_pIndexedHueTable[s - NTSC_NUM_SEQUENCES];
+		if (colorToIndex.find(color) != colorToIndex.end())
+			continue;
+
+		if (uColors == 256)
+			return false;
+
+		g_aIndexedPalette[uColors] = color;
+		colorToIndex[color] = (uint8_t) uColors++;
+	}
+
+	for (UINT i = uColors; i < 256; i++)
+		g_aIndexedPalette[i] = ALPHA32_MASK;
+
+	for (int s = 0; s < NTSC_NUM_SEQUENCES; s++)
+		g_aIndexedMapBnW[s] = colorToIndex[ *(uint32_t*)&g_pIndexedBnWTable[s] ];
+
+	for (int phase = 0; phase < NTSC_NUM_PHASES; phase++)
+		for (int s = 0; s < NTSC_NUM_SEQUENCES; s++)
+			g_aIndexedMapHue[phase][s] = g_pIndexedHueTable ? colorToIndex[ *(uint32_t*)&g_pIndexedHueTable[phase*NTSC_NUM_SEQUENCES + s] ]
+			                                                : g_aIndexedMapBnW[s];
+
+	return true;
+}
+
 //===========================================================================
 static void updatePixelBnWMonitorSingleScanline (uint16_t compositeSignal)
 {
@@ -1148,6 +1608,19 @@ static void updatePixelHueMonitorDoubleScanline (uint16_t compositeSignal)
 	updateColorPhase();
 }
 
+//===========================================================================
+static void updatePixelBnWIndexed (uint16_t compositeSignal)
+{
+	updateFramebufferIndexed(compositeSignal, g_aIndexedMapBnW);
+}
+
+//===========================================================================
+static void updatePixelHueIndexed (uint16_t compositeSignal)
+{
+	updateFramebufferIndexed(compositeSignal, g_aIndexedMapHue[g_nColorPhaseNTSC]);
+	updateColorPhase();
+}
+
 //===========================================================================
 void updateScreenDoubleHires40 (long cycles6502) // wsUpdateVideoHires0
 {
@@ -1390,13 +1863,13 @@ void updateScreenText40 (long cycles6502)
 
 				uint8_t *pMain = MemGetMainPtr(addr);
 				uint8_t  m     = pMain[0];
-				uint8_t  c     = getCharSetBits(m);
-				uint16_t bits  = g_aPixelDoubleMaskHGR[c & 0x7F]; // Optimization: hgrbits second 128 entries are mirror of first 128
+				uint16_t bits  = getGlyphBits40(m);	// NB. Flash already applied
 
-				if (0 == g_nVideoCharSet && 0x40 == (m & 0xC0)) // Flash only if mousetext not active
-					bits ^= g_nTextFlashMask;
-
-				updatePixels( bits );
+				if (!updateTextCellCached( bits ))
+				{
+					updatePixels( bits );
+					updateTextCellStore();
+				}
 
 			}
 		}
@@ -1428,17 +1901,15 @@ void updateScreenText80 (long cycles6502)
 				uint8_t m = pMain[0];
 				uint8_t a = pAux [0];
 
-				uint16_t main = getCharSetBits( m );
-				uint16_t aux  = getCharSetBits( a );
-
-				if ((0 == g_nVideoCharSet) && 0x40 == (m & 0xC0)) // Flash only if mousetext not active
-					main ^= g_nTextFlashMask;
-
-				if ((0 == g_nVideoCharSet) && 0x40 == (a & 0xC0)) // Flash only if mousetext not active
-					aux ^= g_nTextFlashMask;
+				uint16_t main = getGlyphBits80( m );	// NB. Flash already applied
+				uint16_t aux  = getGlyphBits80( a );
 
 				uint16_t bits = (main << 7) | aux;
-				updatePixels( bits );
+				if (!updateTextCellCached( bits ))
+				{
+					updatePixels( bits );
+					updateTextCellStore();
+				}
 			}
 		}
 		updateVideoScannerHorzEOL();
@@ -1473,34 +1944,33 @@ uint32_t*NTSC_VideoGetChromaTable( bool bHueTypeMonochrome, bool bMonitorTypeCol
 }
 
 //===========================================================================
-
-// NB. NTSC video-scanner doesn't get updated during full-speed, so video-dependent Apple II code can hang
-uint16_t NTSC_VideoGetScannerAddress ( void )
+// Stateless: the video address fetched at scanner position (v,h), using the TXT/HGR row-base & horz offset tables
+static uint16_t getVideoScannerAddress ( const UINT v, const UINT h )
 {
-	const uint16_t currVideoClockVert = g_nVideoClockVert;
-	const uint16_t currVideoClockHorz = g_nVideoClockHorz;
-
-	// Required for ANSI STORY (end credits) vert scrolling mid-scanline mixed mode: DGR80, TEXT80, DGR80
-	g_nVideoClockHorz -= 2;
-	if ((SHORT)g_nVideoClockHorz < 0)
-	{
-		g_nVideoClockHorz += VIDEO_SCANNER_MAX_HORZ;
-		g_nVideoClockVert -= 1;
-		if ((SHORT)g_nVideoClockVert < 0)
-			g_nVideoClockVert = VIDEO_SCANNER_MAX_VERT-1;
-	}
-
-	uint16_t addr;
 	bool bHires = (g_uVideoMode & VF_HIRES) && !(g_uVideoMode & VF_TEXT); // SW_HIRES && !SW_TEXT
 	if( bHires )
-		addr = updateVideoScannerAddressHGR();
+		return (g_aClockVertOffsetsHGR[v] + APPLE_IIE_HORZ_CLOCK_OFFSET[v/64][h] + (g_nHiresPage * 0x2000));	// BUG? g_pHorzClockOffset (see updateVideoScannerAddressHGR())
 	else
-		addr = updateVideoScannerAddressTXT();
+		return (g_aClockVertOffsetsTXT[v/8] + g_pHorzClockOffset[v/64][h] + (g_nTextPage * 0x400));
+}
 
-	g_nVideoClockVert = currVideoClockVert;
-	g_nVideoClockHorz = currVideoClockHorz;
+//===========================================================================
+// Video address at the NTSC scanner's current position
+// NB. NTSC video-scanner doesn't get updated during full-speed - so use NTSC_VideoGetScannerAddressFromCycles() for emulation
+uint16_t NTSC_VideoGetScannerAddress ( void )
+{
+	return NTSC_VideoGetScannerAddressFromCycles( g_nVideoClockVert * VIDEO_SCANNER_MAX_HORZ + g_nVideoClockHorz );
+}
+
+//===========================================================================
+// Closed-form: video address for a cycle offset into the video frame (eg. from CpuGetCyclesThisVideoFrame())
+// . Doesn't depend on the NTSC scanner state, so is also correct during full-speed (when the scanner isn't updated)
+uint16_t NTSC_VideoGetScannerAddressFromCycles ( const DWORD uCyclesThisFrame )
+{
+	// Required for ANSI STORY (end credits) vert scrolling mid-scanline mixed mode: DGR80, TEXT80, DGR80
+	const UINT cycles = (uCyclesThisFrame + VIDEO_SCANNER_6502_CYCLES - 2) % VIDEO_SCANNER_6502_CYCLES;
 
-	return addr;
+	return getVideoScannerAddress( cycles / VIDEO_SCANNER_MAX_HORZ, cycles % VIDEO_SCANNER_MAX_HORZ );
 }
 
 //===========================================================================
@@ -1564,8 +2034,9 @@ void NTSC_SetVideoMode( uint32_t uVideoModeFlags )
 //===========================================================================
 void NTSC_SetVideoStyle() // (int v, int s)
 {
-    int half = g_uHalfScanLines;
+    int half = g_uHalfScanLines && !VideoScaler_GetScanlines();	// Scaler draws its own scanlines
 	uint8_t r, g, b;
+	bool bColorTV = false;
 
 	switch ( g_eVideoType )
 	{
@@ -1574,6 +2045,9 @@ void NTSC_SetVideoStyle() // (int v, int s)
 			g = 0xFF;
 			b = 0xFF;
 			updateMonochromeTables( r, g, b );
+			g_pIndexedBnWTable = g_aBnWColorTVCustom;
+			g_pIndexedHueTable = &g_aHueColorTV[0][0];
+			bColorTV = true;
 			if (half)
 			{
 				g_pFuncUpdateBnWPixel = updatePixelBnWColorTVSingleScanline;
@@ -1591,6 +2065,8 @@ void NTSC_SetVideoStyle() // (int v, int s)
 			g = 0xFF;
 			b = 0xFF;
 			updateMonochromeTables( r, g, b );
+			g_pIndexedBnWTable = g_aBnWMonitorCustom;
+			g_pIndexedHueTable = &g_aHueMonitor[0][0];
 			if (half)
 			{
 				g_pFuncUpdateBnWPixel = updatePixelBnWMonitorSingleScanline;
@@ -1607,6 +2083,9 @@ void NTSC_SetVideoStyle() // (int v, int s)
 			g = 0xFF;
 			b = 0xFF;
 			updateMonochromeTables( r, g, b ); // Custom Monochrome color
+			g_pIndexedBnWTable = g_aBnWColorTVCustom;
+			g_pIndexedHueTable = NULL;
+			bColorTV = true;
 			if (half)
 			{
 				g_pFuncUpdateBnWPixel = g_pFuncUpdateHuePixel = updatePixelBnWColorTVSingleScanline;
@@ -1646,6 +2125,8 @@ void NTSC_SetVideoStyle() // (int v, int s)
 			b = (g_nMonochromeRGB >> 16) & 0xFF;
 _mono:
 			updateMonochromeTables( r, g, b ); // Custom Monochrome color
+			g_pIndexedBnWTable = g_aBnWMonitorCustom;
+			g_pIndexedHueTable = NULL;
 			if (half)
 			{
 				g_pFuncUpdateBnWPixel = g_pFuncUpdateHuePixel = updatePixelBnWMonitorSingleScanline;
@@ -1656,6 +2137,24 @@ _mono:
 			}
 			break;
 		}
+
+	if (bColorTV)
+		g_eIndexedStyle = half ? INDEXED_COLORTV_SINGLE : INDEXED_COLORTV_DOUBLE;
+	else
+		g_eIndexedStyle = half ? INDEXED_MONITOR_SINGLE : INDEXED_MONITOR_DOUBLE;
+
+	g_bIndexedFramebuffer = g_bIndexedRequested && updateIndexedPalette();
+	g_bIndexedFramebufferDirty = true;
+
+	if (g_bIndexedRequested && !g_bIndexedFramebuffer)
+		LogFileOutput("NTSC: -fb-indexed: video style has more than 256 colors, so using the 32-bit framebuffer\n");
+	g_bTextCellNeedAbove = bColorTV && !g_bIndexedFramebuffer;
+
+	if (g_bIndexedFramebuffer)
+	{
+		g_pFuncUpdateBnWPixel = updatePixelBnWIndexed;
+		g_pFuncUpdateHuePixel = g_pIndexedHueTable ? updatePixelHueIndexed : updatePixelBnWIndexed;
+	}
 }
 
 //===========================================================================
@@ -1663,7 +2162,7 @@ void NTSC_VideoInit( uint8_t* pFramebuffer ) // wsVideoInit
 {
 	make_csbits();
 	initPixelDoubleMasks();
-	initChromaPhaseTables();
+	initChromaTables();
 	updateMonochromeTables( 0xFF, 0xFF, 0xFF );
 
 	for (int y = 0; y < (VIDEO_SCANNER_Y_DISPLAY*2); y++)
@@ -1760,7 +2259,10 @@ void NTSC_VideoInitAppleType ()
 //===========================================================================
 void NTSC_VideoInitChroma()
 {
-	initChromaPhaseTables();
+	initChromaTables();
+	if (g_bIndexedRequested)
+		NTSC_SetVideoStyle();	// Rebuild the palette (& fall back to the 32-bit writers if it's no longer exact)
+	invalidateTextCells();
 }
 
 //===========================================================================
@@ -1820,6 +2322,15 @@ void NTSC_VideoUpdateCycles( long cycles6502 )
 	_ASSERT(cycles6502 < VIDEO_SCANNER_6502_CYCLES);	// Use NTSC_VideoRedrawWholeScreen() instead
 
 	VideoUpdateCycles(cycles6502);
+	g_nVideoScannerCycles += cycles6502;
+
+	if (g_bVideoScannerEnteredVBL)
+	{
+		// The frame's 192 lines are complete, and video memory is as at the end of the opcode that reached VBL:
+		// so unlike the host-timed end of frame in ContinueExecution(), this point is the same on every run
+		g_bVideoScannerEnteredVBL = false;
+		Video_FrameHashUpdate(g_nVideoScannerCycles);
+	}
 }
 
 //===========================================================================
@@ -1831,6 +2342,7 @@ void NTSC_VideoRedrawWholeScreen( void )
 #endif
 
 	VideoUpdateCycles(VIDEO_SCANNER_6502_CYCLES);
+	g_bVideoScannerEnteredVBL = false;	// A redraw, not emulated time
 
 #ifdef _DEBUG
 	_ASSERT(currVideoClockVert == g_nVideoClockVert);
@@ -1838,6 +2350,72 @@ void NTSC_VideoRedrawWholeScreen( void )
 #endif
 }
 
+//===========================================================================
+// Call before VideoInitialize()
+void NTSC_SetIndexedFramebuffer( bool bEnable )
+{
+	g_bIndexedRequested = bEnable;
+}
+
+// True if the current video style is using the indexed framebuffer (ie. it's been requested & the style's palette is exact)
+bool NTSC_IsIndexedFramebuffer( void )
+{
+	return g_bIndexedFramebuffer;
+}
+
+const uint8_t* NTSC_GetIndexedFramebuffer( UINT& uWidth, UINT& uPitch )
+{
+	uWidth = INDEXED_FRAMEBUFFER_PIXELS;
+	uPitch = INDEXED_FRAMEBUFFER_PITCH;
+	return &g_aIndexedFramebuffer[0][0];
+}
+
+const uint32_t* NTSC_GetIndexedPalette( void )
+{
+	return g_aIndexedPalette;
+}
+
+//===========================================================================
+// Expand the indexed framebuffer to g_pFramebufferbits, applying the same scanline blending as the direct 32-bit writers
+// . Only if it's changed since the last call, as it's called for each present, screenshot & dirty-rect query
+void NTSC_VideoConvertIndexedFramebuffer( void )
+{
+	if (!g_bIndexedFramebuffer || !g_bIndexedFramebufferDirty)
+		return;
+
+	g_bIndexedFramebufferDirty = false;
+
+	bgra_t* pSavedVideoAddress = g_pVideoAddress;
+
+	for (int y = 0; y < VIDEO_SCANNER_Y_DISPLAY; y++)
+	{
+		const uint8_t* pSrc = g_aIndexedFramebuffer[y];
+		g_pVideoAddress = g_pScanLines[2*y];
+
+		switch (g_eIndexedStyle)
+		{
+		case INDEXED_MONITOR_DOUBLE:
+			for (int x = 0; x < INDEXED_FRAMEBUFFER_PIXELS; x++)
+				putFramebufferMonitorDoubleScanline( g_aIndexedPalette[ pSrc[x] ] );
+			break;
+		case INDEXED_MONITOR_SINGLE:
+			for (int x = 0; x < INDEXED_FRAMEBUFFER_PIXELS; x++)
+				putFramebufferMonitorSingleScanline( g_aIndexedPalette[ pSrc[x] ] );
+			break;
+		case INDEXED_COLORTV_DOUBLE:
+			for (int x = 0; x < INDEXED_FRAMEBUFFER_PIXELS; x++)
+				putFramebufferColorTVDoubleScanline( g_aIndexedPalette[ pSrc[x] ] );
+			break;
+		case INDEXED_COLORTV_SINGLE:
+			for (int x = 0; x < INDEXED_FRAMEBUFFER_PIXELS; x++)
+				putFramebufferColorTVSingleScanline( g_aIndexedPalette[ pSrc[x] ] );
+			break;
+		}
+	}
+
+	g_pVideoAddress = pSavedVideoAddress;
+}
+
 //===========================================================================
 bool NTSC_GetColorBurst( void )
 {
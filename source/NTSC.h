@@ -12,6 +12,7 @@
 	extern void     NTSC_SetVideoTextMode( int cols );
 	extern uint32_t*NTSC_VideoGetChromaTable( bool bHueTypeMonochrome, bool bMonitorTypeColorTV );
 	extern uint16_t NTSC_VideoGetScannerAddress( void );
+	extern uint16_t NTSC_VideoGetScannerAddressFromCycles( const DWORD uCyclesThisFrame );
 	extern void     NTSC_VideoInit( uint8_t *pFramebuffer );
 	extern void     NTSC_VideoReinitialize( DWORD cyclesThisFrame );
 	extern void     NTSC_VideoInitAppleType();
@@ -19,3 +20,8 @@
 	extern void     NTSC_VideoUpdateCycles( long cycles6502 );
 	extern void     NTSC_VideoRedrawWholeScreen( void );
 	extern bool     NTSC_GetColorBurst( void );
+	extern void     NTSC_SetIndexedFramebuffer( bool bEnable );
+	extern bool     NTSC_IsIndexedFramebuffer( void );
+	extern const uint8_t*  NTSC_GetIndexedFramebuffer( UINT& uWidth, UINT& uPitch );
+	extern const uint32_t* NTSC_GetIndexedPalette( void );
+	extern void     NTSC_VideoConvertIndexedFramebuffer( void );
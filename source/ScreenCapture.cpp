@@ -0,0 +1,521 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2017, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: Asynchronous screenshot (.png) & frame-sequence capture
+ *
+ * The emulation thread copies the frame into a pooled buffer and queues it.
+ * A background thread encodes & writes it, so file I/O never stalls emulation or audio.
+ * If the pool runs dry the frame is dropped (& counted), as the emulation thread mustn't wait on file I/O.
+ * A dropped frame's number is skipped, so the gap shows in the frame-sequence file.
+ *
+ * Frame-sequence file (-capture <file>):
+ *   CaptureFileHeader_t, then per frame: CaptureFrameHeader_t + frame data
+ *   Frame data is 32bpp BGRA, bottom-up, optionally XOR'd with the previous frame (CAPTURE_FRAME_DELTA)
+ *   and optionally zlib compressed (CAPTURE_FRAME_DEFLATED).
+ *   Each key frame (no CAPTURE_FRAME_DELTA) can be decoded on its own.
+ *
+ * Author: Various
+ */
+
+#include "StdAfx.h"
+
+#include "Common.h"
+#include "Frame.h"
+#include "Log.h"
+#include "ScreenCapture.h"
+
+#include "zlib.h"
+
+static const UINT kNumBuffers = 8;			// 8 x 860KB: absorbs a burst of slow writes while recording at 60fps
+static const UINT kBufferPixels = FRAMEBUFFER_BORDERLESS_W * FRAMEBUFFER_BORDERLESS_H;
+static const UINT kKeyFrameInterval = 600;	// Every 10 secs
+
+#pragma pack(push)
+#pragma pack(1)	// Ensure struct is packed
+
+struct CaptureFileHeader_t
+{
+	char     szId[8];			// "AWCAPT"
+	uint32_t uVersion;
+	uint32_t uWidth;
+	uint32_t uHeight;
+	uint32_t uClockHz;			// 6502 clock
+	uint32_t uCyclesPerFrame;	// Frame rate = uClockHz / uCyclesPerFrame (~59.92Hz)
+};
+
+struct CaptureFrameHeader_t
+{
+	uint32_t uFrame;
+	uint32_t uFlags;
+	uint32_t uSize;				// Size of frame data that follows
+};
+
+#pragma pack(pop)
+
+static const char kCaptureId[] = "AWCAPT";
+static const uint32_t kCaptureVersion = 1;
+
+enum
+{
+	CAPTURE_FRAME_DEFLATED	= 1<<0,
+	CAPTURE_FRAME_DELTA		= 1<<1,
+};
+
+enum CaptureJob_e {CAPTURE_PNG, CAPTURE_FRAME};
+
+struct CaptureJob_t
+{
+	CaptureJob_e eType;
+	uint32_t* pBuffer;
+	UINT uFrame;				// CAPTURE_FRAME: incl. any dropped frames
+	UINT uWidth;
+	UINT uHeight;
+	std::string strFilename;
+};
+
+static bool g_bCaptureInit = false;
+static uint32_t* g_pBuffers[kNumBuffers] = {0};
+static std::stack<uint32_t*> g_FreeBuffers;
+static std::queue<CaptureJob_t> g_Jobs;
+static volatile LONG g_nPendingJobs = 0;	// Queued or being encoded
+
+static CRITICAL_SECTION g_CaptureCriticalSection;	// To guard /g_FreeBuffers/ & /g_Jobs/
+static HANDLE g_hCaptureThread = NULL;
+static HANDLE g_hCaptureEvent[2] = {NULL, NULL};	// [0] = Job queued, [1] = Exit
+
+// Only accessed by the encoder thread (or when there are no pending jobs)
+static FILE* g_pRecordFile = NULL;
+static bool g_bRecordError = false;
+static UINT g_uRecordFrames = 0;
+static UINT g_uRecordFramesRaw = 0;
+static std::vector<uint32_t> g_PrevFrame;
+static std::vector<uint8_t> g_Scratch;
+static std::vector<uint8_t> g_Deflated;
+
+// Only accessed by the emulation thread
+static UINT g_uRecordFrameNum = 0;
+static UINT g_uRecordDropped = 0;
+
+static DWORD WINAPI ScreenCaptureThread(LPVOID);
+
+//===========================================================================
+
+static void ScreenCapture_Init(void)
+{
+	if (g_bCaptureInit)
+		return;
+
+	g_bCaptureInit = true;
+	InitializeCriticalSection(&g_CaptureCriticalSection);
+
+	for (UINT i=0; i<kNumBuffers; i++)
+	{
+		g_pBuffers[i] = new uint32_t[kBufferPixels];
+		g_FreeBuffers.push(g_pBuffers[i]);
+	}
+
+	g_hCaptureEvent[0] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto-reset, initially non-signaled
+	g_hCaptureEvent[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (g_hCaptureEvent[0] && g_hCaptureEvent[1])
+	{
+		DWORD dwThreadId;
+		g_hCaptureThread = CreateThread(NULL,				// lpThreadAttributes
+										0,					// dwStackSize
+										ScreenCaptureThread,
+										NULL,				// lpParameter
+										0,					// dwCreationFlags : 0 = Run immediately
+										&dwThreadId);		// lpThreadId
+	}
+
+	// If there's no encoder thread, then jobs are just done synchronously
+	LogFileOutput("ScreenCapture: CreateThread(), g_hCaptureThread=0x%08X\n", (UINT32)g_hCaptureThread);
+
+	if (g_hCaptureThread)
+		SetThreadPriority(g_hCaptureThread, THREAD_PRIORITY_BELOW_NORMAL);
+}
+
+void ScreenCapture_Uninit(void)
+{
+	if (!g_bCaptureInit)
+		return;
+
+	ScreenCapture_RecordStop();
+
+	if (g_hCaptureThread)
+	{
+		SetEvent(g_hCaptureEvent[1]);	// Thread drains the queue before exiting
+		WaitForSingleObject(g_hCaptureThread, INFINITE);
+		CloseHandle(g_hCaptureThread);
+		g_hCaptureThread = NULL;
+	}
+
+	for (UINT i=0; i<2; i++)
+	{
+		if (g_hCaptureEvent[i])
+			CloseHandle(g_hCaptureEvent[i]);
+		g_hCaptureEvent[i] = NULL;
+	}
+
+	while (!g_FreeBuffers.empty())
+		g_FreeBuffers.pop();
+
+	for (UINT i=0; i<kNumBuffers; i++)
+	{
+		delete [] g_pBuffers[i];
+		g_pBuffers[i] = NULL;
+	}
+
+	DeleteCriticalSection(&g_CaptureCriticalSection);
+	g_bCaptureInit = false;
+}
+
+//===========================================================================
+
+// Returns NULL if the encoder has fallen behind & all the buffers are in use (the caller mustn't wait for one)
+uint32_t* ScreenCapture_AcquireBuffer(void)
+{
+	ScreenCapture_Init();
+
+	uint32_t* pBuffer = NULL;
+
+	EnterCriticalSection(&g_CaptureCriticalSection);
+	if (!g_FreeBuffers.empty())
+	{
+		pBuffer = g_FreeBuffers.top();
+		g_FreeBuffers.pop();
+	}
+	LeaveCriticalSection(&g_CaptureCriticalSection);
+
+	return pBuffer;
+}
+
+void ScreenCapture_ReleaseBuffer(uint32_t* pBuffer)
+{
+	EnterCriticalSection(&g_CaptureCriticalSection);
+	g_FreeBuffers.push(pBuffer);
+	LeaveCriticalSection(&g_CaptureCriticalSection);
+}
+
+//===========================================================================
+
+static void PutBE32(uint8_t* p, uint32_t n)
+{
+	p[0] = (uint8_t) (n >> 24);
+	p[1] = (uint8_t) (n >> 16);
+	p[2] = (uint8_t) (n >> 8);
+	p[3] = (uint8_t) n;
+}
+
+static bool ScreenCapture_WritePNGChunk(FILE* pFile, const char* pType, const uint8_t* pData, UINT uSize)
+{
+	uint8_t aHeader[8];
+	PutBE32(&aHeader[0], uSize);
+	memcpy(&aHeader[4], pType, 4);
+
+	uLong uCRC = crc32(0, &aHeader[4], 4);
+	if (uSize)
+		uCRC = crc32(uCRC, pData, uSize);
+
+	uint8_t aCRC[4];
+	PutBE32(aCRC, uCRC);
+
+	return fwrite(aHeader, sizeof(aHeader), 1, pFile) == 1
+		&& (uSize == 0 || fwrite(pData, uSize, 1, pFile) == 1)
+		&& fwrite(aCRC, sizeof(aCRC), 1, pFile) == 1;
+}
+
+// 24-bit RGB, no interlace
+static bool ScreenCapture_WritePNG(const CaptureJob_t& job)
+{
+	const UINT uRowBytes = 1 + job.uWidth*3;	// Filter byte + RGB
+	g_Scratch.resize(uRowBytes * job.uHeight);
+
+	uint8_t* pDst = &g_Scratch[0];
+	for (UINT y=0; y<job.uHeight; y++)
+	{
+		const uint8_t* pSrc = (const uint8_t*) &job.pBuffer[(job.uHeight-1-y) * job.uWidth];	// Buffer is bottom-up
+		*pDst++ = 0;	// Filter: None
+		for (UINT x=0; x<job.uWidth; x++, pSrc+=4)
+		{
+			*pDst++ = pSrc[2];	// BGRA -> RGB
+			*pDst++ = pSrc[1];
+			*pDst++ = pSrc[0];
+		}
+	}
+
+	uLongf uDeflatedSize = compressBound(g_Scratch.size());
+	g_Deflated.resize(uDeflatedSize);
+	if (compress2(&g_Deflated[0], &uDeflatedSize, &g_Scratch[0], g_Scratch.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+		return false;
+
+	FILE* pFile = fopen(job.strFilename.c_str(), "wb");
+	if (!pFile)
+		return false;
+
+	static const uint8_t aSignature[8] = {0x89,'P','N','G','\r','\n',0x1A,'\n'};
+
+	uint8_t aIHDR[13];
+	PutBE32(&aIHDR[0], job.uWidth);
+	PutBE32(&aIHDR[4], job.uHeight);
+	aIHDR[8] = 8;	// Bit depth
+	aIHDR[9] = 2;	// Colour type: RGB
+	aIHDR[10] = 0;	// Compression: deflate
+	aIHDR[11] = 0;	// Filter method: adaptive
+	aIHDR[12] = 0;	// Interlace: none
+
+	bool bRes = fwrite(aSignature, sizeof(aSignature), 1, pFile) == 1
+		&& ScreenCapture_WritePNGChunk(pFile, "IHDR", aIHDR, sizeof(aIHDR))
+		&& ScreenCapture_WritePNGChunk(pFile, "IDAT", &g_Deflated[0], uDeflatedSize)
+		&& ScreenCapture_WritePNGChunk(pFile, "IEND", NULL, 0);
+
+	fclose(pFile);
+	return bRes;
+}
+
+//===========================================================================
+
+static void ScreenCapture_WriteFrame(const CaptureJob_t& job, const size_t uBacklog)
+{
+	if (!g_pRecordFile || g_bRecordError)
+		return;
+
+	const UINT uPixels = job.uWidth * job.uHeight;
+	const UINT uBytes = uPixels * sizeof(uint32_t);
+
+	CaptureFrameHeader_t frame;
+	frame.uFrame = job.uFrame;
+	frame.uFlags = 0;
+
+	const uint8_t* pData = (const uint8_t*) job.pBuffer;
+
+	if ((g_uRecordFrames % kKeyFrameInterval) != 0 && g_PrevFrame.size() == uPixels)
+	{
+		// Delta: mostly zeros for static screens, so deflates to almost nothing
+		g_Scratch.resize(uBytes);
+		uint32_t* pDelta = (uint32_t*) &g_Scratch[0];
+		for (UINT i=0; i<uPixels; i++)
+		{
+			pDelta[i] = job.pBuffer[i] ^ g_PrevFrame[i];
+			g_PrevFrame[i] = job.pBuffer[i];
+		}
+
+		pData = &g_Scratch[0];
+		frame.uFlags |= CAPTURE_FRAME_DELTA;
+	}
+	else
+	{
+		g_PrevFrame.assign(job.pBuffer, job.pBuffer + uPixels);
+	}
+
+	frame.uSize = uBytes;
+
+	// Encoder falling behind: store uncompressed to catch up (so fewer frames are dropped)
+	if (uBacklog < kNumBuffers/2)
+	{
+		uLongf uDeflatedSize = compressBound(uBytes);
+		g_Deflated.resize(uDeflatedSize);
+		if (compress2(&g_Deflated[0], &uDeflatedSize, pData, uBytes, Z_BEST_SPEED) == Z_OK && uDeflatedSize < uBytes)
+		{
+			pData = &g_Deflated[0];
+			frame.uSize = uDeflatedSize;
+			frame.uFlags |= CAPTURE_FRAME_DEFLATED;
+		}
+	}
+
+	if (!(frame.uFlags & CAPTURE_FRAME_DEFLATED))
+		g_uRecordFramesRaw++;
+
+	if (fwrite(&frame, sizeof(frame), 1, g_pRecordFile) != 1 || fwrite(pData, frame.uSize, 1, g_pRecordFile) != 1)
+	{
+		LogFileOutput("ScreenCapture: Write failed at frame %u\n", g_uRecordFrames);
+		g_bRecordError = true;
+	}
+
+	g_uRecordFrames++;
+}
+
+static void ScreenCapture_DoJob(const CaptureJob_t& job, const size_t uBacklog)
+{
+	if (job.eType == CAPTURE_PNG)
+	{
+		if (!ScreenCapture_WritePNG(job))
+			LogFileOutput("ScreenCapture: Failed to write: %s\n", job.strFilename.c_str());
+	}
+	else
+	{
+		ScreenCapture_WriteFrame(job, uBacklog);
+	}
+
+	ScreenCapture_ReleaseBuffer(job.pBuffer);
+	InterlockedDecrement(&g_nPendingJobs);
+}
+
+static DWORD WINAPI ScreenCaptureThread(LPVOID)
+{
+	while (1)
+	{
+		DWORD dwRes = WaitForMultipleObjects(2, g_hCaptureEvent, FALSE, INFINITE);
+
+		// Always drain the queue (even on exit), so no queued frame is lost
+		while (1)
+		{
+			EnterCriticalSection(&g_CaptureCriticalSection);
+			if (g_Jobs.empty())
+			{
+				LeaveCriticalSection(&g_CaptureCriticalSection);
+				break;
+			}
+			CaptureJob_t job = g_Jobs.front();
+			g_Jobs.pop();
+			const size_t uBacklog = g_Jobs.size();
+			LeaveCriticalSection(&g_CaptureCriticalSection);
+
+			ScreenCapture_DoJob(job, uBacklog);
+		}
+
+		if (dwRes != WAIT_OBJECT_0)
+			break;
+	}
+
+	return 0;
+}
+
+//===========================================================================
+
+static void ScreenCapture_Queue(const CaptureJob_t& job)
+{
+	InterlockedIncrement(&g_nPendingJobs);
+
+	if (!g_hCaptureThread)
+	{
+		ScreenCapture_DoJob(job, 0);
+		return;
+	}
+
+	EnterCriticalSection(&g_CaptureCriticalSection);
+	g_Jobs.push(job);
+	LeaveCriticalSection(&g_CaptureCriticalSection);
+
+	SetEvent(g_hCaptureEvent[0]);
+}
+
+void ScreenCapture_SubmitPNG(uint32_t* pBuffer, UINT uWidth, UINT uHeight, const char* pszFilename)
+{
+	_ASSERT(uWidth * uHeight <= kBufferPixels);
+
+	CaptureJob_t job;
+	job.eType = CAPTURE_PNG;
+	job.pBuffer = pBuffer;
+	job.uFrame = 0;
+	job.uWidth = uWidth;
+	job.uHeight = uHeight;
+	job.strFilename = pszFilename;
+	ScreenCapture_Queue(job);
+}
+
+void ScreenCapture_SubmitFrame(uint32_t* pBuffer, UINT uWidth, UINT uHeight)
+{
+	_ASSERT(uWidth == FRAMEBUFFER_BORDERLESS_W && uHeight == FRAMEBUFFER_BORDERLESS_H);
+
+	CaptureJob_t job;
+	job.eType = CAPTURE_FRAME;
+	job.pBuffer = pBuffer;
+	job.uFrame = g_uRecordFrameNum++;
+	job.uWidth = uWidth;
+	job.uHeight = uHeight;
+	ScreenCapture_Queue(job);
+}
+
+// No free buffer for this frame: skip its frame number
+void ScreenCapture_DropFrame(void)
+{
+	g_uRecordFrameNum++;
+	g_uRecordDropped++;
+}
+
+// Wait until all queued jobs have been written
+void ScreenCapture_Flush(void)
+{
+	while (g_nPendingJobs > 0)
+		Sleep(1);
+}
+
+//===========================================================================
+
+bool ScreenCapture_RecordStart(const char* pszFilename)
+{
+	if (g_pRecordFile)
+		return false;
+
+	ScreenCapture_Init();
+
+	FILE* pFile = fopen(pszFilename, "wb");
+	if (!pFile)
+		return false;
+
+	CaptureFileHeader_t header;
+	memset(&header, 0, sizeof(header));
+	strcpy(header.szId, kCaptureId);
+	header.uVersion = kCaptureVersion;
+	header.uWidth = FRAMEBUFFER_BORDERLESS_W;
+	header.uHeight = FRAMEBUFFER_BORDERLESS_H;
+	header.uClockHz = (uint32_t) CLK_6502;
+	header.uCyclesPerFrame = dwClksPerFrame;
+
+	if (fwrite(&header, sizeof(header), 1, pFile) != 1)
+	{
+		fclose(pFile);
+		return false;
+	}
+
+	g_bRecordError = false;
+	g_uRecordFrames = 0;
+	g_uRecordFramesRaw = 0;
+	g_uRecordFrameNum = 0;
+	g_uRecordDropped = 0;
+	g_PrevFrame.clear();
+
+	g_pRecordFile = pFile;	// Set last: no frame jobs are queued until this is non-NULL
+	LogFileOutput("ScreenCapture: Recording to: %s\n", pszFilename);
+	return true;
+}
+
+void ScreenCapture_RecordStop(void)
+{
+	if (!g_pRecordFile)
+		return;
+
+	ScreenCapture_Flush();
+
+	fclose(g_pRecordFile);
+	g_pRecordFile = NULL;
+
+	LogFileOutput("ScreenCapture: Recorded %u frames (uncompressed=%u, dropped=%u, error=%d)\n",
+		g_uRecordFrames, g_uRecordFramesRaw, g_uRecordDropped, g_bRecordError ? 1 : 0);
+}
+
+bool ScreenCapture_IsRecording(void)
+{
+	return g_pRecordFile != NULL;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+// Asynchronous screenshot & frame-sequence capture
+// . Emulation thread only copies the frame into a pooled buffer & queues it
+// . Encoder thread does the zlib deflate & the file I/O
+// . Pixel buffers are 32bpp BGRA, stored bottom-up (ie. same row order as the DIB framebuffer & .bmp files)
+
+uint32_t* ScreenCapture_AcquireBuffer(void);
+void      ScreenCapture_ReleaseBuffer(uint32_t* pBuffer);
+void      ScreenCapture_SubmitPNG(uint32_t* pBuffer, UINT uWidth, UINT uHeight, const char* pszFilename);
+void      ScreenCapture_SubmitFrame(uint32_t* pBuffer, UINT uWidth, UINT uHeight);
+void      ScreenCapture_DropFrame(void);
+void      ScreenCapture_Flush(void);
+void      ScreenCapture_Uninit(void);
+
+bool      ScreenCapture_RecordStart(const char* pszFilename);
+void      ScreenCapture_RecordStop(void);
+bool      ScreenCapture_IsRecording(void);
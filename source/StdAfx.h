@@ -31,6 +31,7 @@
 typedef UINT8 uint8_t;
 typedef UINT16 uint16_t;
 typedef UINT32 uint32_t;
+typedef UINT64 uint64_t;
 #endif
 
 #include <windows.h>
@@ -32,9 +32,12 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "CPU.h"
 #include "Frame.h"
 #include "Keyboard.h"
+#include "Log.h"
 #include "Memory.h"
 #include "Registry.h"
+#include "ScreenCapture.h"
 #include "Video.h"
+#include "VideoScaler.h"
 #include "NTSC.h"
 
 #include "..\resource\resource.h"
@@ -42,6 +45,8 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "Debugger\Debugger_Color.h"	// For NUM_DEBUG_COLORS
 #include "YamlHelper.h"
 
+#include "VideoDirtyRect.inl"
+
 #define HALF_PIXEL_SOLID 1
 #define HALF_PIXEL_BLEED 0
 
@@ -208,6 +213,7 @@ const BYTE DoubleHiresPalIndex[16] = {
 
     uint8_t      *g_pFramebufferbits = NULL; // last drawn frame
 	int           g_nAltCharSetOffset  = 0; // alternate character set
+	bool          g_bVideoScannerAtFullSpeed = false; // NTSC scanner keeps running at full-speed (eg. for -frame-hash)
 
 // Globals (Private)
 
@@ -302,12 +308,14 @@ static bool bVideoScannerNTSC = true;  // NTSC video scanning (or PAL)
 	// true  = 280x192
 	// false = 560x384
 	void Video_SaveScreenShot( const char *pScreenShotFileName );
-	void Video_MakeScreenShot( FILE *pFile );
+	void Video_CopyScreenShot( uint32_t *pDst, int iScreenShotType );
 
 	int GetMonochromeIndex();
 
 	void V_CreateIdentityPalette ();
 	void  videoCreateDIBSection();
+	static void Video_PresentThreadStop(void);
+	static void Video_BlitScaledDestroy(void);
 
 //===========================================================================
 void CreateFrameOffsetTable (LPBYTE addr, LONG pitch)
@@ -915,6 +923,9 @@ void VideoChooseMonochromeColor ()
 //===========================================================================
 void VideoDestroy () {
 
+  Video_PresentThreadStop();
+  Video_BlitScaledDestroy();
+
   // DESTROY BUFFERS
   VirtualFree(g_pFramebufferinfo,0,MEM_RELEASE);
   VirtualFree(vidlastmem     ,0,MEM_RELEASE);
@@ -1069,6 +1080,12 @@ void VideoRedrawScreenDuringFullSpeed(DWORD dwCyclesThisFrame, bool bInit /*=fal
 
 	dwFullSpeedStartTime += dwFullSpeedDuration;
 
+	if (g_bVideoScannerAtFullSpeed)
+	{
+		VideoRefreshScreen();	// The NTSC scanner has kept the framebuffer up to date, so just present it
+		return;
+	}
+
 	//
 
 	static BYTE text_main[1024*2] = {0};	// page1 & 2
@@ -1114,6 +1131,9 @@ void VideoRedrawScreenDuringFullSpeed(DWORD dwCyclesThisFrame, bool bInit /*=fal
 
 void VideoRedrawScreenAfterFullSpeed(DWORD dwCyclesThisFrame)
 {
+	if (g_bVideoScannerAtFullSpeed)
+		return;	// The NTSC scanner's position & framebuffer are already up to date
+
 	const int nScanLines = bVideoScannerNTSC ? kNTSCScanLines : kPALScanLines;
 
 	g_nVideoClockVert = (uint16_t) (dwCyclesThisFrame / kHClocks) % nScanLines;
@@ -1190,6 +1210,270 @@ static void VideoFrameBufferAdjust(int& xSrc, int& ySrc, bool bInvertY=false)
 	ySrc += dy;
 }
 
+//===========================================================================
+// CPU-side scaler (-scaler, -scanlines): scale the borderless frame to the viewport, then blit it 1:1
+// . pBits is the whole (bottom-up) DIB; xSrc,ySrc is the top-left of the borderless frame (as per StretchBlt)
+// . With scanlines, only every other row is scaled (ie. 560x192) and the scaler draws the gaps itself,
+//   so NTSC's half-scanline blending isn't needed (see NTSC_SetVideoStyle())
+// Returns false if the scaler is off, so the caller should stretch-blit instead
+
+static uint32_t* g_pScaledFrame = NULL;
+static UINT g_uScaledFramePixels = 0;
+
+static bool Video_BlitScaled(HDC hDC, const uint32_t* pBits, int xSrc, int ySrc, int xDst, int yDst, int wDst, int hDst)
+{
+	if (!VideoScaler_IsEnabled() || wDst <= 0 || hDst <= 0)
+		return false;
+
+	const UINT uPixels = wDst * hDst;
+	if (uPixels > g_uScaledFramePixels)
+	{
+		if (g_pScaledFrame)
+			VirtualFree(g_pScaledFrame, 0, MEM_RELEASE);
+		g_pScaledFrame = (uint32_t*) VirtualAlloc(NULL, uPixels*sizeof(uint32_t), MEM_COMMIT, PAGE_READWRITE);
+		g_uScaledFramePixels = g_pScaledFrame ? uPixels : 0;
+		if (!g_pScaledFrame)
+			return false;
+	}
+
+	const uint32_t* pTop = pBits + (FRAMEBUFFER_H-1 - ySrc) * FRAMEBUFFER_W + xSrc;
+	const bool bScanlines = VideoScaler_GetScanlines() != 0;
+	VideoScaler_Process(
+		pTop, bScanlines ? -2*FRAMEBUFFER_W : -FRAMEBUFFER_W,
+		FRAMEBUFFER_BORDERLESS_W, bScanlines ? FRAMEBUFFER_BORDERLESS_H/2 : FRAMEBUFFER_BORDERLESS_H,
+		g_pScaledFrame, wDst, hDst);
+
+	BITMAPINFO bmi;
+	ZeroMemory(&bmi, sizeof(bmi));
+	bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth       = wDst;
+	bmi.bmiHeader.biHeight      = -hDst;	// Top-down
+	bmi.bmiHeader.biPlanes      = 1;
+	bmi.bmiHeader.biBitCount    = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	SetDIBitsToDevice(hDC, xDst, yDst, wDst, hDst, 0, 0, 0, hDst, g_pScaledFrame, &bmi, DIB_RGB_COLORS);
+	return true;
+}
+
+static void Video_BlitScaledDestroy(void)
+{
+	VideoScaler_Uninit();
+
+	if (g_pScaledFrame)
+		VirtualFree(g_pScaledFrame, 0, MEM_RELEASE);
+	g_pScaledFrame = NULL;
+	g_uScaledFramePixels = 0;
+}
+
+//===========================================================================
+// Presentation thread (-present-thread)
+// . Emulation publishes each completed frame into a triple-buffer & continues immediately
+// . Presentation thread blits the most recent frame, so a slow blit (or window-manager stall) no longer delays emulation & audio
+// . Handoff: g_lPresentMiddle holds the index of the middle buffer (+ PRESENT_FRESH if not yet presented). Each side swaps its own
+//   buffer with the middle one using a single InterlockedExchange(), so neither side ever waits for the other.
+// . A frame superseded before it was presented is dropped; if no new frame arrives, the window just keeps the last one (ie. repeated)
+// . Only for windowed MODE_RUNNING refreshes: full-screen, debugger, paused & whole-screen redraws still blit synchronously
+
+struct PresentFrame_t
+{
+	uint32_t* pBits;	// Copy of the whole DIB
+	int xSrc, ySrc;		// Top-left of the borderless frame (as per StretchBlt)
+	int xDst, yDst, wDst, hDst;
+};
+
+static const LONG PRESENT_FRESH = 4;
+
+static bool g_bPresentThreadEnabled = false;
+static HANDLE g_hPresentThread = NULL;
+static HANDLE g_hPresentEvent[2] = {NULL, NULL};	// [0] = Frame published, [1] = Exit
+static PresentFrame_t g_aPresentFrame[3];
+static BITMAPINFO g_PresentBmi;
+static UINT g_uPresentBack = 0;						// Owned by emulation
+static UINT g_uPresentFront = 1;					// Owned by presentation thread
+static volatile LONG g_lPresentMiddle = 2;
+static volatile LONG g_lPresentBusy = 0;			// Presentation thread is blitting
+
+// Counters (written by one side only)
+static UINT g_uPresentPublished = 0;
+static UINT g_uPresentDropped = 0;					// Superseded before being presented
+static UINT g_uPresentPresented = 0;
+static UINT g_uPresentStalls = 0;					// Blits that took longer than a video frame
+static double g_fPresentMaxBlitMS = 0.0;
+
+void Video_SetPresentThread(const bool bEnable)
+{
+	g_bPresentThreadEnabled = bEnable;
+}
+
+static void Video_PresentFrame(const PresentFrame_t& frame)
+{
+	LARGE_INTEGER qpcStart, qpcEnd, qpcFreq;
+	QueryPerformanceCounter(&qpcStart);
+
+	HDC hDC = FrameGetPresentDC();
+	if (hDC && Video_BlitScaled(hDC, frame.pBits, frame.xSrc, frame.ySrc, frame.xDst, frame.yDst, frame.wDst, frame.hDst))
+	{
+		FrameReleasePresentDC(hDC);
+	}
+	else if (hDC)
+	{
+		SetStretchBltMode(hDC, COLORONCOLOR);
+		StretchDIBits(
+			hDC,
+			frame.xDst, frame.yDst,
+			frame.wDst, frame.hDst,
+			frame.xSrc, FRAMEBUFFER_H - (frame.ySrc + FRAMEBUFFER_BORDERLESS_H),	// Bottom-left origin for a bottom-up DIB
+			FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H,
+			frame.pBits,
+			&g_PresentBmi,
+			DIB_RGB_COLORS,
+			SRCCOPY);
+		GdiFlush();
+		FrameReleasePresentDC(hDC);
+	}
+
+	QueryPerformanceCounter(&qpcEnd);
+	QueryPerformanceFrequency(&qpcFreq);
+
+	const double fBlitMS = (double)(qpcEnd.QuadPart - qpcStart.QuadPart) * 1000.0 / (double)qpcFreq.QuadPart;
+	if (fBlitMS > 1000.0 * dwClksPerFrame / CLK_6502)
+		g_uPresentStalls++;
+	if (fBlitMS > g_fPresentMaxBlitMS)
+		g_fPresentMaxBlitMS = fBlitMS;
+
+	g_uPresentPresented++;
+}
+
+static DWORD WINAPI Video_PresentThread(LPVOID)
+{
+	while (WaitForMultipleObjects(2, g_hPresentEvent, FALSE, INFINITE) == WAIT_OBJECT_0)
+	{
+		InterlockedExchange(&g_lPresentBusy, 1);	// NB. Set before checking PRESENT_FRESH (see Video_PresentThreadSync())
+
+		if (g_lPresentMiddle & PRESENT_FRESH)
+		{
+			const LONG lOld = InterlockedExchange(&g_lPresentMiddle, g_uPresentFront);
+			g_uPresentFront = lOld & ~PRESENT_FRESH;
+			Video_PresentFrame(g_aPresentFrame[g_uPresentFront]);
+		}
+
+		InterlockedExchange(&g_lPresentBusy, 0);
+	}
+
+	return 0;
+}
+
+static bool Video_PresentThreadStart(void)
+{
+	for (UINT i=0; i<3; i++)
+		g_aPresentFrame[i].pBits = (uint32_t*) VirtualAlloc(NULL, FRAMEBUFFER_W*FRAMEBUFFER_H*sizeof(uint32_t), MEM_COMMIT, PAGE_READWRITE);
+
+	g_hPresentEvent[0] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto-reset
+	g_hPresentEvent[1] = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	g_PresentBmi = *g_pFramebufferinfo;
+	g_uPresentBack = 0;
+	g_uPresentFront = 1;
+	g_lPresentMiddle = 2;
+
+	if (g_aPresentFrame[0].pBits && g_aPresentFrame[1].pBits && g_aPresentFrame[2].pBits && g_hPresentEvent[0] && g_hPresentEvent[1])
+	{
+		DWORD dwThreadId;
+		g_hPresentThread = CreateThread(NULL,				// lpThreadAttributes
+										0,					// dwStackSize
+										Video_PresentThread,
+										NULL,				// lpParameter
+										0,					// dwCreationFlags : 0 = Run immediately
+										&dwThreadId);		// lpThreadId
+	}
+
+	LogFileOutput("Video: Present thread: CreateThread(), g_hPresentThread=0x%08X\n", (UINT32)g_hPresentThread);
+
+	if (!g_hPresentThread)
+	{
+		g_bPresentThreadEnabled = false;	// Fall back to synchronous blits
+		return false;
+	}
+
+	return true;
+}
+
+static void Video_PresentThreadStop(void)
+{
+	if (g_hPresentThread)
+	{
+		SetEvent(g_hPresentEvent[1]);
+		WaitForSingleObject(g_hPresentThread, INFINITE);
+		CloseHandle(g_hPresentThread);
+		g_hPresentThread = NULL;
+
+		LogFileOutput("Video: Present thread: published=%u, presented=%u, dropped=%u, stalls=%u, max blit=%.2fms\n",
+			g_uPresentPublished, g_uPresentPresented, g_uPresentDropped, g_uPresentStalls, g_fPresentMaxBlitMS);
+	}
+
+	for (UINT i=0; i<2; i++)
+	{
+		if (g_hPresentEvent[i])
+			CloseHandle(g_hPresentEvent[i]);
+		g_hPresentEvent[i] = NULL;
+	}
+
+	for (UINT i=0; i<3; i++)
+	{
+		if (g_aPresentFrame[i].pBits)
+			VirtualFree(g_aPresentFrame[i].pBits, 0, MEM_RELEASE);
+		g_aPresentFrame[i].pBits = NULL;
+	}
+}
+
+// Returns true if the frame was handed to the presentation thread
+static bool Video_PresentThreadPublish(void)
+{
+	if (!g_bPresentThreadEnabled || g_bIsFullScreen || g_nAppMode != MODE_RUNNING)
+		return false;
+
+	if (!g_hPresentThread && !Video_PresentThreadStart())
+		return false;
+
+	PresentFrame_t& frame = g_aPresentFrame[g_uPresentBack];
+	memcpy(frame.pBits, g_pFramebufferbits, FRAMEBUFFER_W*FRAMEBUFFER_H*sizeof(uint32_t));
+
+	int xSrc = BORDER_W;
+	int ySrc = BORDER_H;
+	VideoFrameBufferAdjust(xSrc, ySrc);	// TC: Hacky-fix for GH#341
+	frame.xSrc = xSrc;
+	frame.ySrc = ySrc;
+	frame.xDst = GetFullScreenOffsetX();
+	frame.yDst = GetFullScreenOffsetY();
+	frame.wDst = g_nViewportCX;
+	frame.hDst = g_nViewportCY;
+
+	const LONG lOld = InterlockedExchange(&g_lPresentMiddle, g_uPresentBack | PRESENT_FRESH);
+	g_uPresentBack = lOld & ~PRESENT_FRESH;
+	if (lOld & PRESENT_FRESH)
+		g_uPresentDropped++;
+	g_uPresentPublished++;
+
+	SetEvent(g_hPresentEvent[0]);
+	return true;
+}
+
+// Before a synchronous blit: discard any unpresented frame & wait for an in-progress blit,
+// so that the presentation thread can't overwrite the synchronous blit with an older frame
+static void Video_PresentThreadSync(void)
+{
+	if (!g_hPresentThread)
+		return;
+
+	LONG lMiddle = g_lPresentMiddle;
+	while ((lMiddle & PRESENT_FRESH) && InterlockedCompareExchange(&g_lPresentMiddle, lMiddle & ~PRESENT_FRESH, lMiddle) != lMiddle)
+		lMiddle = g_lPresentMiddle;
+
+	while (g_lPresentBusy)
+		Sleep(0);
+}
+
 void VideoRefreshScreen ( uint32_t uRedrawWholeScreenVideoMode /* =0*/, bool bRedrawWholeScreen /* =false*/ )
 {
 #if defined(_DEBUG) && defined(DEBUG_REFRESH_TIMINGS)
@@ -1206,6 +1490,16 @@ void VideoRefreshScreen ( uint32_t uRedrawWholeScreenVideoMode /* =0*/, bool bRe
 		NTSC_VideoRedrawWholeScreen();
 	}
 
+	NTSC_VideoConvertIndexedFramebuffer();	// No-op unless using the 8-bit indexed framebuffer
+
+	if (!bRedrawWholeScreen && Video_PresentThreadPublish())
+	{
+		g_VideoForceFullRedraw = 0;
+		return;
+	}
+
+	Video_PresentThreadSync();
+
 // NTSC_BEGIN
 	LPBYTE pDstFrameBufferBits = 0;
 	LONG   pitch = 0;
@@ -1243,15 +1537,18 @@ void VideoRefreshScreen ( uint32_t uRedrawWholeScreenVideoMode /* =0*/, bool bRe
 			int wdest = g_nViewportCX;
 			int hdest = g_nViewportCY;
 
-			SetStretchBltMode(hFrameDC, COLORONCOLOR);
-			StretchBlt(
-				hFrameDC, 
-				xdest, ydest,
-				wdest, hdest,
-				g_hDeviceDC,
-				xSrc, ySrc,
-				FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H,
-				SRCCOPY);
+			if (!Video_BlitScaled(hFrameDC, (const uint32_t*)g_pFramebufferbits, xSrc, ySrc, xdest, ydest, wdest, hdest))
+			{
+				SetStretchBltMode(hFrameDC, COLORONCOLOR);
+				StretchBlt(
+					hFrameDC, 
+					xdest, ydest,
+					wdest, hdest,
+					g_hDeviceDC,
+					xSrc, ySrc,
+					FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H,
+					SRCCOPY);
+			}
 		}
 	}
 
@@ -1562,7 +1859,6 @@ bool VideoGetVblBar(const DWORD uExecutedCycles)
 
 //===========================================================================
 
-#define SCREENSHOT_BMP 1
 #define SCREENSHOT_TGA 0
 	
 // alias for nSuffixScreenShotFileName
@@ -1587,9 +1883,7 @@ void Util_MakeScreenShotFileName( char *pFinalFileName_ )
 	char sPrefixScreenShotFileName[ 256 ] = "AppleWin_ScreenShot";
 	// TODO: g_sScreenshotDir
 	char *pPrefixFileName = g_pLastDiskImageName ? g_pLastDiskImageName : sPrefixScreenShotFileName;
-#if SCREENSHOT_BMP
-	sprintf( pFinalFileName_, "%s_%09d.bmp", pPrefixFileName, g_nLastScreenShot );
-#endif
+	sprintf( pFinalFileName_, "%s_%09d.png", pPrefixFileName, g_nLastScreenShot );	// Encoded asynchronously by ScreenCapture
 #if SCREENSHOT_TGA
 	sprintf( pFinalFileName_, "%s%09d.tga", pPrefixFileName, g_nLastScreenShot );
 #endif
@@ -1641,8 +1935,6 @@ void Video_TakeScreenShot( int iScreenShotType )
 	g_nLastScreenShot++;
 }
 
-WinBmpHeader_t g_tBmpHeader;
-
 #if SCREENSHOT_TGA
 	enum TargaImageType_e
 	{
@@ -1675,7 +1967,6 @@ WinBmpHeader_t g_tBmpHeader;
 
 void Video_SetBitmapHeader( WinBmpHeader_t *pBmp, int nWidth, int nHeight, int nBitsPerPixel )
 {
-#if SCREENSHOT_BMP
 	pBmp->nCookie[ 0 ]     = 'B'; // 0x42
 	pBmp->nCookie[ 1 ]     = 'M'; // 0x4d
 	pBmp->nSizeFile        = 0;
@@ -1708,42 +1999,14 @@ void Video_SetBitmapHeader( WinBmpHeader_t *pBmp, int nWidth, int nHeight, int n
 }
 
 //===========================================================================
-void Video_MakeScreenShot(FILE *pFile)
+// Copy the borderless frame (bottom-up, as per the DIB) to a contiguous buffer
+void Video_CopyScreenShot( uint32_t *pDst, int iScreenShotType )
 {
-	WinBmpHeader_t *pBmp = &g_tBmpHeader;
-
-	Video_SetBitmapHeader(
-		pBmp,
-		g_iScreenshotType ? FRAMEBUFFER_BORDERLESS_W/2 : FRAMEBUFFER_BORDERLESS_W,
-		g_iScreenshotType ? FRAMEBUFFER_BORDERLESS_H/2 : FRAMEBUFFER_BORDERLESS_H,
-		32
-	);
-
-//	char sText[256];
-//	sprintf( sText, "sizeof: BITMAPFILEHEADER = %d\n", sizeof(BITMAPFILEHEADER) ); // = 14
-//	MessageBox( g_hFrameWindow, sText, "Info 1", MB_OK );
-//	sprintf( sText, "sizeof: BITMAPINFOHEADER = %d\n", sizeof(BITMAPINFOHEADER) ); // = 40
-//	MessageBox( g_hFrameWindow, sText, "Info 2", MB_OK );
-
-	char sIfSizeZeroOrUnknown_BadWinBmpHeaderPackingSize54[ sizeof( WinBmpHeader_t ) == (14 + 40) ];
-	/**/ sIfSizeZeroOrUnknown_BadWinBmpHeaderPackingSize54[0]=0;
-
-	// Write Header
-	fwrite( pBmp, sizeof( WinBmpHeader_t ), 1, pFile );
-
-	uint32_t *pSrc;
-#if VIDEO_SCREENSHOT_PALETTE
-	// Write Palette Data
-	pSrc = ((uint8_t*)g_pFramebufferinfo) + sizeof(BITMAPINFOHEADER);
-	int nLen = g_tBmpHeader.nPaletteColors * sizeof(bgra_t); // RGBQUAD
-	fwrite( pSrc, nLen, 1, pFile );
-	pSrc += nLen;
-#endif
-
-	// Write Pixel Data
 	// No need to use GetDibBits() since we already have http://msdn.microsoft.com/en-us/library/ms532334.aspx
 	// @reference: "Storing an Image" http://msdn.microsoft.com/en-us/library/ms532340(VS.85).aspx
-	pSrc = (uint32_t*) g_pFramebufferbits;
+	NTSC_VideoConvertIndexedFramebuffer();
+
+	const uint32_t* pSrc = (const uint32_t*) g_pFramebufferbits;
 
 	int xSrc = BORDER_W;
 	int ySrc = BORDER_H;
@@ -1753,25 +2016,20 @@ void Video_MakeScreenShot(FILE *pFile)
 	pSrc += xSrc;					// Skip left border
 	pSrc += ySrc * FRAMEBUFFER_W;	// Skip top border
 
-	if( g_iScreenshotType == SCREENSHOT_280x192 )
+	if( iScreenShotType == SCREENSHOT_280x192 )
 	{
 		pSrc += FRAMEBUFFER_W;	// Start on odd scanline (otherwise for 50% scanline mode get an all black image!)
 
-		uint32_t  aScanLine[ 280 ];
-		uint32_t *pDst;
-
 		// 50% Half Scan Line clears every odd scanline.
 		// SHIFT+PrintScreen saves only the even rows.
-		// NOTE: Keep in sync with _Video_RedrawScreen() & Video_MakeScreenShot()
+		// NOTE: Keep in sync with _Video_RedrawScreen()
 		for( int y = 0; y < FRAMEBUFFER_BORDERLESS_H/2; y++ )
 		{
-			pDst = aScanLine;
 			for( int x = 0; x < FRAMEBUFFER_BORDERLESS_W/2; x++ )
 			{
 				*pDst++ = pSrc[1]; // correction for left edge loss of scaled scanline [Bill Buckel, B#18928]
 				pSrc += 2; // skip odd pixels
 			}
-			fwrite( aScanLine, sizeof(uint32_t), FRAMEBUFFER_BORDERLESS_W/2, pFile );
 			pSrc += FRAMEBUFFER_W; // scan lines doubled - skip odd ones
 			pSrc += BORDER_W*2;	// Skip right border & next line's left border
 		}
@@ -1780,40 +2038,264 @@ void Video_MakeScreenShot(FILE *pFile)
 	{
 		for( int y = 0; y < FRAMEBUFFER_BORDERLESS_H; y++ )
 		{
-			fwrite( pSrc, sizeof(uint32_t), FRAMEBUFFER_BORDERLESS_W, pFile );
+			memcpy( pDst, pSrc, FRAMEBUFFER_BORDERLESS_W * sizeof(uint32_t) );
+			pDst += FRAMEBUFFER_BORDERLESS_W;
 			pSrc += FRAMEBUFFER_W;
 		}
 	}
-#endif // SCREENSHOT_BMP
-
-#if SCREENSHOT_TGA
-	TargaHeader_t *pHeader = &g_tTargaHeader;
-	memset( (void*)pHeader, 0, sizeof( TargaHeader_t ) );
-
-	pHeader->iImageType    = TARGA_RGB;
-	pHeader->nWidthPixels  = FRAMEBUFFER_W;
-	pHeader->nHeightPixels = FRAMEBUFFER_H;
-	pHeader->nBitsPerPixel = 24;
-#endif // SCREENSHOT_TGA
-
 }
 
 //===========================================================================
 void Video_SaveScreenShot( const char *pScreenShotFileName )
 {
-	FILE *pFile = fopen( pScreenShotFileName, "wb" );
-	if( pFile )
+	// Only the copy is done here - the encoding & file I/O are done by the ScreenCapture thread
+	uint32_t *pPixels = ScreenCapture_AcquireBuffer();
+	if( !pPixels )
 	{
-		Video_MakeScreenShot( pFile );
-		fclose( pFile );
+		// Encoder is behind (eg. recording with -capture): don't hold up emulation waiting for it
+		LogFileOutput("Video: Screenshot not saved (no free capture buffer): %s\n", pScreenShotFileName);
+		return;
 	}
 
+	Video_CopyScreenShot( pPixels, g_iScreenshotType );
+	ScreenCapture_SubmitPNG(
+		pPixels,
+		g_iScreenshotType ? FRAMEBUFFER_BORDERLESS_W/2 : FRAMEBUFFER_BORDERLESS_W,
+		g_iScreenshotType ? FRAMEBUFFER_BORDERLESS_H/2 : FRAMEBUFFER_BORDERLESS_H,
+		pScreenShotFileName );
+
 	if( g_bDisplayPrintScreenFileName )
 	{
 		MessageBox( g_hFrameWindow, pScreenShotFileName, "Screen Captured", MB_OK );
 	}
 }
 
+//===========================================================================
+// Frame-sequence recording (-capture <file>): called at each video frame boundary
+void Video_CaptureFrame(void)
+{
+	if (!ScreenCapture_IsRecording())
+		return;
+
+	uint32_t* pPixels = ScreenCapture_AcquireBuffer();
+	if (!pPixels)
+	{
+		ScreenCapture_DropFrame();	// Encoder has fallen behind
+		return;
+	}
+
+	Video_CopyScreenShot(pPixels, SCREENSHOT_560x384);
+	ScreenCapture_SubmitFrame(pPixels, FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H);
+}
+
+//===========================================================================
+// Per-frame hashing, for regression runs (-frame-hash <file>)
+// . At each VBL of the NTSC scanner: hash the framebuffer (or the 8-bit indexed framebuffer), and the video memory + mode
+// . Full speed is disabled while hashing, as it skips the (cycle-accurate) scanner
+// . Log line: <frame>,<cycles>,<framebuffer hash>,<video memory hash> (cycles: emulated, since startup)
+
+static FILE* g_pFrameHashFile = NULL;
+static UINT  g_uFrameHashFrame = 0;
+
+static const uint64_t kFrameHashSeed = 0xCBF29CE484222325ULL;	// FNV-1a (64-bit)
+static const uint64_t kFrameHashPrime = 0x100000001B3ULL;
+
+static uint64_t Video_HashBytes(uint64_t hash, const uint8_t* pData, UINT uSize)
+{
+	// Whole 32-bit words, then any remaining bytes
+	const uint32_t* pWords = (const uint32_t*) pData;
+	for (UINT i = 0; i < uSize/4; i++)
+		hash = (hash ^ pWords[i]) * kFrameHashPrime;
+
+	for (UINT i = uSize & ~3; i < uSize; i++)
+		hash = (hash ^ pData[i]) * kFrameHashPrime;
+
+	return hash;
+}
+
+static uint64_t Video_HashFramebuffer(void)
+{
+	uint64_t hash = kFrameHashSeed;
+
+	if (NTSC_IsIndexedFramebuffer())
+	{
+		UINT uWidth, uPitch;
+		const uint8_t* pIndexed = NTSC_GetIndexedFramebuffer(uWidth, uPitch);
+		for (UINT y = 0; y < FRAMEBUFFER_BORDERLESS_H/2; y++)
+			hash = Video_HashBytes(hash, pIndexed + y*uPitch, uWidth);
+		hash = Video_HashBytes(hash, (const uint8_t*) NTSC_GetIndexedPalette(), 256*sizeof(uint32_t));
+	}
+	else
+	{
+		hash = Video_HashBytes(hash, g_pFramebufferbits, FRAMEBUFFER_W*FRAMEBUFFER_H*sizeof(bgra_t));
+	}
+
+	return hash;
+}
+
+static uint64_t Video_HashVideoMemory(void)
+{
+	uint64_t hash = kFrameHashSeed;
+	hash = Video_HashBytes(hash, (const uint8_t*) &g_uVideoMode, sizeof(g_uVideoMode));
+
+	// TEXT/LORES pages 1 & 2 ($400-$BFF) and HIRES pages 1 & 2 ($2000-$5FFF), main & aux
+	// NB. MemGetMainPtr()/MemGetAuxPtr() are only contiguous within a 256-byte page
+	static const WORD kVideoPages[][2] = { {0x04,0x0C}, {0x20,0x60} };
+	for (UINT r = 0; r < sizeof(kVideoPages)/sizeof(kVideoPages[0]); r++)
+	{
+		for (WORD page = kVideoPages[r][0]; page < kVideoPages[r][1]; page++)
+		{
+			hash = Video_HashBytes(hash, MemGetMainPtr(page << 8), 256);
+			hash = Video_HashBytes(hash, MemGetAuxPtr(page << 8), 256);
+		}
+	}
+
+	return hash;
+}
+
+bool Video_FrameHashOpen(const char* pszFilename)
+{
+	Video_FrameHashClose();
+
+	g_pFrameHashFile = fopen(pszFilename, "wt");
+	g_uFrameHashFrame = 0;
+	g_bVideoScannerAtFullSpeed = (g_pFrameHashFile != NULL);	// So the hashes are taken at full-speed too
+
+	return g_pFrameHashFile != NULL;
+}
+
+void Video_FrameHashClose(void)
+{
+	if (g_pFrameHashFile)
+	{
+		fclose(g_pFrameHashFile);
+		g_pFrameHashFile = NULL;
+		g_bVideoScannerAtFullSpeed = false;
+	}
+}
+
+// Called by the NTSC scanner on entering VBL (uScannerCycles = emulated cycles it's stepped through)
+void Video_FrameHashUpdate(const unsigned __int64 uScannerCycles)
+{
+	if (!g_pFrameHashFile)
+		return;
+
+	const uint64_t uFramebufferHash = Video_HashFramebuffer();
+	const uint64_t uVideoMemoryHash = Video_HashVideoMemory();
+
+	fprintf(g_pFrameHashFile, "%u,%I64u,%016I64X,%016I64X\n", g_uFrameHashFrame, uScannerCycles, uFramebufferHash, uVideoMemoryHash);
+	g_uFrameHashFrame++;
+}
+
+//-------------------------------------
+
+struct FrameHashEntry_t
+{
+	UINT frame;
+	unsigned __int64 cycles;
+	uint64_t framebufferHash;
+	uint64_t videoMemoryHash;
+};
+
+static bool Video_FrameHashReadEntry(FILE* pFile, FrameHashEntry_t& entry)
+{
+	return fscanf(pFile, "%u,%I64u,%I64X,%I64X\n", &entry.frame, &entry.cycles, &entry.framebufferHash, &entry.videoMemoryHash) == 4;
+}
+
+// Compare two -frame-hash logs and report the first divergent frame (to the log file)
+// Returns: 0 = identical, 1 = divergent (or different lengths), 2 = can't open a log
+int Video_FrameHashCompare(const char* pszFilename1, const char* pszFilename2)
+{
+	FILE* pFile1 = fopen(pszFilename1, "rt");
+	FILE* pFile2 = fopen(pszFilename2, "rt");
+
+	int nRes = 0;
+
+	if (!pFile1 || !pFile2)
+	{
+		LogFileOutput("FrameHash: Failed to open: %s\n", !pFile1 ? pszFilename1 : pszFilename2);
+		nRes = 2;
+	}
+	else
+	{
+		while (true)
+		{
+			FrameHashEntry_t e1, e2;
+			const bool bRes1 = Video_FrameHashReadEntry(pFile1, e1);
+			const bool bRes2 = Video_FrameHashReadEntry(pFile2, e2);
+
+			if (!bRes1 && !bRes2)
+			{
+				LogFileOutput("FrameHash: Identical\n");
+				break;
+			}
+
+			if (bRes1 != bRes2)
+			{
+				LogFileOutput("FrameHash: Different lengths: %s ends first, at frame %u\n", !bRes1 ? pszFilename1 : pszFilename2, !bRes1 ? e2.frame : e1.frame);
+				nRes = 1;
+				break;
+			}
+
+			if (e1.frame != e2.frame || e1.cycles != e2.cycles ||
+				e1.framebufferHash != e2.framebufferHash || e1.videoMemoryHash != e2.videoMemoryHash)
+			{
+				LogFileOutput("FrameHash: First divergent frame: %u / %u (cycles: %I64u / %I64u)%s%s%s%s\n",
+					e1.frame, e2.frame, e1.cycles, e2.cycles,
+					(e1.frame != e2.frame) ? " [frame]" : "",
+					(e1.cycles != e2.cycles) ? " [cycles]" : "",
+					(e1.framebufferHash != e2.framebufferHash) ? " [framebuffer]" : "",
+					(e1.videoMemoryHash != e2.videoMemoryHash) ? " [video memory]" : "");
+				nRes = 1;
+				break;
+			}
+		}
+	}
+
+	if (pFile1) fclose(pFile1);
+	if (pFile2) fclose(pFile2);
+
+	return nRes;
+}
+
+//===========================================================================
+// Dirty-rectangle output, for remote & embedded displays (see VideoDirtyRect.inl)
+
+// Returns top-down scanline y of the borderless frame
+static const uint32_t* Video_GetBorderlessScanline(const UINT y)
+{
+	int xSrc = BORDER_W;
+	int ySrc = BORDER_H;
+	VideoFrameBufferAdjust(xSrc, ySrc, true);	// DIB is bottom-up, so same as Video_CopyScreenShot()
+
+	const uint32_t* pBottom = (const uint32_t*) g_pFramebufferbits + xSrc + ySrc * FRAMEBUFFER_W;
+	return pBottom + (FRAMEBUFFER_BORDERLESS_H-1 - y) * FRAMEBUFFER_W;
+}
+
+// Next call to Video_GetDirtyRects() reports the whole frame (eg. for a newly connected display)
+void Video_ResetDirtyRects(void)
+{
+	DirtyRect_Reset();
+}
+
+// Returns the number of rects that changed since the previous call
+UINT Video_GetDirtyRects(VideoDirtyRect_t* pRects, const UINT uMaxRects)
+{
+	NTSC_VideoConvertIndexedFramebuffer();	// No-op unless using the 8-bit indexed framebuffer
+
+	return DirtyRect_Get(Video_GetBorderlessScanline, pRects, uMaxRects);
+}
+
+// Copy a rect's pixels (32bpp BGRA, top-down, pitch = rect.uWidth)
+void Video_CopyDirtyRect(const VideoDirtyRect_t& rect, uint32_t* pDst)
+{
+	for (UINT y=rect.y; y<rect.y+rect.uHeight; y++)
+	{
+		memcpy(pDst, Video_GetBorderlessScanline(y) + rect.x, rect.uWidth * sizeof(uint32_t));
+		pDst += rect.uWidth;
+	}
+}
+
 //===========================================================================
 
 void Config_Load_Video()
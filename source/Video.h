@@ -157,6 +157,7 @@ extern uint32_t   g_uVideoMode;
 extern DWORD      g_eVideoType;		// saved to Registry
 extern DWORD      g_uHalfScanLines;	// saved to Registry
 extern uint8_t   *g_pFramebufferbits;
+extern bool       g_bVideoScannerAtFullSpeed;
 
 typedef bool (*VideoUpdateFuncPtr_t)(int,int,int,int,int);
 
@@ -173,6 +174,7 @@ void    VideoRedrawScreenDuringFullSpeed(DWORD dwCyclesThisFrame, bool bInit = f
 void    VideoRedrawScreenAfterFullSpeed(DWORD dwCyclesThisFrame);
 void    VideoRedrawScreen (void);
 void    VideoRefreshScreen (uint32_t uRedrawWholeScreenVideoMode = 0, bool bRedrawWholeScreen = false);
+void    Video_SetPresentThread(const bool bEnable);
 void    VideoReinitialize ();
 void    VideoResetState ();
 WORD    VideoGetScannerAddress(bool* pbVblBar_OUT, const DWORD uExecutedCycles);
@@ -211,6 +213,24 @@ enum VideoScreenShot_e
 void Video_TakeScreenShot( int iScreenShotType );
 void Video_SetBitmapHeader( WinBmpHeader_t *pBmp, int nWidth, int nHeight, int nBitsPerPixel );
 
+void Video_CaptureFrame(void);
+
+bool Video_FrameHashOpen(const char* pszFilename);
+void Video_FrameHashClose(void);
+void Video_FrameHashUpdate(const unsigned __int64 uScannerCycles);
+int  Video_FrameHashCompare(const char* pszFilename1, const char* pszFilename2);
+
+struct VideoDirtyRect_t
+{
+	UINT x, y;				// Top-left, in the 560x384 borderless frame
+	UINT uWidth, uHeight;
+};
+const UINT VIDEO_DIRTY_RECTS_MAX = 384/2;	// Enough for any frame, given the merging of nearby scanlines
+
+void Video_ResetDirtyRects(void);
+UINT Video_GetDirtyRects(VideoDirtyRect_t* pRects, const UINT uMaxRects);
+void Video_CopyDirtyRect(const VideoDirtyRect_t& rect, uint32_t* pDst);
+
 
 // Win32/MSVC: __stdcall 
 BYTE VideoCheckMode (WORD pc, WORD addr, BYTE bWrite, BYTE d, ULONG uExecutedCycles);
@@ -0,0 +1,103 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2016, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: Dirty-rectangle tracking for the 560x384 borderless frame (see Video_GetDirtyRects())
+ *
+ * Included by Video.cpp & test/TestVideoDirtyRect
+ * Pre: FRAMEBUFFER_BORDERLESS_W/H, VideoDirtyRect_t, MIN/MAX & _ASSERT are defined
+ *
+ * . Each scanline is split into 40 segments of 14 pixels (ie. one Apple byte column), & each segment is compared against
+ *   a copy of the frame from the previous call (a memcmp is as cheap as hashing the segment, & can't collide)
+ * . Changed segments -> changed scanlines -> rects
+ * . Changed scanlines close to each other are merged, so 50% half-scanline mode doesn't produce one rect per scanline
+ */
+
+static const UINT kDirtySegmentW = 14;
+static const UINT kDirtySegments = FRAMEBUFFER_BORDERLESS_W / kDirtySegmentW;
+static const UINT kDirtyRectMergeGap = 2;	// Max unchanged scanlines between 2 changed scanlines in the same rect
+
+static uint32_t g_aDirtyPrevFrame[FRAMEBUFFER_BORDERLESS_H][FRAMEBUFFER_BORDERLESS_W];
+static bool g_bDirtyPrevFrameValid = false;
+
+// Next call to DirtyRect_Get() reports the whole frame
+static void DirtyRect_Reset(void)
+{
+	g_bDirtyPrevFrameValid = false;
+}
+
+// Returns the number of rects that changed since the previous call
+// . pGetScanline(y) returns top-down scanline y of the borderless frame
+// . If there are more than uMaxRects, then the last rect is grown to cover the rest
+static UINT DirtyRect_Get(const uint32_t* (*pGetScanline)(const UINT y), VideoDirtyRect_t* pRects, const UINT uMaxRects)
+{
+	_ASSERT(uMaxRects);
+
+	UINT uNumRects = 0;
+	VideoDirtyRect_t* pRect = NULL;
+
+	for (UINT y=0; y<FRAMEBUFFER_BORDERLESS_H; y++)
+	{
+		const uint32_t* pScanline = pGetScanline(y);
+
+		UINT uFirst = kDirtySegments;
+		UINT uLast = 0;
+		for (UINT s=0; s<kDirtySegments; s++)
+		{
+			const uint32_t* pSegment = &pScanline[s*kDirtySegmentW];
+			uint32_t* pPrevSegment = &g_aDirtyPrevFrame[y][s*kDirtySegmentW];
+
+			if (g_bDirtyPrevFrameValid && memcmp(pSegment, pPrevSegment, kDirtySegmentW*sizeof(uint32_t)) == 0)
+				continue;
+
+			memcpy(pPrevSegment, pSegment, kDirtySegmentW*sizeof(uint32_t));
+			if (uFirst == kDirtySegments)
+				uFirst = s;
+			uLast = s;
+		}
+
+		if (uFirst == kDirtySegments)
+			continue;	// Scanline unchanged
+
+		const UINT x0 = uFirst * kDirtySegmentW;
+		const UINT x1 = (uLast+1) * kDirtySegmentW;
+
+		if (pRect && (y - (pRect->y + pRect->uHeight) <= kDirtyRectMergeGap || uNumRects == uMaxRects))
+		{
+			const UINT xRight = MAX(pRect->x + pRect->uWidth, x1);
+			pRect->x = MIN(pRect->x, x0);
+			pRect->uWidth = xRight - pRect->x;
+			pRect->uHeight = y + 1 - pRect->y;
+		}
+		else
+		{
+			pRect = &pRects[uNumRects++];
+			pRect->x = x0;
+			pRect->y = y;
+			pRect->uWidth = x1 - x0;
+			pRect->uHeight = 1;
+		}
+	}
+
+	g_bDirtyPrevFrameValid = true;
+	return uNumRects;
+}
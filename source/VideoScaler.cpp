@@ -0,0 +1,512 @@
+/*
+AppleWin : An Apple //e emulator for Windows
+
+Copyright (C) 1994-1996, Michael O'Brien
+Copyright (C) 1999-2001, Oliver Schmidt
+Copyright (C) 2002-2005, Tom Charlesworth
+Copyright (C) 2006-2017, Tom Charlesworth, Michael Pohoreski, Nick Westgate
+
+AppleWin is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+AppleWin is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with AppleWin; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Description: CPU-side scaler & scanline effect
+ *
+ * Per output row:
+ * . Vertical pass  : blend the 2 source rows into a temp row (skipped when the weight is 0, eg. integer scaling)
+ * . Horizontal pass: blend the 2 source pixels per output pixel, then apply the row's scanline brightness
+ * All weights are 8.8 fixed point, so a blend of 2 pixels always fits in 16-bit lanes.
+ * Kernels: AVX2 (if supported by compiler & CPU), SSE2, else plain C.
+ * Large outputs are split into horizontal bands, one per worker thread.
+ *
+ * Author: Various
+ */
+
+#include "StdAfx.h"
+
+#include "Common.h"
+#include "Log.h"
+#include "VideoScaler.h"
+
+#include <intrin.h>		// __cpuid()
+#include <emmintrin.h>	// SSE2
+#if _MSC_VER >= 1700	// AVX2 intrinsics supported from VS2012 (cl.exe v17.00)
+#include <immintrin.h>
+#define VIDEOSCALER_AVX2 1
+#else
+#define VIDEOSCALER_AVX2 0
+#endif
+
+enum ScalerSimd_e {SIMD_NONE, SIMD_SSE2, SIMD_AVX2};
+
+struct ScalerTap_t
+{
+	UINT uIndex;	// Blend src[uIndex] & src[uIndex+1]
+	UINT uWeight;	// 0..256: weight of src[uIndex+1]
+};
+
+static VideoScalerFilter_e g_eFilter = VIDEOSCALER_OFF;
+static UINT g_uScanlinesPercent = 0;
+
+static bool g_bScalerInit = false;
+static ScalerSimd_e g_eSimd = SIMD_NONE;
+
+// Tables: rebuilt when the src/dst size or the settings change
+static UINT g_uTableSrcW = 0, g_uTableSrcH = 0, g_uTableDstW = 0, g_uTableDstH = 0;
+static VideoScalerFilter_e g_eTableFilter = VIDEOSCALER_OFF;
+static UINT g_uTableScanlines = 0;
+static bool g_bBilinearX = false;
+static std::vector<ScalerTap_t> g_aTapsX;
+static std::vector<ScalerTap_t> g_aTapsY;
+static std::vector<uint16_t> g_aWeightsX;		// 8 per output pixel: 4 x (256-w), 4 x w
+static std::vector<uint16_t> g_aBrightnessY;	// Per output row: 0..256
+
+// Thread-band split
+static const UINT kMaxThreads = 4;
+static const UINT kMinPixelsPerBand = 256*1024;
+
+struct ScalerJob_t
+{
+	const uint32_t* pSrc;
+	int nSrcPitch;
+	UINT uSrcW;
+	uint32_t* pDst;
+	UINT uDstW;
+	UINT uDstH;
+	UINT uNumBands;
+};
+
+static ScalerJob_t g_Job;
+static UINT g_uNumThreads = 1;	// Including the caller's thread
+static HANDLE g_hWorkerThread[kMaxThreads] = {0};
+static HANDLE g_hWorkerStart[kMaxThreads] = {0};
+static HANDLE g_hWorkerDone[kMaxThreads] = {0};
+static volatile bool g_bWorkerExit = false;
+static std::vector<uint32_t> g_aTempRow[kMaxThreads];
+
+//===========================================================================
+
+void VideoScaler_SetFilter(const VideoScalerFilter_e eFilter)
+{
+	g_eFilter = eFilter;
+}
+
+void VideoScaler_SetScanlines(const UINT uPercent)
+{
+	g_uScanlinesPercent = MIN(uPercent, 100);
+}
+
+UINT VideoScaler_GetScanlines(void)
+{
+	return g_uScanlinesPercent;
+}
+
+bool VideoScaler_IsEnabled(void)
+{
+	return g_eFilter != VIDEOSCALER_OFF || g_uScanlinesPercent != 0;
+}
+
+//===========================================================================
+
+static ScalerSimd_e VideoScaler_DetectSimd(void)
+{
+	int info[4];
+	__cpuid(info, 0);
+	const int nMaxLeaf = info[0];
+
+	__cpuid(info, 1);
+	if ((info[3] & (1<<26)) == 0)	// EDX.SSE2
+		return SIMD_NONE;
+
+#if VIDEOSCALER_AVX2
+	const bool bOSXSAVE = (info[2] & (1<<27)) != 0;
+	const bool bAVX = (info[2] & (1<<28)) != 0;
+	if (nMaxLeaf >= 7 && bOSXSAVE && bAVX && (_xgetbv(0) & 6) == 6)	// OS saves XMM & YMM state
+	{
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1<<5))	// EBX.AVX2
+			return SIMD_AVX2;
+	}
+#endif
+
+	return SIMD_SSE2;
+}
+
+static DWORD WINAPI VideoScaler_WorkerThread(LPVOID lpParameter);
+
+static void VideoScaler_Init(void)
+{
+	if (g_bScalerInit)
+		return;
+
+	g_bScalerInit = true;
+	g_eSimd = VideoScaler_DetectSimd();
+
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo(&sysInfo);
+	g_uNumThreads = MAX(1, MIN(sysInfo.dwNumberOfProcessors, kMaxThreads));
+
+	g_bWorkerExit = false;
+	for (UINT i=1; i<g_uNumThreads; i++)
+	{
+		g_hWorkerStart[i] = CreateEvent(NULL, FALSE, FALSE, NULL);	// Auto-reset
+		g_hWorkerDone[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+		DWORD dwThreadId;
+		if (g_hWorkerStart[i] && g_hWorkerDone[i])
+			g_hWorkerThread[i] = CreateThread(NULL,				// lpThreadAttributes
+												0,				// dwStackSize
+												VideoScaler_WorkerThread,
+												(LPVOID)(UINT_PTR)i,
+												0,				// dwCreationFlags : 0 = Run immediately
+												&dwThreadId);	// lpThreadId
+
+		if (!g_hWorkerThread[i])
+		{
+			g_uNumThreads = i;	// Use just the threads created so far
+			break;
+		}
+	}
+
+	LogFileOutput("VideoScaler: SIMD=%s, threads=%u\n",
+		g_eSimd == SIMD_AVX2 ? "AVX2" : g_eSimd == SIMD_SSE2 ? "SSE2" : "none", g_uNumThreads);
+}
+
+void VideoScaler_Uninit(void)
+{
+	if (!g_bScalerInit)
+		return;
+
+	g_bWorkerExit = true;
+	for (UINT i=1; i<kMaxThreads; i++)
+	{
+		if (g_hWorkerThread[i])
+		{
+			SetEvent(g_hWorkerStart[i]);
+			WaitForSingleObject(g_hWorkerThread[i], INFINITE);
+			CloseHandle(g_hWorkerThread[i]);
+			g_hWorkerThread[i] = NULL;
+		}
+
+		if (g_hWorkerStart[i]) CloseHandle(g_hWorkerStart[i]);
+		if (g_hWorkerDone[i]) CloseHandle(g_hWorkerDone[i]);
+		g_hWorkerStart[i] = g_hWorkerDone[i] = NULL;
+	}
+
+	g_uNumThreads = 1;
+	g_uTableDstW = g_uTableDstH = 0;	// Force tables to be rebuilt
+	g_bScalerInit = false;
+}
+
+//===========================================================================
+
+static void VideoScaler_BuildTaps(std::vector<ScalerTap_t>& taps, const UINT uSrc, const UINT uDst, const bool bBilinear)
+{
+	taps.resize(uDst);
+
+	// Sharp bilinear: texel coords are in a (virtual) nearest-neighbour prescale of the largest integer multiple,
+	// so only the output pixels straddling 2 source pixels get blended
+	const UINT uPrescale = MAX(1, uDst / uSrc);
+	const double fScale = (double)(uSrc * uPrescale) / (double)uDst;
+
+	for (UINT i=0; i<uDst; i++)
+	{
+		ScalerTap_t& tap = taps[i];
+
+		if (!bBilinear)
+		{
+			tap.uIndex = MIN((UINT)(((double)i + 0.5) * uSrc / uDst), uSrc-1);
+			tap.uWeight = 0;
+			continue;
+		}
+
+		double u = ((double)i + 0.5) * fScale - 0.5;
+		if (u < 0.0)
+			u = 0.0;
+
+		const UINT p = (UINT)u;
+		const UINT s0 = MIN(p / uPrescale, uSrc-1);
+		const UINT s1 = MIN((p+1) / uPrescale, uSrc-1);
+
+		tap.uIndex = s0;
+		tap.uWeight = (s0 == s1) ? 0 : (UINT)((u - p) * 256.0 + 0.5);
+	}
+}
+
+// Scanlines: the bottom half of each source row is the dark gap. An output row's brightness depends on how much of it covers gaps.
+static double VideoScaler_GapCoverage(const double y)
+{
+	const double fInt = (double)(UINT)y;
+	const double fFrac = y - fInt;
+	return fInt * 0.5 + (fFrac > 0.5 ? fFrac - 0.5 : 0.0);
+}
+
+static void VideoScaler_BuildTables(const UINT uSrcW, const UINT uSrcH, const UINT uDstW, const UINT uDstH)
+{
+	if (uSrcW == g_uTableSrcW && uSrcH == g_uTableSrcH && uDstW == g_uTableDstW && uDstH == g_uTableDstH &&
+		g_eFilter == g_eTableFilter && g_uScanlinesPercent == g_uTableScanlines)
+		return;
+
+	const bool bBilinear = (g_eFilter == VIDEOSCALER_SHARP_BILINEAR);
+	VideoScaler_BuildTaps(g_aTapsX, uSrcW, uDstW, bBilinear);
+	VideoScaler_BuildTaps(g_aTapsY, uSrcH, uDstH, bBilinear);
+
+	g_bBilinearX = false;
+	g_aWeightsX.resize(uDstW * 8);
+	for (UINT x=0; x<uDstW; x++)
+	{
+		const uint16_t w = (uint16_t) g_aTapsX[x].uWeight;
+		for (UINT i=0; i<4; i++)
+		{
+			g_aWeightsX[x*8+i] = 256 - w;
+			g_aWeightsX[x*8+4+i] = w;
+		}
+		if (w)
+			g_bBilinearX = true;
+	}
+
+	g_aBrightnessY.resize(uDstH);
+	const double fDarken = 256.0 * g_uScanlinesPercent / 100.0;
+	for (UINT y=0; y<uDstH; y++)
+	{
+		const double y0 = (double)y * uSrcH / uDstH;
+		const double y1 = (double)(y+1) * uSrcH / uDstH;
+		const double fCoverage = (VideoScaler_GapCoverage(y1) - VideoScaler_GapCoverage(y0)) / (y1 - y0);
+		g_aBrightnessY[y] = (uint16_t) (256.0 - fDarken * fCoverage + 0.5);
+	}
+
+	for (UINT i=0; i<kMaxThreads; i++)
+		g_aTempRow[i].resize(uSrcW + 2);	// +1 for src[uIndex+1] of the last pixel, +1 for 8-byte loads
+
+	g_uTableSrcW = uSrcW;
+	g_uTableSrcH = uSrcH;
+	g_uTableDstW = uDstW;
+	g_uTableDstH = uDstH;
+	g_eTableFilter = g_eFilter;
+	g_uTableScanlines = g_uScanlinesPercent;
+}
+
+//===========================================================================
+// Kernels
+
+static inline uint32_t BlendPixel(const uint32_t a, const uint32_t b, const UINT w)
+{
+	const UINT rb = ((a & 0x00ff00ff) * (256-w) + (b & 0x00ff00ff) * w) >> 8;
+	const UINT ag = ((a >> 8) & 0x00ff00ff) * (256-w) + ((b >> 8) & 0x00ff00ff) * w;
+	return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+static inline uint32_t ScalePixel(const uint32_t a, const UINT uBrightness)
+{
+	const UINT rb = ((a & 0x00ff00ff) * uBrightness) >> 8;
+	const UINT ag = ((a >> 8) & 0x00ff00ff) * uBrightness;
+	return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+static void VideoScaler_BlendRows(uint32_t* pDst, const uint32_t* pRow0, const uint32_t* pRow1, const UINT uWeight, const UINT uWidth)
+{
+	UINT x = 0;
+
+#if VIDEOSCALER_AVX2
+	if (g_eSimd == SIMD_AVX2)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i w0 = _mm256_set1_epi16((short)(256-uWeight));
+		const __m256i w1 = _mm256_set1_epi16((short)uWeight);
+		for (; x+8<=uWidth; x+=8)
+		{
+			const __m256i a = _mm256_loadu_si256((const __m256i*)&pRow0[x]);
+			const __m256i b = _mm256_loadu_si256((const __m256i*)&pRow1[x]);
+			const __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), w0), _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), w1)), 8);
+			const __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), w0), _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), w1)), 8);
+			_mm256_storeu_si256((__m256i*)&pDst[x], _mm256_packus_epi16(lo, hi));	// NB. Unpack & pack are both per 128-bit lane, so order is preserved
+		}
+	}
+#endif
+
+	if (g_eSimd != SIMD_NONE)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i w0 = _mm_set1_epi16((short)(256-uWeight));
+		const __m128i w1 = _mm_set1_epi16((short)uWeight);
+		for (; x+4<=uWidth; x+=4)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i*)&pRow0[x]);
+			const __m128i b = _mm_loadu_si128((const __m128i*)&pRow1[x]);
+			const __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1)), 8);
+			const __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1)), 8);
+			_mm_storeu_si128((__m128i*)&pDst[x], _mm_packus_epi16(lo, hi));
+		}
+	}
+
+	for (; x<uWidth; x++)
+		pDst[x] = BlendPixel(pRow0[x], pRow1[x], uWeight);
+}
+
+static void VideoScaler_ScaleRowBilinear(uint32_t* pDst, const uint32_t* pRow, const UINT uDstW, const UINT uBrightness)
+{
+	UINT x = 0;
+
+	if (g_eSimd != SIMD_NONE)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bright = _mm_set1_epi16((short)uBrightness);
+		for (; x+2<=uDstW; x+=2)
+		{
+			const __m128i p0 = _mm_loadl_epi64((const __m128i*)&pRow[g_aTapsX[x].uIndex]);		// src[i], src[i+1]
+			const __m128i p1 = _mm_loadl_epi64((const __m128i*)&pRow[g_aTapsX[x+1].uIndex]);
+			const __m128i v0 = _mm_mullo_epi16(_mm_unpacklo_epi8(p0, zero), _mm_loadu_si128((const __m128i*)&g_aWeightsX[x*8]));
+			const __m128i v1 = _mm_mullo_epi16(_mm_unpacklo_epi8(p1, zero), _mm_loadu_si128((const __m128i*)&g_aWeightsX[x*8+8]));
+			const __m128i s0 = _mm_add_epi16(v0, _mm_srli_si128(v0, 8));
+			const __m128i s1 = _mm_add_epi16(v1, _mm_srli_si128(v1, 8));
+			__m128i s = _mm_srli_epi16(_mm_unpacklo_epi64(s0, s1), 8);
+			if (uBrightness != 256)
+				s = _mm_srli_epi16(_mm_mullo_epi16(s, bright), 8);
+			_mm_storel_epi64((__m128i*)&pDst[x], _mm_packus_epi16(s, s));
+		}
+	}
+
+	for (; x<uDstW; x++)
+	{
+		const ScalerTap_t& tap = g_aTapsX[x];
+		const uint32_t pixel = BlendPixel(pRow[tap.uIndex], pRow[tap.uIndex+1], tap.uWeight);
+		pDst[x] = (uBrightness != 256) ? ScalePixel(pixel, uBrightness) : pixel;
+	}
+}
+
+static void VideoScaler_ScaleRowNearest(uint32_t* pDst, const uint32_t* pRow, const UINT uDstW, const UINT uBrightness)
+{
+	for (UINT x=0; x<uDstW; x++)
+		pDst[x] = pRow[g_aTapsX[x].uIndex];
+
+	if (uBrightness == 256)
+		return;
+
+	UINT x = 0;
+
+#if VIDEOSCALER_AVX2
+	if (g_eSimd == SIMD_AVX2)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i bright = _mm256_set1_epi16((short)uBrightness);
+		for (; x+8<=uDstW; x+=8)
+		{
+			const __m256i a = _mm256_loadu_si256((const __m256i*)&pDst[x]);
+			const __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), bright), 8);
+			const __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), bright), 8);
+			_mm256_storeu_si256((__m256i*)&pDst[x], _mm256_packus_epi16(lo, hi));
+		}
+	}
+#endif
+
+	if (g_eSimd != SIMD_NONE)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bright = _mm_set1_epi16((short)uBrightness);
+		for (; x+4<=uDstW; x+=4)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i*)&pDst[x]);
+			const __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), bright), 8);
+			const __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), bright), 8);
+			_mm_storeu_si128((__m128i*)&pDst[x], _mm_packus_epi16(lo, hi));
+		}
+	}
+
+	for (; x<uDstW; x++)
+		pDst[x] = ScalePixel(pDst[x], uBrightness);
+}
+
+//===========================================================================
+
+static void VideoScaler_ProcessBand(const UINT uBand)
+{
+	const ScalerJob_t& job = g_Job;
+	const UINT uRowBegin = job.uDstH * uBand / job.uNumBands;
+	const UINT uRowEnd = job.uDstH * (uBand+1) / job.uNumBands;
+	uint32_t* pTemp = &g_aTempRow[uBand][0];
+
+	for (UINT y=uRowBegin; y<uRowEnd; y++)
+	{
+		const ScalerTap_t& tap = g_aTapsY[y];
+		const uint32_t* pRow0 = job.pSrc + (int)tap.uIndex * job.nSrcPitch;
+		const uint32_t* pRow = pRow0;
+
+		if (tap.uWeight)
+		{
+			VideoScaler_BlendRows(pTemp, pRow0, pRow0 + job.nSrcPitch, tap.uWeight, job.uSrcW);
+			pRow = pTemp;
+		}
+		else if (g_bBilinearX)
+		{
+			memcpy(pTemp, pRow0, job.uSrcW * sizeof(uint32_t));	// Horizontal pass reads 1 pixel past the end
+			pRow = pTemp;
+		}
+
+		uint32_t* pDst = job.pDst + y * job.uDstW;
+
+		if (g_bBilinearX)
+		{
+			pTemp[job.uSrcW] = pTemp[job.uSrcW+1] = pTemp[job.uSrcW-1];
+			VideoScaler_ScaleRowBilinear(pDst, pRow, job.uDstW, g_aBrightnessY[y]);
+		}
+		else
+		{
+			VideoScaler_ScaleRowNearest(pDst, pRow, job.uDstW, g_aBrightnessY[y]);
+		}
+	}
+}
+
+static DWORD WINAPI VideoScaler_WorkerThread(LPVOID lpParameter)
+{
+	const UINT uBand = (UINT)(UINT_PTR)lpParameter;
+
+	while (1)
+	{
+		WaitForSingleObject(g_hWorkerStart[uBand], INFINITE);
+		if (g_bWorkerExit)
+			break;
+
+		VideoScaler_ProcessBand(uBand);
+		SetEvent(g_hWorkerDone[uBand]);
+	}
+
+	return 0;
+}
+
+void VideoScaler_Process(const uint32_t* pSrc, const int nSrcPitch, const UINT uSrcW, const UINT uSrcH, uint32_t* pDst, const UINT uDstW, const UINT uDstH)
+{
+	_ASSERT(uSrcW && uSrcH && uDstW && uDstH);
+
+	VideoScaler_Init();
+	VideoScaler_BuildTables(uSrcW, uSrcH, uDstW, uDstH);
+
+	// Vertical blend reads src row uIndex+1, which is only valid if its weight is non-zero
+	_ASSERT(g_aTapsY[uDstH-1].uIndex < uSrcH);
+
+	g_Job.pSrc = pSrc;
+	g_Job.nSrcPitch = nSrcPitch;
+	g_Job.uSrcW = uSrcW;
+	g_Job.pDst = pDst;
+	g_Job.uDstW = uDstW;
+	g_Job.uDstH = uDstH;
+	g_Job.uNumBands = MAX(1, MIN(g_uNumThreads, (uDstW * uDstH) / kMinPixelsPerBand));
+
+	for (UINT i=1; i<g_Job.uNumBands; i++)
+		SetEvent(g_hWorkerStart[i]);
+
+	VideoScaler_ProcessBand(0);
+
+	if (g_Job.uNumBands > 1)
+		WaitForMultipleObjects(g_Job.uNumBands-1, &g_hWorkerDone[1], TRUE, INFINITE);
+}
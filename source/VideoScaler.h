@@ -0,0 +1,20 @@
+#pragma once
+
+// CPU-side scaler & scanline effect, for presenting the framebuffer at any window size without GDI's StretchBlt()
+
+enum VideoScalerFilter_e
+{
+	VIDEOSCALER_OFF = 0,
+	VIDEOSCALER_NEAREST,
+	VIDEOSCALER_SHARP_BILINEAR,	// Nearest to the largest integer multiple, then bilinear for the fractional remainder
+};
+
+void VideoScaler_SetFilter(const VideoScalerFilter_e eFilter);
+void VideoScaler_SetScanlines(const UINT uPercent);	// Darkening of the gap between scanlines: 0 = off
+UINT VideoScaler_GetScanlines(void);
+bool VideoScaler_IsEnabled(void);
+
+// pSrc: top-left pixel of a 32bpp frame; nSrcPitch in pixels (negative for a bottom-up DIB)
+// pDst: top-down, pitch = uDstW
+void VideoScaler_Process(const uint32_t* pSrc, const int nSrcPitch, const UINT uSrcW, const UINT uSrcH, uint32_t* pDst, const UINT uDstW, const UINT uDstH);
+void VideoScaler_Uninit(void);
@@ -68,6 +68,10 @@ static __forceinline void DoIrqProfiling(DWORD uCycles)
 {
 }
 
+static __forceinline void DMA(ULONG& uExecutedCycles)
+{
+}
+
 static __forceinline void CheckInterruptSources(ULONG uExecutedCycles)
 {
 }
@@ -99,6 +103,9 @@ DWORD z80_mainloop(ULONG uTotalCycles, ULONG uExecutedCycles)
 	return 0;
 }
 
+// From Video.cpp
+bool g_bVideoScannerAtFullSpeed = false;
+
 // From NTSC.cpp
 void NTSC_VideoUpdateCycles( long cycles6502 )
 {
@@ -0,0 +1,483 @@
+#include "stdafx.h"
+
+#include <stdlib.h>
+
+#include "../../source/DiskGCR.inl"
+#include "../../source/DiskDefs.h"
+#include "../../source/DiskBitstream.inl"
+
+// Reference implementation: CImageBase::Code62() & Decode62() as they were before DiskGCR.inl
+
+static const int TRACK_DENIBBLIZED_SIZE = 16 * 256;
+
+static BYTE ms_pWorkBuffer[TRACK_DENIBBLIZED_SIZE * 2];
+
+static const BYTE ms_DiskByte[0x40] =
+{
+	0x96,0x97,0x9A,0x9B,0x9D,0x9E,0x9F,0xA6,
+	0xA7,0xAB,0xAC,0xAD,0xAE,0xAF,0xB2,0xB3,
+	0xB4,0xB5,0xB6,0xB7,0xB9,0xBA,0xBB,0xBC,
+	0xBD,0xBE,0xBF,0xCB,0xCD,0xCE,0xCF,0xD3,
+	0xD6,0xD7,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,
+	0xDF,0xE5,0xE6,0xE7,0xE9,0xEA,0xEB,0xEC,
+	0xED,0xEE,0xEF,0xF2,0xF3,0xF4,0xF5,0xF6,
+	0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+static LPBYTE Code62(int sector)
+{
+	// CONVERT THE 256 8-BIT BYTES INTO 342 6-BIT BYTES, WHICH WE STORE
+	// STARTING AT 4K INTO THE WORK BUFFER.
+	{
+		LPBYTE sectorbase = ms_pWorkBuffer+(sector << 8);
+		LPBYTE resultptr  = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		BYTE   offset     = 0xAC;
+		while (offset != 0x02)
+		{
+			BYTE value = 0;
+#define ADDVALUE(a) value = (value << 2) |        \
+							(((a) & 0x01) << 1) | \
+							(((a) & 0x02) >> 1)
+			ADDVALUE(*(sectorbase+offset));  offset -= 0x56;
+			ADDVALUE(*(sectorbase+offset));  offset -= 0x56;
+			ADDVALUE(*(sectorbase+offset));  offset -= 0x53;
+#undef ADDVALUE
+			*(resultptr++) = value << 2;
+		}
+		*(resultptr-2) &= 0x3F;
+		*(resultptr-1) &= 0x3F;
+		int loop = 0;
+		while (loop < 0x100)
+			*(resultptr++) = *(sectorbase+(loop++));
+	}
+
+	// EXCLUSIVE-OR THE ENTIRE DATA BLOCK WITH ITSELF OFFSET BY ONE BYTE,
+	// CREATING A 343RD BYTE WHICH IS USED AS A CHECKSUM.
+	{
+		BYTE   savedval  = 0;
+		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
+		int    loop      = 342;
+		while (loop--)
+		{
+			*(resultptr++) = savedval ^ *sourceptr;
+			savedval = *(sourceptr++);
+		}
+		*resultptr = savedval;
+	}
+
+	// USING A LOOKUP TABLE, CONVERT THE 6-BIT BYTES INTO DISK BYTES.
+	{
+		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
+		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		int    loop      = 343;
+		while (loop--)
+			*(resultptr++) = ms_DiskByte[(*(sourceptr++)) >> 2];
+	}
+
+	return ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+}
+
+static void Decode62(LPBYTE imageptr)
+{
+	static BOOL tablegenerated = 0;
+	static BYTE sixbitbyte[0x80];
+	if (!tablegenerated)
+	{
+		ZeroMemory(sixbitbyte,0x80);
+		int loop = 0;
+		while (loop < 0x40) {
+			sixbitbyte[ms_DiskByte[loop]-0x80] = loop << 2;
+			loop++;
+		}
+		tablegenerated = 1;
+	}
+
+	// USING OUR TABLE, CONVERT THE DISK BYTES BACK INTO 6-BIT BYTES
+	{
+		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
+		int    loop      = 343;
+		while (loop--)
+			*(resultptr++) = sixbitbyte[*(sourceptr++) & 0x7F];
+	}
+
+	// EXCLUSIVE-OR THE ENTIRE DATA BLOCK WITH ITSELF OFFSET BY ONE BYTE
+	// TO UNDO THE EFFECTS OF THE CHECKSUMMING PROCESS
+	{
+		BYTE   savedval  = 0;
+		LPBYTE sourceptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x400;
+		LPBYTE resultptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		int    loop      = 342;
+		while (loop--)
+		{
+			*resultptr = savedval ^ *(sourceptr++);
+			savedval = *(resultptr++);
+		}
+	}
+
+	// CONVERT THE 342 6-BIT BYTES INTO 256 8-BIT BYTES
+	{
+		LPBYTE lowbitsptr = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE;
+		LPBYTE sectorbase = ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE+0x56;
+		BYTE   offset     = 0xAC;
+		while (offset != 0x02)
+		{
+			if (offset >= 0xAC)
+			{
+				*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
+										| (((*lowbitsptr) & 0x80) >> 7)
+										| (((*lowbitsptr) & 0x40) >> 5);
+			}
+
+			offset -= 0x56;
+			*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
+										| (((*lowbitsptr) & 0x20) >> 5)
+										| (((*lowbitsptr) & 0x10) >> 3);
+
+			offset -= 0x56;
+			*(imageptr+offset) = (*(sectorbase+offset) & 0xFC)
+										| (((*lowbitsptr) & 0x08) >> 3)
+										| (((*lowbitsptr) & 0x04) >> 1);
+
+			offset -= 0x53;
+			lowbitsptr++;
+		}
+	}
+}
+
+//-------------------------------------
+
+static void RefEncode(const BYTE* pSector, BYTE* pNibbles)
+{
+	memcpy(ms_pWorkBuffer, pSector, 0x100);
+	memcpy(pNibbles, Code62(0), GCR62_NIBBLES);
+}
+
+static void RefDecode(const BYTE* pNibbles, BYTE* pSector)
+{
+	memcpy(ms_pWorkBuffer+TRACK_DENIBBLIZED_SIZE, pNibbles, GCR62_NIBBLES);
+	Decode62(pSector);
+}
+
+static void FillRandom(BYTE* p, const int n)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = (BYTE) (rand() >> 4);
+}
+
+//-------------------------------------
+
+static const int kNumSectors = 4096;
+
+int EncodeDecode_test(void)
+{
+	BYTE sector[0x100], sectorRef[0x100], sectorNew[0x100];
+	BYTE nibRef[GCR62_NIBBLES], nibNew[GCR62_NIBBLES];
+
+	for (int n = 0; n < kNumSectors; n++)
+	{
+		if (n == 0)
+			memset(sector, 0x00, sizeof(sector));
+		else if (n == 1)
+			memset(sector, 0xFF, sizeof(sector));
+		else
+			FillRandom(sector, sizeof(sector));
+
+		RefEncode(sector, nibRef);
+		GCR62_Encode(sector, nibNew);
+		if (memcmp(nibRef, nibNew, GCR62_NIBBLES) != 0)
+			return 1;
+
+		GCR62_Decode(nibNew, sectorNew);
+		if (memcmp(sector, sectorNew, sizeof(sector)) != 0)
+			return 1;
+
+		if (!GCR62_Verify(nibNew))
+			return 1;
+
+		// Any other valid disk byte breaks the checksum
+		const int i = rand() % GCR62_NIBBLES;
+		nibNew[i] = g_aGCR62Nibble[ (g_aGCR62Decode[nibNew[i]] + 1 + rand() % 0x3F) & 0x3F ];
+		if (GCR62_Verify(nibNew))
+			return 1;
+	}
+
+	// Arbitrary (incl. invalid) disk bytes must decode exactly as before
+	for (int n = 0; n < kNumSectors; n++)
+	{
+		FillRandom(nibRef, GCR62_NIBBLES);
+		if ((n & 1) == 0)
+		{
+			for (int i = 0; i < GCR62_NIBBLES; i++)
+				nibRef[i] = g_aGCR62Nibble[nibRef[i] & 0x3F];
+		}
+
+		memset(sectorRef, 0, sizeof(sectorRef));
+		RefDecode(nibRef, sectorRef);
+		GCR62_Decode(nibRef, sectorNew);
+		if (memcmp(sectorRef, sectorNew, sizeof(sectorRef)) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+int FindNibble_test(void)
+{
+	BYTE buffer[6656];
+
+	for (int n = 0; n < 256; n++)
+	{
+		FillRandom(buffer, sizeof(buffer));
+		const int len = rand() % (int)sizeof(buffer);
+		const BYTE b = (BYTE) n;
+
+		int expected = -1;
+		for (int i = 0; i < len; i++)
+		{
+			if (buffer[i] == b)
+			{
+				expected = i;
+				break;
+			}
+		}
+
+		if (GCR62_FindNibble(buffer, len, b) != expected)
+			return 1;
+
+		// Not present
+		for (int i = 0; i < len; i++)
+			if (buffer[i] == b) buffer[i] = b ^ 0x01;
+
+		if (GCR62_FindNibble(buffer, len, b) != -1)
+			return 1;
+	}
+
+	return 0;
+}
+
+//-------------------------------------
+
+// A plausible track: gaps of FFs (sync runs & short ones), & runs of random valid disk bytes
+static int MakeNibbleTrack(BYTE* pNibbles, const int nMax)
+{
+	int n = 0;
+	while (n < nMax - 64)
+	{
+		int gap = (rand() & 1) ? 1 + rand() % 4 : (int)BITTRACK_SYNC_RUN + rand() % 40;
+		while (gap-- && n < nMax)
+			pNibbles[n++] = 0xFF;
+
+		int data = 1 + rand() % 400;
+		while (data-- && n < nMax)
+			pNibbles[n++] = g_aGCR62Nibble[rand() & 0x3F];
+	}
+	return n;
+}
+
+static BYTE ms_aBits[BITTRACK_BUFFER_SIZE];
+
+int BitTrack_test(void)
+{
+	BYTE nibbles[NIBBLES_PER_TRACK], nibblesNew[NIBBLES_PER_TRACK];
+	BitTrack_t track = { ms_aBits, 0 };
+
+	for (int n = 0; n < 64; n++)
+	{
+		const int nNibbles = MakeNibbleTrack(nibbles, NIBBLES_PER_TRACK - rand() % 512);
+
+		// Lossless round-trip
+		BitTrack_FromNibbles(track, nibbles, nNibbles);
+		if (track.uBitCount < (UINT)nNibbles * 8 || track.uBitCount > BITTRACK_MAX_BITS)
+			return 1;
+		if (BitTrack_ToNibbles(track, nibblesNew, NIBBLES_PER_TRACK) != nNibbles || memcmp(nibbles, nibblesNew, nNibbles) != 0)
+			return 1;
+
+		// Nibble # <-> bit position (as used by the RWTS trap)
+		for (int i = 1; i < nNibbles; i += 1 + rand() % 64)
+		{
+			if (BitTrack_NibbleAtBit(track, BitTrack_BitAfterNibble(track, i-1)) != i)
+				return 1;
+		}
+
+		// Timed reads: a read loop (LDA $C08C,X / BPL) sees every nibble, in order, over 2 revolutions
+		BitCursor_t cursor;
+		memset(&cursor, 0, sizeof(cursor));
+		BitCursor_SetTrack(cursor, track, 0, 0);
+
+		unsigned __int64 uCycle = 0;
+		for (int i = 0; i < nNibbles * 2; i++)
+		{
+			BYTE latch;
+			while (!((latch = BitCursor_Read(cursor, track, uCycle)) & 0x80))
+				uCycle += 7;
+			if (latch != nibbles[i % nNibbles])
+				return 1;
+			uCycle += 9 + rand() % 16;	// CMP/BNE etc. & loop back
+		}
+
+		// Timed writes: 32 cycles per nibble & 40 per sync (like DOS 3.3's WRITE16), from bit 0
+		const int nNibblesWritten = MakeNibbleTrack(nibblesNew, nNibbles * 8 / 10);
+		BitCursor_SetTrack(cursor, track, 0, 0);
+		cursor.uHead = 0;
+		cursor.uCycle = uCycle = 1000;
+		for (int i = 0; i < nNibblesWritten; i++)
+		{
+			BitCursor_Write(cursor, track, uCycle, nibblesNew[i]);
+			uCycle += (nibblesNew[i] == 0xFF) ? 40 : 32;
+		}
+		BitCursor_FlushWrite(cursor, track);
+
+		if (BitTrack_ToNibbles(track, nibbles, nNibblesWritten) != nNibblesWritten || memcmp(nibbles, nibblesNew, nNibblesWritten) != 0)
+			return 1;
+	}
+
+	// Unformatted track: never a complete nibble
+	memset(nibbles, 0, sizeof(nibbles));
+	BitTrack_FromNibbles(track, nibbles, NIBBLES_PER_TRACK);
+	BitCursor_t cursor;
+	memset(&cursor, 0, sizeof(cursor));
+	BitCursor_SetTrack(cursor, track, 0, 0);
+	for (unsigned __int64 uCycle = 0; uCycle < NIBBLES_PER_TRACK*32*3; uCycle += 7)
+	{
+		if (BitCursor_Read(cursor, track, uCycle) & 0x80)
+			return 1;
+	}
+
+	return 0;
+}
+
+//-------------------------------------
+
+static double GetSeconds(const LARGE_INTEGER& start, const LARGE_INTEGER& end)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	return (double)(end.QuadPart - start.QuadPart) / (double)freq.QuadPart;
+}
+
+static void Benchmark(const char* pszName, void (*pEncode)(const BYTE*, BYTE*), void (*pDecode)(const BYTE*, BYTE*))
+{
+	static const int kIterations = 200000;
+
+	BYTE sector[0x100];
+	BYTE nibbles[GCR62_NIBBLES];
+	FillRandom(sector, sizeof(sector));
+
+	LARGE_INTEGER start, mid, end;
+	QueryPerformanceCounter(&start);
+
+	for (int i = 0; i < kIterations; i++)
+	{
+		sector[i & 0xFF]++;
+		pEncode(sector, nibbles);
+	}
+
+	QueryPerformanceCounter(&mid);
+
+	for (int i = 0; i < kIterations; i++)
+	{
+		nibbles[i % GCR62_NIBBLES] = g_aGCR62Nibble[i & 0x3F];
+		pDecode(nibbles, sector);
+	}
+
+	QueryPerformanceCounter(&end);
+
+	const double encode = GetSeconds(start, mid);
+	const double decode = GetSeconds(mid, end);
+	printf("%-12s encode: %10.0f sectors/s, decode: %10.0f sectors/s\n",
+		pszName,
+		encode > 0.0 ? kIterations / encode : 0.0,
+		decode > 0.0 ? kIterations / decode : 0.0);
+}
+
+// Nibbles/s through a ROM-like read loop (a read every 7 cycles until bit 7 is set): Disk.cpp's nibble path vs the bit cursor
+static void BenchmarkBitTrack(void)
+{
+	static const int kRevolutions = 200;
+
+	BYTE nibbles[NIBBLES_PER_TRACK];
+	const int nNibbles = MakeNibbleTrack(nibbles, NIBBLES_PER_TRACK);
+	BitTrack_t track = { ms_aBits, 0 };
+	BitTrack_FromNibbles(track, nibbles, nNibbles);
+
+	LARGE_INTEGER start, mid, end;
+	UINT sum = 0;
+	QueryPerformanceCounter(&start);
+
+	// Nibble path: every read is the next nibble
+	int byte = 0;
+	for (int i = 0; i < nNibbles * kRevolutions; i++)
+	{
+		sum += nibbles[byte];
+		if (++byte >= nNibbles)
+			byte = 0;
+	}
+
+	QueryPerformanceCounter(&mid);
+
+	BitCursor_t cursor;
+	memset(&cursor, 0, sizeof(cursor));
+	BitCursor_SetTrack(cursor, track, 0, 0);
+	unsigned __int64 uCycle = 0;
+	for (int i = 0; i < nNibbles * kRevolutions; i++)
+	{
+		BYTE latch;
+		while (!((latch = BitCursor_Read(cursor, track, uCycle)) & 0x80))
+			uCycle += 7;
+		sum += latch;
+		uCycle += 14;
+	}
+
+	QueryPerformanceCounter(&end);
+
+	const double nibble = GetSeconds(start, mid);
+	const double bit = GetSeconds(mid, end);
+	printf("%-12s nibble: %10.0f nibbles/s, bit: %10.0f nibbles/s (%u)\n",
+		"Bitstream",
+		nibble > 0.0 ? nNibbles * kRevolutions / nibble : 0.0,
+		bit > 0.0 ? nNibbles * kRevolutions / bit : 0.0,
+		sum & 1);
+}
+
+//-------------------------------------
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+	int res = 1;
+	srand(1);
+
+	GCR62_Init();
+	const bool bHasSSE2 = g_bGCR62UseSSE2;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		g_bGCR62UseSSE2 = (pass == 0) ? false : bHasSSE2;
+
+		res = EncodeDecode_test();
+		if (res) return res;
+
+		res = FindNibble_test();
+		if (res) return res;
+	}
+
+	res = BitTrack_test();
+	if (res) return res;
+
+	// Benchmark only when asked (any argument), so the default run stays quick
+	if (argc > 1)
+	{
+		Benchmark("Reference", RefEncode, RefDecode);
+		g_bGCR62UseSSE2 = false;
+		Benchmark("Table", GCR62_Encode, GCR62_Decode);
+		if (bHasSSE2)
+		{
+			g_bGCR62UseSSE2 = true;
+			Benchmark("SSE2", GCR62_Encode, GCR62_Decode);
+		}
+		BenchmarkBitTrack();
+	}
+
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include "stdafx.h"
+
+#include <crtdbg.h>
+
+#include "../../source/Common.h"
+
+// As Frame.h & Video.h
+#define FRAMEBUFFER_BORDERLESS_W 560
+#define FRAMEBUFFER_BORDERLESS_H 384
+
+struct VideoDirtyRect_t
+{
+	UINT x, y;
+	UINT uWidth, uHeight;
+};
+
+#include "../../source/VideoDirtyRect.inl"
+
+static uint32_t ms_aFrame[FRAMEBUFFER_BORDERLESS_H][FRAMEBUFFER_BORDERLESS_W];
+
+static const uint32_t* GetScanline(const UINT y)
+{
+	return ms_aFrame[y];
+}
+
+static bool IsRect(const VideoDirtyRect_t& rect, const UINT x, const UINT y, const UINT uWidth, const UINT uHeight)
+{
+	return rect.x == x && rect.y == y && rect.uWidth == uWidth && rect.uHeight == uHeight;
+}
+
+//-------------------------------------
+
+int DirtyRect_test(void)
+{
+	VideoDirtyRect_t rects[FRAMEBUFFER_BORDERLESS_H];
+
+	for (UINT y = 0; y < FRAMEBUFFER_BORDERLESS_H; y++)
+		for (UINT x = 0; x < FRAMEBUFFER_BORDERLESS_W; x++)
+			ms_aFrame[y][x] = rand() | (rand() << 16);
+
+	// 1st call: whole frame
+	DirtyRect_Reset();
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 1 || !IsRect(rects[0], 0, 0, FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H))
+		return 1;
+
+	// Unchanged
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 0)
+		return 1;
+
+	// One pixel: its 14-pixel segment
+	ms_aFrame[50][100] ^= 0x00FF00;
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 1 || !IsRect(rects[0], 98, 50, 14, 1))
+		return 1;
+
+	// Changed & then changed back, between calls: unchanged
+	ms_aFrame[200][300] ^= 0x0000FF;
+	ms_aFrame[200][300] ^= 0x0000FF;
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 0)
+		return 1;
+
+	// A change in the segment's last pixel only
+	ms_aFrame[200][307] ^= 0x0000FF;
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 1 || !IsRect(rects[0], 294, 200, 14, 1))
+		return 1;
+
+	// Nearby scanlines are merged (half-scanline mode), others aren't
+	ms_aFrame[10][0] ^= 1;
+	ms_aFrame[12][20] ^= 1;
+	ms_aFrame[20][559] ^= 1;
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 2 || !IsRect(rects[0], 0, 10, 28, 3) || !IsRect(rects[1], 546, 20, 14, 1))
+		return 1;
+
+	// Too many rects: the last one grows to cover the rest
+	ms_aFrame[0][0] ^= 1;
+	ms_aFrame[100][140] ^= 1;
+	ms_aFrame[383][280] ^= 1;
+	if (DirtyRect_Get(GetScanline, rects, 2) != 2 || !IsRect(rects[0], 0, 0, 14, 1) || !IsRect(rects[1], 140, 100, 154, 284))
+		return 1;
+
+	// Reset: whole frame again
+	DirtyRect_Reset();
+	if (DirtyRect_Get(GetScanline, rects, FRAMEBUFFER_BORDERLESS_H) != 1 || !IsRect(rects[0], 0, 0, FRAMEBUFFER_BORDERLESS_W, FRAMEBUFFER_BORDERLESS_H))
+		return 1;
+
+	return 0;
+}
+
+//-------------------------------------
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+	int res = 1;
+	srand(1);
+
+	res = DirtyRect_test();
+	if (res) return res;
+
+	return 0;
+}